@@ -0,0 +1,171 @@
+/*
+ * Buffer arena benchmark, the cost of touching packet buffers spread over a
+ * large working set, as the loops do reading frames and writing replies to
+ * thousands of connections, with buffers from the huge page arena and from
+ * malloc. Past what the TLB covers with 4KB pages, every touch of a buffer
+ * not seen lately walks the page tables, with huge pages far fewer do.
+ *
+ * Build from the repository root:
+ *
+ *   cc -O2 -Isrc bench/bench_arena.c src/arena.c -lpthread -o bench_arena
+ *
+ * Usage:
+ *
+ *   ./bench_arena [-n buffers] [-s size] [-r touches]
+ *
+ * Buffers must fit in ARENA_SIZE, 48MB of them by default. Each touch
+ * reads and writes a cache line at a random offset of a random buffer.
+ * Each line of output is a JSON object for a source of buffers, with the
+ * backing the arena got, "none" meaning it fell back to malloc entirely.
+ */
+#include <time.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "arena.h"
+
+#define LINE                64
+
+static double now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static inline uint64_t xorshift(uint64_t *state)
+{
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+/* Huge pages of the process, from the kernel accounting, in kB */
+static long anon_huge_kb(void)
+{
+  FILE *f = fopen("/proc/self/smaps_rollup", "r");
+  char line[256];
+  long kb = -1;
+
+  if (!f) {
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1) {
+      break;
+    }
+  }
+
+  fclose(f);
+  return kb;
+}
+
+static double touch(unsigned char **bufs, size_t n, size_t size,
+                    size_t touches)
+{
+  uint64_t rng = 0x9e3779b97f4a7c15ULL;
+  unsigned long long sum = 0;
+  double start = now_ns();
+
+  for (size_t i = 0; i < touches; i++) {
+    uint64_t r = xorshift(&rng);
+    unsigned char *line = bufs[r % n] + ((r >> 32) % (size / LINE)) * LINE;
+    sum += line[0];
+    line[1] = (unsigned char) sum;
+  }
+
+  double ns = (now_ns() - start) / touches;
+
+  /* Keep the loads */
+  if (sum == 42) {
+    fprintf(stderr, "%llu\n", sum);
+  }
+
+  return ns;
+}
+
+int main(int argc, char **argv)
+{
+  size_t n = 12288, size = 4096, touches = 20000000;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:s:r:")) != -1) {
+    switch (opt) {
+      case 'n':
+        n = strtoull(optarg, NULL, 10);
+        break;
+      case 's':
+        size = strtoull(optarg, NULL, 10);
+        break;
+      case 'r':
+        touches = strtoull(optarg, NULL, 10);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-n buffers] [-s size] [-r touches]\n",
+                argv[0]);
+        return 1;
+    }
+  }
+
+  if (n == 0 || size < LINE || size > ARENA_MAX_SIZE || touches == 0) {
+    fprintf(stderr, "Need buffers of %d to %d bytes and touches\n", LINE,
+            ARENA_MAX_SIZE);
+    return 1;
+  }
+
+  unsigned char **bufs = malloc(n * sizeof(*bufs));
+
+  if (!bufs) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+
+  const char *sources[] = { "arena", "malloc" };
+
+  for (int s = 0; s < 2; s++) {
+    long huge_before = anon_huge_kb();
+    size_t fallbacks = 0;
+
+    for (size_t i = 0; i < n; i++) {
+      bufs[i] = s == 0 ? arena_alloc(size) : NULL;
+      if (!bufs[i]) {
+        fallbacks += s == 0;
+        bufs[i] = malloc(size);
+      }
+      if (!bufs[i]) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+      }
+      memset(bufs[i], 0, size);
+    }
+
+    long huge = anon_huge_kb() - huge_before;
+    double ns = touch(bufs, n, size, touches);
+    struct arena_stats stats;
+
+    arena_stats(&stats);
+
+    printf("{\"bench\":\"arena\",\"source\":\"%s\",\"backing\":\"%s\","
+           "\"buffers\":%zu,\"size\":%zu,\"fallbacks\":%zu,"
+           "\"huge_kb\":%ld,\"touches\":%zu,\"ns_per_touch\":%.2f}\n",
+           sources[s], s == 0 ? arena_backing_name(stats.backing) : "none",
+           n, size, fallbacks, huge, touches, ns);
+
+    for (size_t i = 0; i < n; i++) {
+      if (arena_owns(bufs[i])) {
+        arena_free(bufs[i]);
+      } else {
+        free(bufs[i]);
+      }
+    }
+  }
+
+  free(bufs);
+
+  return 0;
+}
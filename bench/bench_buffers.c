@@ -0,0 +1,214 @@
+/*
+ * Idle connection footprint benchmark, sets up the per-connection state of
+ * a large number of mostly idle clients and reports the resident memory
+ * each one costs, with a permanent input and output buffer per connection
+ * and with buffers lent by the pool the broker uses.
+ *
+ * Build from the repository root:
+ *
+ *   cc -O2 -Isrc bench/bench_buffers.c src/bufpool.c src/memory.c \
+ *      src/arena.c -lpthread -o bench_buffers
+ *
+ * Usage:
+ *
+ *   ./bench_buffers [-n connections] [-b buffer size] [-r rounds]
+ *                   [-s pool|fixed]
+ *
+ * Each round 1% of the connections get a frame of a random size up to the
+ * buffer size, one in ten of them arriving in pieces and holding its buffer
+ * until the next round, the way on_read lends them. Only user space memory
+ * is measured, the kernel keeps its own per socket on top of it. Both
+ * schemes run by default, the fixed one needs about twice the buffer size
+ * per connection, e.g. 8GB for a million with 4KB buffers.
+ *
+ * Each line of output is a JSON object for a buffering scheme.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "network.h"
+#include "server.h"
+#include "bufpool.h"
+
+struct conn {
+  struct closure closure;
+  /* Permanent buffers of the fixed scheme, NULL with the pool */
+  unsigned char *inbuf;
+  unsigned char *outbuf;
+};
+
+static size_t rss_bytes(void)
+{
+  unsigned long size, resident;
+  FILE *f = fopen("/proc/self/statm", "r");
+
+  if (!f || fscanf(f, "%lu %lu", &size, &resident) != 2) {
+    if (f) {
+      fclose(f);
+    }
+    return 0;
+  }
+
+  fclose(f);
+
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+static inline uint64_t xorshift(uint64_t *state)
+{
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+/* A frame landing on a connection, read as on_read does it */
+static void frame(struct conn *c, size_t size, int partial, int pooled)
+{
+  if (!pooled) {
+    memset(c->inbuf, 0x30, size);
+    return;
+  }
+
+  struct closure *cb = &c->closure;
+
+  /* Second half of a frame which arrived in pieces */
+  if (cb->in) {
+    memset(cb->in + cb->in_len, 0x30, cb->in_need - cb->in_len);
+    bufpool_put(cb->in);
+    cb->in = NULL;
+    return;
+  }
+
+  if (size <= INLINE_FRAME_SIZE && !partial) {
+    unsigned char scratch[INLINE_FRAME_SIZE];
+    memset(scratch, 0x30, size);
+    __asm__ volatile("" : : "r"(scratch) : "memory");
+    return;
+  }
+
+  unsigned char *buf = bufpool_get(size);
+
+  memset(buf, 0x30, partial ? size / 2 : size);
+
+  if (partial) {
+    cb->in = buf;
+    cb->in_len = size / 2;
+    cb->in_need = size;
+  } else {
+    bufpool_put(buf);
+  }
+}
+
+static int run(int pooled, size_t nr, size_t bufsize, int rounds)
+{
+  size_t base = rss_bytes();
+  struct conn *conns = calloc(nr, sizeof(*conns));
+  uint64_t rng = 0x9E3779B97F4A7C15ULL;
+
+  if (!conns) {
+    perror("calloc");
+    return -1;
+  }
+
+  for (size_t i = 0; i < nr; i++) {
+    conns[i].closure.fd = -1;
+    if (!pooled) {
+      conns[i].inbuf = malloc(bufsize);
+      conns[i].outbuf = malloc(bufsize);
+      if (!conns[i].inbuf || !conns[i].outbuf) {
+        perror("malloc");
+        return -1;
+      }
+      /* Every connection sent something once, buffers are touched */
+      memset(conns[i].inbuf, 0, bufsize);
+      memset(conns[i].outbuf, 0, bufsize);
+    }
+  }
+
+  size_t active = nr / 100 ? nr / 100 : 1;
+  size_t frames = 0;
+
+  for (int r = 0; r < rounds; r++) {
+    for (size_t i = 0; i < active; i++) {
+      struct conn *c = &conns[xorshift(&rng) % nr];
+      size_t size = 2 + xorshift(&rng) % (bufsize - 2);
+      frame(c, size, xorshift(&rng) % 10 == 0, pooled);
+      frames++;
+    }
+  }
+
+  size_t rss = rss_bytes() - base;
+  struct bufpool_stats stats;
+
+  bufpool_stats(&stats);
+
+  printf("{\"bench\":\"buffers\",\"scheme\":\"%s\",\"connections\":%zu,"
+         "\"buffer_size\":%zu,\"frames\":%zu,\"rss_bytes\":%zu,"
+         "\"bytes_per_connection\":%.1f,\"closure_size\":%zu,"
+         "\"lent\":%zu,\"pool_idle_bytes\":%zu}\n",
+         pooled ? "pool" : "fixed", nr, bufsize, frames, rss,
+         (double) rss / nr, sizeof(struct closure),
+         pooled ? stats.lent : 0, pooled ? stats.idle_bytes : 0);
+  fflush(stdout);
+
+  for (size_t i = 0; i < nr; i++) {
+    bufpool_put(conns[i].closure.in);
+    free(conns[i].inbuf);
+    free(conns[i].outbuf);
+  }
+
+  free(conns);
+  bufpool_shrink();
+
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  size_t nr = 1000000;
+  size_t bufsize = 4096;
+  int rounds = 10;
+  int pool = 1, fixed = 1;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:b:r:s:")) != -1) {
+    switch (opt) {
+      case 'n':
+        nr = strtoul(optarg, NULL, 10);
+        break;
+      case 'b':
+        bufsize = strtoul(optarg, NULL, 10);
+        break;
+      case 'r':
+        rounds = atoi(optarg);
+        break;
+      case 's':
+        pool = strcmp(optarg, "fixed") != 0;
+        fixed = strcmp(optarg, "pool") != 0;
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-n connections] [-b buffer size] "
+                "[-r rounds] [-s pool|fixed]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if (nr == 0 || bufsize < 4) {
+    fprintf(stderr, "Need at least one connection and a 4 bytes buffer\n");
+    return 1;
+  }
+
+  /* Pool first, the fixed scheme leaves the heap grown behind it */
+  if ((pool && run(1, nr, bufsize, rounds) < 0) ||
+      (fixed && run(0, nr, bufsize, rounds) < 0)) {
+    return 1;
+  }
+
+  return 0;
+}
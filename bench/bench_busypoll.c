@@ -0,0 +1,263 @@
+/*
+ * Busy poll benchmark, round trip latency of a small message echoed by an
+ * event loop thread over TCP loopback, the loop either blocking in
+ * epoll_wait or spinning on it first as evloop_poll does with a busy poll
+ * budget, see network.h.
+ *
+ * The client spins on its socket in both modes, so only the way the loop
+ * waits differs. Loop and client are pinned to CPUs of their own when
+ * there are two, spinning on a single CPU only takes it from the client.
+ *
+ * Build from the repository root:
+ *
+ *   cc -O2 -Isrc bench/bench_busypoll.c -lpthread -o bench_busypoll
+ *
+ * Usage:
+ *
+ *   ./bench_busypoll [-n rounds] [-b budget_us] [-s size] [-g gap_us]
+ *
+ * Output is a JSON object per mode, blocking then spinning for the budget
+ * given, with the median, 99th and 99.9th percentile and worst round trip
+ * in nanoseconds.
+ */
+#define _GNU_SOURCE
+#include <time.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define MAX_SIZE            4096
+#define WARMUP              1000
+
+struct loop_args {
+  int fd;
+  int budget;
+  size_t size;
+  size_t rounds;
+};
+
+static int ncpus;
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void pin(int cpu)
+{
+  cpu_set_t set;
+
+  if (ncpus < 2) {
+    return;
+  }
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu % ncpus, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/* Same waiting as evloop_epoll_wait, budget in microseconds */
+static int wait_events(int epfd, struct epoll_event *ev, int budget)
+{
+  if (budget > 0) {
+    uint64_t start = now_ns(), limit = budget * 1000ULL;
+    do {
+      int n = epoll_wait(epfd, ev, 1, 0);
+      if (n != 0) {
+        return n;
+      }
+    } while (now_ns() - start < limit);
+  }
+
+  return epoll_wait(epfd, ev, 1, -1);
+}
+
+/* The event loop, echoes every message back */
+static void *loop(void *arg)
+{
+  struct loop_args *a = arg;
+  struct epoll_event ev = { .events = EPOLLIN };
+  unsigned char buf[MAX_SIZE];
+  int epfd = epoll_create1(0);
+
+  pin(0);
+  epoll_ctl(epfd, EPOLL_CTL_ADD, a->fd, &ev);
+
+  for (size_t i = 0; i < a->rounds; i++) {
+    size_t got = 0;
+    while (got < a->size) {
+      if (wait_events(epfd, &ev, a->budget) < 0 && errno != EINTR) {
+        return NULL;
+      }
+      ssize_t n = recv(a->fd, buf + got, a->size - got, MSG_DONTWAIT);
+      if (n == 0) {
+        return NULL;
+      }
+      got += n > 0 ? (size_t) n : 0;
+    }
+    if (send(a->fd, buf, a->size, MSG_NOSIGNAL) != (ssize_t) a->size) {
+      return NULL;
+    }
+  }
+
+  close(epfd);
+  return NULL;
+}
+
+static int connected_pair(int fds[2])
+{
+  struct sockaddr_in addr = { .sin_family = AF_INET };
+  socklen_t len = sizeof(addr);
+  int lfd = socket(AF_INET, SOCK_STREAM, 0);
+
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (lfd < 0 || bind(lfd, (struct sockaddr *) &addr, len) < 0
+      || listen(lfd, 1) < 0
+      || getsockname(lfd, (struct sockaddr *) &addr, &len) < 0) {
+    return -1;
+  }
+
+  fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+  if (fds[0] < 0 || connect(fds[0], (struct sockaddr *) &addr, len) < 0) {
+    return -1;
+  }
+
+  fds[1] = accept(lfd, NULL, NULL);
+  close(lfd);
+
+  for (int i = 0; i < 2; i++) {
+    setsockopt(fds[i], IPPROTO_TCP, TCP_NODELAY, &(int) {1}, sizeof(int));
+  }
+
+  return fds[1] < 0 ? -1 : 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+static int run(int budget, size_t rounds, size_t size, int gap)
+{
+  int fds[2];
+  unsigned char buf[MAX_SIZE];
+  uint64_t *rtt = malloc(rounds * sizeof(*rtt));
+
+  if (!rtt || connected_pair(fds) < 0) {
+    perror("setup");
+    return -1;
+  }
+
+  struct loop_args args = { fds[1], budget, size, rounds + WARMUP };
+  pthread_t thread;
+
+  memset(buf, 'x', size);
+  pthread_create(&thread, NULL, loop, &args);
+  pin(1);
+
+  for (size_t i = 0; i < rounds + WARMUP; i++) {
+    uint64_t start = now_ns();
+
+    if (send(fds[0], buf, size, MSG_NOSIGNAL) != (ssize_t) size) {
+      perror("send");
+      return -1;
+    }
+
+    size_t got = 0;
+    while (got < size) {
+      ssize_t n = recv(fds[0], buf + got, size - got, MSG_DONTWAIT);
+      if (n == 0 || (n < 0 && errno != EAGAIN)) {
+        perror("recv");
+        return -1;
+      }
+      got += n > 0 ? (size_t) n : 0;
+    }
+
+    if (i >= WARMUP) {
+      rtt[i - WARMUP] = now_ns() - start;
+    }
+
+    /* Leave the loop idle for a while, as between two client requests */
+    if (gap > 0) {
+      uint64_t until = now_ns() + gap * 1000ULL;
+      while (now_ns() < until)
+        ;
+    }
+  }
+
+  pthread_join(thread, NULL);
+  close(fds[0]);
+  close(fds[1]);
+
+  qsort(rtt, rounds, sizeof(*rtt), cmp_u64);
+
+  printf("{\"bench\":\"busypoll\",\"mode\":\"%s\",\"budget_us\":%d,"
+         "\"rounds\":%zu,\"size\":%zu,\"gap_us\":%d,\"cpus\":%d,"
+         "\"rtt_ns\":{\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,"
+         "\"max\":%llu}}\n",
+         budget > 0 ? "spin" : "block", budget, rounds, size, gap, ncpus,
+         (unsigned long long) rtt[rounds / 2],
+         (unsigned long long) rtt[rounds * 99 / 100],
+         (unsigned long long) rtt[rounds * 999 / 1000],
+         (unsigned long long) rtt[rounds - 1]);
+
+  free(rtt);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  size_t rounds = 100000, size = 64;
+  int budget = 50, gap = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:b:s:g:")) != -1) {
+    switch (opt) {
+      case 'n':
+        rounds = strtoull(optarg, NULL, 10);
+        break;
+      case 'b':
+        budget = atoi(optarg);
+        break;
+      case 's':
+        size = strtoull(optarg, NULL, 10);
+        break;
+      case 'g':
+        gap = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-n rounds] [-b budget_us] [-s size] "
+                "[-g gap_us]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if (rounds == 0 || budget <= 0 || size == 0 || size > MAX_SIZE) {
+    fprintf(stderr, "Need rounds, a budget and a size up to %d\n", MAX_SIZE);
+    return 1;
+  }
+
+  cpu_set_t allowed;
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+  ncpus = CPU_COUNT(&allowed);
+
+  if (run(0, rounds, size, gap) < 0 || run(budget, rounds, size, gap) < 0) {
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,418 @@
+/*
+ * Codec microbenchmarks, drive every packet type through pack_mqtt_packet
+ * and unpack_mqtt_packet, plus the remaining length codec, across payloads
+ * from 16B to 256KB and topics from 1 to 8 levels.
+ *
+ * Build and run from the repository root:
+ *
+ *   cc -O2 -Isrc bench/bench_codec.c src/mqtt.c src/pack.c src/utf8.c \
+ *      src/stream.c src/arena.c src/memory.c -lpthread -o bench_codec \
+ *      && ./bench_codec > codec.jsonl
+ *
+ * Each line of output is a JSON object reporting ns/op, bytes/s and heap
+ * allocations per op, so runs can be diffed with any JSON tool.
+ */
+#include <time.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include "mqtt.h"
+#include "pack.h"
+
+/* Minimum time spent on every case */
+#define MIN_NS          200000000ULL
+
+/*
+ * Count heap allocations by wrapping the glibc allocator, everything the
+ * codec allocates goes through one of these.
+ */
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+static unsigned long long allocs = 0;
+
+void *malloc(size_t size)
+{
+  allocs++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+  allocs++;
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+  allocs++;
+  return __libc_realloc(ptr, size);
+}
+
+static inline unsigned long long now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static const size_t payload_sizes[] = { 16, 256, 4096, 65536, 262144 };
+static const int topic_levels[] = { 1, 2, 4, 8 };
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+/* A benchmark case, run repeatedly with its argument */
+struct bench_case {
+  const char *op;
+  size_t payload;
+  int levels;
+  /* Bytes processed by a single op, encoded packet size */
+  size_t bytes;
+  void (*run)(void *);
+  void *arg;
+};
+
+static void report(const struct bench_case *c)
+{
+  unsigned long long iterations = 0;
+  unsigned long long start_allocs;
+  unsigned long long start;
+  unsigned long long elapsed;
+
+  /* Warm up */
+  for (int i = 0; i < 100; i++) {
+    c->run(c->arg);
+  }
+
+  start_allocs = allocs;
+  start = now_ns();
+
+  do {
+    for (int i = 0; i < 64; i++) {
+      c->run(c->arg);
+    }
+    iterations += 64;
+    elapsed = now_ns() - start;
+  } while (elapsed < MIN_NS);
+
+  double ns_op = (double) elapsed / iterations;
+
+  printf("{\"bench\":\"codec\",\"op\":\"%s\",\"payload\":%zu,\"levels\":%d,"
+         "\"bytes\":%zu,\"iterations\":%llu,\"ns_per_op\":%.1f,"
+         "\"bytes_per_sec\":%.0f,\"allocs_per_op\":%.2f}\n",
+         c->op, c->payload, c->levels, c->bytes, iterations, ns_op,
+         c->bytes * 1e9 / ns_op,
+         (double) (allocs - start_allocs) / iterations);
+  fflush(stdout);
+}
+
+/* Topic made of n levels, e.g. "lvl0/lvl1/lvl2" */
+static unsigned char *make_topic(int levels)
+{
+  unsigned char *topic = malloc(levels * 8 + 1);
+  unsigned char *p = topic;
+
+  for (int i = 0; i < levels; i++) {
+    p += sprintf((char *) p, i == 0 ? "dev%04d" : "/lvl%03d", i);
+  }
+
+  return topic;
+}
+
+/* Full size of an encoded packet from its fixed header */
+static size_t packet_size(const unsigned char *buf)
+{
+  const unsigned char *p = buf + 1;
+  unsigned long long len = mqtt_decode_lenght(&p);
+  return (p - buf) + len;
+}
+
+/* Pack and unpack cases */
+
+struct pack_arg {
+  union mqtt_packet pkt;
+  unsigned type;
+};
+
+static void run_pack(void *arg)
+{
+  struct pack_arg *a = arg;
+  free(pack_mqtt_packet(&a->pkt, a->type));
+}
+
+/* Fast reply path, ack written in place into a reused buffer */
+static void run_pack_ack_inplace(void *arg)
+{
+  unsigned char *buf = arg;
+  mqtt_pack_ack(buf, PUBACK_BYTE, 42);
+}
+
+struct unpack_arg {
+  unsigned char *buf;
+  unsigned type;
+};
+
+static void run_unpack(void *arg)
+{
+  struct unpack_arg *a = arg;
+  union mqtt_packet pkt;
+
+  if (unpack_mqtt_packet(a->buf, &pkt) >= 0) {
+    mqtt_packet_release(&pkt, a->type);
+  }
+}
+
+/* Remaining length codec cases */
+
+static const size_t lenghts[] = {
+  0, 100, 127, 128, 4000, 16383, 16384, 300000, 2097151, 2097152, 268435455
+};
+
+static void run_encode_lenght(void *arg)
+{
+  unsigned char *buf = arg;
+  for (size_t i = 0; i < ARRAY_SIZE(lenghts); i++) {
+    mqtt_encode_lenght(buf + i * 4, lenghts[i]);
+  }
+}
+
+static void run_decode_lenght(void *arg)
+{
+  unsigned char *buf = arg;
+  volatile unsigned long long sum = 0;
+  for (size_t i = 0; i < ARRAY_SIZE(lenghts); i++) {
+    const unsigned char *p = buf + i * 4;
+    sum += mqtt_decode_lenght(&p);
+  }
+}
+
+/* Client packets, the codec has no packer for them, encode by hand */
+
+static unsigned char *make_connect(void)
+{
+  static const char *cid = "bench-client-000000001";
+  static const char *user = "bench-user";
+  static const char *pass = "bench-password";
+  size_t cidlen = strlen(cid);
+  size_t userlen = strlen(user);
+  size_t passlen = strlen(pass);
+  size_t len = 10 + 2 + cidlen + 2 + userlen + 2 + passlen;
+  unsigned char *buf = malloc(len + 5);
+  unsigned char *p = buf;
+
+  pack_u8(&p, CONNECT << 4);
+  p += mqtt_encode_lenght(p, len);
+  pack_u16(&p, 4);
+  memcpy(p, "MQTT", 4);
+  p += 4;
+  pack_u8(&p, 4);
+  /* Username, password and clean session flags */
+  pack_u8(&p, 0xC2);
+  pack_u16(&p, 60);
+  pack_u16(&p, cidlen);
+  memcpy(p, cid, cidlen);
+  p += cidlen;
+  pack_u16(&p, userlen);
+  memcpy(p, user, userlen);
+  p += userlen;
+  pack_u16(&p, passlen);
+  memcpy(p, pass, passlen);
+
+  return buf;
+}
+
+static unsigned char *make_subscribe(unsigned type, int levels)
+{
+  unsigned char *topic = make_topic(levels);
+  size_t topiclen = strlen((char *) topic);
+  /* Four filters, two of them with the last level turned into a '+' */
+  size_t wildlen = levels > 1 ? topiclen - 6 : topiclen;
+  int tuples = 4;
+  size_t qoslen = type == SUBSCRIBE ? 1 : 0;
+  size_t len = 2 + tuples * (2 + qoslen) + 2 * topiclen + 2 * wildlen;
+  unsigned char *buf = malloc(len + 5);
+  unsigned char *p = buf;
+
+  pack_u8(&p, (type << 4) | 0x02);
+  p += mqtt_encode_lenght(p, len);
+  pack_u16(&p, 1);
+
+  for (int i = 0; i < tuples; i++) {
+    size_t flen = i % 2 == 0 ? topiclen : wildlen;
+    pack_u16(&p, flen);
+    memcpy(p, topic, flen);
+    if (flen != topiclen) {
+      p[flen - 1] = '+';
+    }
+    p += flen;
+    if (type == SUBSCRIBE) {
+      pack_u8(&p, AT_LEAST_ONCE);
+    }
+  }
+
+  free(topic);
+  return buf;
+}
+
+int main(void)
+{
+  struct bench_case c;
+
+  /* Remaining length codec */
+  unsigned char lenbuf[ARRAY_SIZE(lenghts) * 4];
+  run_encode_lenght(lenbuf);
+
+  c = (struct bench_case) {
+    "encode_lenght", 0, 0, ARRAY_SIZE(lenghts), run_encode_lenght, lenbuf
+  };
+  report(&c);
+
+  c = (struct bench_case) {
+    "decode_lenght", 0, 0, ARRAY_SIZE(lenghts), run_decode_lenght, lenbuf
+  };
+  report(&c);
+
+  /* Fixed size replies */
+  struct pack_arg pack;
+  struct unpack_arg unpack;
+
+  pack.type = PINGRESP;
+  pack.pkt.header.byte = PINGRESP << 4;
+  c = (struct bench_case) { "pack_pingresp", 0, 0, 2, run_pack, &pack };
+  report(&c);
+
+  pack.type = CONNACK;
+  pack.pkt.connack = *mqtt_packet_connack(CONNACK_BYTE, 0, 0);
+  c = (struct bench_case) { "pack_connack", 0, 0, 4, run_pack, &pack };
+  report(&c);
+
+  unsigned char ackbuf[MQTT_ACK_LEN];
+  c = (struct bench_case) {
+    "pack_ack_inplace", 0, 0, 4, run_pack_ack_inplace, ackbuf
+  };
+  report(&c);
+
+  static const struct {
+    const char *pack_op;
+    const char *unpack_op;
+    unsigned type;
+    unsigned char byte;
+  } acks[] = {
+    { "pack_puback", "unpack_puback", PUBACK, PUBACK_BYTE },
+    { "pack_pubrec", "unpack_pubrec", PUBREC, PUBREC_BYTE },
+    { "pack_pubrel", "unpack_pubrel", PUBREL, PUBREL_BYTE | 0x02 },
+    { "pack_pubcomp", "unpack_pubcomp", PUBCOM, PUBCOMP_BYTE },
+  };
+
+  for (size_t i = 0; i < ARRAY_SIZE(acks); i++) {
+    pack.type = acks[i].type;
+    pack.pkt.ack = *mqtt_packet_ack(acks[i].byte, 42);
+    c = (struct bench_case) { acks[i].pack_op, 0, 0, 4, run_pack, &pack };
+    report(&c);
+
+    unpack.type = acks[i].type;
+    unpack.buf = pack_mqtt_packet(&pack.pkt, pack.type);
+    c = (struct bench_case) { acks[i].unpack_op, 0, 0, 4, run_unpack, &unpack };
+    report(&c);
+    free(unpack.buf);
+  }
+
+  unsigned char rcs[8] = { 0, 1, 2, 1, 0, 1, 2, 0 };
+  pack.type = SUBACK;
+  pack.pkt.suback = (struct mqtt_suback) {
+    .header = { .byte = SUBACK_BYTE },
+    .pkt_id = 42,
+    .rcslen = sizeof(rcs),
+    .rcs = rcs
+  };
+  c = (struct bench_case) {
+    "pack_suback", 0, 0, 4 + sizeof(rcs), run_pack, &pack
+  };
+  report(&c);
+
+  unsigned char pingreq[2] = { PINGREQ << 4, 0 };
+  unpack.type = PINGREQ;
+  unpack.buf = pingreq;
+  c = (struct bench_case) { "unpack_pingreq", 0, 0, 2, run_unpack, &unpack };
+  report(&c);
+
+  /* Client packets */
+  unpack.type = CONNECT;
+  unpack.buf = make_connect();
+  c = (struct bench_case) {
+    "unpack_connect", 0, 0, packet_size(unpack.buf), run_unpack, &unpack
+  };
+  report(&c);
+  free(unpack.buf);
+
+  for (size_t l = 0; l < ARRAY_SIZE(topic_levels); l++) {
+    int levels = topic_levels[l];
+
+    unpack.type = SUBSCRIBE;
+    unpack.buf = make_subscribe(SUBSCRIBE, levels);
+    c = (struct bench_case) {
+      "unpack_subscribe", 0, levels, packet_size(unpack.buf),
+      run_unpack, &unpack
+    };
+    report(&c);
+    free(unpack.buf);
+
+    unpack.type = UNSUSCRIBE;
+    unpack.buf = make_subscribe(UNSUSCRIBE, levels);
+    c = (struct bench_case) {
+      "unpack_unsubscribe", 0, levels, packet_size(unpack.buf),
+      run_unpack, &unpack
+    };
+    report(&c);
+    free(unpack.buf);
+  }
+
+  /* PUBLISH across payload sizes and topic depths, QoS 0 and 1 */
+  for (size_t s = 0; s < ARRAY_SIZE(payload_sizes); s++) {
+    for (size_t l = 0; l < ARRAY_SIZE(topic_levels); l++) {
+      for (int qos = AT_MOST_ONCE; qos <= AT_LEAST_ONCE; qos++) {
+        size_t size = payload_sizes[s];
+        int levels = topic_levels[l];
+        unsigned char *topic = make_topic(levels);
+        unsigned char *payload = malloc(size);
+
+        memset(payload, 'p', size);
+
+        pack.type = PUBLISH;
+        pack.pkt.publish = (struct mqtt_publish) {
+          .header = { .byte = PUBLISH_BYTE | (qos << 1) },
+          .pkt_id = 42,
+          .topiclen = strlen((char *) topic),
+          .topic = topic,
+          .payloadlen = size,
+          .payload = payload
+        };
+
+        unpack.type = PUBLISH;
+        unpack.buf = pack_mqtt_packet(&pack.pkt, PUBLISH);
+
+        size_t bytes = packet_size(unpack.buf);
+
+        c = (struct bench_case) {
+          qos == AT_MOST_ONCE ? "pack_publish_qos0" : "pack_publish_qos1",
+          size, levels, bytes, run_pack, &pack
+        };
+        report(&c);
+
+        c = (struct bench_case) {
+          qos == AT_MOST_ONCE ? "unpack_publish_qos0" : "unpack_publish_qos1",
+          size, levels, bytes, run_unpack, &unpack
+        };
+        report(&c);
+
+        free(unpack.buf);
+        free(payload);
+        free(topic);
+      }
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,211 @@
+/*
+ * Handover benchmark, times a zero-downtime restart: a broker-like process
+ * passes its listening socket and N client connections over to a successor,
+ * along with a snapshot of their sessions and subscriptions, and the
+ * successor reports how long it took from connecting to the handover socket
+ * to owning everything.
+ *
+ * Build from the repository root:
+ *
+ *   cc -O2 -Isrc bench/bench_handover.c src/handover.c src/pack.c \
+ *      src/arena.c src/memory.c -lpthread -o bench_handover
+ *
+ * Usage:
+ *
+ *   ./bench_handover [-n connections] [-s subscriptions per session]
+ *
+ * Connections are one end of socket pairs, passing a descriptor costs the
+ * same whatever the socket. Both processes need as many descriptors as
+ * connections, the soft limit is raised to the hard one and the count
+ * clamped to it.
+ *
+ * Results are printed as a single JSON object on stdout.
+ */
+#define _GNU_SOURCE
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include "handover.h"
+
+/* Descriptors kept aside for everything else */
+#define SPARE_FDS       64
+
+static inline unsigned long long now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Raise the descriptors limit as far as allowed, return it */
+static size_t raise_nofile(void)
+{
+  struct rlimit rl;
+
+  getrlimit(RLIMIT_NOFILE, &rl);
+  rl.rlim_cur = rl.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &rl);
+
+  return rl.rlim_cur;
+}
+
+/* The successor, takes over and reports */
+static int successor(const char *path, size_t subs_per_session)
+{
+  struct handover h;
+  int sock;
+
+  /* Wait for the old process to be ready */
+  while ((sock = handover_connect(path)) < 0) {
+    usleep(1000);
+  }
+
+  unsigned long long start = now_ns();
+
+  if (handover_recv(sock, &h) < 0) {
+    perror("handover_recv");
+    return 1;
+  }
+
+  unsigned long long elapsed = now_ns() - start;
+  size_t conns = 0;
+  size_t subs = 0;
+
+  for (size_t i = 0; i < h.sessions_nr; i++) {
+    conns += h.sessions[i].fd >= 0;
+    subs += h.sessions[i].subs_nr;
+    if (h.sessions[i].fd >= 0) {
+      close(h.sessions[i].fd);
+    }
+  }
+
+  printf("{\"bench\":\"handover\",\"connections\":%zu,\"sessions\":%zu,"
+         "\"subscriptions\":%zu,\"subs_per_session\":%zu,"
+         "\"handover_ms\":%.3f,\"us_per_connection\":%.3f}\n",
+         conns, h.sessions_nr, subs, subs_per_session, elapsed / 1e6,
+         conns ? elapsed / 1e3 / conns : 0.0);
+
+  close(h.listenfd);
+  handover_release(&h);
+  close(sock);
+
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  size_t conns = 100000;
+  size_t subs_per_session = 4;
+  char path[64];
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+    switch (opt) {
+      case 'n':
+        conns = strtoul(optarg, NULL, 10);
+        break;
+      case 's':
+        subs_per_session = strtoul(optarg, NULL, 10);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-n connections] [-s subscriptions]\n",
+                argv[0]);
+        return 1;
+    }
+  }
+
+  size_t nofile = raise_nofile();
+
+  if (conns + SPARE_FDS > nofile) {
+    fprintf(stderr, "Descriptors limit %zu, running with %zu connections\n",
+            nofile, nofile - SPARE_FDS);
+    conns = nofile - SPARE_FDS;
+  }
+
+  snprintf(path, sizeof(path), "/tmp/sol-bench-handover-%d.sock", getpid());
+
+  /* Fork first, the successor must not inherit the connections */
+  pid_t child = fork();
+
+  if (child == 0) {
+    return successor(path, subs_per_session);
+  }
+
+  struct handover h = {
+    .listenfd = socket(AF_INET, SOCK_STREAM, 0),
+    .sessions_nr = conns,
+    .sessions = calloc(conns, sizeof(struct handover_session))
+  };
+
+  for (size_t i = 0; i < conns; i++) {
+    struct handover_session *s = &h.sessions[i];
+    int sv[2];
+    char buf[64];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+      perror("socketpair");
+      kill(child, SIGKILL);
+      return 1;
+    }
+
+    close(sv[1]);
+    s->fd = sv[0];
+    s->version = i % 2 ? 5 : 4;
+    s->receive_maximum = 65535;
+    s->maximum_packet_size = 268435460;
+    snprintf(buf, sizeof(buf), "client-%08zu", i);
+    s->client_id = strdup(buf);
+    s->subs_nr = subs_per_session;
+    s->subs = calloc(subs_per_session, sizeof(*s->subs));
+    for (size_t j = 0; j < subs_per_session; j++) {
+      snprintf(buf, sizeof(buf), "site/%zu/device/%zu/+/telemetry",
+               i % 100, j);
+      s->subs[j].filter = strdup(buf);
+      s->subs[j].qos = j % 3;
+    }
+  }
+
+  int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  unlink(path);
+
+  if (bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+      listen(lfd, 1) < 0) {
+    perror("bind");
+    kill(child, SIGKILL);
+    return 1;
+  }
+
+  int sock = accept(lfd, NULL, NULL);
+
+  if (sock < 0 || handover_send(sock, &h) < 0) {
+    perror("handover_send");
+    kill(child, SIGKILL);
+    return 1;
+  }
+
+  int status;
+
+  waitpid(child, &status, 0);
+  close(sock);
+  close(lfd);
+  unlink(path);
+
+  for (size_t i = 0; i < conns; i++) {
+    close(h.sessions[i].fd);
+  }
+
+  handover_release(&h);
+
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
@@ -0,0 +1,329 @@
+/*
+ * Local transport benchmark, a forked publisher pushes PUBLISH frames to a
+ * consumer reading them the way the broker does, once over a UNIX socket
+ * and once over the shared memory transport, and reports the messages per
+ * second and the CPU time both processes spend per message.
+ *
+ * Build from the repository root:
+ *
+ *   cc -O2 -Isrc bench/bench_shm.c src/shm.c -o bench_shm
+ *
+ * Usage:
+ *
+ *   ./bench_shm [-n messages] [-s ring size]
+ *
+ * The socket consumer peeks the fixed header and then reads the whole frame,
+ * two system calls per message as in recv_packet, blocking on the socket, the shared memory one
+ * peeks and copies out of the ring and only waits on its doorbell when the
+ * ring runs dry. The publisher writes one frame at a time on both. Payloads
+ * whose frame doesn't fit in a ring of the size given are left out.
+ *
+ * Each line of output is a JSON object for a transport and a payload size.
+ */
+#define _GNU_SOURCE
+#include <time.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include "shm.h"
+
+#define TOPIC           "bench/shm"
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+static const size_t payload_sizes[] = { 16, 128, 1024, 8192, 65536 };
+
+static inline unsigned long long now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* User and system time of the process and its waited children so far */
+static unsigned long long cpu_ns(void)
+{
+  struct rusage self, children;
+  getrusage(RUSAGE_SELF, &self);
+  getrusage(RUSAGE_CHILDREN, &children);
+  return (self.ru_utime.tv_sec + self.ru_stime.tv_sec +
+          children.ru_utime.tv_sec + children.ru_stime.tv_sec) * 1000000000ULL +
+         (self.ru_utime.tv_usec + self.ru_stime.tv_usec +
+          children.ru_utime.tv_usec + children.ru_stime.tv_usec) * 1000ULL;
+}
+
+/* QoS 0 PUBLISH frame carrying a payload of the given size */
+static size_t build_frame(unsigned char *frame, size_t payload)
+{
+  size_t topiclen = sizeof(TOPIC) - 1;
+  size_t remaining = 2 + topiclen + payload;
+  size_t pos = 0;
+
+  frame[pos++] = 0x30;
+  do {
+    unsigned char byte = remaining % 128;
+    remaining /= 128;
+    frame[pos++] = byte | (remaining > 0 ? 0x80 : 0);
+  } while (remaining > 0);
+
+  frame[pos++] = topiclen >> 8;
+  frame[pos++] = topiclen & 0xFF;
+  memcpy(frame + pos, TOPIC, topiclen);
+  pos += topiclen;
+  memset(frame + pos, 'x', payload);
+
+  return pos + payload;
+}
+
+/*
+ * Length of the frame starting with the bytes given, 0 if they don't carry
+ * the whole fixed header yet.
+ */
+static size_t frame_lenght(const unsigned char *header, size_t len)
+{
+  size_t remaining = 0;
+  size_t multiplier = 1;
+
+  for (size_t i = 1; i < len && i < 5; i++) {
+    remaining += (header[i] & 0x7F) * multiplier;
+    multiplier *= 128;
+    if (!(header[i] & 0x80)) {
+      return 1 + i + remaining;
+    }
+  }
+
+  return 0;
+}
+
+static void wait_fd(int fd, short events)
+{
+  struct pollfd pfd = { .fd = fd, .events = events };
+  poll(&pfd, 1, 100);
+}
+
+static void report(const char *transport, size_t payload, unsigned long msgs,
+                   unsigned long long elapsed, unsigned long long cpu)
+{
+  printf("{\"bench\":\"shm\",\"transport\":\"%s\",\"payload\":%zu,"
+         "\"messages\":%lu,\"msgs_per_sec\":%.0f,\"cpu_ns_per_msg\":%.1f}\n",
+         transport, payload, msgs, msgs * 1e9 / elapsed, (double) cpu / msgs);
+  fflush(stdout);
+}
+
+static int run_unix(size_t payload, unsigned long msgs)
+{
+  int sv[2];
+  unsigned char *frame = malloc(payload + 64);
+  size_t framelen = build_frame(frame, payload);
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+    perror("socketpair");
+    return -1;
+  }
+
+  unsigned long long start_cpu = cpu_ns();
+  unsigned long long start = now_ns();
+  pid_t child = fork();
+
+  if (child == 0) {
+    close(sv[0]);
+    for (unsigned long i = 0; i < msgs; i++) {
+      size_t off = 0;
+      while (off < framelen) {
+        ssize_t n = send(sv[1], frame + off, framelen - off, 0);
+        if (n < 0) {
+          _exit(1);
+        }
+        off += n;
+      }
+    }
+    _exit(0);
+  }
+
+  close(sv[1]);
+
+  unsigned char *buf = malloc(framelen);
+  unsigned long received = 0;
+
+  while (received < msgs) {
+    unsigned char header[5];
+    ssize_t n = recv(sv[0], header, sizeof(header), MSG_PEEK);
+    size_t len = n > 0 ? frame_lenght(header, n) : 0;
+
+    if (n <= 0) {
+      break;
+    }
+
+    /* Header split across writes, the rest is on its way */
+    if (len == 0) {
+      continue;
+    }
+
+    if (recv(sv[0], buf, len, MSG_WAITALL) != (ssize_t) len) {
+      perror("recv");
+      return -1;
+    }
+    received++;
+  }
+
+  unsigned long long elapsed = now_ns() - start;
+  waitpid(child, NULL, 0);
+  unsigned long long cpu = cpu_ns() - start_cpu;
+
+  report("unix", payload, received, elapsed, cpu);
+
+  close(sv[0]);
+  free(frame);
+  free(buf);
+
+  return received == msgs ? 0 : -1;
+}
+
+static int run_shm(const char *path, size_t ringsize, size_t payload,
+                   unsigned long msgs)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  unsigned char *frame = malloc(payload + 64);
+  size_t framelen = build_frame(frame, payload);
+  int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  unlink(path);
+
+  if (lfd < 0 || bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+      listen(lfd, 1) < 0) {
+    perror("listen");
+    return -1;
+  }
+
+  unsigned long long start_cpu = cpu_ns();
+  unsigned long long start = now_ns();
+  pid_t child = fork();
+
+  if (child == 0) {
+    struct shm_conn conn;
+
+    close(lfd);
+    if (shm_connect(path, ringsize, &conn) < 0) {
+      _exit(1);
+    }
+
+    for (unsigned long i = 0; i < msgs; i++) {
+      size_t off = 0;
+      while (off < framelen) {
+        ssize_t n = shm_send(&conn, frame + off, framelen - off);
+        if (n < 0) {
+          _exit(1);
+        }
+        off += n;
+        if (off < framelen && shm_wait_room(&conn) == 0) {
+          wait_fd(conn.doorbell, POLLIN);
+        }
+        if (off < framelen) {
+          shm_ack(&conn);
+        }
+      }
+    }
+
+    shm_close(&conn);
+    _exit(0);
+  }
+
+  struct shm_conn conn;
+  int fd = accept(lfd, NULL, NULL);
+
+  close(lfd);
+  unlink(path);
+
+  /* Same as the broker, the handshake is read once the socket is readable */
+  wait_fd(fd, POLLIN);
+  if (fd < 0 || shm_accept(fd, &conn) < 0) {
+    perror("shm_accept");
+    return -1;
+  }
+
+  unsigned char *buf = malloc(framelen);
+  unsigned long received = 0;
+
+  while (received < msgs) {
+    unsigned char header[5];
+    size_t n = shm_peek(&conn, header, sizeof(header));
+    size_t len = frame_lenght(header, n);
+
+    if (len > 0 && shm_readable(&conn) >= len) {
+      shm_recv(&conn, buf, len);
+      received++;
+      continue;
+    }
+
+    if (shm_closed(&conn)) {
+      break;
+    }
+
+    if (shm_wait_data(&conn) == 0) {
+      wait_fd(conn.doorbell, POLLIN);
+    }
+    shm_ack(&conn);
+  }
+
+  unsigned long long elapsed = now_ns() - start;
+  waitpid(child, NULL, 0);
+  unsigned long long cpu = cpu_ns() - start_cpu;
+
+  report("shm", payload, received, elapsed, cpu);
+
+  shm_close(&conn);
+  free(frame);
+  free(buf);
+
+  return received == msgs ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+  unsigned long msgs = 1000000;
+  size_t ringsize = 0;
+  char path[64];
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+    switch (opt) {
+      case 'n':
+        msgs = strtoul(optarg, NULL, 10);
+        break;
+      case 's':
+        ringsize = strtoul(optarg, NULL, 10);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-n messages] [-s ring size]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  snprintf(path, sizeof(path), "/tmp/bench-shm-%d.sock", (int) getpid());
+
+  for (size_t i = 0; i < ARRAY_SIZE(payload_sizes); i++) {
+    /* A frame must fit in the ring, the broker refuses bigger ones */
+    if (ringsize > 0 && payload_sizes[i] + 64 > ringsize) {
+      break;
+    }
+    if (run_unix(payload_sizes[i], msgs) < 0 ||
+        run_shm(path, ringsize, payload_sizes[i], msgs) < 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,161 @@
+/*
+ * Heavy hitters benchmark, the cost per PUBLISH of sampling it and counting
+ * its topic and its client as on_read does, and how well the top-K found
+ * matches the exact one, over a Zipf distributed stream of topics.
+ *
+ * Build from the repository root:
+ *
+ *   cc -O2 -Isrc bench/bench_topk.c src/topk.c src/intern.c src/trie.c \
+ *      src/bloom.c src/rcu.c src/memory.c -lm -lpthread -o bench_topk
+ *
+ * Usage:
+ *
+ *   ./bench_topk [-n messages] [-k topics] [-c clients] [-s skew]
+ *
+ * Output is a JSON object, ns per PUBLISH, sampled ones and the others
+ * averaged, the number of the true TOPK_SIZE topics by messages found, and
+ * the worst error of the count among the ones found, relative to the total.
+ * Build with -DTOPK_SAMPLE=1 to count every PUBLISH.
+ */
+#include <math.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "topk.h"
+#include "intern.h"
+
+#define KEY_SIZE        32
+
+static double now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Index of a Zipf distributed draw, from the cumulative weights */
+static size_t zipf_draw(const double *cdf, size_t n)
+{
+  double u = (double) rand() / RAND_MAX * cdf[n - 1];
+  size_t lo = 0, hi = n - 1;
+
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (cdf[mid] < u) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+int main(int argc, char **argv)
+{
+  size_t n = 10000000, keys = 100000, clients = 1000;
+  double skew = 1.1;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:k:c:s:")) != -1) {
+    switch (opt) {
+      case 'n':
+        n = strtoull(optarg, NULL, 10);
+        break;
+      case 'k':
+        keys = strtoull(optarg, NULL, 10);
+        break;
+      case 'c':
+        clients = strtoull(optarg, NULL, 10);
+        break;
+      case 's':
+        skew = atof(optarg);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-n messages] [-k topics] [-c clients] "
+                "[-s skew]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if (n == 0 || keys < TOPK_SIZE || clients == 0) {
+    fprintf(stderr, "Need messages, %d topics and a client at least\n",
+            TOPK_SIZE);
+    return 1;
+  }
+
+  char (*topics)[KEY_SIZE] = malloc(keys * KEY_SIZE);
+  char (*ids)[KEY_SIZE] = malloc(clients * KEY_SIZE);
+  size_t *topic_lens = malloc(keys * sizeof(size_t));
+  size_t *id_lens = malloc(clients * sizeof(size_t));
+  double *cdf = malloc(keys * sizeof(double));
+  unsigned *stream = malloc(n * sizeof(unsigned));
+  unsigned long long *exact = calloc(keys, sizeof(*exact));
+  static struct topk hot_topics, hot_clients;
+
+  if (!topics || !ids || !topic_lens || !id_lens || !cdf || !stream
+      || !exact) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+
+  double sum = 0;
+
+  for (size_t i = 0; i < keys; i++) {
+    topic_lens[i] = snprintf(topics[i], KEY_SIZE, "sensors/%zu/temp", i);
+    sum += 1.0 / pow(i + 1, skew);
+    cdf[i] = sum;
+  }
+
+  for (size_t i = 0; i < clients; i++) {
+    id_lens[i] = snprintf(ids[i], KEY_SIZE, "client-%zu", i);
+  }
+
+  /* Drawn beforehand, only the counting is timed */
+  srand(1);
+  for (size_t i = 0; i < n; i++) {
+    stream[i] = zipf_draw(cdf, keys);
+    exact[stream[i]]++;
+  }
+
+  uint64_t rng = 0x9e3779b97f4a7c15ULL;
+  double start = now_ns();
+
+  /* Same sampling and counting as hot_publish */
+  for (size_t i = 0; i < n; i++) {
+    if (!topk_sampled(&rng)) {
+      continue;
+    }
+    unsigned t = stream[i], c = t % clients;
+    uint64_t bytes = (64 + (t & 255)) * TOPK_SAMPLE;
+    topk_add(&hot_topics, intern_hash(topics[t], topic_lens[t]), topics[t],
+             topic_lens[t], TOPK_SAMPLE, bytes);
+    topk_add(&hot_clients, intern_hash(ids[c], id_lens[c]), ids[c],
+             id_lens[c], TOPK_SAMPLE, bytes);
+  }
+
+  double ns = (now_ns() - start) / n;
+
+  /* The Zipf ranks are the exact ranking, topic i being the i+1-th */
+  struct topk_entry top[TOPK_SIZE];
+  size_t found = topk_list(&hot_topics, TOPK_MESSAGES, top), right = 0;
+  double worst = 0;
+
+  for (size_t i = 0; i < found; i++) {
+    size_t k = strtoull(top[i].key + strlen("sensors/"), NULL, 10);
+    double err = fabs((double) top[i].count - exact[k]) / n;
+    right += k < TOPK_SIZE;
+    worst = err > worst ? err : worst;
+  }
+
+  printf("{\"bench\":\"topk\",\"messages\":%zu,\"topics\":%zu,"
+         "\"clients\":%zu,\"skew\":%.2f,\"sample\":%d,"
+         "\"ns_per_publish\":%.1f,\"top_found\":%zu,\"top_size\":%d,"
+         "\"worst_error\":%.6f,\"tracker_bytes\":%zu}\n",
+         n, keys, clients, skew, TOPK_SAMPLE, ns, right, TOPK_SIZE, worst,
+         sizeof(struct topk));
+
+  return 0;
+}
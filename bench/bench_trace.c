@@ -0,0 +1,137 @@
+/*
+ * Instrumentation overhead benchmark, the cost per packet of the timing
+ * laps and the flight recorder event on_read adds, against the budget of a
+ * packet at 1M messages per second.
+ *
+ * Build from the repository root:
+ *
+ *   cc -O2 -Isrc bench/bench_trace.c src/trace.c -lpthread -o bench_trace
+ *
+ * Usage:
+ *
+ *   ./bench_trace [-n packets] [-d]
+ *
+ * -d dumps the flight recorder and the timings at the end, as SIGUSR1
+ * does in the broker.
+ *
+ * Output is a JSON object, the overhead is given in nanoseconds per packet
+ * and in percent of the 1000ns a packet has at 1M messages per second.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "trace.h"
+
+/* Stand-in for the work of a packet, enough not to be optimized away */
+static volatile uint64_t sink;
+
+static inline void work(uint64_t i)
+{
+  sink += i * 2654435761ULL;
+}
+
+static double now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double run_plain(uint64_t n)
+{
+  double start = now_ns();
+
+  for (uint64_t i = 0; i < n; i++) {
+    work(i);
+    work(i + 1);
+    work(i + 2);
+  }
+
+  return (now_ns() - start) / n;
+}
+
+/*
+ * Same stages on_read goes through, with the same calls, the loop clock
+ * read once every 64 packets as an iteration of a busy loop would.
+ */
+static double run_traced(uint64_t n)
+{
+  double start = now_ns();
+  uint64_t clock = (uint64_t) start / 1000000;
+
+  for (uint64_t i = 0; i < n; i++) {
+    unsigned type = 3;
+    if ((i & 63) == 0) {
+      clock = (uint64_t) now_ns() / 1000000;
+    }
+    trace_tick t = trace_start();
+    work(i);
+    trace_lap(&t, TRACE_RECV, type);
+    trace_record(clock, TRACE_EV_RECV, 5, type, 64);
+    work(i + 1);
+    trace_lap(&t, TRACE_UNPACK, type);
+    work(i + 2);
+    trace_lap(&t, TRACE_HANDLER, type);
+  }
+
+  return (now_ns() - start) / n;
+}
+
+int main(int argc, char **argv)
+{
+  uint64_t n = 50000000;
+  int dump = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:d")) != -1) {
+    switch (opt) {
+      case 'n':
+        n = strtoull(optarg, NULL, 10);
+        break;
+      case 'd':
+        dump = 1;
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-n packets] [-d]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if (n == 0) {
+    fprintf(stderr, "Need at least a packet\n");
+    return 1;
+  }
+
+  trace_init(0);
+
+  /* Warm up, then best of 3 for each, against noise from the machine */
+  run_plain(n / 10);
+  run_traced(n / 10);
+
+  double plain = 1e18, traced = 1e18;
+
+  for (int i = 0; i < 3; i++) {
+    double p = run_plain(n), t = run_traced(n);
+    plain = p < plain ? p : plain;
+    traced = t < traced ? t : traced;
+  }
+
+  double overhead = traced > plain ? traced - plain : 0;
+
+  printf("{\"bench\":\"trace\",\"packets\":%llu,\"sample\":%d,"
+         "\"ring\":%d,\"plain_ns\":%.2f,\"traced_ns\":%.2f,"
+         "\"overhead_ns\":%.2f,\"overhead_pct_at_1m\":%.2f}\n",
+         (unsigned long long) n, TRACE_SAMPLE, TRACE_RING, plain, traced,
+         overhead, overhead / 1000.0 * 100.0);
+  fflush(stdout);
+
+  if (dump) {
+    trace_dump(STDOUT_FILENO);
+  }
+
+  return 0;
+}
@@ -0,0 +1,137 @@
+/*
+ * Cost of the MQTT string validation run by the decoder, in bytes per cycle
+ * for every implementation the CPU supports.
+ *
+ * Build and run from the repository root:
+ *
+ *   cc -O2 -Isrc bench/bench_utf8.c src/utf8.c -o bench_utf8 && ./bench_utf8
+ *
+ * Each line of output is a JSON object, one per input and implementation.
+ */
+#include <time.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include "utf8.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define cycles() __rdtsc()
+#else
+/* No cycle counter, fall back to nanoseconds */
+static inline uint64_t cycles(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+#define TARGET_BYTES    (256ULL * 1024 * 1024)
+
+static const char *impl_names[] = { "scalar", "sse2", "avx2" };
+
+typedef int validator(const unsigned char *, size_t);
+
+struct input {
+  const char *name;
+  validator *validate;
+  unsigned char *buf;
+  size_t len;
+};
+
+/* Fill with a repeated pattern, followed by a final suffix */
+static unsigned char *make_input(const char *pattern, size_t repeat,
+                                 const char *suffix, size_t *out)
+{
+  size_t plen = strlen(pattern);
+  size_t slen = strlen(suffix);
+  unsigned char *buf = malloc(plen * repeat + slen);
+
+  for (size_t i = 0; i < repeat; i++) {
+    memcpy(buf + i * plen, pattern, plen);
+  }
+
+  memcpy(buf + plen * repeat, suffix, slen);
+  *out = plen * repeat + slen;
+
+  return buf;
+}
+
+static void run(const struct input *in, int impl)
+{
+  size_t iterations = TARGET_BYTES / in->len;
+  volatile int valid = 1;
+
+  /* Warm up caches and branch predictors */
+  for (size_t i = 0; i < 1000; i++) {
+    valid &= in->validate(in->buf, in->len);
+  }
+
+  uint64_t start = cycles();
+
+  for (size_t i = 0; i < iterations; i++) {
+    valid &= in->validate(in->buf, in->len);
+  }
+
+  uint64_t elapsed = cycles() - start;
+  double bytes = (double) iterations * in->len;
+
+  printf("{\"bench\":\"utf8\",\"input\":\"%s\",\"impl\":\"%s\","
+         "\"len\":%zu,\"valid\":%d,\"bytes_per_cycle\":%.3f}\n",
+         in->name, impl_names[impl], in->len, valid, bytes / elapsed);
+}
+
+int main(void)
+{
+  struct input inputs[6];
+  int n = 0;
+
+  inputs[n].name = "topic_ascii";
+  inputs[n].validate = mqtt_valid_topic_name;
+  inputs[n].buf = make_input("fleet/", 2, "dev42/temp", &inputs[n].len);
+  n++;
+
+  inputs[n].name = "topic_ascii_long";
+  inputs[n].validate = mqtt_valid_topic_name;
+  inputs[n].buf = make_input("region-eu/site-07/", 6, "temp", &inputs[n].len);
+  n++;
+
+  inputs[n].name = "filter_wildcards";
+  inputs[n].validate = mqtt_valid_topic_filter;
+  inputs[n].buf = make_input("fleet/+/", 4, "#", &inputs[n].len);
+  n++;
+
+  inputs[n].name = "string_ascii_4k";
+  inputs[n].validate = utf8_valid;
+  inputs[n].buf = make_input("client-identifier-", 227, "", &inputs[n].len);
+  n++;
+
+  inputs[n].name = "string_latin_4k";
+  inputs[n].validate = utf8_valid;
+  inputs[n].buf = make_input("caf\xc3\xa9-cr\xc3\xa8me-", 315, "",
+                             &inputs[n].len);
+  n++;
+
+  inputs[n].name = "string_cjk_4k";
+  inputs[n].validate = utf8_valid;
+  inputs[n].buf = make_input("\xe6\xb8\xa9\xe5\xba\xa6\xe4\xbc\xa0", 455, "",
+                             &inputs[n].len);
+  n++;
+
+  for (int impl = UTF8_SCALAR; impl <= UTF8_AVX2; impl++) {
+    if (utf8_select(impl) != impl) {
+      continue;
+    }
+    for (int i = 0; i < n; i++) {
+      run(&inputs[i], impl);
+    }
+  }
+
+  for (int i = 0; i < n; i++) {
+    free(inputs[i].buf);
+  }
+
+  return 0;
+}
@@ -0,0 +1,292 @@
+/*
+ * Send path benchmark, pushes payloads of 4KB to 1MB through a TCP socket
+ * with plain copying sends and with MSG_ZEROCOPY, through the same zerocopy
+ * module the broker uses, and reports the CPU time the sender spends per GB
+ * delivered.
+ *
+ * Build from the repository root:
+ *
+ *   cc -O2 -Isrc bench/bench_zerocopy.c src/zerocopy.c -o bench_zerocopy
+ *
+ * Usage:
+ *
+ *   ./bench_zerocopy [-H host] [-p port] [-g gigabytes]
+ *
+ * Without a host a sink process is forked on the other end of a loopback
+ * connection. Loopback makes the kernel copy the data anyway, which the
+ * zerocopy module notices and falls back to copying, so it only shows the
+ * cost of trying. Real numbers need a sink on another box behind a NIC,
+ * e.g. socat -u TCP-LISTEN:9000,fork,reuseaddr /dev/null
+ *
+ * Each line of output is a JSON object for a mode and a payload size.
+ */
+#define _GNU_SOURCE
+#include <time.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "zerocopy.h"
+
+/* Payloads in flight, each one stays busy until its send completes */
+#define BUFFERS         32
+
+#define SINK_CHUNK      (1 << 20)
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+static const size_t payload_sizes[] = { 4096, 16384, 65536, 262144, 1048576 };
+
+struct buffer {
+  unsigned char *data;
+  int busy;
+};
+
+static inline unsigned long long now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* User and system time of the process so far */
+static unsigned long long cpu_ns(void)
+{
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+         (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+static void buffer_release(void *arg)
+{
+  ((struct buffer *) arg)->busy = 0;
+}
+
+/* Read and drop everything until the connection is closed */
+static void sink(int fd)
+{
+  unsigned char *buf = malloc(SINK_CHUNK);
+
+  while (read(fd, buf, SINK_CHUNK) > 0)
+    ;
+
+  free(buf);
+  _exit(0);
+}
+
+/* Connect to the given sink or to a forked one over loopback */
+static int sink_connect(const char *host, const char *port, pid_t *child)
+{
+  *child = 0;
+
+  if (!host) {
+    int sv[2];
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {
+      .sin_family = AF_INET,
+      .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+    socklen_t len = sizeof(addr);
+
+    if (lfd < 0 || bind(lfd, (struct sockaddr *) &addr, len) < 0 ||
+        listen(lfd, 1) < 0 ||
+        getsockname(lfd, (struct sockaddr *) &addr, &len) < 0) {
+      return -1;
+    }
+
+    sv[0] = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(sv[0], (struct sockaddr *) &addr, len) < 0) {
+      return -1;
+    }
+    sv[1] = accept(lfd, NULL, NULL);
+    close(lfd);
+
+    if ((*child = fork()) == 0) {
+      close(sv[0]);
+      sink(sv[1]);
+    }
+
+    close(sv[1]);
+    return sv[0];
+  }
+
+  struct addrinfo hints = { .ai_family = AF_UNSPEC,
+                            .ai_socktype = SOCK_STREAM };
+  struct addrinfo *res;
+  int fd = -1;
+
+  if (getaddrinfo(host, port, &hints, &res) != 0) {
+    return -1;
+  }
+
+  for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+    if ((fd = socket(ai->ai_family, ai->ai_socktype, 0)) < 0) {
+      continue;
+    }
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+
+  freeaddrinfo(res);
+
+  return fd;
+}
+
+/* Wait for the socket to be writable or to have completions to read */
+static void wait_socket(int fd)
+{
+  struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+  poll(&pfd, 1, 100);
+}
+
+static int run(const char *host, const char *port, int zerocopy,
+               size_t payload, unsigned long long total)
+{
+  struct buffer buffers[BUFFERS];
+  pid_t child;
+  int fd = sink_connect(host, port, &child);
+
+  if (fd < 0) {
+    perror("connect");
+    return -1;
+  }
+
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int) {1}, sizeof(int));
+
+  struct zerocopy *zc = zerocopy_create(fd);
+  int supported = zc->enabled;
+
+  zc->enabled = zerocopy && supported;
+
+  for (int i = 0; i < BUFFERS; i++) {
+    buffers[i].data = malloc(payload);
+    buffers[i].busy = 0;
+    memset(buffers[i].data, 'a' + i, payload);
+  }
+
+  /* Non-blocking, as the broker sockets are */
+  int flags = fcntl(fd, F_GETFL, 0);
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+  unsigned long long sent = 0;
+  unsigned long long start_cpu = cpu_ns();
+  unsigned long long start = now_ns();
+  int next = 0;
+
+  while (sent < total) {
+    struct buffer *b = &buffers[next];
+
+    /* Every buffer pinned, wait for completions */
+    while (b->busy) {
+      wait_socket(fd);
+      zerocopy_reap(zc, fd);
+    }
+
+    size_t off = 0;
+
+    while (off < payload) {
+      ssize_t n = zerocopy_send(zc, fd, b->data + off, payload - off);
+      if (n < 0) {
+        perror("send");
+        return -1;
+      }
+      off += n;
+      if (off < payload) {
+        wait_socket(fd);
+        zerocopy_reap(zc, fd);
+      }
+    }
+
+    b->busy = 1;
+    zerocopy_pin(zc, b, buffer_release);
+    sent += payload;
+    next = (next + 1) % BUFFERS;
+  }
+
+  /* Everything sent must be completed before it counts */
+  while (zc->nr > 0) {
+    wait_socket(fd);
+    zerocopy_reap(zc, fd);
+  }
+
+  unsigned long long elapsed = now_ns() - start;
+  unsigned long long cpu = cpu_ns() - start_cpu;
+  double gb = (double) sent / (1ULL << 30);
+
+  printf("{\"bench\":\"zerocopy\",\"mode\":\"%s\",\"payload\":%zu,"
+         "\"bytes\":%llu,\"supported\":%d,\"zerocopy_sends\":%llu,"
+         "\"copied\":%llu,\"cpu_sec_per_gb\":%.4f,\"gb_per_sec\":%.3f}\n",
+         zerocopy ? "zerocopy" : "copy", payload, sent, supported,
+         (unsigned long long) zc->sends, (unsigned long long) zc->copied,
+         cpu / 1e9 / gb, gb * 1e9 / elapsed);
+  fflush(stdout);
+
+  close(fd);
+  zerocopy_destroy(zc);
+
+  for (int i = 0; i < BUFFERS; i++) {
+    free(buffers[i].data);
+  }
+
+  if (child > 0) {
+    waitpid(child, NULL, 0);
+  }
+
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  const char *host = NULL;
+  const char *port = "9000";
+  double gigabytes = 4;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "H:p:g:")) != -1) {
+    switch (opt) {
+      case 'H':
+        host = optarg;
+        break;
+      case 'p':
+        port = optarg;
+        break;
+      case 'g':
+        gigabytes = atof(optarg);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-H host] [-p port] [-g gigabytes]\n",
+                argv[0]);
+        return 1;
+    }
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  unsigned long long total = gigabytes * (1ULL << 30);
+
+  for (size_t i = 0; i < ARRAY_SIZE(payload_sizes); i++) {
+    for (int zerocopy = 0; zerocopy <= 1; zerocopy++) {
+      if (run(host, port, zerocopy, payload_sizes[i], total) < 0) {
+        return 1;
+      }
+    }
+  }
+
+  return 0;
+}
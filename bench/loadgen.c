@@ -0,0 +1,752 @@
+/*
+ * End-to-end load generator, opens subscriber and publisher connections to
+ * a running broker over TCP loopback or a UNIX socket, drives a mix of
+ * topics, QoS and payload sizes and reports publish-to-deliver latency and
+ * throughput. Runs fully offline on a single box.
+ *
+ * Publishes are sent open-loop at a fixed rate: every message carries the
+ * time it was supposed to be sent, and latency is measured from it rather
+ * than from when it was actually written. A stalled broker then shows up in
+ * the latency instead of silently slowing the generator down (coordinated
+ * omission).
+ *
+ * Build from the repository root:
+ *
+ *   cc -O2 -Isrc bench/loadgen.c src/mqtt.c src/pack.c src/utf8.c \
+ *      src/stream.c src/arena.c src/memory.c -lpthread -o loadgen
+ *
+ * Usage:
+ *
+ *   ./loadgen [-H host] [-p port] [-u unix_path] [-s subscribers]
+ *             [-P publishers] [-t topics] [-l levels] [-r msgs/s]
+ *             [-d seconds] [-q qos:weight,...] [-z bytes:weight,...]
+ *
+ * e.g. ./loadgen -s 2000 -P 100 -t 500 -r 50000 -q 0:80,1:20 -z 64:90,4096:10
+ *
+ * Results are printed as a single JSON object on stdout.
+ */
+#define _GNU_SOURCE
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "mqtt.h"
+#include "pack.h"
+
+#define MAX_MIX             8
+#define MAX_EVENTS          1024
+#define READ_CHUNK          65536
+
+/* Time allowed for in-flight messages to be delivered after the run */
+#define DRAIN_NS            (2 * 1000000000ULL)
+
+/* Time allowed to connect and subscribe every client */
+#define SETUP_NS            (30 * 1000000000ULL)
+
+/*
+ * Log-linear latency histogram, 64 sub-buckets for every power of 2 of
+ * nanoseconds, about 1.5% precision up to hours.
+ */
+#define SUB_BUCKETS_BITS    6
+#define SUB_BUCKETS         (1 << SUB_BUCKETS_BITS)
+#define HIST_BUCKETS        (64 * SUB_BUCKETS)
+
+enum role { SUBSCRIBER, PUBLISHER };
+
+/* Weighted value, e.g. a QoS level or a payload size and its share */
+struct mix {
+  int nr;
+  unsigned long values[MAX_MIX];
+  unsigned weights[MAX_MIX];
+  unsigned total;
+};
+
+struct conn {
+  int fd;
+  enum role role;
+  int connected;
+  int subscribed;
+  /* Partial frames read so far */
+  unsigned char *in;
+  size_t inlen;
+  size_t insize;
+  /* Bytes waiting for the socket to be writable */
+  unsigned char *out;
+  size_t outlen;
+  size_t outoff;
+  size_t outsize;
+  int want_write;
+};
+
+/* Intended send time and sequence, at the start of every payload */
+struct stamp {
+  uint64_t intended_ns;
+  uint64_t seq;
+};
+
+static struct {
+  const char *host;
+  const char *port;
+  const char *unix_path;
+  int subscribers;
+  int publishers;
+  int topics;
+  int levels;
+  double rate;
+  int duration;
+  struct mix qos;
+  struct mix sizes;
+} opts = {
+  .host = "127.0.0.1",
+  .port = "1883",
+  .unix_path = NULL,
+  .subscribers = 100,
+  .publishers = 10,
+  .topics = 100,
+  .levels = 3,
+  .rate = 10000,
+  .duration = 10
+};
+
+static struct {
+  uint64_t sent;
+  uint64_t expected;
+  uint64_t delivered;
+  uint64_t acked;
+  uint64_t errors;
+  uint64_t max_ns;
+  uint64_t hist[HIST_BUCKETS];
+} stats;
+
+static int epollfd;
+static char **topics;
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static inline uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t rng(void)
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+/* Parse a "value:weight,value:weight" list */
+static int parse_mix(const char *arg, struct mix *mix)
+{
+  char *copy = strdup(arg);
+  char *save = NULL;
+
+  mix->nr = 0;
+  mix->total = 0;
+
+  for (char *tok = strtok_r(copy, ",", &save); tok;
+       tok = strtok_r(NULL, ",", &save)) {
+    if (mix->nr == MAX_MIX) {
+      break;
+    }
+    char *colon = strchr(tok, ':');
+    mix->values[mix->nr] = strtoul(tok, NULL, 10);
+    mix->weights[mix->nr] = colon ? strtoul(colon + 1, NULL, 10) : 1;
+    mix->total += mix->weights[mix->nr];
+    mix->nr++;
+  }
+
+  free(copy);
+  return mix->nr > 0 && mix->total > 0 ? 0 : -1;
+}
+
+static unsigned long pick(const struct mix *mix)
+{
+  unsigned r = rng() % mix->total;
+
+  for (int i = 0; i < mix->nr; i++) {
+    if (r < mix->weights[i]) {
+      return mix->values[i];
+    }
+    r -= mix->weights[i];
+  }
+
+  return mix->values[0];
+}
+
+static void hist_record(uint64_t ns)
+{
+  int bucket;
+
+  if (ns < SUB_BUCKETS) {
+    bucket = ns;
+  } else {
+    int msb = 63 - __builtin_clzll(ns);
+    int shift = msb - SUB_BUCKETS_BITS;
+    bucket = (shift + 1) * SUB_BUCKETS + ((ns >> shift) - SUB_BUCKETS);
+  }
+
+  stats.hist[bucket]++;
+
+  if (ns > stats.max_ns) {
+    stats.max_ns = ns;
+  }
+}
+
+/* Upper bound of a bucket, in nanoseconds */
+static uint64_t hist_value(int bucket)
+{
+  if (bucket < SUB_BUCKETS) {
+    return bucket;
+  }
+
+  int shift = bucket / SUB_BUCKETS - 1;
+  uint64_t sub = bucket % SUB_BUCKETS + SUB_BUCKETS;
+
+  return ((sub + 1) << shift) - 1;
+}
+
+static uint64_t hist_percentile(double p)
+{
+  uint64_t target = (uint64_t) (stats.delivered * p / 100.0);
+  uint64_t count = 0;
+
+  if (stats.delivered == 0) {
+    return 0;
+  }
+
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    count += stats.hist[i];
+    if (count > target) {
+      uint64_t value = hist_value(i);
+      return value < stats.max_ns ? value : stats.max_ns;
+    }
+  }
+
+  return stats.max_ns;
+}
+
+static int connect_socket(void)
+{
+  int fd;
+
+  if (opts.unix_path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, opts.unix_path, sizeof(addr.sun_path) - 1);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+      return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+      close(fd);
+      return -1;
+    }
+  } else {
+    struct addrinfo hints = {
+      .ai_family = AF_UNSPEC,
+      .ai_socktype = SOCK_STREAM
+    };
+    struct addrinfo *res;
+    if (getaddrinfo(opts.host, opts.port, &hints, &res) != 0) {
+      return -1;
+    }
+    fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+      if (fd >= 0) {
+        close(fd);
+      }
+      freeaddrinfo(res);
+      return -1;
+    }
+    freeaddrinfo(res);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int) {1}, sizeof(int));
+  }
+
+  /* Connect is blocking, everything after it is not */
+  int flags = fcntl(fd, F_GETFL, 0);
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+  return fd;
+}
+
+static void conn_update_events(struct conn *c)
+{
+  struct epoll_event ev = {
+    .events = EPOLLIN | (c->want_write ? EPOLLOUT : 0),
+    .data.ptr = c
+  };
+
+  epoll_ctl(epollfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void conn_flush(struct conn *c)
+{
+  while (c->outoff < c->outlen) {
+    ssize_t n = send(c->fd, c->out + c->outoff, c->outlen - c->outoff,
+                     MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        stats.errors++;
+        c->outoff = c->outlen;
+      }
+      break;
+    }
+    c->outoff += n;
+  }
+
+  if (c->outoff == c->outlen) {
+    c->outoff = c->outlen = 0;
+  }
+
+  int want_write = c->outlen > 0;
+
+  if (want_write != c->want_write) {
+    c->want_write = want_write;
+    conn_update_events(c);
+  }
+}
+
+/*
+ * Queue bytes on a connection, everything goes through the buffer so that
+ * frames are never interleaved on a congested socket.
+ */
+static void conn_queue(struct conn *c, const unsigned char *buf, size_t len)
+{
+  if (c->outlen + len > c->outsize) {
+    size_t size = c->outsize ? c->outsize : 4096;
+    while (size < c->outlen + len) {
+      size *= 2;
+    }
+    c->out = realloc(c->out, size);
+    c->outsize = size;
+  }
+
+  memcpy(c->out + c->outlen, buf, len);
+  c->outlen += len;
+}
+
+static void send_connect(struct conn *c, int id)
+{
+  char cid[32];
+  size_t cidlen = snprintf(cid, sizeof(cid), "loadgen-%c-%d",
+                           c->role == PUBLISHER ? 'p' : 's', id);
+  size_t len = 10 + 2 + cidlen;
+  unsigned char buf[64];
+  unsigned char *p = buf;
+
+  pack_u8(&p, CONNECT << 4);
+  p += mqtt_encode_lenght(p, len);
+  pack_u16(&p, 4);
+  memcpy(p, "MQTT", 4);
+  p += 4;
+  /* Protocol level 4, clean session, no keepalive */
+  pack_u8(&p, 4);
+  pack_u8(&p, 0x02);
+  pack_u16(&p, 0);
+  pack_u16(&p, cidlen);
+  memcpy(p, cid, cidlen);
+  p += cidlen;
+
+  conn_queue(c, buf, p - buf);
+}
+
+static void send_subscribe(struct conn *c, const char *topic, unsigned qos)
+{
+  size_t topiclen = strlen(topic);
+  size_t len = 2 + 2 + topiclen + 1;
+  unsigned char *buf = malloc(len + 5);
+  unsigned char *p = buf;
+
+  pack_u8(&p, (SUBSCRIBE << 4) | 0x02);
+  p += mqtt_encode_lenght(p, len);
+  pack_u16(&p, 1);
+  pack_u16(&p, topiclen);
+  memcpy(p, topic, topiclen);
+  p += topiclen;
+  pack_u8(&p, qos);
+
+  conn_queue(c, buf, p - buf);
+  free(buf);
+}
+
+/* Size of a packed frame, read back from its fixed header */
+static size_t frame_size(const unsigned char *buf)
+{
+  const unsigned char *p = buf + 1;
+  unsigned long long len = mqtt_decode_lenght(&p);
+  return (p - buf) + len;
+}
+
+static void send_publish(struct conn *c, const char *topic,
+                         uint64_t intended, uint64_t seq)
+{
+  static uint16_t pkt_id = 0;
+  unsigned qos = pick(&opts.qos);
+  size_t size = pick(&opts.sizes);
+  unsigned char *payload = calloc(1, size);
+  struct stamp stamp = { intended, seq };
+
+  memcpy(payload, &stamp, size < sizeof(stamp) ? size : sizeof(stamp));
+
+  union mqtt_packet pkt;
+  pkt.publish = (struct mqtt_publish) {
+    .header = { .byte = PUBLISH_BYTE | (qos << 1) },
+    .pkt_id = ++pkt_id ? pkt_id : ++pkt_id,
+    .topiclen = strlen(topic),
+    .topic = (unsigned char *) topic,
+    .payloadlen = size,
+    .payload = payload
+  };
+
+  unsigned char *frame = pack_mqtt_packet(&pkt, PUBLISH);
+  conn_queue(c, frame, frame_size(frame));
+  free(frame);
+  free(payload);
+}
+
+static void handle_frame(struct conn *c, unsigned char *frame)
+{
+  union mqtt_header hdr = { .byte = frame[0] };
+  union mqtt_packet pkt;
+
+  switch (hdr.bits.type) {
+    case CONNACK:
+      c->connected = 1;
+      break;
+    case SUBACK:
+      c->subscribed = 1;
+      break;
+    case PUBACK:
+      stats.acked++;
+      break;
+    case PUBLISH:
+      if (unpack_mqtt_packet(frame, &pkt) < 0) {
+        stats.errors++;
+        break;
+      }
+      if (pkt.publish.payloadlen >= sizeof(struct stamp)) {
+        struct stamp stamp;
+        memcpy(&stamp, pkt.publish.payload, sizeof(stamp));
+        uint64_t now = now_ns();
+        hist_record(now > stamp.intended_ns ? now - stamp.intended_ns : 0);
+      }
+      stats.delivered++;
+      if (pkt.publish.header.bits.qos == AT_LEAST_ONCE) {
+        union mqtt_packet ack = {
+          .ack = *mqtt_packet_ack(PUBACK_BYTE, pkt.publish.pkt_id)
+        };
+        unsigned char *buf = pack_mqtt_packet(&ack, PUBACK);
+        conn_queue(c, buf, MQTT_ACK_LEN);
+        free(buf);
+      }
+      mqtt_packet_release(&pkt, PUBLISH);
+      break;
+    default:
+      break;
+  }
+}
+
+/*
+ * Length of the next complete frame starting at off in the input buffer,
+ * 0 if it is still partial.
+ */
+static size_t next_frame(const struct conn *c, size_t off)
+{
+  const unsigned char *buf = c->in + off;
+  size_t avail = c->inlen - off;
+
+  if (avail < 2) {
+    return 0;
+  }
+
+  size_t i = 1;
+
+  while (i < avail && i <= 4 && (buf[i] & 128)) {
+    i++;
+  }
+
+  if (i >= avail) {
+    return 0;
+  }
+
+  size_t total = frame_size(buf);
+  return avail >= total ? total : 0;
+}
+
+static void conn_read(struct conn *c)
+{
+  while (1) {
+    if (c->insize - c->inlen < READ_CHUNK) {
+      c->insize = c->insize ? c->insize * 2 : 2 * READ_CHUNK;
+      c->in = realloc(c->in, c->insize);
+    }
+
+    ssize_t n = recv(c->fd, c->in + c->inlen, c->insize - c->inlen, 0);
+
+    if (n <= 0) {
+      if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        stats.errors++;
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, c->fd, NULL);
+      }
+      break;
+    }
+
+    c->inlen += n;
+
+    size_t off = 0;
+    size_t len;
+
+    while ((len = next_frame(c, off)) > 0) {
+      handle_frame(c, c->in + off);
+      off += len;
+    }
+
+    memmove(c->in, c->in + off, c->inlen - off);
+    c->inlen -= off;
+  }
+
+  conn_flush(c);
+}
+
+static void poll_events(int timeout_ms)
+{
+  struct epoll_event events[MAX_EVENTS];
+  int n = epoll_wait(epollfd, events, MAX_EVENTS, timeout_ms);
+
+  for (int i = 0; i < n; i++) {
+    struct conn *c = events[i].data.ptr;
+    if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+      conn_read(c);
+    }
+    if (events[i].events & EPOLLOUT) {
+      conn_flush(c);
+    }
+  }
+}
+
+static struct conn *conn_open(enum role role, int id)
+{
+  struct conn *c = calloc(1, sizeof(*c));
+
+  c->role = role;
+  c->fd = connect_socket();
+
+  if (c->fd < 0) {
+    perror("connect");
+    exit(EXIT_FAILURE);
+  }
+
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+  epoll_ctl(epollfd, EPOLL_CTL_ADD, c->fd, &ev);
+
+  send_connect(c, id);
+  conn_flush(c);
+
+  return c;
+}
+
+static int all_ready(struct conn **conns, int nr)
+{
+  for (int i = 0; i < nr; i++) {
+    if (!conns[i]->connected ||
+        (conns[i]->role == SUBSCRIBER && !conns[i]->subscribed)) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+static void raise_fd_limit(void)
+{
+  struct rlimit rl;
+
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [-H host] [-p port] [-u unix_path] "
+          "[-s subscribers] [-P publishers] [-t topics] [-l levels] "
+          "[-r msgs/s] [-d seconds] [-q qos:weight,...] "
+          "[-z bytes:weight,...]\n", prog);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+  int opt;
+
+  parse_mix("0:1", &opts.qos);
+  parse_mix("64:1", &opts.sizes);
+
+  while ((opt = getopt(argc, argv, "H:p:u:s:P:t:l:r:d:q:z:")) != -1) {
+    switch (opt) {
+      case 'H': opts.host = optarg; break;
+      case 'p': opts.port = optarg; break;
+      case 'u': opts.unix_path = optarg; break;
+      case 's': opts.subscribers = atoi(optarg); break;
+      case 'P': opts.publishers = atoi(optarg); break;
+      case 't': opts.topics = atoi(optarg); break;
+      case 'l': opts.levels = atoi(optarg); break;
+      case 'r': opts.rate = atof(optarg); break;
+      case 'd': opts.duration = atoi(optarg); break;
+      case 'q':
+        if (parse_mix(optarg, &opts.qos) < 0) {
+          usage(argv[0]);
+        }
+        break;
+      case 'z':
+        if (parse_mix(optarg, &opts.sizes) < 0) {
+          usage(argv[0]);
+        }
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  if (opts.topics <= 0 || opts.publishers <= 0 || opts.rate <= 0) {
+    usage(argv[0]);
+  }
+
+  raise_fd_limit();
+  epollfd = epoll_create1(0);
+
+  /* Topics like "loadgen/l1/l2/17", one subscriber set per topic */
+  topics = malloc(opts.topics * sizeof(*topics));
+  for (int i = 0; i < opts.topics; i++) {
+    char buf[256];
+    int n = snprintf(buf, sizeof(buf), "loadgen");
+    for (int l = 1; l < opts.levels - 1 && n < 200; l++) {
+      n += snprintf(buf + n, sizeof(buf) - n, "/l%d", l);
+    }
+    snprintf(buf + n, sizeof(buf) - n, "/%d", i);
+    topics[i] = strdup(buf);
+  }
+
+  int nr = opts.subscribers + opts.publishers;
+  struct conn **conns = malloc(nr * sizeof(*conns));
+
+  for (int i = 0; i < opts.subscribers; i++) {
+    conns[i] = conn_open(SUBSCRIBER, i);
+  }
+
+  for (int i = 0; i < opts.publishers; i++) {
+    conns[opts.subscribers + i] = conn_open(PUBLISHER, i);
+  }
+
+  /* Wait for CONNACKs, then subscribe and wait for SUBACKs */
+  uint64_t deadline = now_ns() + SETUP_NS;
+  int subscribing = 0;
+
+  while (!all_ready(conns, nr)) {
+    if (now_ns() > deadline) {
+      fprintf(stderr, "Timeout setting up connections\n");
+      return EXIT_FAILURE;
+    }
+    if (!subscribing) {
+      subscribing = 1;
+      for (int i = 0; i < nr; i++) {
+        if (!conns[i]->connected) {
+          subscribing = 0;
+        }
+      }
+      for (int i = 0; subscribing && i < opts.subscribers; i++) {
+        /* Highest QoS of the mix, the broker downgrades as needed */
+        unsigned qos = 0;
+        for (int q = 0; q < opts.qos.nr; q++) {
+          if (opts.qos.values[q] > qos) {
+            qos = opts.qos.values[q];
+          }
+        }
+        send_subscribe(conns[i], topics[i % opts.topics], qos);
+        conn_flush(conns[i]);
+      }
+    }
+    poll_events(10);
+  }
+
+  /* Number of subscribers of each topic, to count expected deliveries */
+  int *fanout = calloc(opts.topics, sizeof(int));
+  for (int i = 0; i < opts.subscribers; i++) {
+    fanout[i % opts.topics]++;
+  }
+
+  /* Open-loop run, message k is due at start + k / rate */
+  uint64_t start = now_ns();
+  uint64_t end = start + opts.duration * 1000000000ULL;
+  double interval = 1e9 / opts.rate;
+  uint64_t seq = 0;
+
+  while (1) {
+    uint64_t now = now_ns();
+
+    if (now >= end) {
+      break;
+    }
+
+    uint64_t due = (uint64_t) ((now - start) / interval) + 1;
+
+    while (seq < due) {
+      uint64_t intended = start + (uint64_t) (seq * interval);
+      struct conn *c = conns[opts.subscribers + seq % opts.publishers];
+      int topic = rng() % opts.topics;
+      send_publish(c, topics[topic], intended, seq);
+      stats.expected += fanout[topic];
+      seq++;
+    }
+
+    for (int i = opts.subscribers; i < nr; i++) {
+      conn_flush(conns[i]);
+    }
+
+    uint64_t next = start + (uint64_t) (seq * interval);
+    int timeout = next > now ? (int) ((next - now) / 1000000) : 0;
+    poll_events(timeout);
+  }
+
+  stats.sent = seq;
+  double elapsed = (now_ns() - start) / 1e9;
+
+  /* Give in-flight messages a chance to arrive */
+  uint64_t drain = now_ns() + DRAIN_NS;
+  while (stats.delivered < stats.expected && now_ns() < drain) {
+    poll_events(10);
+  }
+
+  printf("{\"bench\":\"loadgen\",\"transport\":\"%s\",\"subscribers\":%d,"
+         "\"publishers\":%d,\"topics\":%d,\"rate\":%.0f,\"duration_s\":%.2f,"
+         "\"sent\":%llu,\"expected\":%llu,\"delivered\":%llu,"
+         "\"acked\":%llu,\"errors\":%llu,\"sent_per_sec\":%.0f,"
+         "\"delivered_per_sec\":%.0f,\"latency_us\":{\"p50\":%.1f,"
+         "\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}}\n",
+         opts.unix_path ? "unix" : "tcp", opts.subscribers, opts.publishers,
+         opts.topics, opts.rate, elapsed,
+         (unsigned long long) stats.sent,
+         (unsigned long long) stats.expected,
+         (unsigned long long) stats.delivered,
+         (unsigned long long) stats.acked,
+         (unsigned long long) stats.errors,
+         stats.sent / elapsed, stats.delivered / elapsed,
+         hist_percentile(50) / 1e3, hist_percentile(99) / 1e3,
+         hist_percentile(99.9) / 1e3, stats.max_ns / 1e3);
+
+  return stats.errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,211 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include "arena.h"
+
+#define ARENA_CHUNKS        (ARENA_SIZE / ARENA_CHUNK)
+
+/* Free buffers of a class and the chunk it carves new ones from */
+struct arena_class {
+  pthread_mutex_t lock;
+  void *free;
+  unsigned char *cur;
+  unsigned char *end;
+};
+
+static struct {
+  pthread_once_t once;
+  enum arena_backing backing;
+  /* Set once the region is mapped, NULL until then or if it can't be */
+  _Atomic(unsigned char *) base;
+  atomic_size_t chunks_nr;
+  atomic_size_t used;
+  atomic_size_t buffers;
+  atomic_ullong allocs;
+  atomic_ullong fallbacks;
+  /* Class of every chunk taken */
+  unsigned char chunk_class[ARENA_CHUNKS > 0 ? ARENA_CHUNKS : 1];
+  struct arena_class classes[ARENA_CLASSES];
+} arena = { .once = PTHREAD_ONCE_INIT };
+
+static void arena_reserve(void)
+{
+  unsigned char *p;
+
+  for (int i = 0; i < ARENA_CLASSES; i++) {
+    pthread_mutex_init(&arena.classes[i].lock, NULL);
+  }
+
+  if (ARENA_CHUNKS == 0) {
+    return;
+  }
+
+  /* Huge pages reserved by the host, taken for good at once, or none */
+  p = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+  if (p != MAP_FAILED) {
+    arena.backing = ARENA_HUGETLB;
+    atomic_store_explicit(&arena.base, p, memory_order_release);
+    return;
+  }
+
+  /*
+   * Transparent huge pages, a chunk more to align the region on one, the
+   * ends trimmed. Committed only as touched.
+   */
+  p = mmap(NULL, ARENA_SIZE + ARENA_CHUNK, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  if (p == MAP_FAILED) {
+    return;
+  }
+
+  uintptr_t start = ((uintptr_t) p + ARENA_CHUNK - 1) & ~(uintptr_t)
+      (ARENA_CHUNK - 1);
+  size_t head = start - (uintptr_t) p;
+
+  if (head > 0) {
+    munmap(p, head);
+  }
+  munmap((unsigned char *) start + ARENA_SIZE, ARENA_CHUNK - head);
+
+  p = (unsigned char *) start;
+  arena.backing = madvise(p, ARENA_SIZE, MADV_HUGEPAGE) == 0 ?
+      ARENA_THP : ARENA_PAGES;
+  atomic_store_explicit(&arena.base, p, memory_order_release);
+}
+
+static inline unsigned size_class(size_t size)
+{
+  unsigned class = 0;
+
+  while (class < ARENA_CLASSES &&
+         ((size_t) ARENA_MIN_SIZE << class) < size) {
+    class++;
+  }
+
+  return class;
+}
+
+static inline size_t chunk_of(const unsigned char *base, const void *ptr)
+{
+  return ((const unsigned char *) ptr - base) / ARENA_CHUNK;
+}
+
+void *arena_alloc(size_t size)
+{
+  unsigned class = size_class(size);
+
+  pthread_once(&arena.once, arena_reserve);
+
+  unsigned char *base = atomic_load_explicit(&arena.base,
+                                             memory_order_acquire);
+
+  if (!base || class == ARENA_CLASSES) {
+    atomic_fetch_add_explicit(&arena.fallbacks, 1, memory_order_relaxed);
+    return NULL;
+  }
+
+  struct arena_class *c = &arena.classes[class];
+  size_t bufsize = (size_t) ARENA_MIN_SIZE << class;
+  void *buf = NULL;
+
+  pthread_mutex_lock(&c->lock);
+
+  if (c->free) {
+    buf = c->free;
+    c->free = *(void **) buf;
+  } else {
+    if (c->cur == c->end) {
+      size_t chunk = atomic_fetch_add_explicit(&arena.chunks_nr, 1,
+                                               memory_order_relaxed);
+      /* Once the region is used up the count runs past it, harmlessly */
+      if (chunk < ARENA_CHUNKS) {
+        arena.chunk_class[chunk] = class;
+        c->cur = base + chunk * ARENA_CHUNK;
+        c->end = c->cur + ARENA_CHUNK;
+      }
+    }
+    if (c->cur < c->end) {
+      buf = c->cur;
+      c->cur += bufsize;
+    }
+  }
+
+  pthread_mutex_unlock(&c->lock);
+
+  if (!buf) {
+    atomic_fetch_add_explicit(&arena.fallbacks, 1, memory_order_relaxed);
+    return NULL;
+  }
+
+  atomic_fetch_add_explicit(&arena.used, bufsize, memory_order_relaxed);
+  atomic_fetch_add_explicit(&arena.buffers, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&arena.allocs, 1, memory_order_relaxed);
+
+  return buf;
+}
+
+void arena_free(void *buf)
+{
+  if (!buf) {
+    return;
+  }
+
+  unsigned char *base = atomic_load_explicit(&arena.base,
+                                             memory_order_acquire);
+  unsigned class = arena.chunk_class[chunk_of(base, buf)];
+  struct arena_class *c = &arena.classes[class];
+
+  pthread_mutex_lock(&c->lock);
+  *(void **) buf = c->free;
+  c->free = buf;
+  pthread_mutex_unlock(&c->lock);
+
+  atomic_fetch_sub_explicit(&arena.used, (size_t) ARENA_MIN_SIZE << class,
+                            memory_order_relaxed);
+  atomic_fetch_sub_explicit(&arena.buffers, 1, memory_order_relaxed);
+}
+
+int arena_owns(const void *ptr)
+{
+  const unsigned char *base = atomic_load_explicit(&arena.base,
+                                                   memory_order_acquire);
+
+  return base && (const unsigned char *) ptr >= base
+      && (const unsigned char *) ptr < base + ARENA_SIZE;
+}
+
+size_t arena_size(const void *buf)
+{
+  const unsigned char *base = atomic_load_explicit(&arena.base,
+                                                   memory_order_acquire);
+
+  return (size_t) ARENA_MIN_SIZE << arena.chunk_class[chunk_of(base, buf)];
+}
+
+void arena_stats(struct arena_stats *stats)
+{
+  int mapped = atomic_load_explicit(&arena.base, memory_order_acquire) != 0;
+  size_t chunks = atomic_load_explicit(&arena.chunks_nr,
+                                       memory_order_relaxed);
+
+  stats->backing = mapped ? arena.backing : ARENA_NONE;
+  stats->reserved = mapped ? ARENA_SIZE : 0;
+  stats->carved = (chunks < ARENA_CHUNKS ? chunks : ARENA_CHUNKS)
+      * (size_t) ARENA_CHUNK;
+  stats->used = atomic_load_explicit(&arena.used, memory_order_relaxed);
+  stats->buffers = atomic_load_explicit(&arena.buffers, memory_order_relaxed);
+  stats->allocs = atomic_load_explicit(&arena.allocs, memory_order_relaxed);
+  stats->fallbacks = atomic_load_explicit(&arena.fallbacks,
+                                          memory_order_relaxed);
+}
+
+const char *arena_backing_name(enum arena_backing backing)
+{
+  static const char *names[] = { "none", "pages", "thp", "hugetlb" };
+  return names[backing];
+}
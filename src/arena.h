@@ -0,0 +1,84 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdio.h>
+
+/*
+ * Arena of packet I/O buffers, a single region reserved once and backed by
+ * huge pages where the system has them, so that the buffers in flight take
+ * a few TLB entries instead of one per 4KB page.
+ *
+ * The region is mapped with MAP_HUGETLB from the huge pages reserved on the
+ * host, else aligned on ARENA_CHUNK and advised MADV_HUGEPAGE for
+ * transparent ones, else left with normal pages: buffers work the same way
+ * with any of them, only the TLB savings are lost.
+ *
+ * Buffers come in power of 2 size classes from ARENA_MIN_SIZE up to
+ * ARENA_MAX_SIZE, each aligned on its size. A class takes ARENA_CHUNK of
+ * the region at a time and carves its buffers out of it, a chunk is never
+ * given back. Freed buffers wait on the free list of their class for the
+ * next allocation, lists are shared by every thread so a buffer can be
+ * freed by any of them, e.g. a frame sent last by another loop.
+ *
+ * Bigger buffers, and any once the region is used up, are for the caller
+ * to allocate elsewhere. Nothing is counted on the memory tags, callers
+ * charge the buffers they get, see memory.h.
+ */
+
+/* Bytes of the region, a multiple of ARENA_CHUNK, 0 for no arena */
+#ifndef ARENA_SIZE
+#define ARENA_SIZE          (64 * 1024 * 1024)
+#endif
+
+/* Size of a huge page, the unit the region is handed out in */
+#define ARENA_CHUNK         (2 * 1024 * 1024)
+
+#define ARENA_MIN_SHIFT     8
+#define ARENA_MIN_SIZE      (1 << ARENA_MIN_SHIFT)
+
+/* Size classes, from 256B to 64KB */
+#define ARENA_CLASSES       9
+#define ARENA_MAX_SIZE      (ARENA_MIN_SIZE << (ARENA_CLASSES - 1))
+
+/* What the region is backed by, ARENA_NONE if it couldn't be mapped */
+enum arena_backing {
+  ARENA_NONE,
+  ARENA_PAGES,
+  ARENA_THP,
+  ARENA_HUGETLB
+};
+
+struct arena_stats {
+  enum arena_backing backing;
+  /* Bytes of the region, of the chunks taken by classes and of buffers */
+  size_t reserved;
+  size_t carved;
+  size_t used;
+  /* Buffers currently allocated */
+  size_t buffers;
+  /* Allocations served and the ones left to the caller, too big or full */
+  unsigned long long allocs;
+  unsigned long long fallbacks;
+};
+
+/*
+ * Allocate a buffer of at least the given size, NULL if none fits. The
+ * first call reserves the region.
+ */
+void *arena_alloc(size_t);
+
+/* Free a buffer of the arena, NULL is ignored */
+void arena_free(void *);
+
+/* Whether a pointer is a buffer of the arena */
+int arena_owns(const void *);
+
+/* Usable size of a buffer of the arena */
+size_t arena_size(const void *);
+
+void arena_stats(struct arena_stats *);
+
+/* Name of a backing, as shown by the stats */
+const char *arena_backing_name(enum arena_backing);
+
+#endif
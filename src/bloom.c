@@ -0,0 +1,120 @@
+#include <stdlib.h>
+#include <string.h>
+#include "memory.h"
+#include "bloom.h"
+
+/* Number of bits set per key, all of them in the same block */
+#define BLOOM_K             6
+
+/* Counters saturate, a saturated bit is never cleared again */
+#define COUNTER_MAX         UINT8_MAX
+
+/* Murmur3 finalizer, spreads the key bits used to select the positions */
+static inline uint64_t mix64(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static inline size_t block_of(const struct bloom *bloom, uint64_t key)
+{
+  return (size_t) (key >> 32) & (bloom->blocks_nr - 1);
+}
+
+/* i-th bit position inside the block, 9 bits of the mixed key each */
+static inline unsigned bit_of(uint64_t mixed, int i)
+{
+  return (mixed >> (9 * i)) & (BLOOM_BLOCK_BITS - 1);
+}
+
+int bloom_init(struct bloom *bloom, size_t blocks)
+{
+  size_t nr = 1;
+
+  while (nr < blocks) {
+    nr <<= 1;
+  }
+
+  bloom->blocks_nr = nr;
+  bloom->bits = aligned_alloc(64, nr * BLOOM_BLOCK_BITS / 8);
+  bloom->counters = mem_calloc(MEM_TRIE, nr * BLOOM_BLOCK_BITS,
+                               sizeof(uint8_t));
+  mem_track(MEM_TRIE, bloom->bits);
+
+  if (!bloom->bits || !bloom->counters) {
+    mem_free(MEM_TRIE, bloom->bits);
+    mem_free(MEM_TRIE, bloom->counters);
+    return -1;
+  }
+
+  memset(bloom->bits, 0, nr * BLOOM_BLOCK_BITS / 8);
+
+  return 0;
+}
+
+void bloom_release(struct bloom *bloom)
+{
+  mem_free(MEM_TRIE, bloom->bits);
+  mem_free(MEM_TRIE, bloom->counters);
+  bloom->bits = NULL;
+  bloom->counters = NULL;
+}
+
+void bloom_add(struct bloom *bloom, uint64_t key)
+{
+  size_t block = block_of(bloom, key);
+  uint64_t mixed = mix64(key);
+  uint64_t *words = bloom->bits + block * BLOOM_BLOCK_WORDS;
+  uint8_t *counters = bloom->counters + block * BLOOM_BLOCK_BITS;
+
+  for (int i = 0; i < BLOOM_K; i++) {
+    unsigned bit = bit_of(mixed, i);
+    if (counters[bit] == COUNTER_MAX) {
+      continue;
+    }
+    if (counters[bit]++ == 0) {
+      __atomic_fetch_or(&words[bit / 64], 1ULL << (bit % 64),
+                        __ATOMIC_RELEASE);
+    }
+  }
+}
+
+void bloom_del(struct bloom *bloom, uint64_t key)
+{
+  size_t block = block_of(bloom, key);
+  uint64_t mixed = mix64(key);
+  uint64_t *words = bloom->bits + block * BLOOM_BLOCK_WORDS;
+  uint8_t *counters = bloom->counters + block * BLOOM_BLOCK_BITS;
+
+  for (int i = 0; i < BLOOM_K; i++) {
+    unsigned bit = bit_of(mixed, i);
+    if (counters[bit] == 0 || counters[bit] == COUNTER_MAX) {
+      continue;
+    }
+    if (--counters[bit] == 0) {
+      __atomic_fetch_and(&words[bit / 64], ~(1ULL << (bit % 64)),
+                         __ATOMIC_RELEASE);
+    }
+  }
+}
+
+int bloom_test(const struct bloom *bloom, uint64_t key)
+{
+  size_t block = block_of(bloom, key);
+  uint64_t mixed = mix64(key);
+  const uint64_t *words = bloom->bits + block * BLOOM_BLOCK_WORDS;
+
+  for (int i = 0; i < BLOOM_K; i++) {
+    unsigned bit = bit_of(mixed, i);
+    uint64_t word = __atomic_load_n(&words[bit / 64], __ATOMIC_RELAXED);
+    if (!(word & (1ULL << (bit % 64)))) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
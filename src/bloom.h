@@ -0,0 +1,37 @@
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Blocked counting bloom filter. Every key sets its bits inside a single
+ * 64 bytes block, so a lookup costs at most one cache miss.
+ *
+ * Bits are read lock-free by any thread, while the counters backing them,
+ * needed to support removals, are private to the writer, which must be
+ * serialized by the caller (e.g. under the trie writer lock).
+ */
+
+#define BLOOM_BLOCK_BITS    512
+#define BLOOM_BLOCK_WORDS   (BLOOM_BLOCK_BITS / 64)
+
+struct bloom {
+  /* Number of blocks, always a power of 2 */
+  size_t blocks_nr;
+  uint64_t *bits;
+  /* Saturating counters, one per bit, writer side only */
+  uint8_t *counters;
+};
+
+/* Init a filter with at least the given number of blocks */
+int bloom_init(struct bloom *, size_t);
+void bloom_release(struct bloom *);
+
+void bloom_add(struct bloom *, uint64_t);
+void bloom_del(struct bloom *, uint64_t);
+
+/* Return 0 if the key is surely not in the set, 1 if it may be */
+int bloom_test(const struct bloom *, uint64_t);
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef BROKER_H
+#define BROKER_H
+
+#include <stdio.h>
+
+/*
+ * Embedded broker, for services linking the broker core to publish and
+ * subscribe in-process. Messages are routed through the same subscription
+ * trie as the ones coming from the network: subscribers living in the
+ * process get the topic and payload of the publisher as they are, with no
+ * packet ever built, remote subscribers get a regular PUBLISH frame.
+ *
+ * The broker is single threaded, every call is to be made from the thread
+ * calling sol_poll, callbacks included. Callbacks run on the publisher
+ * stack, within sol_publish or within sol_poll for messages published by
+ * remote clients, and may publish, subscribe and unsubscribe themselves.
+ */
+
+struct evloop;
+
+/* Subscriber living in the broker process, opaque */
+struct sol_subscriber;
+
+/*
+ * Message delivered to an in-process subscriber, topic and payload belong
+ * to the publisher and are only valid for the duration of the call. qos is
+ * the lower of the published and the subscribed ones.
+ */
+typedef void sol_message_cb(const char *, const unsigned char *, size_t,
+                            unsigned, void *);
+
+/*
+ * Set the embedded broker up on the event loop serving the network clients,
+ * NULL for a broker with in-process clients only. Returns -1 on error.
+ */
+int sol_init(struct evloop *);
+
+/*
+ * Publish a message with a QoS from 0 to 2, retained if retain is set, an
+ * empty retained message clears the one on the topic. Returns the number of
+ * subscribers it was delivered to, -1 on invalid topic or QoS.
+ */
+int sol_publish(const char *, const unsigned char *, size_t, unsigned, int);
+
+/*
+ * Subscribe a callback to a topic filter, wildcards and shared groups
+ * included. The retained messages matching it are delivered right away.
+ * Returns NULL on error.
+ */
+struct sol_subscriber *sol_subscribe(const char *, unsigned,
+                                     sol_message_cb *, void *);
+
+/* Cancel a subscription, the callback is never called again afterwards */
+int sol_unsubscribe(struct sol_subscriber *);
+
+/*
+ * Serve the network clients for at most the timeout given in milliseconds,
+ * -1 to block, and release what unsubscribing left behind. Without a loop
+ * only the latter happens and it returns at once. Returns the number of
+ * events handled, -1 on error.
+ */
+int sol_poll(int);
+
+#endif
@@ -0,0 +1,163 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "memory.h"
+#include "arena.h"
+#include "bufpool.h"
+
+/*
+ * Header in front of the buffers from the allocator, keeps the data max
+ * aligned. The ones of the arena have none, it knows their size.
+ */
+struct buf_hdr {
+  union {
+    struct {
+      /* Size class, BUFPOOL_CLASSES for unpooled buffers */
+      uint32_t class;
+      uint32_t size;
+    };
+    max_align_t align;
+  };
+};
+
+/* Idle buffers are linked through their first bytes, whatever they are */
+struct bufpool {
+  unsigned char *idle[BUFPOOL_CLASSES];
+  size_t idle_nr[BUFPOOL_CLASSES];
+  size_t lent;
+  unsigned long long hits;
+  unsigned long long misses;
+};
+
+static _Thread_local struct bufpool pool;
+
+static inline unsigned size_class(size_t size)
+{
+  unsigned class = 0;
+
+  while (class < BUFPOOL_CLASSES &&
+         ((size_t) BUFPOOL_MIN_SIZE << class) < size) {
+    class++;
+  }
+
+  return class;
+}
+
+static inline struct buf_hdr *buf_hdr(const unsigned char *buf)
+{
+  return (struct buf_hdr *) buf - 1;
+}
+
+static inline unsigned buf_class(const unsigned char *buf)
+{
+  return arena_owns(buf) ? size_class(arena_size(buf)) : buf_hdr(buf)->class;
+}
+
+/* Give a buffer back to where it came from, returns the bytes released */
+static size_t buf_release(unsigned char *buf)
+{
+  size_t size;
+
+  if (arena_owns(buf)) {
+    size = arena_size(buf);
+    arena_free(buf);
+    mem_uncharge(MEM_BUFFERS, size);
+    return size;
+  }
+
+  size = sizeof(struct buf_hdr) + buf_hdr(buf)->size;
+  mem_free(MEM_BUFFERS, buf_hdr(buf));
+  return size;
+}
+
+unsigned char *bufpool_get(size_t size)
+{
+  unsigned class = size_class(size);
+  unsigned char *buf;
+
+  if (class < BUFPOOL_CLASSES && pool.idle[class]) {
+    buf = pool.idle[class];
+    pool.idle[class] = *(unsigned char **) buf;
+    pool.idle_nr[class]--;
+    pool.hits++;
+    pool.lent++;
+    return buf;
+  }
+
+  size_t cap = class < BUFPOOL_CLASSES ?
+      (size_t) BUFPOOL_MIN_SIZE << class : size;
+
+  /* Huge page backed when it fits in the arena */
+  if (class < BUFPOOL_CLASSES && cap <= ARENA_MAX_SIZE &&
+      (buf = arena_alloc(cap))) {
+    mem_charge(MEM_BUFFERS, cap);
+  } else {
+    struct buf_hdr *hdr = mem_malloc(MEM_BUFFERS, sizeof(*hdr) + cap);
+    if (!hdr) {
+      return NULL;
+    }
+    hdr->class = class;
+    hdr->size = cap;
+    buf = (unsigned char *) (hdr + 1);
+  }
+
+  pool.misses++;
+  pool.lent++;
+
+  return buf;
+}
+
+void bufpool_put(unsigned char *buf)
+{
+  if (!buf) {
+    return;
+  }
+
+  unsigned class = buf_class(buf);
+
+  pool.lent--;
+
+  if (class == BUFPOOL_CLASSES || pool.idle_nr[class] == BUFPOOL_KEEP) {
+    buf_release(buf);
+    return;
+  }
+
+  *(unsigned char **) buf = pool.idle[class];
+  pool.idle[class] = buf;
+  pool.idle_nr[class]++;
+}
+
+size_t bufpool_size(const unsigned char *buf)
+{
+  return arena_owns(buf) ? arena_size(buf) : buf_hdr(buf)->size;
+}
+
+size_t bufpool_shrink(void)
+{
+  size_t released = 0;
+
+  for (unsigned i = 0; i < BUFPOOL_CLASSES; i++) {
+    while (pool.idle[i]) {
+      unsigned char *buf = pool.idle[i];
+      pool.idle[i] = *(unsigned char **) buf;
+      released += buf_release(buf);
+    }
+    pool.idle_nr[i] = 0;
+  }
+
+  return released;
+}
+
+void bufpool_stats(struct bufpool_stats *stats)
+{
+  stats->lent = pool.lent;
+  stats->idle = 0;
+  stats->idle_bytes = 0;
+  stats->hits = pool.hits;
+  stats->misses = pool.misses;
+
+  for (unsigned i = 0; i < BUFPOOL_CLASSES; i++) {
+    stats->idle += pool.idle_nr[i];
+    stats->idle_bytes += pool.idle_nr[i] * ((size_t) BUFPOOL_MIN_SIZE << i);
+  }
+}
@@ -0,0 +1,55 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stdio.h>
+
+/*
+ * Buffer pool lending input buffers to connections, so that an idle one
+ * holds none. A connection borrows a buffer only while it has a frame to
+ * read, and keeps it across events only if the frame arrives in pieces.
+ *
+ * Buffers come in power of 2 size classes, from BUFPOOL_MIN_SIZE up, the
+ * ones given back are kept for the next borrower up to BUFPOOL_KEEP per
+ * class, the rest go back to where they came from. Pools are per thread, a
+ * buffer must be given back on the thread it was borrowed from, as event
+ * loops do.
+ *
+ * Classes up to ARENA_MAX_SIZE are taken from the huge page arena, see
+ * arena.h, bigger ones and any the arena can't serve from the allocator.
+ */
+
+#define BUFPOOL_MIN_SHIFT   8
+#define BUFPOOL_MIN_SIZE    (1 << BUFPOOL_MIN_SHIFT)
+
+/* Size classes, from 256B to 8MB, bigger buffers are never pooled */
+#define BUFPOOL_CLASSES     16
+
+/* Idle buffers kept per class */
+#define BUFPOOL_KEEP        64
+
+struct bufpool_stats {
+  /* Buffers currently borrowed */
+  size_t lent;
+  /* Buffers waiting in the pool and the bytes they take */
+  size_t idle;
+  size_t idle_bytes;
+  /* Borrowings served from the pool and from the allocator */
+  unsigned long long hits;
+  unsigned long long misses;
+};
+
+/* Borrow a buffer of at least the given size, NULL if out of memory */
+unsigned char *bufpool_get(size_t);
+
+/* Give a borrowed buffer back, NULL is ignored */
+void bufpool_put(unsigned char *);
+
+/* Usable size of a borrowed buffer */
+size_t bufpool_size(const unsigned char *);
+
+/* Release every idle buffer of the pool, returns the bytes released */
+size_t bufpool_shrink(void);
+
+void bufpool_stats(struct bufpool_stats *);
+
+#endif
@@ -0,0 +1,505 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+#include "pack.h"
+#include "handover.h"
+
+#define HANDOVER_MAGIC      0x534f4c48
+#define HANDOVER_FORMAT     1
+
+/* Magic, format, connections and snapshot lenght as two 32 bits halves */
+#define HEADER_SIZE         (4 + 1 + 4 + 4 + 4)
+
+/* Session without a live connection */
+#define NO_CONN             0xffffffff
+
+/* Bounded reader of the snapshot */
+struct reader {
+  const uint8_t *p;
+  const uint8_t *end;
+};
+
+static int write_all(int fd, const unsigned char *buf, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+static int read_all(int fd, unsigned char *buf, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = read(fd, buf, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+/* Send a small message with up to HANDOVER_BATCH descriptors attached */
+static int send_fds(int sock, const unsigned char *buf, size_t len,
+                    const int *fds, size_t nr)
+{
+  char control[CMSG_SPACE(sizeof(int) * HANDOVER_BATCH)];
+  struct iovec iov = { .iov_base = (void *) buf, .iov_len = len };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1
+  };
+
+  if (nr > 0) {
+    memset(control, 0, sizeof(control));
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nr);
+
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int) * nr);
+    memcpy(CMSG_DATA(cm), fds, sizeof(int) * nr);
+  }
+
+  ssize_t n;
+
+  while ((n = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+    ;
+
+  if (n < 0) {
+    return -1;
+  }
+
+  /* Descriptors went with the first byte, the rest is plain data */
+  return write_all(sock, buf + n, len - n);
+}
+
+/*
+ * Receive a message sent by send_fds, storing the descriptors attached, up
+ * to max, and their number. Returns -1 on error or if descriptors were
+ * dropped or more than max came.
+ */
+static int recv_fds(int sock, unsigned char *buf, size_t len,
+                    int *fds, size_t max, size_t *nr)
+{
+  int received[HANDOVER_BATCH];
+  char control[CMSG_SPACE(sizeof(int) * HANDOVER_BATCH)];
+  struct iovec iov = { .iov_base = buf, .iov_len = len };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = sizeof(control)
+  };
+  ssize_t n;
+
+  *nr = 0;
+
+  while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+    ;
+
+  if (n <= 0) {
+    return -1;
+  }
+
+  for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm;
+       cm = CMSG_NXTHDR(&msg, cm)) {
+    if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+      *nr = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      memcpy(received, CMSG_DATA(cm), sizeof(int) * *nr);
+    }
+  }
+
+  if ((msg.msg_flags & MSG_CTRUNC) || *nr > max) {
+    for (size_t i = 0; i < *nr; i++) {
+      close(received[i]);
+    }
+    *nr = 0;
+    return -1;
+  }
+
+  memcpy(fds, received, sizeof(int) * *nr);
+
+  return read_all(sock, buf + n, len - n);
+}
+
+static size_t session_size(const struct handover_session *s)
+{
+  size_t size = 2 + strlen(s->client_id) + 4 + 1 + 2 + 4 + 2 + 2 + 2 + 4;
+
+  for (size_t i = 0; i < s->aliases_nr; i++) {
+    size += 2 + 2 + strlen(s->aliases[i].topic);
+  }
+
+  for (size_t i = 0; i < s->subs_nr; i++) {
+    size += 2 + strlen(s->subs[i].filter) + 1;
+  }
+
+  return size;
+}
+
+static void pack_string(uint8_t **ptr, const char *str)
+{
+  size_t len = strlen(str);
+  pack_u16(ptr, len);
+  memcpy(*ptr, str, len);
+  *ptr += len;
+}
+
+/* Serialize the sessions, connections numbered in order of appearance */
+static unsigned char *snapshot_pack(const struct handover *h, size_t *size)
+{
+  *size = 4;
+
+  for (size_t i = 0; i < h->sessions_nr; i++) {
+    *size += session_size(&h->sessions[i]);
+  }
+
+  unsigned char *buf = malloc(*size);
+
+  if (!buf) {
+    return NULL;
+  }
+
+  uint8_t *ptr = buf;
+  uint32_t conn = 0;
+
+  pack_u32(&ptr, h->sessions_nr);
+
+  for (size_t i = 0; i < h->sessions_nr; i++) {
+    const struct handover_session *s = &h->sessions[i];
+    pack_string(&ptr, s->client_id);
+    pack_u32(&ptr, s->fd >= 0 ? conn++ : NO_CONN);
+    pack_u8(&ptr, s->version);
+    pack_u16(&ptr, s->receive_maximum);
+    pack_u32(&ptr, s->maximum_packet_size);
+    pack_u16(&ptr, s->alias_in_max);
+    pack_u16(&ptr, s->alias_out_max);
+    pack_u16(&ptr, s->aliases_nr);
+    for (size_t j = 0; j < s->aliases_nr; j++) {
+      pack_u16(&ptr, s->aliases[j].alias);
+      pack_string(&ptr, s->aliases[j].topic);
+    }
+    pack_u32(&ptr, s->subs_nr);
+    for (size_t j = 0; j < s->subs_nr; j++) {
+      pack_string(&ptr, s->subs[j].filter);
+      pack_u8(&ptr, s->subs[j].qos);
+    }
+  }
+
+  return buf;
+}
+
+static int read_u8(struct reader *r, uint8_t *val)
+{
+  if (r->end - r->p < 1) {
+    return -1;
+  }
+  *val = unpack_u8(&r->p);
+  return 0;
+}
+
+static int read_u16(struct reader *r, uint16_t *val)
+{
+  if (r->end - r->p < 2) {
+    return -1;
+  }
+  *val = unpack_u16(&r->p);
+  return 0;
+}
+
+static int read_u32(struct reader *r, uint32_t *val)
+{
+  if (r->end - r->p < 4) {
+    return -1;
+  }
+  *val = unpack_u32(&r->p);
+  return 0;
+}
+
+static char *read_string(struct reader *r)
+{
+  uint16_t len;
+
+  if (read_u16(r, &len) < 0 || r->end - r->p < len) {
+    return NULL;
+  }
+
+  char *str = malloc(len + 1);
+
+  if (!str) {
+    return NULL;
+  }
+
+  memcpy(str, r->p, len);
+  str[len] = '\0';
+  r->p += len;
+
+  return str;
+}
+
+static int session_unpack(struct reader *r, struct handover_session *s,
+                          const int *fds, size_t fds_nr)
+{
+  uint32_t conn;
+  uint16_t aliases_nr;
+  uint32_t subs_nr;
+
+  if (!(s->client_id = read_string(r)) ||
+      read_u32(r, &conn) < 0 ||
+      read_u8(r, &s->version) < 0 ||
+      read_u16(r, &s->receive_maximum) < 0 ||
+      read_u32(r, &s->maximum_packet_size) < 0 ||
+      read_u16(r, &s->alias_in_max) < 0 ||
+      read_u16(r, &s->alias_out_max) < 0 ||
+      read_u16(r, &aliases_nr) < 0) {
+    return -1;
+  }
+
+  if (conn != NO_CONN && conn >= fds_nr) {
+    return -1;
+  }
+
+  s->fd = conn == NO_CONN ? -1 : fds[conn];
+
+  if (aliases_nr > 0 &&
+      !(s->aliases = calloc(aliases_nr, sizeof(*s->aliases)))) {
+    return -1;
+  }
+
+  for (; s->aliases_nr < aliases_nr; s->aliases_nr++) {
+    struct handover_alias *a = &s->aliases[s->aliases_nr];
+    if (read_u16(r, &a->alias) < 0 || !(a->topic = read_string(r))) {
+      return -1;
+    }
+  }
+
+  /* Every subscription takes 3 bytes at least, don't trust the count */
+  if (read_u32(r, &subs_nr) < 0 || subs_nr > (size_t) (r->end - r->p) / 3) {
+    return -1;
+  }
+
+  if (subs_nr > 0 && !(s->subs = calloc(subs_nr, sizeof(*s->subs)))) {
+    return -1;
+  }
+
+  for (; s->subs_nr < subs_nr; s->subs_nr++) {
+    struct handover_sub *sub = &s->subs[s->subs_nr];
+    if (!(sub->filter = read_string(r))) {
+      return -1;
+    }
+    if (read_u8(r, &sub->qos) < 0) {
+      free(sub->filter);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int handover_connect(const char *path)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+int handover_send(int sock, const struct handover *h)
+{
+  size_t size;
+  unsigned char *snapshot = snapshot_pack(h, &size);
+
+  if (!snapshot) {
+    return -1;
+  }
+
+  size_t conns = 0;
+
+  for (size_t i = 0; i < h->sessions_nr; i++) {
+    conns += h->sessions[i].fd >= 0;
+  }
+
+  unsigned char header[HEADER_SIZE];
+  uint8_t *ptr = header;
+
+  pack_u32(&ptr, HANDOVER_MAGIC);
+  pack_u8(&ptr, HANDOVER_FORMAT);
+  pack_u32(&ptr, conns);
+  pack_u32(&ptr, (uint64_t) size >> 32);
+  pack_u32(&ptr, size & 0xffffffff);
+
+  if (send_fds(sock, header, HEADER_SIZE, &h->listenfd, 1) < 0) {
+    goto err;
+  }
+
+  /* Connections in batches, in the order the snapshot numbers them */
+  int fds[HANDOVER_BATCH];
+  size_t i = 0;
+
+  while (conns > 0) {
+    size_t nr = 0;
+    unsigned char count[4];
+    uint8_t *cptr = count;
+
+    for (; i < h->sessions_nr && nr < HANDOVER_BATCH; i++) {
+      if (h->sessions[i].fd >= 0) {
+        fds[nr++] = h->sessions[i].fd;
+      }
+    }
+
+    pack_u32(&cptr, nr);
+
+    if (send_fds(sock, count, sizeof(count), fds, nr) < 0) {
+      goto err;
+    }
+
+    conns -= nr;
+  }
+
+  if (write_all(sock, snapshot, size) < 0) {
+    goto err;
+  }
+
+  free(snapshot);
+
+  return 0;
+
+err:
+  free(snapshot);
+  return -1;
+}
+
+int handover_recv(int sock, struct handover *h)
+{
+  unsigned char header[HEADER_SIZE];
+  const uint8_t *ptr = header;
+  unsigned char *snapshot = NULL;
+  int *fds = NULL;
+  size_t fds_nr = 0;
+  size_t nr;
+
+  memset(h, 0, sizeof(*h));
+  h->listenfd = -1;
+
+  if (recv_fds(sock, header, HEADER_SIZE, &h->listenfd, 1, &nr) < 0) {
+    return -1;
+  }
+
+  if (nr != 1 || unpack_u32(&ptr) != HANDOVER_MAGIC ||
+      unpack_u8(&ptr) != HANDOVER_FORMAT) {
+    goto err;
+  }
+
+  size_t conns = unpack_u32(&ptr);
+  uint64_t size = (uint64_t) unpack_u32(&ptr) << 32;
+  size |= unpack_u32(&ptr);
+
+  if (conns > 0 && !(fds = malloc(sizeof(int) * conns))) {
+    goto err;
+  }
+
+  while (fds_nr < conns) {
+    unsigned char count[4];
+    const uint8_t *cptr = count;
+    if (recv_fds(sock, count, sizeof(count), fds + fds_nr,
+                 conns - fds_nr, &nr) < 0) {
+      goto err;
+    }
+    fds_nr += nr;
+    if (nr == 0 || nr != unpack_u32(&cptr)) {
+      goto err;
+    }
+  }
+
+  if (!(snapshot = malloc(size)) || read_all(sock, snapshot, size) < 0) {
+    goto err;
+  }
+
+  struct reader r = { .p = snapshot, .end = snapshot + size };
+  uint32_t sessions_nr;
+
+  if (read_u32(&r, &sessions_nr) < 0 || sessions_nr > size / 4 ||
+      !(h->sessions = calloc(sessions_nr ? sessions_nr : 1,
+                             sizeof(*h->sessions)))) {
+    goto err;
+  }
+
+  for (; h->sessions_nr < sessions_nr; h->sessions_nr++) {
+    h->sessions[h->sessions_nr].fd = -1;
+    if (session_unpack(&r, &h->sessions[h->sessions_nr], fds, fds_nr) < 0) {
+      h->sessions_nr++;
+      goto err;
+    }
+  }
+
+  free(snapshot);
+  free(fds);
+
+  return 0;
+
+err:
+  handover_release(h);
+  free(snapshot);
+  for (size_t i = 0; i < fds_nr; i++) {
+    close(fds[i]);
+  }
+  free(fds);
+  if (h->listenfd >= 0) {
+    close(h->listenfd);
+  }
+  h->listenfd = -1;
+  return -1;
+}
+
+void handover_release(struct handover *h)
+{
+  for (size_t i = 0; i < h->sessions_nr; i++) {
+    struct handover_session *s = &h->sessions[i];
+    free(s->client_id);
+    for (size_t j = 0; j < s->aliases_nr; j++) {
+      free(s->aliases[j].topic);
+    }
+    free(s->aliases);
+    for (size_t j = 0; j < s->subs_nr; j++) {
+      free(s->subs[j].filter);
+    }
+    free(s->subs);
+  }
+
+  free(h->sessions);
+  h->sessions = NULL;
+  h->sessions_nr = 0;
+}
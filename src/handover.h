@@ -0,0 +1,78 @@
+#ifndef HANDOVER_H
+#define HANDOVER_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Zero-downtime restart. A running broker listens on a local UNIX socket for
+ * its successor; once it connects, the listening socket and the live client
+ * connections are passed over with SCM_RIGHTS, together with a snapshot of
+ * every session and its subscriptions. The successor picks up where the old
+ * broker left, clients never see their connection drop.
+ *
+ * Descriptors go in batches of at most HANDOVER_BATCH per message, the
+ * kernel limit, the snapshot follows as a plain byte stream. Sessions refer
+ * to their connection by descriptor, the one of the sender on the way out
+ * and the one received on the way in.
+ */
+
+/* Default path of the handover socket */
+#define HANDOVER_PATH       "/tmp/sol-handover.sock"
+
+/* Most descriptors passed in a single message, SCM_MAX_FD */
+#define HANDOVER_BATCH      253
+
+struct handover_alias {
+  uint16_t alias;
+  char *topic;
+};
+
+struct handover_sub {
+  char *filter;
+  uint8_t qos;
+};
+
+struct handover_session {
+  char *client_id;
+  /* Live connection, -1 for a session without one */
+  int fd;
+  /* Protocol level and the limits set by the client on CONNECT */
+  uint8_t version;
+  uint16_t receive_maximum;
+  uint32_t maximum_packet_size;
+  uint16_t alias_in_max;
+  uint16_t alias_out_max;
+  /* Inbound topic aliases, the client may keep using them */
+  size_t aliases_nr;
+  struct handover_alias *aliases;
+  size_t subs_nr;
+  struct handover_sub *subs;
+};
+
+struct handover {
+  int listenfd;
+  size_t sessions_nr;
+  struct handover_session *sessions;
+};
+
+/* Connect to the handover socket of a running broker, -1 if there is none */
+int handover_connect(const char *);
+
+/*
+ * Pass the listening socket, the connections and the sessions over to the
+ * successor connected on the socket. Descriptors stay open on this side,
+ * it's up to the caller to close them once done. Returns -1 on error.
+ */
+int handover_send(int, const struct handover *);
+
+/*
+ * Receive everything sent by handover_send, descriptors arrive open and
+ * close-on-exec. Returns -1 on error, nothing is kept then.
+ */
+int handover_recv(int, struct handover *);
+
+/* Free the sessions, leaving every descriptor open */
+void handover_release(struct handover *);
+
+#endif
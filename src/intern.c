@@ -0,0 +1,278 @@
+#include <stdlib.h>
+#include <string.h>
+#include "memory.h"
+#include "intern.h"
+
+#define HASH_SEED       0x2d358dccaa6c78a5ULL
+#define HASH_M1         0x9e3779b97f4a7c15ULL
+#define HASH_M2         0xbf58476d1ce4e5b9ULL
+
+/* Buckets are kept at most half full */
+#define LOAD_FACTOR     2
+
+/* Subscription set being collected from a trie walk */
+struct collector {
+  size_t nr;
+  size_t size;
+  struct subscription *subs;
+  int err;
+};
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t hash_word(uint64_t hash, uint64_t word)
+{
+  return rotl64(hash ^ (word * HASH_M1), 29) * HASH_M2;
+}
+
+/*
+ * Process the topic in 8 bytes words with no per-byte branching, the
+ * compiler is free to keep the whole loop in registers.
+ */
+uint64_t intern_hash(const char *topic, size_t len)
+{
+  uint64_t hash = HASH_SEED ^ (len * HASH_M1);
+  uint64_t word;
+
+  while (len >= sizeof(word)) {
+    memcpy(&word, topic, sizeof(word));
+    hash = hash_word(hash, word);
+    topic += sizeof(word);
+    len -= sizeof(word);
+  }
+
+  word = 0;
+  memcpy(&word, topic, len);
+  hash = hash_word(hash, word);
+
+  hash ^= hash >> 31;
+  hash *= HASH_M2;
+  hash ^= hash >> 29;
+
+  return hash;
+}
+
+int intern_init(struct intern_table *table, struct trie *trie,
+                size_t capacity)
+{
+  size_t buckets = 1;
+
+  while (buckets < capacity * LOAD_FACTOR) {
+    buckets <<= 1;
+  }
+
+  table->trie = trie;
+  table->version = trie_version(trie);
+  table->capacity = capacity;
+  table->entries_nr = 0;
+  table->entries = mem_calloc(MEM_TRIE, capacity, sizeof(*table->entries));
+  table->buckets_nr = buckets;
+  table->buckets = mem_calloc(MEM_TRIE, buckets, sizeof(*table->buckets));
+  table->hits = 0;
+  table->misses = 0;
+
+  if (!table->entries || !table->buckets) {
+    mem_free(MEM_TRIE, table->entries);
+    mem_free(MEM_TRIE, table->buckets);
+    return -1;
+  }
+
+  return 0;
+}
+
+static void entry_invalidate(struct intern_entry *entry)
+{
+  mem_free(MEM_TRIE, entry->subs);
+  entry->subs = NULL;
+  entry->subs_nr = 0;
+  entry->valid = 0;
+}
+
+void intern_release(struct intern_table *table)
+{
+  for (size_t i = 0; i < table->entries_nr; i++) {
+    entry_invalidate(&table->entries[i]);
+    mem_free(MEM_TRIE, table->entries[i].topic);
+  }
+
+  mem_free(MEM_TRIE, table->entries);
+  mem_free(MEM_TRIE, table->buckets);
+  table->entries = NULL;
+  table->buckets = NULL;
+}
+
+uint32_t intern_topic(struct intern_table *table, const char *topic,
+                      size_t len)
+{
+  uint64_t hash = intern_hash(topic, len);
+  uint64_t tag = hash >> 32;
+  size_t mask = table->buckets_nr - 1;
+  size_t i = hash & mask;
+
+  while (table->buckets[i] != 0) {
+    uint64_t bucket = table->buckets[i];
+    if ((bucket >> 32) == tag) {
+      uint32_t id = (uint32_t) bucket - 1;
+      struct intern_entry *entry = &table->entries[id];
+      if (entry->hash == hash && entry->len == len &&
+          memcmp(entry->topic, topic, len) == 0) {
+        return id;
+      }
+    }
+    i = (i + 1) & mask;
+  }
+
+  if (table->entries_nr == table->capacity) {
+    return INTERN_NONE;
+  }
+
+  struct intern_entry *entry = &table->entries[table->entries_nr];
+  entry->topic = mem_malloc(MEM_TRIE, len + 1);
+
+  if (!entry->topic) {
+    return INTERN_NONE;
+  }
+
+  memcpy(entry->topic, topic, len);
+  entry->topic[len] = '\0';
+  entry->len = len;
+  entry->hash = hash;
+  entry->valid = 0;
+
+  uint32_t id = table->entries_nr++;
+  table->buckets[i] = (tag << 32) | (id + 1);
+
+  return id;
+}
+
+static void intern_flush(struct intern_table *table)
+{
+  for (size_t i = 0; i < table->entries_nr; i++) {
+    entry_invalidate(&table->entries[i]);
+  }
+}
+
+/*
+ * Drop the cached sets of the topics a changed filter routes to, and the
+ * ones holding groups which may live on a node retired with its path.
+ */
+static void intern_invalidate(struct intern_table *table, const char *filter)
+{
+  for (size_t i = 0; i < table->entries_nr; i++) {
+    struct intern_entry *entry = &table->entries[i];
+    if (!entry->valid) {
+      continue;
+    }
+    if (entry->shared ? trie_path_match(filter, entry->topic) :
+        trie_filter_match(filter, entry->topic)) {
+      entry_invalidate(entry);
+    }
+  }
+}
+
+/* Apply the subscription changes happened since the last routing */
+static void intern_sync(struct intern_table *table)
+{
+  unsigned long seen = table->version;
+  unsigned long version = trie_version(table->trie);
+
+  if (version == seen) {
+    return;
+  }
+
+  if (version - seen > TRIE_CHANGELOG) {
+    intern_flush(table);
+    table->version = version;
+    return;
+  }
+
+  for (unsigned long seq = seen + 1; seq <= version; seq++) {
+    const char *filter = trie_changed_filter(table->trie, seq);
+    if (!filter) {
+      intern_flush(table);
+      break;
+    }
+    intern_invalidate(table, filter);
+  }
+
+  /* Writers may have overwritten entries we were reading */
+  if (trie_version(table->trie) - seen > TRIE_CHANGELOG) {
+    intern_flush(table);
+  }
+
+  table->version = version;
+}
+
+static void collect(const struct subscription *sub, void *arg)
+{
+  struct collector *c = arg;
+
+  if (c->err) {
+    return;
+  }
+
+  if (c->nr == c->size) {
+    size_t size = c->size ? c->size * 2 : 4;
+    struct subscription *subs =
+        mem_realloc(MEM_TRIE, c->subs, size * sizeof(*subs));
+    if (!subs) {
+      c->err = 1;
+      return;
+    }
+    c->subs = subs;
+    c->size = size;
+  }
+
+  c->subs[c->nr++] = *sub;
+}
+
+size_t intern_route(struct intern_table *table, const char *topic,
+                    size_t len, trie_match_cb *cb, void *arg)
+{
+  intern_sync(table);
+
+  uint32_t id = intern_topic(table, topic, len);
+
+  if (id == INTERN_NONE) {
+    table->misses++;
+    return trie_match(table->trie, topic, cb, arg);
+  }
+
+  struct intern_entry *entry = &table->entries[id];
+
+  if (!entry->valid) {
+    struct collector c = { 0 };
+    table->misses++;
+    /* Groups are cached as such, the member is picked on every routing */
+    trie_match_shared(table->trie, topic, collect, &c);
+    if (c.err) {
+      mem_free(MEM_TRIE, c.subs);
+      return trie_match(table->trie, topic, cb, arg);
+    }
+    entry->subs = c.subs;
+    entry->subs_nr = c.nr;
+    entry->shared = 0;
+    for (size_t i = 0; i < c.nr; i++) {
+      entry->shared |= c.subs[i].group != NULL;
+    }
+    entry->valid = 1;
+  } else {
+    table->hits++;
+  }
+
+  for (size_t i = 0; i < entry->subs_nr; i++) {
+    const struct subscription *sub = &entry->subs[i];
+    if (sub->group) {
+      sub = trie_share_pick(table->trie, sub->group, entry->topic);
+      if (!sub) {
+        continue;
+      }
+    }
+    cb(sub, arg);
+  }
+
+  return entry->subs_nr;
+}
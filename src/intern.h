@@ -0,0 +1,79 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "trie.h"
+
+/*
+ * Topic intern table, maps published topic names to stable integer IDs and
+ * caches for each ID the set of subscriptions it routes to.
+ *
+ * A topic is hashed once, a hit on a valid entry delivers straight from the
+ * cached set, skipping the trie walk. Entries are invalidated incrementally:
+ * the table follows the trie changelog and drops only the cached sets of the
+ * topics matched by each changed filter. Sets holding shared groups point
+ * into trie nodes, they are dropped as well when a change retires any node
+ * of their groups.
+ *
+ * A table is meant to be owned by a single event loop, it has no locking.
+ */
+
+#define INTERN_NONE         UINT32_MAX
+
+/* Default max number of topics interned */
+#define INTERN_CAPACITY     65536
+
+struct intern_entry {
+  uint64_t hash;
+  char *topic;
+  size_t len;
+  /* Cached routing, valid only if the flag is set */
+  int valid;
+  /* Whether the set holds shared groups */
+  int shared;
+  size_t subs_nr;
+  struct subscription *subs;
+};
+
+struct intern_table {
+  struct trie *trie;
+  /* Last trie change applied to the cached sets */
+  unsigned long version;
+  /* Entries indexed by topic ID, never moved once created */
+  size_t capacity;
+  size_t entries_nr;
+  struct intern_entry *entries;
+  /*
+   * Open addressing index, each bucket stores the high 32 bits of the hash
+   * and the ID + 1, so most misses never touch an entry.
+   */
+  size_t buckets_nr;
+  uint64_t *buckets;
+  /* Routing served from a valid cached set */
+  unsigned long long hits;
+  /* Routing that had to walk the trie */
+  unsigned long long misses;
+};
+
+int intern_init(struct intern_table *, struct trie *, size_t);
+void intern_release(struct intern_table *);
+
+/* Hash a topic name 8 bytes at a time */
+uint64_t intern_hash(const char *, size_t);
+
+/*
+ * Return the ID of a topic, interning it if not present yet, INTERN_NONE if
+ * the table is full.
+ */
+uint32_t intern_topic(struct intern_table *, const char *, size_t);
+
+/*
+ * Route a published topic through the cached subscription set of its ID,
+ * falling back to a trie walk to fill the set on the first publish or after
+ * an invalidation. Returns the number of subscriptions matched.
+ */
+size_t intern_route(struct intern_table *, const char *, size_t,
+                    trie_match_cb *, void *);
+
+#endif
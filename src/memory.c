@@ -0,0 +1,215 @@
+#include <string.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <stdatomic.h>
+#include "memory.h"
+
+/* Usage at which each pressure level starts, in percent of the ceiling */
+static const unsigned mem_thresholds[MEM_LEVELS] = { 0, 80, 90, 95, 100 };
+
+static const char *mem_tag_names[MEM_TAGS] = {
+  "connections",
+  "buffers",
+  "queues",
+  "retained",
+  "trie",
+  "sessions"
+};
+
+/* Counters of each tag, on their own cache line, loops update them a lot */
+static struct {
+  _Alignas(64) atomic_size_t used;
+} mem_tags[MEM_TAGS];
+
+static atomic_size_t ceiling = MEMORY_CEILING;
+
+static struct {
+  size_t nr;
+  struct {
+    mem_reclaim_fn *fn;
+    void *arg;
+  } reclaimers[MEM_RECLAIMERS];
+} mem_levels[MEM_LEVELS];
+
+static inline void mem_add(enum mem_tag tag, void *ptr)
+{
+  if (ptr) {
+    atomic_fetch_add_explicit(&mem_tags[tag].used, malloc_usable_size(ptr),
+                              memory_order_relaxed);
+  }
+}
+
+static inline void mem_sub(enum mem_tag tag, void *ptr)
+{
+  if (ptr) {
+    atomic_fetch_sub_explicit(&mem_tags[tag].used, malloc_usable_size(ptr),
+                              memory_order_relaxed);
+  }
+}
+
+void *mem_malloc(enum mem_tag tag, size_t size)
+{
+  void *ptr = malloc(size);
+  mem_add(tag, ptr);
+  return ptr;
+}
+
+void *mem_calloc(enum mem_tag tag, size_t nmemb, size_t size)
+{
+  void *ptr = calloc(nmemb, size);
+  mem_add(tag, ptr);
+  return ptr;
+}
+
+void *mem_realloc(enum mem_tag tag, void *ptr, size_t size)
+{
+  size_t old = ptr ? malloc_usable_size(ptr) : 0;
+  void *nptr = realloc(ptr, size);
+
+  /* The old block is left untouched on failure */
+  if (!nptr) {
+    return NULL;
+  }
+
+  atomic_fetch_sub_explicit(&mem_tags[tag].used, old, memory_order_relaxed);
+  mem_add(tag, nptr);
+
+  return nptr;
+}
+
+char *mem_strdup(enum mem_tag tag, const char *s)
+{
+  char *copy = strdup(s);
+  mem_add(tag, copy);
+  return copy;
+}
+
+void mem_free(enum mem_tag tag, void *ptr)
+{
+  mem_sub(tag, ptr);
+  free(ptr);
+}
+
+void mem_track(enum mem_tag tag, void *ptr)
+{
+  mem_add(tag, ptr);
+}
+
+void mem_untrack(enum mem_tag tag, void *ptr)
+{
+  mem_sub(tag, ptr);
+}
+
+void mem_charge(enum mem_tag tag, size_t size)
+{
+  atomic_fetch_add_explicit(&mem_tags[tag].used, size, memory_order_relaxed);
+}
+
+void mem_uncharge(enum mem_tag tag, size_t size)
+{
+  atomic_fetch_sub_explicit(&mem_tags[tag].used, size, memory_order_relaxed);
+}
+
+size_t mem_used(void)
+{
+  size_t used = 0;
+
+  for (int i = 0; i < MEM_TAGS; i++) {
+    used += atomic_load_explicit(&mem_tags[i].used, memory_order_relaxed);
+  }
+
+  return used;
+}
+
+size_t mem_tag_used(enum mem_tag tag)
+{
+  return atomic_load_explicit(&mem_tags[tag].used, memory_order_relaxed);
+}
+
+const char *mem_tag_name(enum mem_tag tag)
+{
+  return mem_tag_names[tag];
+}
+
+void mem_set_ceiling(size_t bytes)
+{
+  atomic_store(&ceiling, bytes);
+}
+
+size_t mem_ceiling(void)
+{
+  return atomic_load(&ceiling);
+}
+
+enum mem_pressure mem_pressure(void)
+{
+  size_t limit = atomic_load_explicit(&ceiling, memory_order_relaxed);
+
+  if (limit == 0) {
+    return MEM_OK;
+  }
+
+  /* Percent, computed without overflowing on large ceilings */
+  size_t used = mem_used();
+  size_t percent = used / (limit / 100 + 1);
+  enum mem_pressure level = MEM_OK;
+
+  while (level + 1 < MEM_LEVELS && percent >= mem_thresholds[level + 1]) {
+    level++;
+  }
+
+  /* Rounding must never let usage past the ceiling go unrefused */
+  if (used >= limit) {
+    level = MEM_REFUSE;
+  }
+
+  return level;
+}
+
+enum mem_pressure mem_pressure_since(enum mem_pressure last)
+{
+  enum mem_pressure level = mem_pressure();
+  size_t limit = atomic_load_explicit(&ceiling, memory_order_relaxed);
+
+  if (level >= last || limit == 0) {
+    return level;
+  }
+
+  size_t percent = mem_used() / (limit / 100 + 1);
+
+  /* Down a level at a time, as long as usage is clear of its threshold */
+  while (last > level && percent + MEM_HYSTERESIS < mem_thresholds[last]) {
+    last--;
+  }
+
+  return last;
+}
+
+int mem_reclaimer(enum mem_pressure level, mem_reclaim_fn *fn, void *arg)
+{
+  if (level == MEM_OK || level >= MEM_LEVELS ||
+      mem_levels[level].nr == MEM_RECLAIMERS) {
+    return -1;
+  }
+
+  size_t n = mem_levels[level].nr++;
+  mem_levels[level].reclaimers[n].fn = fn;
+  mem_levels[level].reclaimers[n].arg = arg;
+
+  return 0;
+}
+
+enum mem_pressure mem_reclaim(void)
+{
+  enum mem_pressure pressure = mem_pressure();
+
+  for (int level = MEM_SHRINK; level <= (int) pressure; level++) {
+    for (size_t i = 0; i < mem_levels[level].nr; i++) {
+      mem_levels[level].reclaimers[i].fn(mem_levels[level].reclaimers[i].arg);
+    }
+    /* Each step may have been enough to step back */
+    pressure = mem_pressure();
+  }
+
+  return pressure;
+}
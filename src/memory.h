@@ -0,0 +1,120 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <stdio.h>
+
+/*
+ * Memory accounting, allocations are tagged by the subsystem owning them
+ * and counted in the bytes the allocator really handed out, so the total
+ * follows the resident heap closely enough to be held under a ceiling.
+ *
+ * With a ceiling set, usage maps to a pressure level and the broker reacts
+ * at each one in turn, running the reclaimers registered for every level up
+ * to the current one, from the cheapest to the most disruptive:
+ *
+ * - MEM_SHRINK, from 80%, drop idle buffers and caches, rebuilt on demand
+ * - MEM_DROP_QOS0, from 90%, drop QoS 0 messages not yet sent
+ * - MEM_SPILL, from 95%, move offline session queues out of memory
+ * - MEM_REFUSE, at the ceiling, new connections are refused
+ *
+ * Reclaimers run only at the points the broker calls mem_reclaim from,
+ * never from inside an allocation. Levels are left with some hysteresis, a
+ * level is entered at its threshold but left only MEM_HYSTERESIS percent
+ * under it, so that usage hovering around a threshold doesn't have the
+ * reclaimers run over and over.
+ */
+
+/* Default ceiling in bytes, 0 for none, set at runtime by mem_set_ceiling */
+#ifndef MEMORY_CEILING
+#define MEMORY_CEILING      0
+#endif
+
+/* Percent of the ceiling under its threshold a level is left at */
+#define MEM_HYSTERESIS      5
+
+/*
+ * Milliseconds between two runs of the reclaimers while the pressure holds
+ * at the same level, a rising one runs them at once.
+ */
+#ifndef MEM_RECLAIM_INTERVAL
+#define MEM_RECLAIM_INTERVAL 1000
+#endif
+
+enum mem_tag {
+  MEM_CONNECTIONS,
+  MEM_BUFFERS,
+  MEM_QUEUES,
+  MEM_RETAINED,
+  MEM_TRIE,
+  MEM_SESSIONS,
+  MEM_TAGS
+};
+
+enum mem_pressure {
+  MEM_OK,
+  MEM_SHRINK,
+  MEM_DROP_QOS0,
+  MEM_SPILL,
+  MEM_REFUSE,
+  MEM_LEVELS
+};
+
+/* Allocation functions, same as the standard ones, counted on a tag */
+void *mem_malloc(enum mem_tag, size_t);
+void *mem_calloc(enum mem_tag, size_t, size_t);
+void *mem_realloc(enum mem_tag, void *, size_t);
+char *mem_strdup(enum mem_tag, const char *);
+void mem_free(enum mem_tag, void *);
+
+/*
+ * Count or stop counting on a tag a block allocated elsewhere, e.g. by the
+ * codec, to be freed with mem_free or after mem_untrack.
+ */
+void mem_track(enum mem_tag, void *);
+void mem_untrack(enum mem_tag, void *);
+
+/*
+ * Count or stop counting on a tag bytes the allocator didn't hand out, e.g.
+ * buffers carved out of the arena, see arena.h
+ */
+void mem_charge(enum mem_tag, size_t);
+void mem_uncharge(enum mem_tag, size_t);
+
+/* Bytes in use, overall and by a single tag */
+size_t mem_used(void);
+size_t mem_tag_used(enum mem_tag);
+
+/* Name of a tag, as published under $SOL/broker/memory/ */
+const char *mem_tag_name(enum mem_tag);
+
+void mem_set_ceiling(size_t);
+size_t mem_ceiling(void);
+
+/* Current pressure level, MEM_OK without a ceiling */
+enum mem_pressure mem_pressure(void);
+
+/*
+ * Pressure level with hysteresis, given the level reached before: higher
+ * if usage rose past a threshold, lower only once it fell MEM_HYSTERESIS
+ * percent under the one of the level reached.
+ */
+enum mem_pressure mem_pressure_since(enum mem_pressure);
+
+/*
+ * Reclaimer of a pressure level, returns the bytes it released, or an
+ * estimate of them. At most MEM_RECLAIMERS per level.
+ */
+typedef size_t mem_reclaim_fn(void *);
+
+#define MEM_RECLAIMERS      8
+
+int mem_reclaimer(enum mem_pressure, mem_reclaim_fn *, void *);
+
+/*
+ * Run the reclaimers of every level up to the current pressure, lowest
+ * first, stopping as soon as the pressure falls below the next level.
+ * Returns the pressure left.
+ */
+enum mem_pressure mem_reclaim(void);
+
+#endif
@@ -0,0 +1,205 @@
+#define _GNU_SOURCE
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "metrics.h"
+
+static struct metrics_segment *segment;
+static pthread_mutex_t segment_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static _Thread_local struct metrics_thread *slot;
+
+static uint64_t clock_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Set the file up under a temporary name first and move it in place once
+ * complete, a reader never maps one half initialized. The name is made
+ * unique and the file created exclusively, the directory is usually world
+ * writable and anything planted there under a name we could guess would be
+ * followed.
+ */
+static struct metrics_segment *segment_create(const char *path)
+{
+  char tmp[4096];
+  struct metrics_segment *s = MAP_FAILED;
+
+  if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int) sizeof(tmp)) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+
+  int fd = mkostemp(tmp, O_CLOEXEC);
+
+  if (fd < 0) {
+    return NULL;
+  }
+
+  /* Readable by the tools of other users, as the segment always was */
+  if (fchmod(fd, 0644) < 0 || ftruncate(fd, sizeof(*s)) < 0) {
+    goto err;
+  }
+
+  s = mmap(NULL, sizeof(*s), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (s == MAP_FAILED) {
+    goto err;
+  }
+
+  /* A new file reads as zeroes, every sequence starts even */
+  s->hdr.magic = METRICS_MAGIC;
+  s->hdr.version = METRICS_VERSION;
+  s->hdr.size = sizeof(*s);
+  s->hdr.pid = getpid();
+  s->hdr.created = clock_ms();
+  s->hdr.threads_max = METRICS_THREADS;
+
+  if (rename(tmp, path) < 0) {
+    goto err;
+  }
+
+  close(fd);
+
+  return s;
+
+err:
+
+  if (s != MAP_FAILED) {
+    munmap(s, sizeof(*s));
+  }
+  close(fd);
+  unlink(tmp);
+
+  return NULL;
+}
+
+int metrics_open(const char *path)
+{
+  int rc = 0;
+
+  pthread_mutex_lock(&segment_lock);
+
+  if (!segment) {
+    segment = segment_create(path);
+    rc = segment ? 0 : -1;
+  }
+
+  pthread_mutex_unlock(&segment_lock);
+
+  return rc;
+}
+
+void metrics_close(void)
+{
+  pthread_mutex_lock(&segment_lock);
+
+  if (segment) {
+    munmap(segment, sizeof(*segment));
+    segment = NULL;
+  }
+
+  pthread_mutex_unlock(&segment_lock);
+}
+
+struct metrics_segment *metrics_segment(void)
+{
+  return segment;
+}
+
+struct metrics_thread *metrics_thread_claim(void)
+{
+  if (slot || !segment) {
+    return slot;
+  }
+
+  unsigned n = atomic_fetch_add(&segment->hdr.threads_nr, 1);
+
+  if (n >= METRICS_THREADS) {
+    return NULL;
+  }
+
+  slot = &segment->threads[n];
+  slot->tid = gettid();
+
+  return slot;
+}
+
+int metrics_read(const _Atomic uint32_t *seq, const void *src, void *dst,
+                 size_t len)
+{
+  for (int i = 0; i < METRICS_READ_TRIES; i++) {
+    uint32_t before = atomic_load_explicit(seq, memory_order_acquire);
+
+    if (before & 1) {
+      continue;
+    }
+
+    memcpy(dst, src, len);
+    atomic_thread_fence(memory_order_acquire);
+
+    if (atomic_load_explicit(seq, memory_order_relaxed) == before) {
+      return 0;
+    }
+  }
+
+  errno = EAGAIN;
+  return -1;
+}
+
+const struct metrics_segment *metrics_attach(const char *path,
+                                             uint64_t *inode)
+{
+  struct stat st;
+  const struct metrics_segment *s;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0) {
+    return NULL;
+  }
+
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return NULL;
+  }
+
+  if ((size_t) st.st_size < sizeof(struct metrics_header)) {
+    close(fd);
+    errno = EPROTO;
+    return NULL;
+  }
+
+  s = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (s == MAP_FAILED) {
+    return NULL;
+  }
+
+  if (s->hdr.magic != METRICS_MAGIC || s->hdr.version != METRICS_VERSION
+      || s->hdr.size != sizeof(*s) || (size_t) st.st_size != sizeof(*s)) {
+    munmap((void *) s, st.st_size);
+    errno = EPROTO;
+    return NULL;
+  }
+
+  if (inode) {
+    *inode = st.st_ino;
+  }
+
+  return s;
+}
+
+void metrics_detach(const struct metrics_segment *s)
+{
+  if (s) {
+    munmap((void *) s, sizeof(*s));
+  }
+}
@@ -0,0 +1,185 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "memory.h"
+#include "trace.h"
+#include "arena.h"
+
+/*
+ * Metrics segment, a memory file the broker keeps a snapshot of its
+ * counters in, for tools on the same host to read with no system call and
+ * nothing asked of the broker, working just the same when it is overloaded.
+ *
+ * The snapshot is refreshed by the event loops every METRICS_INTERVAL, out
+ * of the packet path. The broker wide section is written by the first loop
+ * attached, each loop then has a section of its own. Every section is
+ * guarded by a seqlock: the writer makes its sequence odd while it writes,
+ * a reader copies the section and retries if the sequence was odd or moved
+ * meanwhile, so readers never hold the writer back.
+ *
+ * The layout is versioned, a reader must check magic, version and size in
+ * the header before anything else. A broker starting anew, or taking over
+ * from another, replaces the file, readers notice it by its inode.
+ */
+
+#define METRICS_MAGIC       0x4d4c4f53
+#define METRICS_VERSION     3
+
+/* Default path of the segment, "" not to export metrics */
+#ifndef METRICS_PATH
+#define METRICS_PATH        "/dev/shm/sol.metrics"
+#endif
+
+/* Milliseconds between two snapshots */
+#ifndef METRICS_INTERVAL
+#define METRICS_INTERVAL    500
+#endif
+
+/* Event loops with a section of their own, the ones after have none */
+#define METRICS_THREADS     32
+
+/* Reads retried before giving up on a writer gone in the middle of one */
+#define METRICS_READ_TRIES  1024
+
+struct metrics_header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t size;
+  int64_t pid;
+  /* CLOCK_MONOTONIC in milliseconds at creation */
+  uint64_t created;
+  uint32_t threads_max;
+  /* Sections claimed by the loops so far */
+  atomic_uint threads_nr;
+  /* Names of the memory tags, as mem_tag_name gives them */
+  char mem_tags[MEM_TAGS][16];
+};
+
+/* Timing of a stage of a packet type, see trace.h, in ticks */
+struct metrics_stage {
+  uint64_t count;
+  uint64_t ticks;
+  uint64_t max;
+  uint64_t hist[TRACE_HIST];
+};
+
+/* Broker wide counters, the ones of struct sol_info and more */
+struct metrics_broker {
+  _Alignas(64) _Atomic uint32_t seq;
+  /* Loop clock at the snapshot, CLOCK_MONOTONIC in milliseconds */
+  uint64_t updated;
+  int64_t nclients;
+  int64_t nconnections;
+  int64_t nthrottled;
+  int64_t start_time;
+  uint64_t bytes_recv;
+  uint64_t bytes_sent;
+  uint64_t messages_recv;
+  uint64_t messages_sent;
+  uint64_t messages_dropped;
+  uint64_t filter_hits;
+  uint64_t filter_misses;
+  uint64_t filter_false_positives;
+  uint64_t throttles;
+  /* Memory accounting, see memory.h */
+  uint64_t mem_used;
+  uint64_t mem_ceiling;
+  uint64_t mem_pressure;
+  uint64_t mem_tags[MEM_TAGS];
+  /* Huge page buffer arena, see arena.h, backing an enum arena_backing */
+  uint32_t arena_backing;
+  uint64_t arena_reserved;
+  uint64_t arena_carved;
+  uint64_t arena_used;
+  uint64_t arena_buffers;
+  uint64_t arena_allocs;
+  uint64_t arena_fallbacks;
+  /* Packets and frames seen by the stage timing, and the tick length */
+  uint64_t packets;
+  double ns_per_tick;
+  struct metrics_stage stages[TRACE_STAGES][TRACE_TYPES];
+};
+
+/* Counters of an event loop, from its own thread */
+struct metrics_thread {
+  _Alignas(64) _Atomic uint32_t seq;
+  uint32_t tid;
+  uint64_t updated;
+  /* Connections waiting for the scheduler, closures deferred */
+  uint64_t sched_ready;
+  uint64_t deferred;
+  /* Routing cache, see intern.h */
+  uint64_t cache_topics;
+  uint64_t cache_hits;
+  uint64_t cache_misses;
+  /* Input buffer pool, see bufpool.h */
+  uint64_t buf_lent;
+  uint64_t buf_idle_bytes;
+  uint64_t buf_hits;
+  uint64_t buf_misses;
+  /* CPU and memory node of the loop, -1 if unpinned, see server.h */
+  int32_t cpu;
+  int32_t node;
+  /* Connections accepted whose packets were processed on that CPU or not */
+  uint64_t accepts_local;
+  uint64_t accepts_remote;
+};
+
+struct metrics_segment {
+  struct metrics_header hdr;
+  struct metrics_broker broker;
+  struct metrics_thread threads[METRICS_THREADS];
+};
+
+/*
+ * Create the segment at a path, replacing the one there, and map it. Once
+ * per process, the calls after the first succeeding do nothing. Returns -1
+ * on error.
+ */
+int metrics_open(const char *);
+
+/* Unmap the segment, the file is left for readers to see the last values */
+void metrics_close(void);
+
+/* Segment mapped by metrics_open, NULL if none */
+struct metrics_segment *metrics_segment(void);
+
+/*
+ * Claim the section of the calling thread, the first one claimed is also
+ * the one writing the broker wide section. NULL if there is no segment or
+ * no section left.
+ */
+struct metrics_thread *metrics_thread_claim(void);
+
+static inline void metrics_write_begin(_Atomic uint32_t *seq)
+{
+  uint32_t s = atomic_load_explicit(seq, memory_order_relaxed);
+  atomic_store_explicit(seq, s + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+}
+
+static inline void metrics_write_end(_Atomic uint32_t *seq)
+{
+  uint32_t s = atomic_load_explicit(seq, memory_order_relaxed);
+  atomic_store_explicit(seq, s + 1, memory_order_release);
+}
+
+/*
+ * Reader side, copy a section guarded by the given sequence out of a
+ * mapped segment. Returns -1 if no consistent copy could be taken in
+ * METRICS_READ_TRIES, e.g. the broker died while writing it.
+ */
+int metrics_read(const _Atomic uint32_t *, const void *, void *, size_t);
+
+/*
+ * Reader side, map a segment read-only and check its layout. Returns NULL
+ * with errno set on error, EPROTO for a layout this build can't read.
+ */
+const struct metrics_segment *metrics_attach(const char *, uint64_t *);
+
+void metrics_detach(const struct metrics_segment *);
+
+#endif
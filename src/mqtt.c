@@ -1,100 +1,477 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
 
 #include "mqtt.h"
 #include "pack.h"
-
-static size_t unpack_mqtt_connect(const unsigned char *, union mqtt_header *,
-                                  union mqtt_packet *);
-static size_t unpack_mqtt_publish(const unsigned char *, union mqtt_header *,
-                                  union mqtt_packet *);
-static size_t unpack_mqtt_subscribe(const unsigned char *, union mqtt_header *,
-                                    union mqtt_packet *);
-static size_t unpack_mqtt_unsubscribe(const unsigned char *, union mqtt_header *, 
-                                      union mqtt_packet *);
-static size_t unpack_mqtt_ack(const unsigned char *, union mqtt_header *,
-                              union mqtt_packet *);
-
-static unsigned char *pack_mqtt_header(const union mqtt_header *);
-static unsigned char *pack_mqtt_ack(const union mqtt_packet *);
-static unsigned char *pack_mqtt_connack(const union mqtt_packet *);
-static unsigned char *pack_mqtt_suback(const union mqtt_packet *);
-static unsigned char *pack_mqtt_publish(const union mqtt_packet *);
+#include "utf8.h"
+#include "stream.h"
+
+static ssize_t unpack_mqtt_connect(const unsigned char *, union mqtt_header *,
+                                  union mqtt_packet *, unsigned char);
+static ssize_t unpack_mqtt_publish(const unsigned char *, union mqtt_header *,
+                                  union mqtt_packet *, unsigned char);
+static ssize_t unpack_mqtt_subscribe(const unsigned char *, union mqtt_header *,
+                                    union mqtt_packet *, unsigned char);
+static ssize_t unpack_mqtt_unsubscribe(const unsigned char *, union mqtt_header *, 
+                                      union mqtt_packet *, unsigned char);
+static ssize_t unpack_mqtt_ack(const unsigned char *, union mqtt_header *,
+                              union mqtt_packet *, unsigned char);
+
+static unsigned char *pack_mqtt_header(const union mqtt_header *, size_t *);
+static unsigned char *pack_mqtt_ack(const union mqtt_packet *, unsigned char,
+                                    size_t *);
+static unsigned char *pack_mqtt_connack(const union mqtt_packet *,
+                                        unsigned char, size_t *);
+static unsigned char *pack_mqtt_suback(const union mqtt_packet *,
+                                       unsigned char, size_t *);
+static unsigned char *pack_mqtt_publish(const union mqtt_packet *,
+                                        unsigned char, size_t *);
 
 /*
  * MQTT v3.1.1 standard, remaining lenght field on the fixed header
  * can be at most 4 bytes
  */
 
-static const int MAX_LEN_BYTES = 4;
+#define MAX_LEN_BYTES   4
+
+/*
+ * Largest remaining lenght encodable with 1, 2, 3 and 4 bytes, 7 bits per
+ * byte, the top one flagging that more bytes follow.
+ */
+static const size_t lenght_limits[MAX_LEN_BYTES] = {
+  127, 16383, 2097151, MQTT_MAX_LENGHT
+};
+
+/*
+ * Number of bytes needed to encode a remaining lenght, computed without
+ * branching, 0 if it exceeds the maximum allowed.
+ */
+size_t mqtt_lenght_bytes(size_t len)
+{
+  if (len > MQTT_MAX_LENGHT) {
+    return 0;
+  }
+
+  return 1 + (len > lenght_limits[0]) + (len > lenght_limits[1])
+      + (len > lenght_limits[2]);
+}
 
 /*
  * Enconde remaining lenght on a MQTT packet header, comprised of 
  * variable Header and Payload if present. It does not take into 
- * account the bytes required to store itself. 
+ * account the bytes required to store itself. Returns the number of
+ * bytes written, 0 if the lenght can't be encoded.
  */
 
 int mqtt_encode_lenght(unsigned char *buf, size_t len)
 {
-    int bytes = 0;
-    do 
-    {
-        if (bytes + 1 > MAX_LEN_BYTES) {
-            return bytes;
-        }
+  size_t bytes = mqtt_lenght_bytes(len);
 
-        short d = len % 128;
-        len /= 128;
-        
-        /* If there are more digits to encode, set the top bit of 
-         * this digit 
-         */ 
-        if (len > 0) {
-            d |= 128;
-        }
+  if (bytes == 0) {
+    return 0;
+  }
+
+  /* Every byte but the last has the continuation bit set */
+  for (size_t i = 0; i < bytes - 1; i++) {
+    buf[i] = (len & 127) | 128;
+    len >>= 7;
+  }
 
-        buf[bytes++] = d;
-    } while (len > 0);
+  buf[bytes - 1] = len;
 
-    return bytes;
+  return bytes;
+}
+
+/*
+ * Decode a remaining lenght from a window of avail bytes, which may be
+ * shorter than the field itself, e.g. what was peeked from a socket so far.
+ * Returns the number of bytes the field takes storing the value in len, 0 if
+ * more bytes are needed and -1 if the field is longer than 4 bytes.
+ */
+
+int mqtt_decode_lenght_window(const unsigned char *buf, size_t avail,
+                              size_t *len)
+{
+  size_t value = 0;
+  size_t n = avail < MAX_LEN_BYTES ? avail : MAX_LEN_BYTES;
+
+  for (size_t i = 0; i < n; i++) {
+    value |= (size_t) (buf[i] & 127) << (7 * i);
+    if ((buf[i] & 128) == 0) {
+      *len = value;
+      return i + 1;
+    }
+  }
+
+  return avail >= MAX_LEN_BYTES ? -1 : 0;
 }
 
 /*
  * Decode remaining lenght comprised of variable Header and Payload
  * if present. It does not take into account the bytes storing 
- * lenght.
- *
- * TODO Handle case where multiplier > 128 * 128 * 128
+ * lenght. The field is read up to its 4 bytes limit, a longer one
+ * yields MQTT_LENGHT_MALFORMED.
  */
 
 unsigned long long mqtt_decode_lenght(const unsigned char **buf) 
 {
-  char c;
-  int multiplier = 1;
-  unsigned long long value = 0LL;
-  do {
-    c = (char)**buf;
-    value += (c & 127) * multiplier;
-    multiplier *= 128;
-    (*buf)++;
-  } while ((c & 128) != 0);
+  size_t len = 0;
+  int bytes = mqtt_decode_lenght_window(*buf, MAX_LEN_BYTES, &len);
+
+  if (bytes < 0) {
+    *buf += MAX_LEN_BYTES;
+    return MQTT_LENGHT_MALFORMED;
+  }
+
+  *buf += bytes;
+  return len;
+}
+
+/*
+ * MQTT 5 properties
+ */
+
+/* Wire types of property values */
+#define PROP_NONE       0
+#define PROP_BYTE       1
+#define PROP_U16        2
+#define PROP_U32        3
+#define PROP_VARINT     4
+#define PROP_STRING     5
+#define PROP_BINARY     6
+#define PROP_PAIR       7
+
+static const unsigned char property_types[MQTT_PROP_MAX + 1] = {
+  [MQTT_PROP_PAYLOAD_FORMAT]          = PROP_BYTE,
+  [MQTT_PROP_MESSAGE_EXPIRY]          = PROP_U32,
+  [MQTT_PROP_CONTENT_TYPE]            = PROP_STRING,
+  [MQTT_PROP_RESPONSE_TOPIC]          = PROP_STRING,
+  [MQTT_PROP_CORRELATION_DATA]        = PROP_BINARY,
+  [MQTT_PROP_SUBSCRIPTION_ID]         = PROP_VARINT,
+  [MQTT_PROP_SESSION_EXPIRY]          = PROP_U32,
+  [MQTT_PROP_ASSIGNED_CLIENT_ID]      = PROP_STRING,
+  [MQTT_PROP_SERVER_KEEPALIVE]        = PROP_U16,
+  [MQTT_PROP_AUTH_METHOD]             = PROP_STRING,
+  [MQTT_PROP_AUTH_DATA]               = PROP_BINARY,
+  [MQTT_PROP_REQUEST_PROBLEM_INFO]    = PROP_BYTE,
+  [MQTT_PROP_WILL_DELAY]              = PROP_U32,
+  [MQTT_PROP_REQUEST_RESPONSE_INFO]   = PROP_BYTE,
+  [MQTT_PROP_RESPONSE_INFO]           = PROP_STRING,
+  [MQTT_PROP_SERVER_REFERENCE]        = PROP_STRING,
+  [MQTT_PROP_REASON_STRING]           = PROP_STRING,
+  [MQTT_PROP_RECEIVE_MAXIMUM]         = PROP_U16,
+  [MQTT_PROP_TOPIC_ALIAS_MAXIMUM]     = PROP_U16,
+  [MQTT_PROP_TOPIC_ALIAS]             = PROP_U16,
+  [MQTT_PROP_MAXIMUM_QOS]             = PROP_BYTE,
+  [MQTT_PROP_RETAIN_AVAILABLE]        = PROP_BYTE,
+  [MQTT_PROP_USER_PROPERTY]           = PROP_PAIR,
+  [MQTT_PROP_MAXIMUM_PACKET_SIZE]     = PROP_U32,
+  [MQTT_PROP_WILDCARD_SUB_AVAILABLE]  = PROP_BYTE,
+  [MQTT_PROP_SUB_ID_AVAILABLE]        = PROP_BYTE,
+  [MQTT_PROP_SHARED_SUB_AVAILABLE]    = PROP_BYTE
+};
+
+/* Properties stored in struct mqtt_properties, in encoding order */
+static const unsigned char stored_properties[] = {
+  MQTT_PROP_PAYLOAD_FORMAT,
+  MQTT_PROP_MESSAGE_EXPIRY,
+  MQTT_PROP_SESSION_EXPIRY,
+  MQTT_PROP_RECEIVE_MAXIMUM,
+  MQTT_PROP_TOPIC_ALIAS_MAXIMUM,
+  MQTT_PROP_TOPIC_ALIAS,
+  MQTT_PROP_MAXIMUM_PACKET_SIZE
+};
+
+#define STORED_PROPERTIES   (sizeof(stored_properties) / sizeof(*stored_properties))
+
+/* Store a decoded value, returns -1 if it is not allowed */
+static int property_store(struct mqtt_properties *props, unsigned char id,
+                          uint32_t value)
+{
+  switch (id) {
+    case MQTT_PROP_PAYLOAD_FORMAT:
+      props->payload_format = value;
+      return value > 1 ? -1 : 0;
+    case MQTT_PROP_MESSAGE_EXPIRY:
+      props->message_expiry = value;
+      return 0;
+    case MQTT_PROP_SESSION_EXPIRY:
+      props->session_expiry = value;
+      return 0;
+    case MQTT_PROP_RECEIVE_MAXIMUM:
+      props->receive_maximum = value;
+      return value == 0 ? -1 : 0;
+    case MQTT_PROP_TOPIC_ALIAS_MAXIMUM:
+      props->topic_alias_maximum = value;
+      return 0;
+    case MQTT_PROP_TOPIC_ALIAS:
+      props->topic_alias = value;
+      return value == 0 ? -1 : 0;
+    case MQTT_PROP_MAXIMUM_PACKET_SIZE:
+      props->maximum_packet_size = value;
+      return value == 0 ? -1 : 0;
+    case MQTT_PROP_SUBSCRIPTION_ID:
+      return value == 0 ? -1 : 0;
+    default:
+      return 0;
+  }
+}
+
+static uint32_t property_value(const struct mqtt_properties *props,
+                               unsigned char id)
+{
+  switch (id) {
+    case MQTT_PROP_PAYLOAD_FORMAT:
+      return props->payload_format;
+    case MQTT_PROP_MESSAGE_EXPIRY:
+      return props->message_expiry;
+    case MQTT_PROP_SESSION_EXPIRY:
+      return props->session_expiry;
+    case MQTT_PROP_RECEIVE_MAXIMUM:
+      return props->receive_maximum;
+    case MQTT_PROP_TOPIC_ALIAS_MAXIMUM:
+      return props->topic_alias_maximum;
+    case MQTT_PROP_TOPIC_ALIAS:
+      return props->topic_alias;
+    case MQTT_PROP_MAXIMUM_PACKET_SIZE:
+      return props->maximum_packet_size;
+    default:
+      return 0;
+  }
+}
+
+ssize_t mqtt_unpack_properties(const unsigned char *buf, size_t avail,
+                               struct mqtt_properties *props)
+{
+  size_t len = 0;
+  int bytes = mqtt_decode_lenght_window(buf, avail, &len);
+
+  if (bytes <= 0 || len > avail - bytes) {
+    return -1;
+  }
+
+  memset(props, 0, sizeof(*props));
+
+  const uint8_t *ptr = buf + bytes;
+  const uint8_t *end = ptr + len;
+
+  while (ptr < end) {
+    /* Identifiers are varints, but every one defined fits a single byte */
+    unsigned char id = unpack_u8(&ptr);
+
+    if (id > MQTT_PROP_MAX || property_types[id] == PROP_NONE) {
+      return -1;
+    }
+
+    /* Only user properties and subscription identifiers may repeat */
+    if (MQTT_PROP_HAS(props, id) && id != MQTT_PROP_USER_PROPERTY &&
+        id != MQTT_PROP_SUBSCRIPTION_ID) {
+      return -1;
+    }
+
+    MQTT_PROP_SET(props, id);
+
+    size_t left = end - ptr;
+    uint32_t value = 0;
+    int type = property_types[id];
+
+    switch (type) {
+      case PROP_BYTE:
+        if (left < sizeof(uint8_t)) {
+          return -1;
+        }
+        value = unpack_u8(&ptr);
+        break;
+      case PROP_U16:
+        if (left < sizeof(uint16_t)) {
+          return -1;
+        }
+        value = unpack_u16(&ptr);
+        break;
+      case PROP_U32:
+        if (left < sizeof(uint32_t)) {
+          return -1;
+        }
+        value = unpack_u32(&ptr);
+        break;
+      case PROP_VARINT: {
+        size_t varint = 0;
+        int n = mqtt_decode_lenght_window(ptr, left, &varint);
+        if (n <= 0) {
+          return -1;
+        }
+        ptr += n;
+        value = varint;
+        break;
+      }
+      default:
+        /* Strings and binary data are skipped, a pair is two strings */
+        for (int i = 0; i < (type == PROP_PAIR ? 2 : 1); i++) {
+          if (left < sizeof(uint16_t)) {
+            return -1;
+          }
+          uint16_t slen = unpack_u16(&ptr);
+          left -= sizeof(uint16_t);
+          if (slen > left ||
+              (type != PROP_BINARY && !utf8_valid(ptr, slen))) {
+            return -1;
+          }
+          ptr += slen;
+          left -= slen;
+        }
+        break;
+    }
+
+    if (property_store(props, id, value) < 0) {
+      return -1;
+    }
+  }
+
+  return bytes + len;
+}
+
+/* Lenght of the stored properties flagged, their lenght field excluded */
+static size_t properties_lenght(const struct mqtt_properties *props)
+{
+  size_t len = 0;
+
+  for (size_t i = 0; i < STORED_PROPERTIES; i++) {
+    unsigned char id = stored_properties[i];
+    if (!MQTT_PROP_HAS(props, id)) {
+      continue;
+    }
+    switch (property_types[id]) {
+      case PROP_BYTE:
+        len += 1 + sizeof(uint8_t);
+        break;
+      case PROP_U16:
+        len += 1 + sizeof(uint16_t);
+        break;
+      case PROP_U32:
+        len += 1 + sizeof(uint32_t);
+        break;
+    }
+  }
 
-  return value;
+  return len;
+}
+
+size_t mqtt_properties_size(const struct mqtt_properties *props)
+{
+  size_t len = properties_lenght(props);
+  return mqtt_lenght_bytes(len) + len;
+}
+
+void mqtt_pack_properties(unsigned char **ptr,
+                          const struct mqtt_properties *props)
+{
+  *ptr += mqtt_encode_lenght(*ptr, properties_lenght(props));
+
+  for (size_t i = 0; i < STORED_PROPERTIES; i++) {
+    unsigned char id = stored_properties[i];
+    if (!MQTT_PROP_HAS(props, id)) {
+      continue;
+    }
+    pack_u8(ptr, id);
+    uint32_t value = property_value(props, id);
+    switch (property_types[id]) {
+      case PROP_BYTE:
+        pack_u8(ptr, value);
+        break;
+      case PROP_U16:
+        pack_u16(ptr, value);
+        break;
+      case PROP_U32:
+        pack_u32(ptr, value);
+        break;
+    }
+  }
+}
+
+ssize_t mqtt_publish_header_lenght(const unsigned char *buf, size_t avail,
+                                   unsigned char version)
+{
+  const unsigned char qos = (buf[0] >> 1) & 0x03;
+  size_t len = 0;
+  int lenght_bytes = mqtt_decode_lenght_window(buf + 1, avail - 1, &len);
+
+  if (lenght_bytes < 0) {
+    return -1;
+  }
+
+  /* Fixed header, then topic lenght */
+  size_t need = 1 + MAX_LEN_BYTES + sizeof(uint16_t);
+
+  if (lenght_bytes == 0) {
+    return need;
+  }
+
+  need = 1 + lenght_bytes + sizeof(uint16_t);
+
+  if (avail < need) {
+    return need;
+  }
+
+  const uint8_t *ptr = buf + need - sizeof(uint16_t);
+  need += unpack_u16(&ptr);
+
+  if (qos > AT_MOST_ONCE) {
+    need += sizeof(uint16_t);
+  }
+
+  if (version == MQTT_V5) {
+    /* Properties lenght is known once its varint is there */
+    size_t props = 0;
+    int n = avail > need ?
+        mqtt_decode_lenght_window(buf + need, avail - need, &props) : 0;
+    if (n < 0) {
+      return -1;
+    }
+    if (n == 0) {
+      return need + MAX_LEN_BYTES;
+    }
+    need += n + props;
+  }
+
+  if (need > 1 + lenght_bytes + len) {
+    return -1;
+  }
+
+  return need;
 }
 
 /*
  * MQTT unpacking functions
  */
 
-static size_t unpack_mqtt_connect(const unsigned char *buf,
+/*
+ * Bytes a u16 prefixed string at buf takes, prefix included, 0 if it runs
+ * past the avail bytes left of the packet. Checked before unpack_string16
+ * copies it out, lenghts come from the client.
+ */
+static inline size_t string16_lenght(const unsigned char *buf, size_t avail)
+{
+  if (avail < sizeof(uint16_t)) {
+    return 0;
+  }
+
+  size_t len = sizeof(uint16_t) + ((buf[0] << 8) | buf[1]);
+
+  return len <= avail ? len : 0;
+}
+
+static ssize_t unpack_mqtt_connect(const unsigned char *buf,
                                   union mqtt_header *hdr,
-                                  union mqtt_packet *pkt) 
+                                  union mqtt_packet *pkt,
+                                  unsigned char version) 
 {
   struct mqtt_connect connect = {.header = *hdr};
   pkt->connect = connect;
 
-  const unsigned char *init = buf;
+  /* CONNECT is the one packet telling its own protocol level */
+  (void) version;
 
   /*
    * Second byte of the fixed header, contains the lenght of the
@@ -102,12 +479,21 @@ static size_t unpack_mqtt_connect(const unsigned char *buf,
    */
 
   size_t len = mqtt_decode_lenght(&buf);
+  const unsigned char *end = buf + len;
 
-  /* For now ignore checks on protocol name and reserved bits,
-   * just skip to the 8th byte
-   */
+  /* Skip the protocol name, "MQTT" or "MQIsdp" for 3.1, to its level */
+  size_t name_len = string16_lenght(buf, len);
+
+  if (name_len == 0 || len < name_len + 4) {
+    goto malformed;
+  }
+
+  buf += name_len;
+  pkt->connect.version = unpack_u8((const uint8_t **)&buf);
 
-  buf = init + 8;
+  if (pkt->connect.version > MQTT_V5) {
+    goto malformed;
+  }
 
   /* Read variable header byte flags */
   pkt->connect.byte = unpack_u8((const uint8_t **)&buf);
@@ -115,6 +501,19 @@ static size_t unpack_mqtt_connect(const unsigned char *buf,
   /* Read keepalive MSB and LSB (2 bytes word) */
   pkt->connect.payload.keepalive = unpack_u16((const uint8_t **)&buf);
 
+  if (pkt->connect.version == MQTT_V5) {
+    ssize_t n = mqtt_unpack_properties(buf, end - buf,
+                                       &pkt->connect.properties);
+    if (n < 0) {
+      goto malformed;
+    }
+    buf += n;
+  }
+
+  if (string16_lenght(buf, end - buf) == 0) {
+    goto malformed;
+  }
+
   /*Read CID lenght (2 bytes word) */
   uint16_t cid_len = unpack_u16((const uint8_t **)&buf);
 
@@ -123,30 +522,67 @@ static size_t unpack_mqtt_connect(const unsigned char *buf,
     pkt->connect.payload.client_id = malloc(cid_len + 1);
     unpack_bytes((const uint8_t **)&buf, cid_len,
                  pkt->connect.payload.client_id);
+    if (!utf8_valid(pkt->connect.payload.client_id, cid_len)) {
+      goto malformed;
+    }
   }
 
   /* Read the will topic and message if will is set on flags */
   if (pkt->connect.bits.will == 1) {
-    unpack_string16((unsigned char**)&buf, &pkt->connect.payload.will_topic);
+    /* Will properties are checked but not kept, wills carry none of ours */
+    if (pkt->connect.version == MQTT_V5) {
+      struct mqtt_properties will;
+      ssize_t n = mqtt_unpack_properties(buf, end - buf, &will);
+      if (n < 0) {
+        goto malformed;
+      }
+      buf += n;
+    }
+    size_t will_len = string16_lenght(buf, end - buf);
+    if (will_len == 0 || string16_lenght(buf + will_len,
+                                         end - buf - will_len) == 0) {
+      goto malformed;
+    }
+    uint16_t topic_len =
+        unpack_string16((unsigned char**)&buf,
+                        &pkt->connect.payload.will_topic);
     unpack_string16((unsigned char**)&buf, &pkt->connect.payload.will_message);
+    if (!mqtt_valid_topic_name(pkt->connect.payload.will_topic, topic_len)) {
+      goto malformed;
+    }
   }
 
   /* Read the username if username flag is set */
   if (pkt->connect.bits.username == 1) {
-    unpack_string16((unsigned char**)&buf, &pkt->connect.payload.username);
+    if (string16_lenght(buf, end - buf) == 0) {
+      goto malformed;
+    }
+    uint16_t username_len =
+        unpack_string16((unsigned char**)&buf, &pkt->connect.payload.username);
+    if (!utf8_valid(pkt->connect.payload.username, username_len)) {
+      goto malformed;
+    }
   }
 
   /* Read the password if password flag is set */
   if (pkt->connect.bits.password == 1) {
+    if (string16_lenght(buf, end - buf) == 0) {
+      goto malformed;
+    }
     unpack_string16((unsigned char**)&buf, &pkt->connect.payload.password);
   }
 
   return len;
+
+malformed:
+  mqtt_packet_release(pkt, CONNECT);
+  return -1;
 }
 
-static size_t unpack_mqtt_publish(const unsigned char *buf,
+static ssize_t unpack_mqtt_publish(const unsigned char *buf,
                                   union mqtt_header *hdr,
-                                  union mqtt_packet *pkt) {
+                                  union mqtt_packet *pkt,
+                                  unsigned char version) {
   struct mqtt_publish publish = {
       .header = *hdr
   };
@@ -158,16 +594,43 @@ static size_t unpack_mqtt_publish(const unsigned char *buf,
    * of the connect packet
    */ 
   size_t len = mqtt_decode_lenght(&buf);
+  const unsigned char *start = buf;
+  size_t topic_len = string16_lenght(buf, len);
+
+  if (topic_len == 0 || (publish.header.bits.qos > AT_MOST_ONCE &&
+                         len - topic_len < sizeof(uint16_t))) {
+    goto malformed;
+  }
 
   pkt->publish.topiclen =
       unpack_string16((unsigned char **)&buf, &pkt->publish.topic);
-  uint16_t message_len = len;
 
   /* Read packet id */
 
   if (publish.header.bits.qos > AT_MOST_ONCE) {
     pkt->publish.pkt_id = unpack_u16((const uint8_t **)&buf);
-    message_len -= sizeof(uint16_t);
+  }
+
+  if (version == MQTT_V5) {
+    ssize_t n = mqtt_unpack_properties(buf, len - (buf - start),
+                                       &pkt->publish.properties);
+    if (n < 0) {
+      goto malformed;
+    }
+    buf += n;
+  }
+
+  /*
+   * Wildcards are not allowed in topic names, an empty one is allowed only
+   * if the topic is sent as a MQTT 5 topic alias.
+   */
+  if (pkt->publish.topiclen == 0) {
+    if (!MQTT_PROP_HAS(&pkt->publish.properties, MQTT_PROP_TOPIC_ALIAS)) {
+      goto malformed;
+    }
+  } else if (!mqtt_valid_topic_name(pkt->publish.topic,
+                                    pkt->publish.topiclen)) {
+    goto malformed;
   }
 
   /*
@@ -175,17 +638,22 @@ static size_t unpack_mqtt_publish(const unsigned char *buf,
    * header from the remaining lenght field that is in the Fixed header
    */ 
 
-  message_len -= (sizeof(uint16_t) + pkt->publish.topiclen);
+  size_t message_len = len - (buf - start);
   pkt->publish.payloadlen = message_len;
   pkt->publish.payload = malloc(message_len + 1);
   unpack_bytes((const uint8_t **)&buf, message_len, pkt->publish.payload);
   
   return len;
+
+malformed:
+  free(pkt->publish.topic);
+  return -1;
 }
 
-static size_t unpack_mqtt_subscribe(const unsigned char *buf,
+static ssize_t unpack_mqtt_subscribe(const unsigned char *buf,
                                     union mqtt_header *hdr,
-                                    union mqtt_packet *pkt) 
+                                    union mqtt_packet *pkt,
+                                    unsigned char version) 
 {
   struct mqtt_subscribe subscribe = {
     .header = *hdr
@@ -199,21 +667,42 @@ static size_t unpack_mqtt_subscribe(const unsigned char *buf,
   size_t len = mqtt_decode_lenght(&buf);
   size_t remaining_bytes = len;
 
+  if (remaining_bytes < sizeof(uint16_t)) {
+    return -1;
+  }
+
   /* Read packet id */
   subscribe.pkt_id = unpack_u16((const uint8_t **)&buf);
   remaining_bytes -= sizeof(uint16_t);
 
+  /* Subscription identifiers and user properties, none of them is kept */
+  if (version == MQTT_V5) {
+    struct mqtt_properties props;
+    ssize_t n = mqtt_unpack_properties(buf, remaining_bytes, &props);
+    if (n < 0) {
+      return -1;
+    }
+    buf += n;
+    remaining_bytes -= n;
+  }
+
   /*
    * Read in a loop all remaining bytes specified by len of the Fixed Header
    * From now on the payload consist of 3 tuples formed by:
    * - topic lenght
    * - topic filter (string)
-   * - qos 
+   * - qos, MQTT 5 packs it with other subscription options in a byte
    */ 
 
   int i = 0;
   while (remaining_bytes > 0)
   {
+    /* The whole tuple must be there, its filter and options byte */
+    size_t tuple_len = string16_lenght(buf, remaining_bytes);
+    if (tuple_len == 0 || tuple_len == remaining_bytes) {
+      goto malformed;
+    }
+
     /* Read lenght bytes of the first topic filter */
     remaining_bytes -= sizeof(uint16_t);
 
@@ -224,19 +713,34 @@ static size_t unpack_mqtt_subscribe(const unsigned char *buf,
         unpack_string16((unsigned char **)&buf, &subscribe.tuples[i].topic);
     remaining_bytes -= subscribe.tuples[i].topic_len;
     subscribe.tuples[i].qos = unpack_u8((const uint8_t **)&buf);
-
-    len -= sizeof(uint8_t);
+    remaining_bytes -= sizeof(uint8_t);
     i++;
+
+    if (version == MQTT_V5) {
+      subscribe.tuples[i-1].qos &= 0x03;
+    }
+
+    if (!mqtt_valid_topic_filter(subscribe.tuples[i-1].topic,
+                                 subscribe.tuples[i-1].topic_len)) {
+      goto malformed;
+    }
   }
 
   subscribe.tuples_len = i;
   pkt->subscribe = subscribe;
   return len;
+
+malformed:
+  subscribe.tuples_len = i;
+  pkt->subscribe = subscribe;
+  mqtt_packet_release(pkt, SUBSCRIBE);
+  return -1;
 }
 
-static size_t unpack_mqtt_unsubscribe(const unsigned char *buf,
+static ssize_t unpack_mqtt_unsubscribe(const unsigned char *buf,
                                       union mqtt_header *hdr,
-                                      union mqtt_packet *pkt) 
+                                      union mqtt_packet *pkt,
+                                      unsigned char version) 
 {
   struct mqtt_unsuscribe unsubscribe = {
     .header = *hdr
@@ -250,10 +754,24 @@ static size_t unpack_mqtt_unsubscribe(const unsigned char *buf,
   size_t len = mqtt_decode_lenght(&buf);
   size_t remaining_bytes = len;
 
+  if (remaining_bytes < sizeof(uint16_t)) {
+    return -1;
+  }
+
   /* Read packet id */
   unsubscribe.pkt_id = unpack_u16((const uint8_t **)&buf);
   remaining_bytes -= sizeof(uint16_t);
 
+  if (version == MQTT_V5) {
+    struct mqtt_properties props;
+    ssize_t n = mqtt_unpack_properties(buf, remaining_bytes, &props);
+    if (n < 0) {
+      return -1;
+    }
+    buf += n;
+    remaining_bytes -= n;
+  }
+
   /*
    * Read in a loop all remaining bytes specified by len of the Fixed Header
    * From now on the payload consist of 2 tuples formed by:
@@ -264,6 +782,10 @@ static size_t unpack_mqtt_unsubscribe(const unsigned char *buf,
   int i = 0;
   while (remaining_bytes > 0)
   {
+    if (string16_lenght(buf, remaining_bytes) == 0) {
+      goto malformed;
+    }
+
     /* Read lenght bytes of the first topic filter */
     remaining_bytes -= sizeof(uint16_t);
 
@@ -275,16 +797,28 @@ static size_t unpack_mqtt_unsubscribe(const unsigned char *buf,
     remaining_bytes -= unsubscribe.tuples[i].topic_len;
 
     i++;
+
+    if (!mqtt_valid_topic_filter(unsubscribe.tuples[i-1].topic,
+                                 unsubscribe.tuples[i-1].topic_len)) {
+      goto malformed;
+    }
   }
 
   unsubscribe.tuples_len = i;
   pkt->unsuscribe = unsubscribe;
   return len;
+
+malformed:
+  unsubscribe.tuples_len = i;
+  pkt->unsuscribe = unsubscribe;
+  mqtt_packet_release(pkt, UNSUSCRIBE);
+  return -1;
 }
 
-static size_t unpack_mqtt_ack(const unsigned char *buf,
+static ssize_t unpack_mqtt_ack(const unsigned char *buf,
                               union mqtt_header *hdr,
-                              union mqtt_packet *pkt)
+                              union mqtt_packet *pkt,
+                              unsigned char version)
 {
   struct mqtt_ack ack = {
     .header = *hdr
@@ -296,15 +830,34 @@ static size_t unpack_mqtt_ack(const unsigned char *buf,
    */
 
   size_t len = mqtt_decode_lenght(&buf);
+
+  if (len < sizeof(uint16_t)) {
+    return -1;
+  }
+
   ack.pkt_id = unpack_u16((const uint8_t **)&buf);
+
+  /* MQTT 5 reason code and properties, both can be left out */
+  if (version == MQTT_V5 && len > sizeof(uint16_t)) {
+    ack.rc = unpack_u8((const uint8_t **)&buf);
+    if (len > sizeof(uint16_t) + 1) {
+      struct mqtt_properties props;
+      if (mqtt_unpack_properties(buf, len - sizeof(uint16_t) - 1,
+                                 &props) < 0) {
+        return -1;
+      }
+    }
+  }
+
   pkt->ack = ack;
   
   return len;
 }
 
-typedef size_t mqtt_unpack_handler (const unsigned char*,
+typedef ssize_t mqtt_unpack_handler (const unsigned char*,
                                     union mqtt_header *,
-                                    union mqtt_packet *);
+                                    union mqtt_packet *,
+                                    unsigned char);
 
 /* 
  * Unpack functions mapping unpack_handlers positioned in the array
@@ -325,9 +878,21 @@ static mqtt_unpack_handler *unpack_handlers[11] = {
   unpack_mqtt_unsubscribe
 };
 
-int unpack_mqtt_packet(const unsigned char *buf, union mqtt_packet *pkt)
+/*
+ * Unpack a packet of size bytes, strings are validated on the way, returns
+ * -1 if the packet is malformed, nothing is left allocated in that case.
+ * Only the packets a client sends are decoded, any other type is malformed,
+ * as is a remaining lenght longer than 4 bytes or running past the size.
+ */
+int unpack_mqtt_packet_version(const unsigned char *buf, size_t size,
+                               union mqtt_packet *pkt, unsigned char version)
 {
   int rc = 0;
+  size_t len = 0;
+
+  if (size < 2) {
+    return -1;
+  }
 
   /* Read first byte of the fixed header */
   unsigned char type = (unsigned char)*buf;
@@ -335,18 +900,39 @@ int unpack_mqtt_packet(const unsigned char *buf, union mqtt_packet *pkt)
       .byte = type
   };
 
-  if (header.bits.type == DISCONNECT 
-      || header.bits.type == PINGREQ
-      || header.bits.type == PINGRESP) {
+  int lenght_bytes = mqtt_decode_lenght_window(buf + 1, size - 1, &len);
+
+  if (lenght_bytes <= 0 || len > size - 1 - lenght_bytes) {
+    return -1;
+  }
+
+  if (header.bits.type == DISCONNECT || header.bits.type == PINGREQ) {
     pkt->header = header;
-  } else {
+  } else if (header.bits.type < sizeof(unpack_handlers) /
+             sizeof(*unpack_handlers) && unpack_handlers[header.bits.type]) {
     /* Call the appropiate unpack handler based on the message type */
-    rc = unpack_handlers[header.bits.type](++buf, &header, pkt);
+    rc = unpack_handlers[header.bits.type](++buf, &header, pkt, version);
+  } else {
+    rc = -1;
   }
 
   return rc;
 }
 
+/* The frame is trusted to hold as many bytes as its header announces */
+int unpack_mqtt_packet(const unsigned char *buf, union mqtt_packet *pkt)
+{
+  size_t len = 0;
+  int lenght_bytes = mqtt_decode_lenght_window(buf + 1, MAX_LEN_BYTES, &len);
+
+  if (lenght_bytes <= 0) {
+    return -1;
+  }
+
+  return unpack_mqtt_packet_version(buf, 1 + lenght_bytes + len, pkt,
+                                    MQTT_V311);
+}
+
 /*
  * MQTT packets building functions
  */ 
@@ -429,15 +1015,22 @@ void mqtt_packet_release(union mqtt_packet *pkt, unsigned type)
       }
       break;
     case SUBSCRIBE:
-    case UNSUSCRIBE:
       for (unsigned i = 0; i < pkt->subscribe.tuples_len; i++) {
         free(pkt->subscribe.tuples[i].topic);
       }
       free(pkt->subscribe.tuples);
       break;
+    /* Tuples have a different layout, they carry no QoS */
+    case UNSUSCRIBE:
+      for (unsigned i = 0; i < pkt->unsuscribe.tuples_len; i++) {
+        free(pkt->unsuscribe.tuples[i].topic);
+      }
+      free(pkt->unsuscribe.tuples);
+      break;
     case PUBLISH:
       free(pkt->publish.topic);
       free(pkt->publish.payload);
+      stream_blob_put(pkt->publish.blob);
       break;
     default:
       break;
@@ -448,7 +1041,8 @@ void mqtt_packet_release(union mqtt_packet *pkt, unsigned type)
  * MQTT packets packing functions
  */ 
 
-typedef unsigned char *mqtt_pack_handler(const union mqtt_packet *);
+typedef unsigned char *mqtt_pack_handler(const union mqtt_packet *,
+                                         unsigned char, size_t *);
 
 static mqtt_pack_handler *pack_handlers[13] = {
   NULL,
@@ -466,7 +1060,52 @@ static mqtt_pack_handler *pack_handlers[13] = {
   NULL
 };
 
-static unsigned char *pack_mqtt_header(const union mqtt_header *hdr)
+/*
+ * Fixed size replies never change but for a couple of bytes, so they are
+ * all built at compile time. The remaining lenght of a CONNACK is always 2.
+ */
+const unsigned char mqtt_pingresp_frame[MQTT_HEADER_LEN] = {
+  PINGRESP_BYTE, 0
+};
+
+#define CONNACK_FRAME(sp, rc)   { CONNACK_BYTE, MQTT_HEADER_LEN, (sp), (rc) }
+
+static const unsigned char connack_frames[2][MQTT_CONNACK_MAX_RC + 1]
+                                         [MQTT_ACK_LEN] = {
+  {
+    CONNACK_FRAME(0, 0), CONNACK_FRAME(0, 1), CONNACK_FRAME(0, 2),
+    CONNACK_FRAME(0, 3), CONNACK_FRAME(0, 4), CONNACK_FRAME(0, 5)
+  },
+  {
+    CONNACK_FRAME(1, 0), CONNACK_FRAME(1, 1), CONNACK_FRAME(1, 2),
+    CONNACK_FRAME(1, 3), CONNACK_FRAME(1, 4), CONNACK_FRAME(1, 5)
+  }
+};
+
+const unsigned char *mqtt_connack_frame(unsigned char session_present,
+                                        unsigned char rc)
+{
+  if (rc > MQTT_CONNACK_MAX_RC) {
+    return NULL;
+  }
+
+  return connack_frames[session_present & 1][rc];
+}
+
+size_t mqtt_pack_ack(unsigned char *buf, unsigned char byte,
+                     unsigned short pkt_id)
+{
+  unsigned char *ptr = buf;
+
+  pack_u8(&ptr, byte);
+  pack_u8(&ptr, MQTT_HEADER_LEN);
+  pack_u16(&ptr, pkt_id);
+
+  return MQTT_ACK_LEN;
+}
+
+static unsigned char *pack_mqtt_header(const union mqtt_header *hdr,
+                                       size_t *size)
 {
   unsigned char *packed = malloc(MQTT_HEADER_LEN);
   unsigned char *ptr = packed;
@@ -474,56 +1113,83 @@ static unsigned char *pack_mqtt_header(const union mqtt_header *hdr)
 
   /* Encode 0 lenght bytes, message like this have only a fixed header */
   mqtt_encode_lenght(ptr, 0);
+  *size = MQTT_HEADER_LEN;
   return packed;
 }
 
-static unsigned char *pack_mqtt_ack (const union mqtt_packet *pkt)
+static unsigned char *pack_mqtt_ack (const union mqtt_packet *pkt,
+                                     unsigned char version, size_t *size)
 {
-  unsigned char *packed = malloc(MQTT_ACK_LEN);
-  unsigned char *ptr = packed;
-
-  pack_u8(&ptr, pkt->ack.header.byte);
-  mqtt_encode_lenght(ptr, MQTT_HEADER_LEN);
+  /* MQTT 5 acks carry a reason code, which can be left out on success */
+  if (version == MQTT_V5 && pkt->ack.rc != 0) {
+    unsigned char *packed = malloc(MQTT_ACK_LEN + 1);
+    unsigned char *ptr = packed;
+    pack_u8(&ptr, pkt->ack.header.byte);
+    pack_u8(&ptr, MQTT_HEADER_LEN + 1);
+    pack_u16(&ptr, pkt->ack.pkt_id);
+    pack_u8(&ptr, pkt->ack.rc);
+    *size = MQTT_ACK_LEN + 1;
+    return packed;
+  }
 
-  ptr++;
+  unsigned char *packed = malloc(MQTT_ACK_LEN);
 
-  pack_u16(&ptr, pkt->ack.pkt_id);
+  *size = mqtt_pack_ack(packed, pkt->ack.header.byte, pkt->ack.pkt_id);
 
   return packed;
 }
 
-static unsigned char *pack_mqtt_connack (const union mqtt_packet *pkt)
+static unsigned char *pack_mqtt_connack (const union mqtt_packet *pkt,
+                                         unsigned char version, size_t *size)
 {
-  unsigned char *packed = malloc(MQTT_ACK_LEN);
-  unsigned char *ptr = packed;
+  size_t len = MQTT_HEADER_LEN;
 
-  pack_u8(&ptr, pkt->connack.header.byte);
-  mqtt_encode_lenght(ptr, MQTT_HEADER_LEN);
+  if (version == MQTT_V5) {
+    len += mqtt_properties_size(&pkt->connack.properties);
+  }
+
+  *size = 1 + mqtt_lenght_bytes(len) + len;
 
-  ptr++;
+  unsigned char *packed = malloc(*size);
+  unsigned char *ptr = packed;
 
+  pack_u8(&ptr, pkt->connack.header.byte);
+  ptr += mqtt_encode_lenght(ptr, len);
   pack_u8(&ptr, pkt->connack.byte);
   pack_u8(&ptr, pkt->connack.rc);
 
+  if (version == MQTT_V5) {
+    mqtt_pack_properties(&ptr, &pkt->connack.properties);
+  }
+
   return packed;
 }
 
-static unsigned char *pack_mqtt_suback (const union mqtt_packet *pkt)
+/* Also used for MQTT 5 UNSUBACK, which carries a reason code per filter */
+static unsigned char *pack_mqtt_suback (const union mqtt_packet *pkt,
+                                        unsigned char version, size_t *size)
 {
-  size_t pktlen = MQTT_HEADER_LEN + sizeof(uint16_t) + pkt->suback.rcslen;
+  size_t len = sizeof(uint16_t) + pkt->suback.rcslen;
 
-  unsigned char *packed = malloc(pktlen + 0);
-  unsigned char *ptr = packed;
+  /* No properties, just their zero lenght */
+  if (version == MQTT_V5) {
+    len++;
+  }
 
-  pack_u8(&ptr, pkt->suback.header.byte);
+  *size = 1 + mqtt_lenght_bytes(len) + len;
 
-  size_t len = sizeof(uint16_t) + pkt->suback.rcslen;
-  int step = mqtt_encode_lenght(ptr, len);
+  unsigned char *packed = malloc(*size);
+  unsigned char *ptr = packed;
 
-  ptr += step;
+  pack_u8(&ptr, pkt->suback.header.byte);
+  ptr += mqtt_encode_lenght(ptr, len);
 
   pack_u16(&ptr, pkt->suback.pkt_id);
 
+  if (version == MQTT_V5) {
+    pack_u8(&ptr, 0);
+  }
+
   for (int i = 0; i < pkt->suback.rcslen; i++) {
     pack_u8(&ptr, pkt->suback.rcs[i]);
   }
@@ -531,68 +1197,111 @@ static unsigned char *pack_mqtt_suback (const union mqtt_packet *pkt)
   return packed;
 }
 
-static unsigned char *pack_mqtt_publish(const union mqtt_packet *pkt)
+/* Remaining lenght of a PUBLISH, its payload included */
+static size_t publish_remaining(const union mqtt_packet *pkt,
+                                unsigned char version)
 {
-  /*
-   * We must calculate the total lenght of the packet including header
-   * and lenght field of the fixed header part
-   */
-  size_t pktlen = MQTT_HEADER_LEN + sizeof(uint16_t) + 
-      pkt->publish.topiclen + pkt->publish.payloadlen;
-
-  /* Total len of the packet including fixed header len */
-
-  size_t len = 0L;
+  size_t len = sizeof(uint16_t) + pkt->publish.topiclen
+      + pkt->publish.payloadlen;
 
   if (pkt->header.bits.qos > AT_MOST_ONCE) {
-    pktlen += sizeof(uint16_t);
+    len += sizeof(uint16_t);
   }
 
-  int remaining_offset = 0;
-
-  if ((pktlen - 1) > 0x200000) {
-    remaining_offset = 3;
-  } else if ((pktlen - 1) > 0x4000) {
-    remaining_offset = 2;
-  } else if ((pktlen - 1) > 0x80) {
-    remaining_offset = 1;
+  if (version == MQTT_V5) {
+    len += mqtt_properties_size(&pkt->publish.properties);
   }
 
-  pktlen += remaining_offset;
+  return len;
+}
 
-  unsigned char *packed = malloc(pktlen);
-  unsigned char *ptr = packed;
+size_t mqtt_publish_size(const union mqtt_packet *pkt, unsigned char version)
+{
+  size_t len = publish_remaining(pkt, version);
+  size_t lenght_bytes = mqtt_lenght_bytes(len);
 
-  pack_u8(&ptr, pkt->publish.header.byte);
+  if (lenght_bytes == 0) {
+    return 0;
+  }
 
-  /* Total len of the packet excluding fixed header len */
-  len += (pktlen - MQTT_HEADER_LEN - remaining_offset);
+  /* A streamed payload is not copied, it follows the headers on the wire */
+  if (pkt->publish.blob) {
+    return 1 + lenght_bytes + len - pkt->publish.payloadlen;
+  }
 
-  /* 
-   * TODO handle case where step is > 1, e.g. when longer than 
-   * 128 bytes is published
-   */
-  int step = mqtt_encode_lenght(ptr, len);
-  ptr += step;
+  return 1 + lenght_bytes + len;
+}
+
+void mqtt_pack_publish(unsigned char *buf, const union mqtt_packet *pkt,
+                       unsigned char version)
+{
+  unsigned char *ptr = buf;
+
+  pack_u8(&ptr, pkt->publish.header.byte);
+  ptr += mqtt_encode_lenght(ptr, publish_remaining(pkt, version));
 
-  /* Topic len followed by topic name in bytes */
+  /* Topic len followed by topic name in bytes, empty if sent as an alias */
   pack_u16(&ptr, pkt->publish.topiclen);
-  pack_bytes(&ptr, pkt->publish.topic);
+  memcpy(ptr, pkt->publish.topic, pkt->publish.topiclen);
+  ptr += pkt->publish.topiclen;
 
   /* Packet id */
   if (pkt->header.bits.qos > AT_MOST_ONCE) {
     pack_u16(&ptr, pkt->publish.pkt_id);
   }
 
-  pack_bytes(&ptr, pkt->publish.payload);
+  if (version == MQTT_V5) {
+    mqtt_pack_properties(&ptr, &pkt->publish.properties);
+  }
+
+  /* Payload is binary, it can't be measured with strlen */
+  if (!pkt->publish.blob) {
+    memcpy(ptr, pkt->publish.payload, pkt->publish.payloadlen);
+  }
+}
+
+/*
+ * Remaining lenght is known up front, so is the size of the field storing
+ * it, the packet is written once in a buffer of the exact size
+ */
+static unsigned char *pack_mqtt_publish(const union mqtt_packet *pkt,
+                                        unsigned char version, size_t *size)
+{
+  if ((*size = mqtt_publish_size(pkt, version)) == 0) {
+    return NULL;
+  }
+
+  unsigned char *packed = malloc(*size);
+
+  if (packed) {
+    mqtt_pack_publish(packed, pkt, version);
+  }
+
   return packed;
 }
 
-unsigned char *pack_mqtt_packet(const union mqtt_packet *pkt, unsigned type)
+unsigned char *pack_mqtt_packet_version(const union mqtt_packet *pkt,
+                                        unsigned type, unsigned char version,
+                                        size_t *size)
 {
+  size_t ignored;
+
+  if (!size) {
+    size = &ignored;
+  }
+
   if (type == PINGREQ || type == PINGRESP) {
-    return pack_mqtt_header(&pkt->header);
+    return pack_mqtt_header(&pkt->header, size);
+  }
+
+  if (version == MQTT_V5 && type == UNSUBACK) {
+    return pack_mqtt_suback(pkt, version, size);
   }
 
-  return pack_handlers[type](pkt);
+  return pack_handlers[type](pkt, version, size);
+}
+
+unsigned char *pack_mqtt_packet(const union mqtt_packet *pkt, unsigned type)
+{
+  return pack_mqtt_packet_version(pkt, type, MQTT_V311, NULL);
 }
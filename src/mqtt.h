@@ -2,10 +2,23 @@
 #define MQTT_H
 
 #include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 #define MQTT_HEADER_LEN 2
 #define MQTT_ACK_LEN    4
 
+/*
+ * Largest remaining lenght, 4 bytes of 7 bits each, and the value returned
+ * decoding a field that doesn't fit in them
+ */
+#define MQTT_MAX_LENGHT         268435455
+#define MQTT_LENGHT_MALFORMED   ((unsigned long long) -1)
+
+/* Protocol levels carried by CONNECT, 3.1.1 and 5 */
+#define MQTT_V311       4
+#define MQTT_V5         5
+
 /*************************************************************
  * Stub bytes, useful for generic replies these represent
  * the first byte in the fixed header.
@@ -19,7 +32,7 @@
 #define PUBCOMP_BYTE    0x70
 #define SUBACK_BYTE     0x90
 #define UNSUBACK_BTYE   0x80
-#define PINGRESP_BYTE   0x00
+#define PINGRESP_BYTE   0xD0
 
 /************************************************************
  *                      Message types
@@ -47,6 +60,60 @@ enum qos_level {
   EXACTLY_ONCE
 };
 
+/************************************************************
+ *                  MQTT 5 properties
+ ***********************************************************/
+enum mqtt_property_id {
+  MQTT_PROP_PAYLOAD_FORMAT          = 0x01,
+  MQTT_PROP_MESSAGE_EXPIRY          = 0x02,
+  MQTT_PROP_CONTENT_TYPE            = 0x03,
+  MQTT_PROP_RESPONSE_TOPIC          = 0x08,
+  MQTT_PROP_CORRELATION_DATA        = 0x09,
+  MQTT_PROP_SUBSCRIPTION_ID         = 0x0B,
+  MQTT_PROP_SESSION_EXPIRY          = 0x11,
+  MQTT_PROP_ASSIGNED_CLIENT_ID      = 0x12,
+  MQTT_PROP_SERVER_KEEPALIVE        = 0x13,
+  MQTT_PROP_AUTH_METHOD             = 0x15,
+  MQTT_PROP_AUTH_DATA               = 0x16,
+  MQTT_PROP_REQUEST_PROBLEM_INFO    = 0x17,
+  MQTT_PROP_WILL_DELAY              = 0x18,
+  MQTT_PROP_REQUEST_RESPONSE_INFO   = 0x19,
+  MQTT_PROP_RESPONSE_INFO           = 0x1A,
+  MQTT_PROP_SERVER_REFERENCE        = 0x1C,
+  MQTT_PROP_REASON_STRING           = 0x1F,
+  MQTT_PROP_RECEIVE_MAXIMUM         = 0x21,
+  MQTT_PROP_TOPIC_ALIAS_MAXIMUM     = 0x22,
+  MQTT_PROP_TOPIC_ALIAS             = 0x23,
+  MQTT_PROP_MAXIMUM_QOS             = 0x24,
+  MQTT_PROP_RETAIN_AVAILABLE        = 0x25,
+  MQTT_PROP_USER_PROPERTY           = 0x26,
+  MQTT_PROP_MAXIMUM_PACKET_SIZE     = 0x27,
+  MQTT_PROP_WILDCARD_SUB_AVAILABLE  = 0x28,
+  MQTT_PROP_SUB_ID_AVAILABLE        = 0x29,
+  MQTT_PROP_SHARED_SUB_AVAILABLE    = 0x2A
+};
+
+#define MQTT_PROP_MAX       MQTT_PROP_SHARED_SUB_AVAILABLE
+
+/* Check if a property was present in a decoded set or is to be encoded */
+#define MQTT_PROP_HAS(props, id)    (((props)->set >> (id)) & 1)
+#define MQTT_PROP_SET(props, id)    ((props)->set |= 1ULL << (id))
+
+/*
+ * Properties the broker acts upon, decoded in place. Every other property is
+ * validated and skipped, encoding writes only the ones flagged in set.
+ */
+struct mqtt_properties {
+  uint64_t set;
+  uint8_t payload_format;
+  uint32_t message_expiry;
+  uint32_t session_expiry;
+  uint16_t receive_maximum;
+  uint32_t maximum_packet_size;
+  uint16_t topic_alias_maximum;
+  uint16_t topic_alias;
+};
+
 union mqtt_header {
   unsigned char byte;
   struct {
@@ -72,6 +139,10 @@ struct mqtt_connect {
     } bits;
   };
 
+  /* Protocol level, MQTT_V311 or MQTT_V5 */
+  unsigned char version;
+  struct mqtt_properties properties;
+
   struct {
     unsigned short keepalive;
     unsigned char *client_id;
@@ -92,6 +163,7 @@ struct mqtt_connack {
     } btis;
   };
   unsigned char rc;
+  struct mqtt_properties properties;
 };
 
 struct mqtt_subscribe {
@@ -122,18 +194,28 @@ struct mqtt_suback {
   unsigned char *rcs;
 };
 
+struct stream_blob;
+
 struct mqtt_publish {
   union mqtt_header header;
   unsigned short pkt_id;
   unsigned short topiclen;
   unsigned char *topic;
-  unsigned short payloadlen;
+  size_t payloadlen;
   unsigned char *payload;
+  struct mqtt_properties properties;
+  /*
+   * Streamed payload, set instead of payload for large messages, packing
+   * writes only the headers then and the payload is sent from the blob.
+   */
+  struct stream_blob *blob;
 };
 
 struct mqtt_ack {
   union mqtt_header header;
   unsigned short pkt_id;
+  /* Reason code, MQTT 5 only, 0 if left out */
+  unsigned char rc;
 };
 
 typedef struct mqtt_ack mqtt_puback;
@@ -159,11 +241,49 @@ union mqtt_packet {
 /****************************************************************
  *                  Important functions
  ***************************************************************/
+size_t mqtt_lenght_bytes(size_t);
 int mqtt_encode_lenght(unsigned char *, size_t);
+int mqtt_decode_lenght_window(const unsigned char *, size_t, size_t *);
 unsigned long long mqtt_decode_lenght(const unsigned char **);
 int unpack_mqtt_packet(const unsigned char *, union mqtt_packet *);
 unsigned char* pack_mqtt_packet(const union mqtt_packet *, unsigned);
 
+/*
+ * Versioned codec, packets other than CONNECT don't say which protocol level
+ * they follow, it's the one the connection agreed on. The unversioned calls
+ * above are MQTT v3.1.1, CONNECT is decoded by the level it carries anyway.
+ * Packing returns the packet size in the last argument, if not NULL. MQTT 5
+ * UNSUBACK is packed from a struct mqtt_suback, a reason code per filter.
+ * Unpacking is given the bytes received, the frame must fit in them.
+ */
+int unpack_mqtt_packet_version(const unsigned char *, size_t,
+                               union mqtt_packet *, unsigned char);
+unsigned char *pack_mqtt_packet_version(const union mqtt_packet *, unsigned,
+                                        unsigned char, size_t *);
+
+/*
+ * Decode a MQTT 5 property block, lenght included, out of at most avail
+ * bytes. Returns the bytes it takes, -1 if malformed: truncated, unknown
+ * identifier, repeated property or invalid value.
+ */
+ssize_t mqtt_unpack_properties(const unsigned char *, size_t,
+                               struct mqtt_properties *);
+
+/*
+ * Lenght of the fixed and variable headers of a PUBLISH, everything but the
+ * payload, out of at most avail bytes of it. If avail doesn't cover them
+ * the return value is a lower bound, the call is to be repeated with at
+ * least that many bytes. Returns -1 if malformed.
+ */
+ssize_t mqtt_publish_header_lenght(const unsigned char *, size_t,
+                                   unsigned char);
+
+/* Size of the encoded property block, lenght included */
+size_t mqtt_properties_size(const struct mqtt_properties *);
+
+/* Write the property block, lenght included, advancing the pointer */
+void mqtt_pack_properties(unsigned char **, const struct mqtt_properties *);
+
 /****************************************************************
  * Utility functions
  ***************************************************************/
@@ -178,4 +298,35 @@ struct mqtt_publish *mqtt_packet_publish(unsigned char, unsigned short, size_t,
                                          unsigned char *);
 void mqtt_packet_release(union mqtt_packet *, unsigned);
 
+/****************************************************************
+ * Fast reply path, fixed size packets served without allocating
+ ***************************************************************/
+
+/* Highest CONNACK return code, 5 is "not authorized" */
+#define MQTT_CONNACK_MAX_RC     5
+
+/* Complete PINGRESP frame, header byte followed by a zero lenght */
+extern const unsigned char mqtt_pingresp_frame[MQTT_HEADER_LEN];
+
+/*
+ * Return the static CONNACK frame, MQTT_ACK_LEN bytes long, matching the
+ * session present flag and return code, NULL if the code is unknown.
+ */
+const unsigned char *mqtt_connack_frame(unsigned char, unsigned char);
+
+/*
+ * Write an ack packet, PUBACK, PUBREC, PUBREL, PUBCOMP or UNSUBACK, into a
+ * caller buffer of at least MQTT_ACK_LEN bytes and return its size.
+ */
+size_t mqtt_pack_ack(unsigned char *, unsigned char, unsigned short);
+
+/*
+ * Size of a PUBLISH packed for a protocol version, a streamed payload left
+ * out, 0 if it is too long for the protocol. mqtt_pack_publish writes it
+ * into a caller buffer of that size, e.g. one of the arena.
+ */
+size_t mqtt_publish_size(const union mqtt_packet *, unsigned char);
+void mqtt_pack_publish(unsigned char *, const union mqtt_packet *,
+                       unsigned char);
+
 #endif
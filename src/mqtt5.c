@@ -0,0 +1,299 @@
+#include <stdlib.h>
+#include <string.h>
+#include "intern.h"
+#include "mqtt5.h"
+
+/* Lookup buckets are kept at most half full */
+#define LOAD_FACTOR     2
+
+int mqtt5_state_init(struct mqtt5_state *state,
+                     const struct mqtt_connect *connect, uint16_t alias_in_max)
+{
+  const struct mqtt_properties *props = &connect->properties;
+
+  memset(state, 0, sizeof(*state));
+  state->version = connect->version == MQTT_V5 ? MQTT_V5 : MQTT_V311;
+  state->receive_maximum = MQTT5_RECEIVE_MAXIMUM;
+  state->maximum_packet_size = MQTT5_MAX_PACKET_SIZE;
+
+  if (state->version != MQTT_V5) {
+    return 0;
+  }
+
+  if (MQTT_PROP_HAS(props, MQTT_PROP_RECEIVE_MAXIMUM)) {
+    state->receive_maximum = props->receive_maximum;
+  }
+
+  if (MQTT_PROP_HAS(props, MQTT_PROP_MAXIMUM_PACKET_SIZE)) {
+    state->maximum_packet_size = props->maximum_packet_size;
+  }
+
+  if (alias_in_max > 0) {
+    state->alias_in = calloc(alias_in_max, sizeof(*state->alias_in));
+    if (!state->alias_in) {
+      return -1;
+    }
+    state->alias_in_max = alias_in_max;
+  }
+
+  uint16_t alias_out_max = props->topic_alias_maximum;
+
+  if (alias_out_max > MQTT5_ALIAS_OUT_MAX) {
+    alias_out_max = MQTT5_ALIAS_OUT_MAX;
+  }
+
+  if (alias_out_max > 0) {
+    size_t buckets = 1;
+    while (buckets < (size_t) alias_out_max * LOAD_FACTOR) {
+      buckets <<= 1;
+    }
+    state->alias_out = calloc(alias_out_max, sizeof(*state->alias_out));
+    state->buckets = calloc(buckets, sizeof(*state->buckets));
+    if (!state->alias_out || !state->buckets) {
+      mqtt5_state_release(state);
+      return -1;
+    }
+    state->alias_out_max = alias_out_max;
+    state->buckets_nr = buckets;
+  }
+
+  return 0;
+}
+
+void mqtt5_state_release(struct mqtt5_state *state)
+{
+  for (uint16_t i = 0; i < state->alias_in_max; i++) {
+    free(state->alias_in[i].topic);
+  }
+
+  for (uint16_t i = 0; i < state->alias_out_nr; i++) {
+    free(state->alias_out[i].topic);
+  }
+
+  free(state->alias_in);
+  free(state->alias_out);
+  free(state->buckets);
+  state->alias_in = NULL;
+  state->alias_out = NULL;
+  state->buckets = NULL;
+  state->alias_in_max = 0;
+  state->alias_out_max = 0;
+  state->alias_out_nr = 0;
+}
+
+void mqtt5_connack_properties(const struct mqtt5_state *state,
+                              struct mqtt_properties *props,
+                              uint16_t receive_maximum,
+                              uint32_t maximum_packet_size)
+{
+  memset(props, 0, sizeof(*props));
+
+  props->receive_maximum = receive_maximum;
+  MQTT_PROP_SET(props, MQTT_PROP_RECEIVE_MAXIMUM);
+
+  props->maximum_packet_size = maximum_packet_size;
+  MQTT_PROP_SET(props, MQTT_PROP_MAXIMUM_PACKET_SIZE);
+
+  if (state->alias_in_max > 0) {
+    props->topic_alias_maximum = state->alias_in_max;
+    MQTT_PROP_SET(props, MQTT_PROP_TOPIC_ALIAS_MAXIMUM);
+  }
+}
+
+int mqtt5_alias_in(struct mqtt5_state *state, struct mqtt_publish *publish)
+{
+  if (!MQTT_PROP_HAS(&publish->properties, MQTT_PROP_TOPIC_ALIAS)) {
+    return 0;
+  }
+
+  uint16_t alias = publish->properties.topic_alias;
+
+  if (alias == 0 || alias > state->alias_in_max) {
+    return -1;
+  }
+
+  struct mqtt5_alias *entry = &state->alias_in[alias - 1];
+
+  /* Topic with an alias, (re)define it */
+  if (publish->topiclen > 0) {
+    char *topic = malloc(publish->topiclen + 1);
+    if (!topic) {
+      return -1;
+    }
+    memcpy(topic, publish->topic, publish->topiclen + 1);
+    free(entry->topic);
+    entry->topic = topic;
+    entry->len = publish->topiclen;
+    return 0;
+  }
+
+  if (!entry->topic) {
+    return -1;
+  }
+
+  /* Alias only, the packet owns its topic as if it had been sent */
+  unsigned char *topic = malloc(entry->len + 1);
+
+  if (!topic) {
+    return -1;
+  }
+
+  memcpy(topic, entry->topic, entry->len + 1);
+  free(publish->topic);
+  publish->topic = topic;
+  publish->topiclen = entry->len;
+
+  return 0;
+}
+
+/*
+ * Bucket holding the alias of a topic, or the empty one where it would go,
+ * aliases start from 1 so that zero marks an empty bucket.
+ */
+static size_t bucket_find(const struct mqtt5_state *state, uint64_t hash,
+                          const char *topic, size_t len)
+{
+  size_t mask = state->buckets_nr - 1;
+  size_t i = hash & mask;
+
+  while (state->buckets[i] != 0) {
+    const struct mqtt5_alias *entry = &state->alias_out[state->buckets[i] - 1];
+    if (entry->hash == hash && entry->len == len &&
+        memcmp(entry->topic, topic, len) == 0) {
+      break;
+    }
+    i = (i + 1) & mask;
+  }
+
+  return i;
+}
+
+/* Linear probing removal, shift back the entries displaced past the hole */
+static void bucket_delete(struct mqtt5_state *state, size_t i)
+{
+  size_t mask = state->buckets_nr - 1;
+  size_t j = i;
+
+  while (1) {
+    j = (j + 1) & mask;
+    if (state->buckets[j] == 0) {
+      break;
+    }
+    size_t home = state->alias_out[state->buckets[j] - 1].hash & mask;
+    /* Move it only if its home is not between the hole and itself */
+    if ((j > i && (home <= i || home > j)) ||
+        (j < i && home <= i && home > j)) {
+      state->buckets[i] = state->buckets[j];
+      i = j;
+    }
+  }
+
+  state->buckets[i] = 0;
+}
+
+/* Bind a topic to an alias, evicting the topic it was bound to if any */
+static int alias_assign(struct mqtt5_state *state, uint16_t alias,
+                        uint64_t hash, const char *topic, size_t len)
+{
+  struct mqtt5_alias *entry = &state->alias_out[alias - 1];
+  char *copy = malloc(len + 1);
+
+  if (!copy) {
+    return -1;
+  }
+
+  memcpy(copy, topic, len);
+  copy[len] = '\0';
+
+  if (entry->topic) {
+    bucket_delete(state, bucket_find(state, entry->hash,
+                                     entry->topic, entry->len));
+    free(entry->topic);
+  } else {
+    state->alias_out_nr++;
+  }
+
+  entry->hash = hash;
+  entry->topic = copy;
+  entry->len = len;
+  state->buckets[bucket_find(state, hash, topic, len)] = alias;
+
+  return 0;
+}
+
+/* Packed size of a PUBLISH with a topic of the given lenght, 0 if too big */
+static size_t publish_size(const struct mqtt5_state *state,
+                           const struct mqtt_publish *publish, size_t topiclen)
+{
+  size_t len = sizeof(uint16_t) + topiclen + publish->payloadlen;
+
+  if (publish->header.bits.qos > AT_MOST_ONCE) {
+    len += sizeof(uint16_t);
+  }
+
+  if (state->version == MQTT_V5) {
+    len += mqtt_properties_size(&publish->properties);
+  }
+
+  size_t lenght_bytes = mqtt_lenght_bytes(len);
+  size_t size = 1 + lenght_bytes + len;
+
+  return lenght_bytes == 0 || size > state->maximum_packet_size ? 0 : size;
+}
+
+size_t mqtt5_publish_out(struct mqtt5_state *state,
+                         struct mqtt_publish *publish)
+{
+  if (state->alias_out_max == 0) {
+    return publish_size(state, publish, publish->topiclen);
+  }
+
+  const char *topic = (const char *) publish->topic;
+  uint64_t hash = intern_hash(topic, publish->topiclen);
+  size_t i = bucket_find(state, hash, topic, publish->topiclen);
+  int known = state->buckets[i] != 0;
+
+  publish->properties.topic_alias =
+      known ? state->buckets[i] : state->alias_out_next + 1;
+  MQTT_PROP_SET(&publish->properties, MQTT_PROP_TOPIC_ALIAS);
+
+  size_t size = publish_size(state, publish, known ? 0 : publish->topiclen);
+
+  if (size == 0) {
+    return 0;
+  }
+
+  if (known) {
+    publish->topiclen = 0;
+    return size;
+  }
+
+  if (alias_assign(state, publish->properties.topic_alias, hash, topic,
+                   publish->topiclen) < 0) {
+    /* Send the topic in full, without an alias */
+    publish->properties.set &= ~(1ULL << MQTT_PROP_TOPIC_ALIAS);
+    return publish_size(state, publish, publish->topiclen);
+  }
+
+  state->alias_out_next = (state->alias_out_next + 1) % state->alias_out_max;
+
+  return size;
+}
+
+int mqtt5_inflight_acquire(struct mqtt5_state *state)
+{
+  if (state->inflight >= state->receive_maximum) {
+    return -1;
+  }
+
+  state->inflight++;
+
+  return 0;
+}
+
+void mqtt5_inflight_release(struct mqtt5_state *state)
+{
+  if (state->inflight > 0) {
+    state->inflight--;
+  }
+}
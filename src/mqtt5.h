@@ -0,0 +1,95 @@
+#ifndef MQTT5_H
+#define MQTT5_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "mqtt.h"
+
+/*
+ * Per-connection MQTT 5 state: topic alias tables in both directions and the
+ * limits a client sets on what the broker sends it, Receive Maximum for the
+ * QoS > 0 messages in flight and Maximum Packet Size.
+ *
+ * Topic aliases replace the topic of a PUBLISH with a 2 bytes integer once
+ * both ends know it, which matters when topics are longer than payloads.
+ * Outbound aliases are looked up by topic in an open addressing table and
+ * reassigned round-robin once the client limit is reached.
+ *
+ * MQTT v3.1.1 connections get a state too, with aliases disabled and no
+ * limits, so the delivery path needs no version checks.
+ */
+
+/* Topic aliases accepted from a client, advertised in CONNACK */
+#define MQTT5_ALIAS_IN_MAX      64
+
+/* Most outbound aliases kept per connection, whatever the client allows */
+#define MQTT5_ALIAS_OUT_MAX     256
+
+/* Receive Maximum and Maximum Packet Size when the client sets none */
+#define MQTT5_RECEIVE_MAXIMUM   65535
+#define MQTT5_MAX_PACKET_SIZE   (MQTT_MAX_LENGHT + 5)
+
+struct mqtt5_alias {
+  uint64_t hash;
+  char *topic;
+  size_t len;
+};
+
+struct mqtt5_state {
+  unsigned char version;
+  /* Inbound aliases, indexed by alias - 1, set by the client */
+  uint16_t alias_in_max;
+  struct mqtt5_alias *alias_in;
+  /* Outbound aliases, indexed by alias - 1, and their lookup by topic */
+  uint16_t alias_out_max;
+  uint16_t alias_out_nr;
+  uint16_t alias_out_next;
+  struct mqtt5_alias *alias_out;
+  size_t buckets_nr;
+  uint16_t *buckets;
+  /* Flow control requested by the client */
+  uint16_t receive_maximum;
+  uint16_t inflight;
+  uint32_t maximum_packet_size;
+};
+
+/*
+ * Set up the state of a connection from its CONNECT, accepting up to the
+ * given number of inbound aliases. Returns -1 on allocation failure.
+ */
+int mqtt5_state_init(struct mqtt5_state *, const struct mqtt_connect *,
+                     uint16_t);
+
+void mqtt5_state_release(struct mqtt5_state *);
+
+/*
+ * Properties of the CONNACK answering the connection: the broker Receive
+ * Maximum and Maximum Packet Size given, and the inbound alias limit.
+ */
+void mqtt5_connack_properties(const struct mqtt5_state *,
+                              struct mqtt_properties *, uint16_t, uint32_t);
+
+/*
+ * Resolve the topic alias of an incoming PUBLISH: a topic with an alias
+ * sets it, an empty topic is replaced by a copy of the one set. Returns -1
+ * on protocol error, alias out of range or never set.
+ */
+int mqtt5_alias_in(struct mqtt5_state *, struct mqtt_publish *);
+
+/*
+ * Prepare an outgoing PUBLISH, the caller own copy of it, and return its
+ * packed size. A topic alias is assigned or reused, the topic is left out
+ * if the client already knows it. Returns 0 if the packet exceeds the client
+ * Maximum Packet Size, it must be dropped then and no alias is assigned.
+ */
+size_t mqtt5_publish_out(struct mqtt5_state *, struct mqtt_publish *);
+
+/*
+ * Take a slot of the client Receive Maximum window before sending a QoS > 0
+ * PUBLISH, -1 if the window is full and the message has to wait. The slot
+ * is given back on PUBACK or PUBCOMP.
+ */
+int mqtt5_inflight_acquire(struct mqtt5_state *);
+void mqtt5_inflight_release(struct mqtt5_state *);
+
+#endif
@@ -1,11 +1,15 @@
+#define _GNU_SOURCE
 #include <asm-generic/errno-base.h>
 #include <asm-generic/errno.h>
 #include <asm-generic/socket.h>
 #include <cstddef>
 #include <stdio.h>
 #include <string.h>
-#define _DEFAULT_SOURCE 
 #include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <limits.h>
 #include <errno.h>
 #include <netdb.h>
 #include <unistd.h>
@@ -18,9 +22,16 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 #include "network.h"
+#include "zerocopy.h"
+#include "rcu.h"
 //#include "config.h"
 
+/* Memory nodes set_mempolicy is told about, as many as the kernel has */
+#define MEMORY_NODES            1024
+
 /* Set non-blocking socket */
 int set_nonblocking(int fd)
 {
@@ -50,6 +61,76 @@ int set_tcp_nodelay(int fd)
   return setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int) {1}, sizeof(int));
 }
 
+int set_busy_poll(int fd, int usecs)
+{
+  if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(int)) < 0) {
+    return -1;
+  }
+#ifdef SO_PREFER_BUSY_POLL
+  /* Older kernels lack it, busy polling works all the same */
+  (void) setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &(int) {1},
+                    sizeof(int));
+#endif
+  return 0;
+}
+
+int pin_thread(int n)
+{
+  cpu_set_t allowed, cpu;
+
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+    return -1;
+  }
+
+  int count = CPU_COUNT(&allowed);
+
+  if (count == 0 || n < 0) {
+    return -1;
+  }
+
+  n %= count;
+
+  for (int i = 0; i < CPU_SETSIZE; i++) {
+    if (!CPU_ISSET(i, &allowed) || n-- > 0) {
+      continue;
+    }
+    CPU_ZERO(&cpu);
+    CPU_SET(i, &cpu);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu), &cpu) != 0) {
+      return -1;
+    }
+    return i;
+  }
+
+  return -1;
+}
+
+int prefer_local_memory(void)
+{
+  unsigned cpu, node;
+
+  if (getcpu(&cpu, &node) < 0) {
+    return -1;
+  }
+
+  unsigned long mask[MEMORY_NODES / (8 * sizeof(unsigned long))] = { 0 };
+
+  if (node >= MEMORY_NODES) {
+    errno = ERANGE;
+    return -1;
+  }
+
+  /* No libnuma, the system call is all it takes, it reads a bit less */
+  mask[node / (8 * sizeof(unsigned long))] |=
+      1UL << (node % (8 * sizeof(unsigned long)));
+  if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask,
+              (unsigned long) MEMORY_NODES + 1) < 0) {
+    return -1;
+  }
+
+  return node;
+}
+
 static int create_and_bind_unix(const char *sockpath)
 {
   struct sockaddr_un addr;
@@ -72,7 +153,8 @@ static int create_and_bind_unix(const char *sockpath)
   return fd;
 }
 
-static int create_and_bind_tcp(const char *host, const char *port)
+static int create_and_bind_tcp(const char *host, const char *port,
+                               int reuseport)
 {
   struct addrinfo hints = {
     .ai_family = AF_UNSPEC,
@@ -102,6 +184,12 @@ static int create_and_bind_tcp(const char *host, const char *port)
       perror("SO_REUSEADDR");
     }
 
+    /* Sockets of a group bound to the same address share its connections */
+    if (reuseport &&
+        setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0) {
+      perror("SO_REUSEPORT");
+    }
+
     if ((bind(sfd, rp->ai_addr, rp->ai_addrlen)) == 0) {
       /* Succesful bind */
       break;
@@ -123,10 +211,10 @@ static int create_and_bind_tcp(const char *host, const char *port)
 int create_and_bind(const char *host, const char *port, int socket_family)
 {
   int fd;
-  if (socket_family == UNIX) {
+  if (socket_family == UNIX || socket_family == SHM) {
     fd = create_and_bind_unix(host);
   } else {
-    fd = create_and_bind_tcp(host, port);
+    fd = create_and_bind_tcp(host, port, 0);
   }
 
   return fd;
@@ -162,7 +250,34 @@ int make_listen(const char *host, const char *port, int socket_family)
   return sfd;
 }
 
-int accept_connection(int serversock)
+int make_listen_cpu(const char *host, const char *port, int cpu)
+{
+  int sfd = create_and_bind_tcp(host, port, 1);
+
+  if (sfd == -1) {
+    return -1;
+  }
+
+  /*
+   * Preferred by the kernel for the connections whose packets it processes
+   * on that CPU, the other sockets of the group still take the rest
+   */
+  if (cpu >= 0 &&
+      setsockopt(sfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) < 0) {
+    perror("SO_INCOMING_CPU");
+  }
+
+  if (set_nonblocking(sfd) == -1 || listen(sfd, conf->tcp_blacklog) == -1) {
+    close(sfd);
+    return -1;
+  }
+
+  set_tcp_nodelay(sfd);
+
+  return sfd;
+}
+
+int accept_connection(int serversock, int busy_poll)
 {
   int clientsock;
   struct sockaddr_in addr;
@@ -179,6 +294,11 @@ int accept_connection(int serversock)
     set_tcp_nodelay(clientsock);
   }
 
+  /* Best effort, without the capability the loop still spins */
+  if (busy_poll > 0) {
+    (void) set_busy_poll(clientsock, busy_poll);
+  }
+
   char ip_buff[INET_ADDRSTRLEN + 1];
 
   if (inet_ntop(AF_INET, &addr.sin_addr,
@@ -258,6 +378,23 @@ ssize_t recv_bytes(int fd, unsigned char *buf, size_t bufsize)
  **************************************************************************/
 
 #define EVLOOP_INITIAL_SIZE     4
+
+/* Monotonic clock in milliseconds */
+static unsigned long long clock_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/* Monotonic clock in microseconds, to measure the busy poll budget */
+static unsigned long long clock_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
 struct evloop *evloop_create(int max_events, int timeout)
 {
   struct evloop *loop = malloc(sizeof(*loop));
@@ -271,11 +408,19 @@ void evloop_init(struct evloop *loop, int max_events, int timeout)
   loop->events = malloc(sizeof(struct epoll_event) * max_events);
   loop->epollfd = epoll_create1(0);
   loop->timeout = timeout;
+  loop->busy_poll = BUSY_POLL_BUDGET;
+  loop->cpu = -1;
+  loop->node = -1;
   loop->periodic_maxsize = EVLOOP_INITIAL_SIZE;
   loop->periodic_nr = 0;
   loop->periodic_task =
       malloc(EVLOOP_INITIAL_SIZE * sizeof(*loop->periodic_task));
   loop->status = 0;
+  loop->now = clock_ms();
+  loop->deferred_maxsize = 0;
+  loop->deferred_nr = 0;
+  loop->deferred_seq = 0;
+  loop->deferred = NULL;
 }
 
 void evloop_free(struct evloop *loop)
@@ -285,6 +430,7 @@ void evloop_free(struct evloop *loop)
     free(loop->periodic_task[i]);
   }
   free(loop->periodic_task);
+  free(loop->deferred);
   free(loop);
 }
 
@@ -373,67 +519,232 @@ void evloop_add_periodic_task(struct evloop *loop, int seconds,
   loop->periodic_nr++;
 }
 
-int evloop_wait(struct evloop *el)
+static inline int deferred_before(const struct evloop_deferred *a,
+                                  const struct evloop_deferred *b)
+{
+  return a->at < b->at || (a->at == b->at && a->seq < b->seq);
+}
+
+int evloop_defer_callback(struct evloop *el, struct closure *cb,
+                          unsigned long long ms)
+{
+  if (el->deferred_nr == el->deferred_maxsize) {
+    int size = el->deferred_maxsize ?
+        el->deferred_maxsize * 2 : EVLOOP_INITIAL_SIZE;
+    struct evloop_deferred *deferred =
+        realloc(el->deferred, size * sizeof(*deferred));
+    if (!deferred) {
+      return -1;
+    }
+    el->deferred = deferred;
+    el->deferred_maxsize = size;
+  }
+
+  /* Sift up from the last slot */
+  struct evloop_deferred d = {
+    .at = el->now + ms,
+    .seq = el->deferred_seq++,
+    .closure = cb
+  };
+  int i = el->deferred_nr++;
+
+  while (i > 0 && deferred_before(&d, &el->deferred[(i - 1) / 2])) {
+    el->deferred[i] = el->deferred[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+
+  el->deferred[i] = d;
+
+  return 0;
+}
+
+/* Take the earliest deferred closure out of the heap */
+static struct closure *evloop_deferred_pop(struct evloop *el)
+{
+  struct closure *cb = el->deferred[0].closure;
+  struct evloop_deferred last = el->deferred[--el->deferred_nr];
+  int i = 0;
+
+  /* Sift the last entry down from the root */
+  while (2 * i + 1 < el->deferred_nr) {
+    int child = 2 * i + 1;
+    if (child + 1 < el->deferred_nr &&
+        deferred_before(&el->deferred[child + 1], &el->deferred[child])) {
+      child++;
+    }
+    if (!deferred_before(&el->deferred[child], &last)) {
+      break;
+    }
+    el->deferred[i] = el->deferred[child];
+    i = child;
+  }
+
+  if (el->deferred_nr > 0) {
+    el->deferred[i] = last;
+  }
+
+  return cb;
+}
+
+/*
+ * epoll_wait spinning with no timeout for the busy poll budget of the loop
+ * first, then blocking for what is left of the timeout. A loop with no
+ * budget, or asked not to wait, goes straight to the second.
+ */
+static int evloop_epoll_wait(struct evloop *el, int timeout)
+{
+  if (el->busy_poll > 0 && timeout != 0) {
+    unsigned long long start = clock_us(), spun = 0;
+    unsigned long long budget = (unsigned long long) el->busy_poll;
+
+    if (timeout > 0 && budget > timeout * 1000ULL) {
+      budget = timeout * 1000ULL;
+    }
+
+    do {
+      int events = epoll_wait(el->epollfd, el->events, el->max_events, 0);
+      if (events != 0) {
+        return events;
+      }
+      spun = clock_us() - start;
+    } while (spun < budget);
+
+    if (timeout > 0) {
+      timeout -= (int) (spun / 1000);
+      if (timeout <= 0) {
+        return 0;
+      }
+    }
+  }
+
+  return epoll_wait(el->epollfd, el->events, el->max_events, timeout);
+}
+
+int evloop_poll(struct evloop *el, int timeout)
 {
-  int rc = 0;
   int events = 0;
   long int timer = 0L;
   int periodic_done = 0;
 
-  while (1) {
-    events = epoll_wait(el->epollfd, el->events, el->max_events, el->timeout);
-    
-    if (events < 0) {
-      /* Signals to all threads. Ignore it for now */
-      if (errno == EINTR) {
-        continue;
-      }
-      /* Error ocurred, break the loop */
-      rc = -1;
-      el->status = errno;
-      break;
+  /* Loop is a reader of the shared subscription index */
+  rcu_register_thread();
+
+  /* Wake up in time for the earliest deferred callback */
+  if (el->deferred_nr > 0) {
+    unsigned long long at = el->deferred[0].at;
+    unsigned long long left = at > el->now ? at - el->now : 0;
+    int wait = left > INT_MAX ? INT_MAX : (int) left;
+    if (timeout < 0 || wait < timeout) {
+      timeout = wait;
     }
+  }
 
-    for (int i = 0; i < events; i++) {
-      /* Check for erros */
-      if ((el->events[i].events & EPOLLERR) ||
-          (el->events[i].events & EPOLLHUP) ||
-          (!(el->events[i].events & EPOLLIN) &&
-           !(el->events[i].events & EPOLLOUT))) {
-        /* An error has ocurred on this fd, or the socket is not
-         * ready for a reading, closing connection
-         */
-        perror("epoll_wait(2)");
-        shutdown(el->events[i].data.fd, 0);
-        close(el->events[i].data.fd);
-        
-        el->status = errno;
-        continue;
-      }
+  /* Blocking could last forever, don't hold back reclamation meanwhile */
+  rcu_thread_offline();
+  events = evloop_epoll_wait(el, timeout);
+  rcu_thread_online();
 
+  el->now = clock_ms();
+
+  if (events < 0) {
+    /* Signals to all threads. Ignore it for now */
+    if (errno == EINTR) {
+      return 0;
+    }
+    /* Error ocurred */
+    el->status = errno;
+    return -1;
+  }
+
+  for (int i = 0; i < events; i++) {
+    /*
+     * Zerocopy completions wait on the socket error queue, which raises
+     * EPOLLERR alone, leave them to the callback
+     */
+    if (el->events[i].events == EPOLLERR &&
+        ((struct closure *) el->events[i].data.ptr)->zc) {
       struct closure *closure = el->events[i].data.ptr;
-      periodic_done = 0;
-
-      for (int i = 0; i < el->periodic_nr && periodic_done == 0; i++) {
-        if (el->events[i].data.fd == el->periodic_task[i]->timerfd) {
-          struct closure *c = el->periodic_task[i]->closure;
-          (void) read(el->events[i].data.fd, &timer, 8);
-          periodic_done = 1;
-        }
-      }
+      closure->call(el, closure->arg);
+      continue;
+    }
+
+    /* Check for erros */
+    if ((el->events[i].events & EPOLLERR) ||
+        (el->events[i].events & EPOLLHUP) ||
+        (!(el->events[i].events & EPOLLIN) &&
+         !(el->events[i].events & EPOLLOUT))) {
+      /* An error has ocurred on this fd, or the socket is not
+       * ready for a reading, closing connection
+       */
+      perror("epoll_wait(2)");
+      shutdown(el->events[i].data.fd, 0);
+      close(el->events[i].data.fd);
+
+      el->status = errno;
+      continue;
+    }
 
-      if (periodic_done == 1) {
-        continue;
+    struct closure *closure = el->events[i].data.ptr;
+    periodic_done = 0;
+
+    for (int i = 0; i < el->periodic_nr && periodic_done == 0; i++) {
+      if (el->events[i].data.fd == el->periodic_task[i]->timerfd) {
+        struct closure *c = el->periodic_task[i]->closure;
+        (void) read(el->events[i].data.fd, &timer, 8);
+        periodic_done = 1;
       }
+    }
 
-      /* No error events, proceed to run callback */
-      closure->call(el, closure->arg);
+    if (periodic_done == 1) {
+      continue;
     }
+
+    /* No error events, proceed to run callback */
+    closure->call(el, closure->arg);
   }
 
+  /*
+   * Deferred callbacks due, the ones deferred meanwhile come after them and
+   * wait for the next iteration
+   */
+  int due = el->deferred_nr;
+
+  while (due-- > 0 && el->deferred_nr > 0 && el->deferred[0].at <= el->now) {
+    struct closure *closure = evloop_deferred_pop(el);
+    closure->call(el, closure->arg);
+  }
+
+  /*
+   * Quiescent point, no callback of this loop holds references to
+   * rcu-protected data past this line
+   */
+  rcu_quiescent_state();
+
+  return events;
+}
+
+int evloop_wait(struct evloop *el)
+{
+  int rc = 0;
+
+  while (1) {
+    if (evloop_poll(el, el->timeout) < 0) {
+      /* Error ocurred, break the loop */
+      rc = -1;
+      break;
+    }
+  }
+
+  rcu_unregister_thread();
+
   return rc;
 }
 
+void evloop_busy_poll(struct evloop *el, int usecs)
+{
+  el->busy_poll = usecs > 0 ? usecs : 0;
+}
+
 int evloop_rearm_callback_read(struct evloop *el, struct closure *cb)
 {
   return epoll_mod(el->epollfd, cb->fd, EPOLLIN, cb);
@@ -444,9 +755,14 @@ int evloop_rearm_callback_write(struct evloop *el, struct closure *cb)
   return epoll_mod(el->epollfd, cb->fd, EPOLLOUT, cb);
 }
 
+int evloop_rearm_callback_rw(struct evloop *el, struct closure *cb)
+{
+  return epoll_mod(el->epollfd, cb->fd, EPOLLIN | EPOLLOUT, cb);
+}
+
 int evloop_del_callback(struct evloop *el, struct closure *cb)
 {
-  return epoll_del(el->epollfd, cb->fc);
+  return epoll_del(el->epollfd, cb->fd);
 }
 
 
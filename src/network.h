@@ -5,10 +5,16 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include "util.h"
+#include "ratelimit.h"
+#include "outq.h"
 
-/* Socket families */
+/*
+ * Socket families, SHM listens on a UNIX socket for clients on the same host
+ * to set up a shared memory connection, see shm.h
+ */
 #define UNIX    0
 #define INET    1
+#define SHM     2
 
 /* Set non-blocking socket */
 int set_nonblocking(int);
@@ -20,6 +26,27 @@ int set_nonblocking(int);
 
 int set_tcp_nodelay(int);
 
+/*
+ * Set SO_BUSY_POLL to the given microseconds, a blocking read on the socket
+ * then polls the device queue for that long before sleeping, and
+ * SO_PREFER_BUSY_POLL where the kernel has it. Raising it over the
+ * net.core.busy_read sysctl takes CAP_NET_ADMIN.
+ */
+int set_busy_poll(int, int);
+
+/*
+ * Pin the calling thread to the n-th CPU it is allowed to run on, modulo
+ * their number. Returns the CPU, -1 on error.
+ */
+int pin_thread(int);
+
+/*
+ * Prefer the memory node of the CPU the calling thread runs on for the
+ * pages it touches first from now on, meant for a pinned thread so that
+ * what it allocates stays next to it. Returns the node, -1 on error.
+ */
+int prefer_local_memory(void);
+
 /* Auxiliary function for creating epoll server */
 int create_and_bind(const char *, const char *, int);
 
@@ -28,8 +55,19 @@ int create_and_bind(const char *, const char *, int);
  */
 int make_listen(const char *, const char *, int);
 
-/* Accept a connection and add it to the right epollfd */
-int accept_connection(int);
+/*
+ * TCP listening socket of a loop, one of a SO_REUSEPORT group bound to the
+ * same address, one per loop. The kernel hands a new connection to the one
+ * whose SO_INCOMING_CPU, the given CPU, is the one it processes its packets
+ * on, -1 to leave it to the group hash. Returns -1 on error.
+ */
+int make_listen_cpu(const char *, const char *, int);
+
+/*
+ * Accept a connection and add it to the right epollfd, with the given
+ * SO_BUSY_POLL in microseconds, 0 for none
+ */
+int accept_connection(int, int);
 
 /* Helper functions to create and find socket to listen for new connections
  * and to set socket in non-blocking mode.
@@ -57,12 +95,39 @@ ssize_t recv_bytes(int, unsigned char *, size_t);
  * Event loop wrapper structure, define and EPOLL loop and his status. The 
  * EPPOL instance use EPOLLNESHOT for each event and must be re-armed 
  * manually, in order to allow future uses on a multithreaded architecture.
+ * now is the loop clock, CLOCK_MONOTONIC in milliseconds read once per
+ * iteration, for callbacks needing the time without a syscall each.
+ * deferred are the closures whose callback is to run at a given time of
+ * that clock, a min-heap on it.
  */
 
+struct closure;
+
+struct evloop_deferred {
+  unsigned long long at;
+  /* Order of deferral, first come first served for the same time */
+  unsigned long long seq;
+  struct closure *closure;
+};
+
+/*
+ * Default busy poll budget of an event loop, the microseconds it spins on
+ * epoll_wait with no timeout before blocking, 0 never to spin. Spinning
+ * saves the wakeup of a thread asleep in epoll, a few microseconds per
+ * event, for a CPU kept busy by every loop. See evloop_busy_poll.
+ */
+#ifndef BUSY_POLL_BUDGET
+#define BUSY_POLL_BUDGET    0
+#endif
+
 struct evloop {
   int epollfd;
   int max_events;
   int timeout;
+  int busy_poll;
+  /* CPU and memory node the loop is pinned to, -1 if it is not */
+  int cpu;
+  int node;
   int status;
   struct epoll_event *events;
   /* Dynamic array of periodic task, a pair descriptor - closure */
@@ -73,6 +138,11 @@ struct evloop {
     int timerfd;
     struct closure *closure;
   } **periodic_task;
+  unsigned long long now;
+  int deferred_maxsize;
+  int deferred_nr;
+  unsigned long long deferred_seq;
+  struct evloop_deferred *deferred;
 };
 
 typedef void callback(struct evloop *, void *);
@@ -81,17 +151,64 @@ typedef void callback(struct evloop *, void *);
  * descriptor if needed, args is a void pointer wich can be a structure
  * poiting to callback parameters and closure_id a UUID for the closure 
  * itsefl. 
- * The last two fields are payload, a serialized version of the result of a
+ * The last fields are payload, a serialized version of the result of a
  * callback, ready to be sent through wire and a function pointer to the 
  * callback function execute.
+ * Short fixed size replies skip the payload: reply points either to a
+ * static frame or to reply_buf, written in place, and written tracks how
+ * much of the pending output already went out.
+ * mqtt5 is the protocol state of a client connection, set on CONNECT.
+ * stream_in is a PUBLISH whose payload is still being received, while blob
+ * is a streamed payload to send after the output above, from blob_sent on.
+ * zc tracks the payloads sent with MSG_ZEROCOPY, set on the first large one.
+ * shm is the shared memory connection of SHM clients, fd is its doorbell.
+ * in is the buffer borrowed for an incoming frame arriving in pieces, in_len
+ * bytes of it received out of in_need, NULL for an idle connection. A frame
+ * held back by a rate limit waits there too, complete and unread.
+ * bucket is the rate limit of the connection, throttled set while its next
+ * read is deferred for the bucket to refill.
+ * out is the bulk lane of the connection output, the PUBLISH frames routed
+ * to it, behind the control packets above. deficit, next_ready and ready
+ * are its state in the loop scheduler, blocked is set while the socket is
+ * too full to take more of it. mailbox is the one of the loop owning the
+ * connection, where other threads post the frames routed to it.
  */
 
+#define CLOSURE_REPLY_SIZE  8
+
+struct mqtt5_state;
+struct stream_blob;
+union mqtt_packet;
+struct zerocopy;
+struct shm_conn;
+
 struct closure {
   int fd;
   void *obj;
   void *arg;
   char closure_id[UUID_LEN];
   struct bytestring *payload;
+  const unsigned char *reply;
+  size_t replylen;
+  size_t written;
+  unsigned char reply_buf[CLOSURE_REPLY_SIZE];
+  struct mqtt5_state *mqtt5;
+  union mqtt_packet *stream_in;
+  struct stream_blob *blob;
+  size_t blob_sent;
+  struct zerocopy *zc;
+  struct shm_conn *shm;
+  unsigned char *in;
+  size_t in_len;
+  size_t in_need;
+  struct bucket bucket;
+  int throttled;
+  struct outq out;
+  size_t deficit;
+  struct closure *next_ready;
+  int ready;
+  int blocked;
+  struct outq_mailbox *mailbox;
   callback *call;
 };
 
@@ -107,6 +224,19 @@ void evloop_free(struct evloop *);
  */
 int evloop_wait(struct evloop *);
 
+/*
+ * Single iteration of evloop_wait, waits at most the timeout given in
+ * milliseconds, -1 to block. Returns the number of events handled, -1 on
+ * error with the loop status set.
+ */
+int evloop_poll(struct evloop *, int);
+
+/*
+ * Set the busy poll budget of a loop in microseconds, 0 to always block.
+ * Connections accepted by the loop from then on get it as SO_BUSY_POLL.
+ */
+void evloop_busy_poll(struct evloop *, int);
+
 /* 
  * Register a clorsure with a function to be executed every time the paired
  * descriptor is re-armed
@@ -120,6 +250,14 @@ void evloop_add_callback(struct evloop *, struct closure *);
 void evloop_add_periodic_task(struct evloop *, int, unsigned long long, 
                               struct closure *);
 
+/*
+ * Run the callback of a closure once, the given milliseconds from now, in
+ * place of re-arming its descriptor, e.g. to throttle it. The closure must
+ * not be armed meanwhile. Returns -1 if out of memory.
+ */
+int evloop_defer_callback(struct evloop *, struct closure *,
+                          unsigned long long);
+
 /* 
  * Unregister a closure by removing the associated descriptor from the 
  * EPOLL loop.
@@ -138,6 +276,12 @@ int evloop_rearm_callback_read(struct evloop *, struct closure *);
  */
 int evloop_rearm_callback_write(struct evloop *, struct closure *);
 
+/*
+ * Rearm the file descriptor associated with a closure for both read and
+ * write, the callback telling them apart if it needs to.
+ */
+int evloop_rearm_callback_rw(struct evloop *, struct closure *);
+
 /* Epool managment functions */
 int epoll_add(int, int, int, void *);
 
@@ -0,0 +1,335 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "memory.h"
+#include "arena.h"
+#include "outq.h"
+
+/* Iovecs gathered per write, 3 at most per frame */
+#define OUTQ_IOV    64
+
+struct outq_frame *outq_frame_create(unsigned char *data, size_t len,
+                                     size_t id_off, unsigned qos)
+{
+  struct outq_frame *f = mem_malloc(MEM_QUEUES, sizeof(*f));
+
+  if (!f) {
+    return NULL;
+  }
+
+  atomic_init(&f->refs, 1);
+  f->qos = qos;
+  f->id_off = qos > 0 ? id_off : 0;
+  f->len = len;
+  f->data = data;
+
+  return f;
+}
+
+struct outq_frame *outq_frame_get(struct outq_frame *f)
+{
+  atomic_fetch_add_explicit(&f->refs, 1, memory_order_relaxed);
+  return f;
+}
+
+void outq_data_free(unsigned char *data)
+{
+  if (arena_owns(data)) {
+    mem_uncharge(MEM_QUEUES, arena_size(data));
+    arena_free(data);
+  } else {
+    mem_free(MEM_QUEUES, data);
+  }
+}
+
+void outq_frame_put(struct outq_frame *f)
+{
+  if (f && atomic_fetch_sub_explicit(&f->refs, 1,
+                                     memory_order_acq_rel) == 1) {
+    outq_data_free(f->data);
+    mem_free(MEM_QUEUES, f);
+  }
+}
+
+void outq_init(struct outq *q)
+{
+  q->head = NULL;
+  q->tail = NULL;
+  q->nr = 0;
+  q->bytes = 0;
+  q->sent = 0;
+}
+
+int outq_push(struct outq *q, struct outq_frame *f, unsigned short pkt_id)
+{
+  struct outq_entry *e = mem_malloc(MEM_QUEUES, sizeof(*e));
+
+  if (!e) {
+    return -1;
+  }
+
+  e->next = NULL;
+  e->frame = outq_frame_get(f);
+  e->pkt_id[0] = pkt_id >> 8;
+  e->pkt_id[1] = pkt_id & 0xFF;
+  e->written = 0;
+
+  if (q->tail) {
+    q->tail->next = e;
+  } else {
+    q->head = e;
+  }
+
+  q->tail = e;
+  q->nr++;
+  q->bytes += f->len;
+
+  return 0;
+}
+
+size_t outq_started(const struct outq *q)
+{
+  if (!q->head || q->head->written == 0) {
+    return 0;
+  }
+
+  return q->head->frame->len - q->head->written;
+}
+
+static void entry_free(struct outq_entry *e)
+{
+  outq_frame_put(e->frame);
+  mem_free(MEM_QUEUES, e);
+}
+
+/*
+ * Iovecs of what is left of an entry, the frame split around the packet
+ * identifier if it has one. Returns how many.
+ */
+static int entry_iov(const struct outq_entry *e, struct iovec *iov)
+{
+  const struct outq_frame *f = e->frame;
+  struct iovec parts[3];
+  int nr = 0, n = 0;
+
+  if (f->id_off > 0) {
+    parts[nr++] = (struct iovec) { f->data, f->id_off };
+    parts[nr++] = (struct iovec) { (void *) e->pkt_id, 2 };
+    parts[nr++] = (struct iovec) { f->data + f->id_off + 2,
+                                   f->len - f->id_off - 2 };
+  } else {
+    parts[nr++] = (struct iovec) { f->data, f->len };
+  }
+
+  size_t skip = e->written;
+
+  for (int i = 0; i < nr; i++) {
+    if (skip >= parts[i].iov_len) {
+      skip -= parts[i].iov_len;
+      continue;
+    }
+    iov[n].iov_base = (unsigned char *) parts[i].iov_base + skip;
+    iov[n].iov_len = parts[i].iov_len - skip;
+    skip = 0;
+    n++;
+  }
+
+  return n;
+}
+
+/* Account n bytes written from the head, releasing the frames done */
+static void outq_advance(struct outq *q, size_t n)
+{
+  while (n > 0) {
+    struct outq_entry *e = q->head;
+    size_t left = e->frame->len - e->written;
+
+    if (n < left) {
+      e->written += n;
+      q->bytes -= n;
+      return;
+    }
+
+    n -= left;
+    q->bytes -= left;
+    q->head = e->next;
+    if (!q->head) {
+      q->tail = NULL;
+    }
+    q->nr--;
+    q->sent++;
+    entry_free(e);
+  }
+}
+
+ssize_t outq_send(struct outq *q, outq_write_fn *writer, void *arg,
+                  size_t budget, int *blocked)
+{
+  size_t total = 0;
+
+  *blocked = 0;
+
+  while (q->head) {
+    struct iovec iov[OUTQ_IOV];
+    int iovcnt = 0;
+    size_t want = 0;
+
+    for (struct outq_entry *e = q->head;
+         e && iovcnt + 3 <= OUTQ_IOV; e = e->next) {
+      size_t left = e->frame->len - e->written;
+      if (want + left > budget - total) {
+        break;
+      }
+      iovcnt += entry_iov(e, iov + iovcnt);
+      want += left;
+    }
+
+    /* The next frame is for another round */
+    if (want == 0) {
+      break;
+    }
+
+    ssize_t n = writer(arg, iov, iovcnt);
+
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        *blocked = 1;
+        break;
+      }
+      return -1;
+    }
+
+    outq_advance(q, n);
+    total += n;
+
+    if ((size_t) n < want) {
+      *blocked = 1;
+      break;
+    }
+  }
+
+  return total;
+}
+
+size_t outq_drop_qos0(struct outq *q)
+{
+  struct outq_entry **link = &q->head;
+  struct outq_entry *last = NULL;
+  size_t dropped = 0;
+
+  while (*link) {
+    struct outq_entry *e = *link;
+    if (e->frame->qos == 0 && e->written == 0) {
+      *link = e->next;
+      q->bytes -= e->frame->len;
+      q->nr--;
+      entry_free(e);
+      dropped++;
+    } else {
+      last = e;
+      link = &e->next;
+    }
+  }
+
+  q->tail = last;
+
+  return dropped;
+}
+
+void outq_clear(struct outq *q)
+{
+  while (q->head) {
+    struct outq_entry *e = q->head;
+    q->head = e->next;
+    entry_free(e);
+  }
+
+  q->tail = NULL;
+  q->nr = 0;
+  q->bytes = 0;
+}
+
+int outq_mailbox_init(struct outq_mailbox *m)
+{
+  m->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  atomic_init(&m->head, NULL);
+
+  return m->fd < 0 ? -1 : 0;
+}
+
+static void post_drop(const struct outq_post *p, void *arg)
+{
+  (void) p;
+  (void) arg;
+}
+
+void outq_mailbox_release(struct outq_mailbox *m)
+{
+  outq_mailbox_drain(m, post_drop, NULL);
+  close(m->fd);
+  m->fd = -1;
+}
+
+int outq_mailbox_post(struct outq_mailbox *m, int fd, const void *target,
+                      struct outq_frame *f, unsigned short pkt_id)
+{
+  struct outq_post *p = mem_malloc(MEM_QUEUES, sizeof(*p));
+
+  if (!p) {
+    return -1;
+  }
+
+  p->frame = outq_frame_get(f);
+  p->fd = fd;
+  p->target = target;
+  p->pkt_id = pkt_id;
+  /* Once pushed the post is the loop's, only head is looked at after */
+  struct outq_post *head = atomic_load_explicit(&m->head,
+                                                memory_order_relaxed);
+  do {
+    p->next = head;
+  } while (!atomic_compare_exchange_weak_explicit(&m->head, &head, p,
+                                                  memory_order_release,
+                                                  memory_order_relaxed));
+
+  /* The first post since the last drain rings, the others find it pending */
+  if (!head) {
+    eventfd_write(m->fd, 1);
+  }
+
+  return 0;
+}
+
+size_t outq_mailbox_drain(struct outq_mailbox *m, outq_post_fn *fn,
+                          void *arg)
+{
+  eventfd_t value;
+  struct outq_post *rev = NULL;
+  size_t n = 0;
+
+  /* Acked first, a post made after the exchange rings again */
+  eventfd_read(m->fd, &value);
+
+  struct outq_post *p = atomic_exchange_explicit(&m->head, NULL,
+                                                 memory_order_acquire);
+
+  /* Newest first on the stack */
+  while (p) {
+    struct outq_post *next = p->next;
+    p->next = rev;
+    rev = p;
+    p = next;
+  }
+
+  while (rev) {
+    struct outq_post *next = rev->next;
+    fn(rev, arg);
+    outq_frame_put(rev->frame);
+    mem_free(MEM_QUEUES, rev);
+    rev = next;
+    n++;
+  }
+
+  return n;
+}
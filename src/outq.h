@@ -0,0 +1,134 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+/*
+ * Outbound queue of a connection, for the PUBLISH frames routed to it. They
+ * are bulk data, sent as the socket and the scheduler allow, never ahead of
+ * a control packet of the connection.
+ *
+ * Frames are packed once per message, QoS and protocol version and shared,
+ * refcounted, by the queues of every subscriber they go to. Each entry
+ * carries the packet identifier of its subscriber, spliced in on the way
+ * out.
+ *
+ * A queue belongs to the loop of its connection. Frames routed from another
+ * thread are posted to the mailbox of that loop, which queues them itself,
+ * frames are the only thing shared, their data is never written once packed.
+ */
+
+struct outq_frame {
+  atomic_uint refs;
+  unsigned qos;
+  /* Offset of the packet identifier in data, for QoS 1 and 2 */
+  size_t id_off;
+  size_t len;
+  unsigned char *data;
+};
+
+struct outq_entry {
+  struct outq_entry *next;
+  struct outq_frame *frame;
+  unsigned char pkt_id[2];
+  size_t written;
+};
+
+struct outq {
+  struct outq_entry *head;
+  struct outq_entry *tail;
+  /* Frames queued and the bytes of them left to send */
+  size_t nr;
+  size_t bytes;
+  /* Frames sent whole since the queue was created */
+  unsigned long long sent;
+};
+
+/*
+ * Writer of a queue, e.g. writev on a socket. Returns the bytes written,
+ * possibly fewer than given, or -1 with errno set, EAGAIN if none fit.
+ */
+typedef ssize_t outq_write_fn(void *, const struct iovec *, int);
+
+/*
+ * Frame of a packed PUBLISH of the given QoS, data is taken over and freed
+ * with the last reference, counted on MEM_QUEUES. One reference. Data is
+ * either from the arena, see arena.h, or from mem_malloc.
+ */
+struct outq_frame *outq_frame_create(unsigned char *, size_t, size_t,
+                                     unsigned);
+
+/* Free the data of a frame, wherever it came from */
+void outq_data_free(unsigned char *);
+
+struct outq_frame *outq_frame_get(struct outq_frame *);
+void outq_frame_put(struct outq_frame *);
+
+void outq_init(struct outq *);
+
+/* Queue a frame with the packet identifier of the subscriber, -1 if OOM */
+int outq_push(struct outq *, struct outq_frame *, unsigned short);
+
+/*
+ * Bytes left of the frame at the head if it went out in part, 0 otherwise.
+ * Nothing else can go out on the connection before it is done.
+ */
+size_t outq_started(const struct outq *);
+
+/*
+ * Send whole frames from the head for as long as they fit in the budget,
+ * what is left of a frame already started included, batched in as few
+ * writes as possible. blocked is set if the writer took less than given.
+ * Returns the bytes sent, -1 on error.
+ */
+ssize_t outq_send(struct outq *, outq_write_fn *, void *, size_t, int *);
+
+/* Drop the QoS 0 frames not started yet, returns how many */
+size_t outq_drop_qos0(struct outq *);
+
+void outq_clear(struct outq *);
+
+/*
+ * Frame posted to the mailbox of a loop for one of its connections, known
+ * by descriptor and subscriber, the loop checks it is still there on drain.
+ */
+struct outq_post {
+  struct outq_post *next;
+  struct outq_frame *frame;
+  int fd;
+  const void *target;
+  unsigned short pkt_id;
+};
+
+/*
+ * Mailbox of a loop, a lock-free stack of posts with any number of threads
+ * posting and the loop alone draining it, in order. The eventfd rings the
+ * loop when a post finds it empty.
+ */
+struct outq_mailbox {
+  int fd;
+  _Atomic(struct outq_post *) head;
+};
+
+/* Consumer of the posts drained, the frame reference stays with the post */
+typedef void outq_post_fn(const struct outq_post *, void *);
+
+int outq_mailbox_init(struct outq_mailbox *);
+
+/* Drop what is left in the mailbox and close its eventfd */
+void outq_mailbox_release(struct outq_mailbox *);
+
+/*
+ * Post a frame for the connection of a descriptor and subscriber, taking a
+ * reference to it, with the packet identifier of the subscriber. Returns
+ * -1 if OOM.
+ */
+int outq_mailbox_post(struct outq_mailbox *, int, const void *,
+                      struct outq_frame *, unsigned short);
+
+/* Hand every post to the consumer, oldest first, returns how many */
+size_t outq_mailbox_drain(struct outq_mailbox *, outq_post_fn *, void *);
+
+#endif
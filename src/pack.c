@@ -3,6 +3,8 @@
 #include <stdlib.h>
 #include <arpa/inet.h>
 
+#include "arena.h"
+#include "memory.h"
 #include "pack.h"
 
 /* Reading data */
@@ -88,7 +90,12 @@ void bytestring_init(struct bytestring *bstring, size_t size)
   }
 
   bstring->size = size;
-  bstring->data = malloc(sizeof(unsigned char) * size);
+  /* Huge page backed when it fits in the arena, see arena.h */
+  if ((bstring->data = arena_alloc(size))) {
+    mem_charge(MEM_BUFFERS, arena_size(bstring->data));
+  } else {
+    bstring->data = malloc(sizeof(unsigned char) * size);
+  }
   bytestring_reset(bstring);
 }
 
@@ -98,7 +105,12 @@ void bytestring_release(struct bytestring *bstring)
     return;
   }
 
-  free(bstring->data);
+  if (arena_owns(bstring->data)) {
+    mem_uncharge(MEM_BUFFERS, arena_size(bstring->data));
+    arena_free(bstring->data);
+  } else {
+    free(bstring->data);
+  }
   free(bstring);
 }
 
@@ -108,6 +120,9 @@ void bytestring_reset(struct bytestring *bstring)
     return;
   }
 
-  bstring->data = 0;
-  memset(bstring->data, 0, bstring->size);
+  bstring->last = 0;
+
+  if (bstring->data) {
+    memset(bstring->data, 0, bstring->size);
+  }
 }
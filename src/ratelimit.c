@@ -0,0 +1,148 @@
+#include <string.h>
+#include <stdlib.h>
+#include "memory.h"
+#include "ratelimit.h"
+
+/* Tokens are counted in thousandths, a rate per second refills per ms */
+#define TOKEN   1000ULL
+
+void bucket_init(struct bucket *b, const struct ratelimit *limit,
+                 unsigned long long now)
+{
+  b->tokens = limit->burst * TOKEN;
+  b->stamp = now;
+}
+
+unsigned long long bucket_take(struct bucket *b, const struct ratelimit *limit,
+                               unsigned long long now)
+{
+  if (limit->rate == 0) {
+    return 0;
+  }
+
+  unsigned long long cap = (limit->burst ? limit->burst : 1) * TOKEN;
+
+  /* The loop clock never goes back, but a bucket may be older than it */
+  if (now > b->stamp) {
+    unsigned long long elapsed = now - b->stamp;
+    /* Past a full refill the exact amount doesn't matter, nor overflows */
+    if (elapsed >= cap / limit->rate + 1) {
+      b->tokens = cap;
+    } else {
+      b->tokens += elapsed * limit->rate;
+      if (b->tokens > cap) {
+        b->tokens = cap;
+      }
+    }
+    b->stamp = now;
+  }
+
+  if (b->tokens >= TOKEN) {
+    b->tokens -= TOKEN;
+    return 0;
+  }
+
+  /* Rounded up, waking up early would only find the bucket still short */
+  return (TOKEN - b->tokens + limit->rate - 1) / limit->rate;
+}
+
+void bucket_give(struct bucket *b, const struct ratelimit *limit)
+{
+  if (limit->rate > 0) {
+    b->tokens += TOKEN;
+  }
+}
+
+int ratelimit_prefix_set(struct ratelimit_prefixes *t, const char *prefix,
+                         const struct ratelimit *limit)
+{
+  size_t len = strlen(prefix);
+  struct ratelimit_prefix *p = NULL;
+  int err = 0;
+
+  pthread_mutex_lock(&t->lock);
+
+  for (size_t i = 0; i < t->nr; i++) {
+    if (t->prefixes[i].len == len &&
+        memcmp(t->prefixes[i].prefix, prefix, len) == 0) {
+      p = &t->prefixes[i];
+      break;
+    }
+  }
+
+  if (!p) {
+    struct ratelimit_prefix *prefixes =
+        mem_realloc(MEM_SESSIONS, t->prefixes, (t->nr + 1) * sizeof(*p));
+    if (!prefixes) {
+      err = -1;
+      goto out;
+    }
+    t->prefixes = prefixes;
+    p = &t->prefixes[t->nr];
+    if (!(p->prefix = mem_strdup(MEM_SESSIONS, prefix))) {
+      err = -1;
+      goto out;
+    }
+    p->len = len;
+    p->throttled = 0;
+    t->nr++;
+  }
+
+  p->limit = *limit;
+  bucket_init(&p->bucket, limit, 0);
+
+out:
+  pthread_mutex_unlock(&t->lock);
+  return err;
+}
+
+struct ratelimit_prefix *ratelimit_prefix_match(struct ratelimit_prefixes *t,
+                                                const char *topic, size_t len)
+{
+  struct ratelimit_prefix *best = NULL;
+
+  /* A handful of prefixes at most, a scan beats anything smarter */
+  for (size_t i = 0; i < t->nr; i++) {
+    struct ratelimit_prefix *p = &t->prefixes[i];
+    if (p->len <= len && (!best || p->len > best->len) &&
+        memcmp(p->prefix, topic, p->len) == 0) {
+      best = p;
+    }
+  }
+
+  return best;
+}
+
+unsigned long long ratelimit_prefix_take(struct ratelimit_prefixes *t,
+                                         const char *topic, size_t len,
+                                         unsigned long long now)
+{
+  unsigned long long wait = 0;
+
+  pthread_mutex_lock(&t->lock);
+
+  struct ratelimit_prefix *p = ratelimit_prefix_match(t, topic, len);
+
+  if (p && (wait = bucket_take(&p->bucket, &p->limit, now)) > 0) {
+    p->throttled++;
+  }
+
+  pthread_mutex_unlock(&t->lock);
+
+  return wait;
+}
+
+void ratelimit_prefixes_release(struct ratelimit_prefixes *t)
+{
+  pthread_mutex_lock(&t->lock);
+
+  for (size_t i = 0; i < t->nr; i++) {
+    mem_free(MEM_SESSIONS, t->prefixes[i].prefix);
+  }
+
+  mem_free(MEM_SESSIONS, t->prefixes);
+  t->prefixes = NULL;
+  t->nr = 0;
+
+  pthread_mutex_unlock(&t->lock);
+}
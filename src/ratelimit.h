@@ -0,0 +1,86 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/*
+ * Token buckets for admission control, refilled from a clock in
+ * milliseconds given by the caller, the cached one of the event loop, so a
+ * check costs no syscall.
+ *
+ * A bucket holds up to burst tokens and gains rate of them per second,
+ * counted in thousandths so that low rates refill smoothly. A rate of 0
+ * means no limit.
+ */
+
+struct ratelimit {
+  unsigned rate;
+  unsigned burst;
+};
+
+struct bucket {
+  unsigned long long tokens;
+  unsigned long long stamp;
+};
+
+/* Fill a bucket up to its burst, one stamped 0 fills up on first use */
+void bucket_init(struct bucket *, const struct ratelimit *,
+                 unsigned long long);
+
+/*
+ * Take a token out of a bucket, returns 0 if there was one, else the
+ * milliseconds to wait for it, no token taken.
+ */
+unsigned long long bucket_take(struct bucket *, const struct ratelimit *,
+                               unsigned long long);
+
+/* Give back a token taken, when admission needs several buckets */
+void bucket_give(struct bucket *, const struct ratelimit *);
+
+/*
+ * Limits by topic prefix, shared by every client publishing under it, the
+ * longest matching prefix applies. Clients of every loop draw from the same
+ * buckets, the table and its buckets are only touched under its lock.
+ */
+struct ratelimit_prefix {
+  char *prefix;
+  size_t len;
+  struct ratelimit limit;
+  struct bucket bucket;
+  /* Publishes held back by the bucket */
+  unsigned long long throttled;
+};
+
+struct ratelimit_prefixes {
+  pthread_mutex_t lock;
+  /* Read without the lock to skip it when there are no prefixes */
+  atomic_size_t nr;
+  struct ratelimit_prefix *prefixes;
+};
+
+#define RATELIMIT_PREFIXES_INIT { .lock = PTHREAD_MUTEX_INITIALIZER }
+
+/*
+ * Set the limit of a prefix, replacing the previous one if any. Returns -1
+ * if out of memory.
+ */
+int ratelimit_prefix_set(struct ratelimit_prefixes *, const char *,
+                         const struct ratelimit *);
+
+/* Longest prefix of the table matching a topic, NULL if none, unlocked */
+struct ratelimit_prefix *ratelimit_prefix_match(struct ratelimit_prefixes *,
+                                                const char *, size_t);
+
+/*
+ * Take a token out of the bucket of the longest prefix matching a topic,
+ * as bucket_take, 0 if no prefix matches. Counted as throttled if short.
+ */
+unsigned long long ratelimit_prefix_take(struct ratelimit_prefixes *,
+                                         const char *, size_t,
+                                         unsigned long long);
+
+void ratelimit_prefixes_release(struct ratelimit_prefixes *);
+
+#endif
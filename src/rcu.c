@@ -0,0 +1,210 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "rcu.h"
+
+/* Reader states, an offline reader never holds back the global epoch */
+#define RCU_UNUSED      0
+#define RCU_ONLINE      1
+#define RCU_OFFLINE     2
+
+/*
+ * Per-thread reader record, padded to a cache line to avoid false sharing
+ * between loops announcing their quiescent states.
+ */
+struct rcu_reader {
+  atomic_ulong epoch;
+  atomic_int state;
+  char pad[64 - sizeof(atomic_ulong) - sizeof(atomic_int)];
+};
+
+/* Object waiting for a grace period before being released */
+struct rcu_deferred {
+  void *ptr;
+  rcu_destructor *destructor;
+  unsigned long epoch;
+  struct rcu_deferred *next;
+};
+
+static struct rcu_reader readers[RCU_MAX_THREADS];
+
+static atomic_ulong global_epoch = 1;
+
+/* Pending objects, writers are rare so a plain locked list is enough */
+static pthread_mutex_t deferred_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rcu_deferred *deferred = NULL;
+static atomic_size_t deferred_nr = 0;
+
+static _Thread_local int reader_idx = -1;
+
+int rcu_register_thread(void)
+{
+  if (reader_idx >= 0) {
+    return 0;
+  }
+
+  for (int i = 0; i < RCU_MAX_THREADS; i++) {
+    int unused = RCU_UNUSED;
+    if (atomic_compare_exchange_strong(&readers[i].state,
+                                       &unused, RCU_OFFLINE)) {
+      reader_idx = i;
+      rcu_thread_online();
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+void rcu_unregister_thread(void)
+{
+  if (reader_idx < 0) {
+    return;
+  }
+
+  atomic_store(&readers[reader_idx].state, RCU_UNUSED);
+  reader_idx = -1;
+}
+
+/*
+ * Release every object retired at least two epochs ago: all readers have
+ * announced a quiescent state after the epoch in which it was unlinked.
+ */
+static void rcu_reclaim(unsigned long epoch)
+{
+  struct rcu_deferred *expired = NULL;
+
+  pthread_mutex_lock(&deferred_lock);
+
+  struct rcu_deferred **pp = &deferred;
+  while (*pp) {
+    struct rcu_deferred *d = *pp;
+    if (d->epoch + 2 <= epoch) {
+      *pp = d->next;
+      d->next = expired;
+      expired = d;
+      atomic_fetch_sub(&deferred_nr, 1);
+    } else {
+      pp = &d->next;
+    }
+  }
+
+  pthread_mutex_unlock(&deferred_lock);
+
+  while (expired) {
+    struct rcu_deferred *next = expired->next;
+    expired->destructor(expired->ptr);
+    free(expired);
+    expired = next;
+  }
+}
+
+/*
+ * Try to move the global epoch forward, succeeds only if every online
+ * reader already observed the current one.
+ */
+static void rcu_try_advance(void)
+{
+  unsigned long epoch = atomic_load_explicit(&global_epoch,
+                                             memory_order_acquire);
+
+  for (int i = 0; i < RCU_MAX_THREADS; i++) {
+    if (atomic_load_explicit(&readers[i].state,
+                             memory_order_acquire) != RCU_ONLINE) {
+      continue;
+    }
+    if (atomic_load_explicit(&readers[i].epoch,
+                             memory_order_acquire) != epoch) {
+      return;
+    }
+  }
+
+  if (atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1)) {
+    epoch++;
+  }
+
+  if (atomic_load_explicit(&deferred_nr, memory_order_relaxed) > 0) {
+    rcu_reclaim(epoch);
+  }
+}
+
+void rcu_quiescent_state(void)
+{
+  if (reader_idx < 0) {
+    return;
+  }
+
+  unsigned long epoch = atomic_load_explicit(&global_epoch,
+                                             memory_order_acquire);
+
+  /* Nothing changed since the last announcement, keep the fast path cheap */
+  if (atomic_load_explicit(&readers[reader_idx].epoch,
+                           memory_order_relaxed) != epoch) {
+    atomic_store_explicit(&readers[reader_idx].epoch, epoch,
+                          memory_order_release);
+  }
+
+  if (atomic_load_explicit(&deferred_nr, memory_order_relaxed) > 0) {
+    rcu_try_advance();
+  }
+}
+
+void rcu_thread_offline(void)
+{
+  if (reader_idx < 0) {
+    return;
+  }
+
+  atomic_store_explicit(&readers[reader_idx].state, RCU_OFFLINE,
+                        memory_order_release);
+
+  /* We may have been the last one holding back the epoch */
+  if (atomic_load_explicit(&deferred_nr, memory_order_relaxed) > 0) {
+    rcu_try_advance();
+  }
+}
+
+void rcu_thread_online(void)
+{
+  if (reader_idx < 0) {
+    return;
+  }
+
+  atomic_store(&readers[reader_idx].epoch, atomic_load(&global_epoch));
+  atomic_store(&readers[reader_idx].state, RCU_ONLINE);
+
+  /* Epoch must be visible before any protected pointer is read */
+  atomic_thread_fence(memory_order_seq_cst);
+}
+
+void rcu_defer(void *ptr, rcu_destructor *destructor)
+{
+  if (!ptr) {
+    return;
+  }
+
+  struct rcu_deferred *d = malloc(sizeof(*d));
+
+  /* Out of memory, better to leak than to free under a reader */
+  if (!d) {
+    return;
+  }
+
+  d->ptr = ptr;
+  d->destructor = destructor;
+  d->epoch = atomic_load(&global_epoch);
+
+  pthread_mutex_lock(&deferred_lock);
+  d->next = deferred;
+  deferred = d;
+  atomic_fetch_add(&deferred_nr, 1);
+  pthread_mutex_unlock(&deferred_lock);
+
+  /* Writer may run on a thread not reading at all, help things move */
+  rcu_try_advance();
+}
+
+void rcu_flush(void)
+{
+  rcu_reclaim((unsigned long) -1);
+}
@@ -0,0 +1,46 @@
+#ifndef RCU_H
+#define RCU_H
+
+/*
+ * Quiescent-state based reclamation for read-mostly structures shared
+ * between event loops, e.g. the subscription index.
+ *
+ * Readers never take a lock: they just dereference the published pointers.
+ * Writers build new versions of the nodes they touch, publish them with an
+ * atomic store and hand the old versions to rcu_defer. Old versions are
+ * released only after every registered loop has passed a quiescent point,
+ * which evloop_wait announces at the end of each iteration.
+ */
+
+/* Max number of threads (event loops) that can read protected structures */
+#define RCU_MAX_THREADS     64
+
+typedef void rcu_destructor(void *);
+
+/* Register the calling thread as a reader, returns -1 if full */
+int rcu_register_thread(void);
+void rcu_unregister_thread(void);
+
+/*
+ * Announce that the calling thread holds no references to protected data,
+ * must be called outside of any read-side section.
+ */
+void rcu_quiescent_state(void);
+
+/*
+ * Extended quiescent state, a thread going to block (e.g. on epoll_wait)
+ * goes offline so it does not hold back reclamation while sleeping.
+ */
+void rcu_thread_offline(void);
+void rcu_thread_online(void);
+
+/* Defer the release of an unlinked object till all readers moved on */
+void rcu_defer(void *, rcu_destructor *);
+
+/*
+ * Release all pending objects regardless of readers, to be used only on
+ * shutdown when no loop is running anymore.
+ */
+void rcu_flush(void);
+
+#endif
@@ -2,6 +2,10 @@
 #define _POSIX_C_SOURCE     200809L
 #include <time.h>
 #include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <string.h>
 #include <stdlib.h>
@@ -9,14 +13,33 @@
 #include <arpa/inet.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
 #include "pack.h"
 #include "util.h"
 #include "mqtt.h"
+#include "mqtt5.h"
+#include "stream.h"
+#include "zerocopy.h"
+#include "handover.h"
+#include "shm.h"
+#include "utf8.h"
+#include "rcu.h"
+#include "memory.h"
+#include "bufpool.h"
+#include "arena.h"
+#include "ratelimit.h"
+#include "outq.h"
+#include "trace.h"
+#include "metrics.h"
+#include "topk.h"
 //#include "core.h"
 #include "network.h"
+#include "trie.h"
+#include "intern.h"
 //#include "hashtable.h"
 //#include "config.h"
 #include "server.h"
+#include "broker.h"
 
 /* Seconds in a Sol, easter egg */
 static const double SOL_SECONDS = 88775.24;
@@ -87,19 +110,113 @@ struct connection {
 static void on_read(struct evloop *, void *);
 static void on_write(struct evloop *, void *);
 static void on_accept(struct evloop *, void *);
+static void on_shm_handshake(struct evloop *, void *);
+
+/*
+ * Run the memory reclaimers if the pressure calls for it, see memory.h,
+ * returns the pressure left
+ */
+static enum mem_pressure memory_reclaim(unsigned long long);
+
+/* Largest PUBLISH streamed, see STREAM_MAX_SIZE */
+static size_t stream_max = STREAM_MAX_SIZE;
+
+/* Rate limit of every client and of the topic prefixes limited */
+static struct ratelimit client_limit = { RATELIMIT_RATE, RATELIMIT_BURST };
+static struct ratelimit_prefixes topic_limits = RATELIMIT_PREFIXES_INIT;
+
+/* Busy poll budget of the loops started from now on and their pinning */
+static struct {
+  int usecs;
+  int pin;
+  atomic_int loops;
+} polling = { BUSY_POLL_BUDGET, BUSY_POLL_PIN };
+
+/*
+ * Listening socket of the loop, with server_listen_local, and how many of
+ * the connections it accepted had their packets processed on its CPU
+ */
+static _Thread_local struct closure listen_closure;
+static _Thread_local struct {
+  unsigned long long local;
+  unsigned long long remote;
+} steering;
+
+/* Rearm helpers, aware of shared memory connections */
+static void closure_rearm_read(struct evloop *, struct closure *);
+static void closure_wait_write(struct evloop *, struct closure *);
+
+/*
+ * Outbound scheduler of the loop, see sched_round. ready is the list of the
+ * connections with bulk data to send, round the closure run once per loop
+ * iteration while there are any.
+ */
+static _Thread_local struct {
+  struct evloop *loop;
+  struct closure *head;
+  struct closure *tail;
+  size_t nr;
+  int pending;
+  struct closure round;
+} sched;
+
+static void sched_wake(struct closure *);
+static void sched_remove(struct closure *);
+
+/*
+ * Mailbox of the loop, see outq.h, frames routed from other threads to its
+ * connections, and the closure of its eventfd.
+ */
+static _Thread_local struct outq_mailbox mailbox = { .fd = -1 };
+static _Thread_local struct closure mailbox_closure;
+static ssize_t closure_send_bulk(struct closure *, size_t, int *);
+
+/*
+ * Heavy hitters, see topk.h, the topics and the clients publishing the most
+ * by messages and by bytes, the bytes sent to a client counting as well.
+ * Every loop counts in trackers of its own and merges them into the broker
+ * ones every TOPK_INTERVAL, starting over. The rankings are published under
+ * $SOL/broker/top/ every TOPK_INTERVAL, from what the loops merged so far.
+ */
+static struct {
+  pthread_mutex_t lock;
+  struct topk topics;
+  struct topk clients;
+  struct closure tick;
+  atomic_int started;
+} hot = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static _Thread_local struct {
+  struct topk *topics;
+  struct topk *clients;
+  struct closure tick;
+  /* Sampling state, see topk_sampled */
+  uint64_t rng;
+} hot_loop = { .rng = 0x9e3779b97f4a7c15ULL };
+
+static void hot_publish(struct closure *, const struct mqtt_publish *);
+static void hot_sent(struct closure *, size_t);
+
+/* Closures of the connections by descriptor */
+static int conn_register(struct closure *);
+static void conn_unregister(struct closure *);
+
+/* Drop every subscription of a client, before it is freed */
+struct sol_client;
+static void client_unsubscribe_all(struct sol_client *);
 
 /* 
  * Periodic task callback, will be executed every N seconds defined on 
  * the configuration.
  */ 
-static int accept_new_client(int fd, struct connection *conn)
+static int accept_new_client(int fd, int busy_poll, struct connection *conn)
 {
   if (!conn) {
     return -1;
   }
 
   /* Accept the connection */
-  int clientsock = accept_connection(fd);
+  int clientsock = accept_connection(fd, busy_poll);
   
   /* Abort if not accepted */
   if (clientsock == -1) {
@@ -111,12 +228,14 @@ static int accept_new_client(int fd, struct connection *conn)
   socklen_t addrlen = sizeof(addr);
 
   if (getpeername(clientsock, (struct sockaddr *)&addr, &addrlen) < 0) {
+    close(clientsock);
     return -1;
   }
 
   char ip_buff[INET_ADDRSTRLEN + 1];
 
   if (inet_ntop(AF_INET, &addr.sin_addr, ip_buff, sizeof(ip_buff)) == NULL) {
+    close(clientsock);
     return -1;
   }
 
@@ -124,6 +243,7 @@ static int accept_new_client(int fd, struct connection *conn)
   socklen_t sinlen = sizeof(sin);
 
   if (getsockname(fd, (struct sockaddr *)&sin, &sinlen) < 0) {
+    close(clientsock);
     return -1;
   }
 
@@ -133,6 +253,57 @@ static int accept_new_client(int fd, struct connection *conn)
   return 0;
 }
 
+/*
+ * Create the closure of a client connection, registered and ready to be set
+ * in EPOLLIN event
+ */
+static struct closure *client_closure_create(int fd)
+{
+  struct closure *client_closure =
+      mem_malloc(MEM_CONNECTIONS, sizeof(*client_closure));
+
+  if (!client_closure) {
+    return NULL;
+  }
+
+  /* Populate client structure */
+  client_closure->fd = fd;
+  client_closure->obj = NULL;
+  client_closure->payload = NULL;
+  client_closure->reply = NULL;
+  client_closure->replylen = 0;
+  client_closure->written = 0;
+  client_closure->mqtt5 = NULL;
+  client_closure->stream_in = NULL;
+  client_closure->blob = NULL;
+  client_closure->blob_sent = 0;
+  client_closure->zc = NULL;
+  client_closure->shm = NULL;
+  client_closure->in = NULL;
+  client_closure->in_len = 0;
+  client_closure->in_need = 0;
+  bucket_init(&client_closure->bucket, &client_limit, 0);
+  client_closure->throttled = 0;
+  outq_init(&client_closure->out);
+  client_closure->deficit = 0;
+  client_closure->next_ready = NULL;
+  client_closure->ready = 0;
+  client_closure->blocked = 0;
+  client_closure->mailbox = &mailbox;
+  client_closure->arg = client_closure;
+  client_closure->call = on_read;
+
+  if (conn_register(client_closure) < 0) {
+    mem_free(MEM_CONNECTIONS, client_closure);
+    return NULL;
+  }
+
+  generate_uuid(client_closure->closure_id);
+  hashtable_put(sol.closures, client_closure->closure_id, client_closure);
+
+  return client_closure;
+}
+
 /*
  * Handle new connection, create a fresh new struct client structure and
  * link it to the fd, ready to be set in EPOLLIN event
@@ -143,22 +314,51 @@ static void on_accept(struct evloop *loop, void *arg)
   struct closure *server = arg;
   struct connection conn;
 
-  accept_new_client(server->fd, &conn);
+  /* Nothing to take in, e.g. the client gave up meanwhile */
+  if (accept_new_client(server->fd, loop->busy_poll, &conn) < 0) {
+    evloop_rearm_callback_read(loop, server);
+    return;
+  }
+
+  /* Last resort of the memory ceiling, the broker takes no one else in */
+  if (memory_reclaim(loop->now) == MEM_REFUSE) {
+    sol_warning("Memory ceiling reached, refusing connection from %s",
+                conn.ip);
+    close(conn.fd);
+    evloop_rearm_callback_read(loop, server);
+    return;
+  }
+
   /* Create a client structure to handle his context connection */
-  struct closure *client_closure = malloc(sizeof(*client_closure));
+  struct closure *client_closure = client_closure_create(conn.fd);
 
   if (!client_closure) {
+    close(conn.fd);
+    evloop_rearm_callback_read(loop, server);
     return;
   }
 
-  /* Populate client structure */
-  client_closure->fd = conn.fd;
-  client_closure->obj = NULL;
-  client_closure->payload = NULL;
-  client_closure->arg = client_closure;
-  client_closure->call = on_read;
-  generate_uuid(client_closure->closure_id);
-  hashtable_put(sol.closures, client_closure->closure_id, client_closure);
+  /*
+   * Whether the kernel steered it to the loop on its receiving CPU, only
+   * connections taken in count, and only if the kernel could tell.
+   */
+  if (loop->cpu >= 0) {
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(conn.fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0
+        && cpu >= 0) {
+      if (cpu == loop->cpu) {
+        steering.local++;
+      } else {
+        steering.remote++;
+      }
+    }
+  }
+
+  /* Shared memory clients send their handshake first */
+  if (conf->socket_family == SHM) {
+    client_closure->call = on_shm_handshake;
+  }
 
   /* Add it to the epoll loop */
   evloop_add_callback(loop, client_closure);
@@ -169,227 +369,2955 @@ static void on_accept(struct evloop *loop, void *arg)
   /* Record the new client connected */
   info.nclients++;
   info.nconnections++;
+  trace_record(loop->now, TRACE_EV_ACCEPT, conn.fd, 0, 0);
   sol_info("New connection from %s on port %s", conn.ip, conf->port);
 }
 
+/*
+ * First event on a connection accepted on a SHM family socket, the client
+ * handshake carries the memory file and the doorbells. From then on the
+ * closure waits on the broker doorbell instead of the socket.
+ */
+static void on_shm_handshake(struct evloop *loop, void *arg)
+{
+  struct closure *cb = arg;
+  struct shm_conn *shm = mem_malloc(MEM_CONNECTIONS, sizeof(*shm));
+
+  if (!shm || shm_accept(cb->fd, shm) < 0) {
+    sol_error("Refused shared memory connection: %s", strerror(errno));
+    mem_free(MEM_CONNECTIONS, shm);
+    evloop_del_callback(loop, cb);
+    conn_unregister(cb);
+    shutdown(cb->fd, 0);
+    close(cb->fd);
+    hashtable_del(sol.closures, cb->closure_id);
+    info.nclients--;
+    info.nconnections--;
+    return;
+  }
+
+  /* The socket now belongs to the connection */
+  evloop_del_callback(loop, cb);
+  conn_unregister(cb);
+  cb->shm = shm;
+  cb->fd = shm->doorbell;
+  cb->call = on_read;
+
+  if (conn_register(cb) < 0) {
+    sol_error("Refused shared memory connection: %s", strerror(ENOMEM));
+    shm_close(shm);
+    mem_free(MEM_CONNECTIONS, shm);
+    hashtable_del(sol.closures, cb->closure_id);
+    info.nclients--;
+    info.nconnections--;
+    return;
+  }
+
+  evloop_add_callback(loop, cb);
+
+  /* The client may have written its CONNECT before the broker got here */
+  if (shm_readable(shm) > 0) {
+    shm_kick(shm);
+  }
+}
+
+/*
+ * Read up to len bytes, as many as the socket has. Returns the bytes read,
+ * -1 on error or if the client closed the connection.
+ */
+static ssize_t recv_some(int fd, unsigned char *buf, size_t len)
+{
+  size_t total = 0;
+
+  while (total < len) {
+    ssize_t n = recv(fd, buf + total, len - total, 0);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      return -1;
+    }
+    if (n == 0) {
+      return -1;
+    }
+    total += n;
+  }
+
+  return total;
+}
+
+/*
+ * Buffer for an incoming frame, the stack one given for small frames, else
+ * one borrowed from the pool.
+ */
+static inline unsigned char *frame_buffer(unsigned char *scratch,
+                                          size_t pktlen)
+{
+  return pktlen <= INLINE_FRAME_SIZE ? scratch : bufpool_get(pktlen);
+}
+
+/*
+ * Carry on with a frame which arrived in pieces, handing its buffer over to
+ * the caller once complete.
+ */
+static ssize_t recv_rest(struct closure *cb, unsigned char **buf,
+                         char *command)
+{
+  ssize_t n = recv_some(cb->fd, cb->in + cb->in_len,
+                        cb->in_need - cb->in_len);
+
+  if (n < 0) {
+    return -ERRCLIENTDC;
+  }
+
+  cb->in_len += n;
+
+  if (cb->in_len < cb->in_need) {
+    return -ERRAGAIN;
+  }
+
+  ssize_t pktlen = cb->in_need;
+
+  *buf = cb->in;
+  *command = cb->in[0];
+  cb->in = NULL;
+  cb->in_len = 0;
+  cb->in_need = 0;
+
+  return pktlen;
+}
+
 /*
  * Parse packet header, it is required at least the Fixed Header
  * of each packed, which is contained in the first 2 bytes in order
  * to read packet type and total lenght that we need to recv to 
  * complete the packet.
  *
- * This function accept a socket fd, a buffer to read incoming
- * streams of bytes and a structure formed by 2 fields.
+ * This function accept the client closure, a scratch buffer of
+ * INLINE_FRAME_SIZE bytes and 2 output fields.
  *
- * - buf -> a byte buffer, it will be malloc'ed in the function and
- *          it will contain the serialized bytes of the incoming packet.
+ * - buf -> set to the buffer holding the serialized bytes of the incoming
+ *          packet, scratch or one borrowed from the pool, to be given back
+ *          by the caller.
  * - flags -> flags pointer, copy the flag setting of the incoming paclet,
  *            again for simplicity and convenience of the caller.
+ *
+ * A packet arriving in pieces is kept in a borrowed buffer on the closure
+ * until complete, -ERRAGAIN is returned meanwhile.
  */ 
-static ssize_t recv_packet(int clientfd, unsigned char *buf, char *command)
+static ssize_t recv_packet(struct closure *cb, unsigned char *scratch,
+                           unsigned char **buf, char *command)
 {
+  int clientfd = cb->fd;
   ssize_t nbytes = 0;
 
-  /* Read the first byte, it should contain the message type code */
-  if ((nbytes == recv_bytes(clientfd, buf, 1)) <= 0) {
+  /* Rest of a frame which arrived in pieces */
+  if (cb->in) {
+    return recv_rest(cb, buf, command);
+  }
+
+  /*
+   * Peek the whole fixed header in a single call, the first byte carries the
+   * message type code and the following 1 to 4 bytes the remaining lenght.
+   * Nothing is consumed until the header is complete.
+   */
+  unsigned char header[1 + 4];
+
+  if ((nbytes = recv(clientfd, header, sizeof(header), MSG_PEEK)) < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return -ERRAGAIN;
+    }
+    return -ERRCLIENTDC;
+  }
+
+  if (nbytes == 0) {
     return -ERRCLIENTDC;
   }
 
-  unsigned char byte = *buf;
-  buf++;
+  unsigned char type = header[0] >> 4;
 
-  if (DISCONNECT < byte || CONNECT > byte) {
+  if (DISCONNECT < type || CONNECT > type) {
     return -ERRPACKETERR;
   }
 
-  /* Read remaining lenght bytes which starts at byte 2 and ca be long to 
-   * 4 bytes based on the size stored, so byte 2-5 is dedicated to the
-   * packet lenght.
-   */
-  unsigned char buff[4];
-  int count = 0;
-  int n = 0;
-
-  do {
-    if ((n = recv_bytes(clientfd, buf+count, 1)) <= 0) {
-      return -ERRCLIENTDC;
-    }
+  size_t tlen = 0;
+  int lenght_bytes = mqtt_decode_lenght_window(header + 1, nbytes - 1, &tlen);
 
-    buff[count] = buf[count];
-    nbytes += n;
-  } while (buff[count++] & (1 << 7));
+  if (lenght_bytes < 0) {
+    return -ERRPACKETERR;
+  }
 
-  // Reset temporary buffer
-  const unsigned char *pbuf = &buff[0];
-  unsigned long long tlen = mqtt_decode_lenght(&pbuf);
+  /* Header split across segments, wait for the rest of it */
+  if (lenght_bytes == 0) {
+    return -ERRAGAIN;
+  }
 
   /*
    * Set return code to -ERRMAXREQSIZE in case the total packet len
    * exceeds the configuration limit 'max_request_size'.
    */
-  if (tlen > conf->max_request_size) {
-    nbytes = -ERRMAXREQSIZE;
-    goto exit;
+  size_t pktlen = 1 + lenght_bytes + tlen;
+
+  /* Large PUBLISH payloads are streamed instead of buffered, up to a size */
+  if (type == PUBLISH && pktlen > STREAM_THRESHOLD) {
+    return pktlen > stream_max ? -ERRMAXREQSIZE : -ERRSTREAM;
   }
 
-  /* Read remaining bytes to complete packet */
-  if ((n = recv_bytes(clientfd, buf+1, tlen)) < 0) {
-    goto err;
+  if (pktlen > conf->max_request_size) {
+    return -ERRMAXREQSIZE;
   }
 
-  nbytes += n;
-  *command = byte;
+  unsigned char *dst = frame_buffer(scratch, pktlen);
 
-  exit:
-    return nbytes;
-  err:
-    shutdown(clientfd, 0);
-    close(clientfd);
-    return nbytes;
+  if (!dst) {
+    return -ERRCLIENTDC;
+  }
+
+  /* Read the whole packet, fixed header included */
+  if ((nbytes = recv_some(clientfd, dst, pktlen)) < 0) {
+    if (dst != scratch) {
+      bufpool_put(dst);
+    }
+    return -ERRCLIENTDC;
+  }
+
+  /* Only part of it arrived, keep it in a borrowed buffer until the rest */
+  if ((size_t) nbytes < pktlen) {
+    if (dst == scratch) {
+      if (!(dst = bufpool_get(pktlen))) {
+        return -ERRCLIENTDC;
+      }
+      memcpy(dst, scratch, nbytes);
+    }
+    cb->in = dst;
+    cb->in_len = nbytes;
+    cb->in_need = pktlen;
+    return -ERRAGAIN;
+  }
+
+  *buf = dst;
+  *command = header[0];
+
+  return nbytes;
 }
 
-/* Handle incoming request, after being accepted or after a reply */
-static void on_read(struct evloop *loop, void *arg)
+/*
+ * Same as recv_packet for a shared memory connection, the packet is taken
+ * from the ring once complete, the client is asked to ring when more comes
+ * otherwise. Packets which can't fit in the ring are refused.
+ */
+static ssize_t shm_recv_packet(struct shm_conn *shm, unsigned char *scratch,
+                               unsigned char **buf, char *command)
 {
-  struct closure *cb = arg;
+  unsigned char header[1 + 4];
+  size_t nbytes = shm_peek(shm, header, sizeof(header));
 
-  /* Raw bytes buffer to handle input from client */
-  unsigned char *buffer = malloc(conf->max_request_size);
-  ssize_t bytes = 0;
-  char command = 0;
+  if (nbytes == 0) {
+    if (shm_closed(shm)) {
+      return -ERRCLIENTDC;
+    }
+    shm_wait_data(shm);
+    return -ERRAGAIN;
+  }
 
-  /* 
-   * We must read all incoming bytes untill an entire packet is
-   * recieved. This is achieved by following the MQTT v3.1.1
-   * protocol specifications, which send the size of the 
-   * remaining packet as the second byte. By knowing it we know
-   * if the packet is ready to be deserialized and used.
-   */ 
-  bytes = recv_packet(cb->fd, buffer, &command);
+  unsigned char type = header[0] >> 4;
 
-  /*
-   * Looks like we got a client desconnection.
-   *
-   * TODO: Set a error handler for ERRMAXREQSIZE instead of 
-   * dropping client connection, explicitly returning an informative
-   * error code to the client connected.
-   */
-  if (bytes == -ERRCLIENTDC || bytes == -ERRMAXREQSIZE) {
-    goto errdc;
+  if (DISCONNECT < type || CONNECT > type) {
+    return -ERRPACKETERR;
   }
 
-  info.bytes_recv++;
-
-  /* 
-   * Unpack recieved bytes into a mqtt_packet structure and 
-   * execute the correct handler based on the type of the operation.
-   */
-  union mqtt_packet packet;
-  unpack_mqtt_packet(buffer, &packet);
-  union mqtt_header hdr = {
-    .byte = command
-  };
+  size_t tlen = 0;
+  int lenght_bytes = mqtt_decode_lenght_window(header + 1, nbytes - 1, &tlen);
 
-  /* Execute command callback */
-  int rc = handlers[hdr.bits.type](cb, &packet);
+  if (lenght_bytes < 0) {
+    return -ERRPACKETERR;
+  }
 
-  if (rc == REARM_W) {
-    cb->call = on_write;
+  size_t pktlen = 1 + lenght_bytes + tlen;
 
-    /*
-     * Reset handler to read_handler in order to read new
-     * incomming data and EPOLL event for read fds.
-     */
-    evloop_rearm_callback_write(loop, cb);
-  } else if (rc == REARM_R) {
-    cb->call = on_read;
-    evloop_rearm_callback_read(loop, cb);
+  if (lenght_bytes > 0 &&
+      (pktlen > conf->max_request_size || pktlen > shm->rx.size)) {
+    return -ERRMAXREQSIZE;
   }
 
-exit:
-  free(buffer);
-  return;
-errdc:
-  free(buffer);
-  sol_error("Dropping client");
-  shutdown(cb->fd, 0);
-  close(cb->fd);
-  hashtable_del(sol.clients, ((struct sol_client *) cb->obj)->client_id);
-  hashtable_del(sol.closures, cb->closure_id);
-  info.nclients--;
-  info.nconnections--;
-  return;
-}
+  /* Packet not entirely written yet */
+  if (lenght_bytes == 0 || shm_readable(shm) < pktlen) {
+    if (shm_closed(shm)) {
+      return -ERRCLIENTDC;
+    }
+    shm_wait_data(shm);
+    return -ERRAGAIN;
+  }
 
-static void on_write(struct evloop *loop, void *arg)
-{
-  struct closure *cb = arg;
-  ssize_t sent;
-  if ((sent = send_bytes(cb->fd, cb->payload->data, cb->payload->size)) < 0) {
-    sol_error("Error writing on socket to client %s: %s",
-              ((struct sol_client *)cb->obj)->client_id, strerror(errno));
+  if (!(*buf = frame_buffer(scratch, pktlen))) {
+    return -ERRCLIENTDC;
+  }
 
-    /* Update information stats */
-    info.bytes_sent += sent;
-    bytestring_release(cb->payload);
-    cb->payload = NULL;
+  shm_recv(shm, *buf, pktlen);
+  *command = header[0];
 
-    /* Re-arm callback by setting EPOLL event on EPOLLIN to read fds and
-     * re-assinging the callback "on_read" for the next event.
-     */
-    cb->call = on_read;
-    evloop_rearm_callback_read(loop, cb);
-  }
+  return pktlen;
 }
 
-/* 
- * Statistics topics, published every N seconds defined by configuration
- * interval.
+/*
+ * Keep the connection protocol state in step with an incoming packet: set it
+ * up on CONNECT, resolve PUBLISH topic aliases and give back in-flight slots
+ * on the acks ending a QoS > 0 delivery. Returns -1 on protocol error.
  */
-#define SYS_TOPICS      14
-
-static const char *sys_topics[SYS_TOPICS] = {
-  "$SOL/",
-  "$SOL/broker/",
-  "$SOL/broker/clients/",
-  "$SOL/broker/bytes/",
-  "$SOL/broker/messages/",
-  "$SOL/broker/uptime/",
-  "$SOL/broker/uptime/sol",
-  "$SOL/broker/clients/connected/",
-  "$SOL/broker/clients/disconnected/",
-  "$SOL/broker/bytes/sent/",
-  "$SOL/broker/bytes/received/",
-  "$SOL/broker/messages/sent/",
-  "$SOL/broker/messages/received/",
-  "$SOL/broker/memory/used/",
-};
-
-static void run(struct evloop *loop)
+static int mqtt5_track(struct closure *cb, unsigned type,
+                       union mqtt_packet *pkt)
 {
-  if (evloop_wait(loop) < 0) {
-    sol_error("Event loop exited unexpectedely: %s", strerror(loop->status));
-    evloop_free(loop);
+  switch (type) {
+    case CONNECT:
+      /* A second CONNECT is a protocol error */
+      if (cb->mqtt5) {
+        return -1;
+      }
+      cb->mqtt5 = mem_malloc(MEM_SESSIONS, sizeof(*cb->mqtt5));
+      if (!cb->mqtt5 ||
+          mqtt5_state_init(cb->mqtt5, &pkt->connect, MQTT5_ALIAS_IN_MAX) < 0) {
+        mem_free(MEM_SESSIONS, cb->mqtt5);
+        cb->mqtt5 = NULL;
+        return -1;
+      }
+      return 0;
+    case PUBLISH:
+      return cb->mqtt5 ? mqtt5_alias_in(cb->mqtt5, &pkt->publish) : 0;
+    case PUBACK:
+    case PUBCOM:
+      if (cb->mqtt5) {
+        mqtt5_inflight_release(cb->mqtt5);
+      }
+      return 0;
+    default:
+      return 0;
   }
 }
 
 /*
- * Cleanup function to be passed in as a destructor to the hashtable for
- * connecting clients
- */ 
-static int client_destructor(struct hashtable_entry *entry)
+ * Start receiving a streamed PUBLISH: its headers are consumed and unpacked,
+ * a blob is created for the payload and the packet parked on the closure
+ * until the payload is complete. Headers are read in scratch, or in a
+ * buffer of their size set in borrowed if they don't fit, for the caller to
+ * give back. Returns 0 if the headers didn't arrive yet, nothing is
+ * consumed then, 1 once started and -1 on error.
+ */
+static int stream_begin(struct closure *cb, unsigned char *scratch,
+                        unsigned char **borrowed, unsigned char version)
 {
-  if (!entry) {
-    return -1;
+  unsigned char *peek = scratch;
+  size_t room = INLINE_FRAME_SIZE;
+  size_t want = 1 + 4 + sizeof(uint16_t);
+  ssize_t need = 0;
+  ssize_t n = 0;
+
+  /* Peek more and more until the whole variable header is there */
+  while (1) {
+    if ((n = recv(cb->fd, peek, want, MSG_PEEK)) <= 0) {
+      return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    need = mqtt_publish_header_lenght(peek, n, version);
+    if (need < 0 || (size_t) need > conf->max_request_size) {
+      return -1;
+    }
+    if (need <= n) {
+      break;
+    }
+    if ((size_t) n < want) {
+      return 0;
+    }
+    if ((size_t) need > room) {
+      bufpool_put(*borrowed);
+      if (!(*borrowed = bufpool_get(need))) {
+        return -1;
+      }
+      peek = *borrowed;
+      room = need;
+    }
+    want = need;
   }
 
-  struct sol_client *client = entry->val;
+  unsigned char *buf = peek;
 
-  if (client->client_id) {
+  if (recv_bytes(cb->fd, buf, need) != need) {
+    return -1;
+  }
+
+  const unsigned char *ptr = buf + 1;
+  size_t len = mqtt_decode_lenght(&ptr);
+  size_t lenght_bytes = ptr - buf - 1;
+  size_t payloadlen = 1 + lenght_bytes + len - need;
+
+  /* The file counts on the ceiling, see stream.h, it must fit under it */
+  if (1 + lenght_bytes + len > stream_max ||
+      (mem_ceiling() > 0 && mem_used() + payloadlen > mem_ceiling())) {
+    return -1;
+  }
+
+  /*
+   * Rewrite the fixed header right before the variable one, with the
+   * remaining lenght of the headers only, so that it unpacks as a PUBLISH
+   * with an empty payload.
+   */
+  size_t vhlen = need - 1 - lenght_bytes;
+  size_t vhlen_bytes = mqtt_lenght_bytes(vhlen);
+  unsigned char *start = buf + lenght_bytes - vhlen_bytes;
+
+  start[0] = buf[0];
+  mqtt_encode_lenght(start + 1, vhlen);
+
+  union mqtt_packet *pkt = malloc(sizeof(*pkt));
+
+  if (!pkt) {
+    return -1;
+  }
+
+  if (unpack_mqtt_packet_version(start, 1 + vhlen_bytes + vhlen, pkt,
+                                 version) < 0) {
+    free(pkt);
+    return -1;
+  }
+
+  free(pkt->publish.payload);
+  pkt->publish.payload = NULL;
+  pkt->publish.payloadlen = payloadlen;
+  pkt->publish.blob = stream_blob_create(payloadlen);
+
+  if (!pkt->publish.blob) {
+    mqtt_packet_release(pkt, PUBLISH);
+    free(pkt);
+    return -1;
+  }
+
+  cb->stream_in = pkt;
+
+  return 1;
+}
+
+/*
+ * Receive what is available of a streamed payload, returns 1 once complete,
+ * moving the packet to pkt, 0 if more is to come and -1 on error.
+ */
+static int stream_continue(struct closure *cb, union mqtt_packet *pkt)
+{
+  struct stream_blob *blob = cb->stream_in->publish.blob;
+  ssize_t n = stream_blob_fill(blob, cb->fd);
+
+  if (n == 0) {
+    return -1;
+  }
+
+  if (n < 0) {
+    return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+  }
+
+  if (!stream_blob_complete(blob)) {
+    return 0;
+  }
+
+  *pkt = *cb->stream_in;
+  free(cb->stream_in);
+  cb->stream_in = NULL;
+
+  return 1;
+}
+
+void server_busy_poll(unsigned usecs, int pin)
+{
+  polling.usecs = usecs > INT_MAX ? INT_MAX : (int) usecs;
+  polling.pin = pin;
+}
+
+void server_stream_max(size_t bytes)
+{
+  stream_max = bytes;
+}
+
+void server_ratelimit(unsigned rate, unsigned burst)
+{
+  client_limit.rate = rate;
+  client_limit.burst = burst;
+}
+
+int server_ratelimit_topic(const char *prefix, unsigned rate, unsigned burst)
+{
+  struct ratelimit limit = { rate, burst };
+  return ratelimit_prefix_set(&topic_limits, prefix, &limit);
+}
+
+/*
+ * Admission of a complete frame, before any parsing, returns 0 if it can
+ * be handled now, else the milliseconds to wait for. The bucket of the
+ * client is charged for every packet, the one of the topic prefix for
+ * PUBLISH, whose topic is read straight from the frame.
+ */
+static unsigned long long admit_frame(struct evloop *loop, struct closure *cb,
+                                      const unsigned char *frame, size_t len)
+{
+  unsigned long long wait = bucket_take(&cb->bucket, &client_limit,
+                                        loop->now);
+
+  if (wait > 0 || topic_limits.nr == 0 || (frame[0] >> 4) != PUBLISH) {
+    return wait;
+  }
+
+  size_t tlen = 0;
+  int lenght_bytes = mqtt_decode_lenght_window(frame + 1, len - 1, &tlen);
+
+  /* Malformed, left for unpack to refuse */
+  if (lenght_bytes <= 0 || (size_t) lenght_bytes + 3 > len) {
+    return 0;
+  }
+
+  const unsigned char *topic = frame + 1 + lenght_bytes;
+  size_t topiclen = (topic[0] << 8) | topic[1];
+
+  if (topic + 2 + topiclen > frame + len) {
+    return 0;
+  }
+
+  wait = ratelimit_prefix_take(&topic_limits, (const char *) topic + 2,
+                               topiclen, loop->now);
+
+  if (wait == 0) {
+    return 0;
+  }
+
+  /* The frame is to be admitted again, charged again then */
+  bucket_give(&cb->bucket, &client_limit);
+
+  return wait;
+}
+
+/*
+ * Hold the next read of a client back for the given milliseconds, instead
+ * of re-arming it, keeping the frame not admitted yet if any, to be handed
+ * out again by recv_packet. The socket fills up meanwhile, pushing back on
+ * the client through TCP flow control.
+ */
+static int throttle(struct evloop *loop, struct closure *cb,
+                    unsigned char *scratch, unsigned char **buf, size_t len,
+                    unsigned long long wait)
+{
+  if (*buf) {
+    unsigned char *frame = *buf;
+    if (frame == scratch) {
+      if (!(frame = bufpool_get(len))) {
+        return -1;
+      }
+      memcpy(frame, scratch, len);
+    }
+    cb->in = frame;
+    cb->in_len = len;
+    cb->in_need = len;
+    *buf = NULL;
+  }
+
+  if (evloop_defer_callback(loop, cb, wait) < 0) {
+    return -1;
+  }
+
+  cb->throttled = 1;
+  info.nthrottled++;
+  info.throttles++;
+  trace_record(loop->now, TRACE_EV_THROTTLE, cb->fd,
+               cb->in ? cb->in[0] >> 4 : PUBLISH, len);
+
+  return 0;
+}
+
+/* Handle incoming request, after being accepted or after a reply */
+static void on_read(struct evloop *loop, void *arg)
+{
+  struct closure *cb = arg;
+
+  /* Reading is a safe point to give memory back under pressure */
+  memory_reclaim(loop->now);
+
+  /*
+   * Raw bytes buffer to handle input from client, small frames are read
+   * in scratch, bigger ones in a buffer borrowed for as long as needed.
+   */
+  unsigned char scratch[INLINE_FRAME_SIZE];
+  unsigned char *buffer = NULL;
+  ssize_t bytes = 0;
+  char command = 0;
+  union mqtt_packet packet;
+  unsigned char version = cb->mqtt5 ? cb->mqtt5->version : MQTT_V311;
+  unsigned long long wait = 0;
+  /* Start of the stage being timed, 0 if this packet isn't sampled */
+  trace_tick t = trace_start();
+
+  /* Frames routed from here are scheduled on this loop */
+  sched.loop = loop;
+
+  /* Deferred call, the buckets refilled */
+  if (cb->throttled) {
+    cb->throttled = 0;
+    info.nthrottled--;
+  }
+
+  /* Woken up with room for the bulk lane, maybe, back in line */
+  if (cb->blocked) {
+    cb->blocked = 0;
+    sched_wake(cb);
+  }
+
+  /* Payloads sent with zerocopy the kernel is done with */
+  if (cb->zc && zerocopy_reap(cb->zc, cb->fd) < 0) {
+    goto errdc;
+  }
+
+  if (cb->shm) {
+    shm_ack(cb->shm);
+  }
+
+  /* Payload of a streamed PUBLISH still coming */
+  if (cb->stream_in) {
+    goto stream;
+  }
+
+  /* 
+   * We must read all incoming bytes untill an entire packet is
+   * recieved. This is achieved by following the MQTT v3.1.1
+   * protocol specifications, which send the size of the 
+   * remaining packet as the second byte. By knowing it we know
+   * if the packet is ready to be deserialized and used.
+   */ 
+  if (cb->shm && !cb->in) {
+    bytes = shm_recv_packet(cb->shm, scratch, &buffer, &command);
+  } else {
+    bytes = recv_packet(cb, scratch, &buffer, &command);
+  }
+
+  /*
+   * Looks like we got a client desconnection.
+   *
+   * TODO: Set a error handler for ERRMAXREQSIZE instead of 
+   * dropping client connection, explicitly returning an informative
+   * error code to the client connected.
+   */
+  if (bytes == -ERRCLIENTDC || bytes == -ERRPACKETERR
+      || bytes == -ERRMAXREQSIZE) {
+    if (bytes != -ERRCLIENTDC) {
+      trace_error(loop->now, cb->fd, (unsigned char) command >> 4, -bytes);
+    }
+    goto errdc;
+  }
+
+  /* Incomplete fixed header, try again on the next EPOLLIN */
+  if (bytes == -ERRAGAIN) {
+    evloop_rearm_callback_read(loop, cb);
+    goto exit;
+  }
+
+  if (bytes == -ERRSTREAM) {
+    /*
+     * Nothing consumed yet, a throttled stream is peeked again later. Its
+     * topic is still to come, only the client limit applies.
+     */
+    if ((wait = bucket_take(&cb->bucket, &client_limit, loop->now)) > 0) {
+      if (throttle(loop, cb, scratch, &buffer, 0, wait) < 0) {
+        goto errdc;
+      }
+      goto exit;
+    }
+    /* Headers only are read, the payload goes to a memory file */
+    int rc = stream_begin(cb, scratch, &buffer, version);
+    if (rc < 0) {
+      goto errdc;
+    }
+    if (rc == 0) {
+      evloop_rearm_callback_read(loop, cb);
+      goto exit;
+    }
+    goto stream;
+  }
+
+  /* Over its limits the frame waits, unparsed, for the buckets to refill */
+  if ((wait = admit_frame(loop, cb, buffer, bytes)) > 0) {
+    if (throttle(loop, cb, scratch, &buffer, bytes, wait) < 0) {
+      goto errdc;
+    }
+    goto exit;
+  }
+
+  info.bytes_recv++;
+  trace_lap(&t, TRACE_RECV, (unsigned char) command >> 4);
+  trace_record(loop->now, TRACE_EV_RECV, cb->fd, (unsigned char) command >> 4,
+               bytes);
+
+  /* 
+   * Unpack recieved bytes into a mqtt_packet structure and 
+   * execute the correct handler based on the type of the operation.
+   */
+
+  /* Malformed packets, e.g. invalid UTF-8 strings, close the connection */
+  if (unpack_mqtt_packet_version(buffer, bytes, &packet, version) < 0) {
+    trace_error(loop->now, cb->fd, (unsigned char) command >> 4, ERRPACKETERR);
+    goto errdc;
+  }
+
+  trace_lap(&t, TRACE_UNPACK, (unsigned char) command >> 4);
+
+  goto dispatch;
+
+stream:
+  switch (stream_continue(cb, &packet)) {
+    case -1:
+      goto errdc;
+    case 0:
+      evloop_rearm_callback_read(loop, cb);
+      goto exit;
+  }
+
+  info.bytes_recv++;
+  command = packet.header.byte;
+  trace_lap(&t, TRACE_RECV, PUBLISH);
+  trace_record(loop->now, TRACE_EV_RECV, cb->fd, PUBLISH,
+               packet.publish.payloadlen);
+
+dispatch:;
+  union mqtt_header hdr = {
+    .byte = command
+  };
+
+  if (mqtt5_track(cb, hdr.bits.type, &packet) < 0) {
+    mqtt_packet_release(&packet, hdr.bits.type);
+    trace_error(loop->now, cb->fd, hdr.bits.type, ERRPACKETERR);
+    goto errdc;
+  }
+
+  if (hdr.bits.type == PUBLISH) {
+    hot_publish(cb, &packet.publish);
+  }
+
+  /* Execute command callback */
+  int rc = handlers[hdr.bits.type](cb, &packet);
+
+  trace_lap(&t, TRACE_HANDLER, hdr.bits.type);
+
+  if (rc == REARM_W) {
+    cb->call = on_write;
+
+    /*
+     * Reset handler to read_handler in order to read new
+     * incomming data and EPOLL event for read fds.
+     */
+    evloop_rearm_callback_write(loop, cb);
+  } else if (rc == REARM_R) {
+    cb->call = on_read;
+    closure_rearm_read(loop, cb);
+  }
+
+exit:
+  if (buffer != scratch) {
+    bufpool_put(buffer);
+  }
+  return;
+errdc:
+  if (buffer != scratch) {
+    bufpool_put(buffer);
+  }
+  trace_record(loop->now, TRACE_EV_CLOSE, cb->fd, 0, 0);
+  bufpool_put(cb->in);
+  cb->in = NULL;
+  sched_remove(cb);
+  outq_clear(&cb->out);
+  conn_unregister(cb);
+  if (cb->mqtt5) {
+    mqtt5_state_release(cb->mqtt5);
+    mem_free(MEM_SESSIONS, cb->mqtt5);
+    cb->mqtt5 = NULL;
+  }
+  if (cb->stream_in) {
+    mqtt_packet_release(cb->stream_in, PUBLISH);
+    free(cb->stream_in);
+    cb->stream_in = NULL;
+  }
+  sol_error("Dropping client");
+  if (cb->shm) {
+    /* The descriptor is the doorbell, closed with the connection */
+    shm_close(cb->shm);
+    mem_free(MEM_CONNECTIONS, cb->shm);
+    cb->shm = NULL;
+  } else {
+    shutdown(cb->fd, 0);
+    close(cb->fd);
+  }
+  zerocopy_destroy(cb->zc);
+  cb->zc = NULL;
+  client_unsubscribe_all(cb->obj);
+  hashtable_del(sol.clients, ((struct sol_client *) cb->obj)->client_id);
+  hashtable_del(sol.closures, cb->closure_id);
+  info.nclients--;
+  info.nconnections--;
+  return;
+}
+
+/*
+ * Shared memory connections are only ever registered for EPOLLIN on their
+ * doorbell, the client rings it when it wrote something or when it made
+ * room the broker asked for. What is left in the ring after a packet has to
+ * be picked up on the next wake up, the doorbell having been acked already.
+ */
+static void closure_rearm_read(struct evloop *loop, struct closure *cb)
+{
+  if (cb->shm && shm_readable(cb->shm) > 0) {
+    shm_kick(cb->shm);
+  }
+  evloop_rearm_callback_read(loop, cb);
+}
+
+/* Wait for room to write the rest of the closure output */
+static void closure_wait_write(struct evloop *loop, struct closure *cb)
+{
+  if (cb->shm) {
+    shm_wait_room(cb->shm);
+    evloop_rearm_callback_read(loop, cb);
+  } else {
+    evloop_rearm_callback_write(loop, cb);
+  }
+}
+
+/*
+ * Closures of the connections by descriptor, subscribers are known by
+ * theirs, the frames routed to them go to the closure queue. Every loop
+ * looks them up, the table is grown and changed under the write lock.
+ */
+static struct closure **conns;
+static int conns_size;
+static pthread_rwlock_t conns_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static int conn_register(struct closure *cb)
+{
+  int err = 0;
+
+  pthread_rwlock_wrlock(&conns_lock);
+
+  if (cb->fd >= conns_size) {
+    int size = conns_size ? conns_size : 1024;
+    while (size <= cb->fd) {
+      size *= 2;
+    }
+    struct closure **c = mem_realloc(MEM_CONNECTIONS, conns,
+                                     size * sizeof(*conns));
+    if (!c) {
+      err = -1;
+      goto out;
+    }
+    memset(c + conns_size, 0, (size - conns_size) * sizeof(*conns));
+    conns = c;
+    conns_size = size;
+  }
+
+  conns[cb->fd] = cb;
+
+out:
+  pthread_rwlock_unlock(&conns_lock);
+  return err;
+}
+
+static void conn_unregister(struct closure *cb)
+{
+  pthread_rwlock_wrlock(&conns_lock);
+  if (cb->fd >= 0 && cb->fd < conns_size && conns[cb->fd] == cb) {
+    conns[cb->fd] = NULL;
+  }
+  pthread_rwlock_unlock(&conns_lock);
+}
+
+/* Caller holds conns_lock */
+static inline struct closure *conn_lookup_locked(int fd)
+{
+  return fd >= 0 && fd < conns_size ? conns[fd] : NULL;
+}
+
+/*
+ * Closure on a descriptor, only safe to use past the lock for the loop
+ * owning it, which is the only one unregistering it.
+ */
+static inline struct closure *conn_lookup(int fd)
+{
+  struct closure *cb;
+
+  pthread_rwlock_rdlock(&conns_lock);
+  cb = conn_lookup_locked(fd);
+  pthread_rwlock_unlock(&conns_lock);
+
+  return cb;
+}
+
+/* Writers of the bulk lane, see outq.h */
+static ssize_t socket_writev(void *arg, const struct iovec *iov, int iovcnt)
+{
+  struct closure *cb = arg;
+  struct msghdr msg = {
+    .msg_iov = (struct iovec *) iov,
+    .msg_iovlen = iovcnt
+  };
+
+  return sendmsg(cb->fd, &msg, MSG_NOSIGNAL);
+}
+
+static ssize_t shm_writev(void *arg, const struct iovec *iov, int iovcnt)
+{
+  struct closure *cb = arg;
+  ssize_t total = 0;
+
+  for (int i = 0; i < iovcnt; i++) {
+    ssize_t n = shm_send(cb->shm, iov[i].iov_base, iov[i].iov_len);
+    if (n < 0) {
+      return total > 0 ? total : -1;
+    }
+    total += n;
+    if ((size_t) n < iov[i].iov_len) {
+      break;
+    }
+  }
+
+  return total;
+}
+
+static ssize_t closure_send_bulk(struct closure *cb, size_t budget,
+                                 int *blocked)
+{
+  unsigned long long sent = cb->out.sent;
+  ssize_t n = outq_send(&cb->out, cb->shm ? shm_writev : socket_writev, cb,
+                        budget, blocked);
+
+  if (n > 0) {
+    info.bytes_sent += n;
+    info.messages_sent += cb->out.sent - sent;
+    hot_sent(cb, n);
+  }
+
+  return n;
+}
+
+/*
+ * Wait for room for the bulk lane, on top of what the closure waits for
+ * already. Whatever wakes it up next puts it back in line, the rest is up
+ * to on_write.
+ */
+static void closure_wait_bulk(struct evloop *loop, struct closure *cb)
+{
+  cb->blocked = 1;
+
+  if (cb->shm) {
+    shm_wait_room(cb->shm);
+  } else if (cb->call == on_read && !cb->throttled) {
+    evloop_rearm_callback_rw(loop, cb);
+  }
+}
+
+static void sched_round(struct evloop *, void *);
+
+/* Put a connection with bulk data to send in line for the next round */
+static void sched_wake(struct closure *cb)
+{
+  if (cb->ready || cb->blocked || !cb->out.head) {
+    return;
+  }
+
+  cb->ready = 1;
+  cb->next_ready = NULL;
+
+  if (sched.tail) {
+    sched.tail->next_ready = cb;
+  } else {
+    sched.head = cb;
+  }
+
+  sched.tail = cb;
+  sched.nr++;
+
+  /* Rounds run after the events of the loop iteration */
+  if (!sched.pending && sched.loop) {
+    sched.round.call = sched_round;
+    sched.round.arg = NULL;
+    if (evloop_defer_callback(sched.loop, &sched.round, 0) == 0) {
+      sched.pending = 1;
+    }
+  }
+}
+
+static struct closure *sched_pop(void)
+{
+  struct closure *cb = sched.head;
+
+  sched.head = cb->next_ready;
+  if (!sched.head) {
+    sched.tail = NULL;
+  }
+
+  sched.nr--;
+  cb->ready = 0;
+  cb->next_ready = NULL;
+
+  return cb;
+}
+
+static void sched_remove(struct closure *cb)
+{
+  if (!cb->ready) {
+    return;
+  }
+
+  struct closure **link = &sched.head;
+  struct closure *prev = NULL;
+
+  while (*link != cb) {
+    prev = *link;
+    link = &(*link)->next_ready;
+  }
+
+  *link = cb->next_ready;
+  if (sched.tail == cb) {
+    sched.tail = prev;
+  }
+
+  sched.nr--;
+  cb->ready = 0;
+  cb->next_ready = NULL;
+}
+
+/*
+ * One round of deficit round robin over the connections with bulk data to
+ * send, run once per loop iteration while there are any, so that reading
+ * and control packets are never held back by it for longer than a round.
+ * Each connection gains SCHED_QUANTUM bytes of credit per round and sends
+ * whole PUBLISH frames as long as its credit covers them, the credit left
+ * carried over to the next round for the larger ones. Connections waiting
+ * for a control packet to go out sit out until on_write is done with it.
+ */
+static void sched_round(struct evloop *loop, void *arg)
+{
+  size_t n = sched.nr;
+  (void) arg;
+
+  sched.pending = 0;
+
+  while (n-- > 0 && sched.head) {
+    struct closure *cb = sched_pop();
+    int blocked = 0;
+
+    if (cb->reply || cb->payload || cb->blob) {
+      continue;
+    }
+
+    cb->deficit += SCHED_QUANTUM;
+
+    ssize_t sent = closure_send_bulk(cb, cb->deficit, &blocked);
+
+    if (sent < 0) {
+      /* The connection error shows up on its next read */
+      sol_error("Error writing on socket to client %s: %s",
+                ((struct sol_client *)cb->obj)->client_id, strerror(errno));
+      outq_clear(&cb->out);
+      cb->deficit = 0;
+      continue;
+    }
+
+    cb->deficit -= sent;
+
+    if (!cb->out.head) {
+      cb->deficit = 0;
+    } else if (blocked) {
+      closure_wait_bulk(loop, cb);
+    } else {
+      sched_wake(cb);
+    }
+  }
+}
+
+/* Release callback of payloads pinned by zerocopy sends */
+static void payload_release(void *payload)
+{
+  bytestring_release(payload);
+}
+
+static void on_write(struct evloop *loop, void *arg)
+{
+  struct closure *cb = arg;
+  const unsigned char *out;
+  size_t len;
+  ssize_t sent;
+  int zerocopy = 0;
+
+  /* Payloads sent with zerocopy the kernel is done with */
+  if (cb->zc && zerocopy_reap(cb->zc, cb->fd) < 0) {
+    sol_error("Error reading zerocopy completions of client %s: %s",
+              ((struct sol_client *)cb->obj)->client_id, strerror(errno));
+  }
+
+  if (cb->shm) {
+    shm_ack(cb->shm);
+  }
+
+  /* A PUBLISH of the bulk lane went out in part, it has to be finished */
+  size_t started = outq_started(&cb->out);
+
+  if (started > 0) {
+    int blocked;
+    if (closure_send_bulk(cb, started, &blocked) < 0) {
+      sol_error("Error writing on socket to client %s: %s",
+                ((struct sol_client *)cb->obj)->client_id, strerror(errno));
+      outq_clear(&cb->out);
+    } else if (blocked) {
+      closure_wait_write(loop, cb);
+      return;
+    }
+  }
+
+  if (cb->reply) {
+    out = cb->reply;
+    len = cb->replylen;
+  } else if (cb->payload) {
+    out = cb->payload->data;
+    len = cb->payload->size;
+  } else {
+    /* Dropped under memory pressure before it could go out */
+    goto rearm;
+  }
+
+  /*
+   * Large payloads go with zerocopy, the state is only set up for the
+   * clients receiving them. Smaller ones are copied, whatever came before,
+   * pinning pages and reaping a completion costs more than the copy. The
+   * choice holds for every part of a payload, its size doesn't change.
+   */
+  if (!cb->reply && !cb->shm && ZEROCOPY_THRESHOLD > 0 &&
+      len >= ZEROCOPY_THRESHOLD) {
+    if (!cb->zc) {
+      cb->zc = zerocopy_create(cb->fd);
+    }
+    zerocopy = cb->zc != NULL;
+  }
+
+  if (cb->shm) {
+    sent = shm_send(cb->shm, out + cb->written, len - cb->written);
+  } else if (zerocopy) {
+    sent = zerocopy_send(cb->zc, cb->fd, out + cb->written, len - cb->written);
+  } else {
+    sent = send_bytes(cb->fd, out + cb->written, len - cb->written);
+  }
+
+  if (sent < 0) {
+    sol_error("Error writing on socket to client %s: %s",
+              ((struct sol_client *)cb->obj)->client_id, strerror(errno));
+    goto rearm;
+  }
+
+  /* Update information stats */
+  info.bytes_sent += sent;
+  hot_sent(cb, sent);
+  cb->written += sent;
+
+  /* Socket buffer full, wait for it to drain before sending the rest */
+  if (cb->written < len) {
+    closure_wait_write(loop, cb);
+    return;
+  }
+
+  /* Streamed payload, straight from its memory file */
+  if (cb->blob) {
+    if (cb->shm) {
+      sent = shm_send_file(cb->shm, cb->blob->fd, &cb->blob_sent,
+                           cb->blob->size);
+    } else {
+      sent = stream_blob_send(cb->blob, cb->fd, &cb->blob_sent);
+    }
+    if (sent < 0) {
+      sol_error("Error streaming payload to client %s: %s",
+                ((struct sol_client *)cb->obj)->client_id, strerror(errno));
+      goto rearm;
+    }
+    info.bytes_sent += sent;
+    hot_sent(cb, sent);
+    if (cb->blob_sent < cb->blob->size) {
+      closure_wait_write(loop, cb);
+      return;
+    }
+  }
+
+rearm:
+  if (cb->reply) {
+    cb->reply = NULL;
+    cb->replylen = 0;
+  } else if (!cb->payload) {
+    /* Nothing left, see above */
+  } else if (zerocopy) {
+    /* Kept until the kernel is done sending it */
+    zerocopy_pin(cb->zc, cb->payload, payload_release);
+    cb->payload = NULL;
+  } else {
+    bytestring_release(cb->payload);
+    cb->payload = NULL;
+  }
+
+  cb->written = 0;
+
+  if (cb->blob) {
+    stream_blob_put(cb->blob);
+    cb->blob = NULL;
+    cb->blob_sent = 0;
+  }
+
+  /* Re-arm callback by setting EPOLL event on EPOLLIN to read fds and
+   * re-assinging the callback "on_read" for the next event.
+   */
+  cb->call = on_read;
+  closure_rearm_read(loop, cb);
+
+  /* Control output done, the bulk lane can carry on */
+  cb->blocked = 0;
+  sched_wake(cb);
+}
+
+/*
+ * Set a fixed size reply as the closure output, frame is either a static
+ * one or the closure reply_buf, either way nothing needs to be freed after
+ * it is sent.
+ */
+static void closure_reply(struct closure *cb, const unsigned char *frame,
+                          size_t len)
+{
+  cb->reply = frame;
+  cb->replylen = len;
+  cb->written = 0;
+}
+
+static int pingreq_handler(struct closure *cb, union mqtt_packet *pkt)
+{
+  (void) pkt;
+  sol_debug("Received PINGREQ");
+
+  /* Reply with the static PINGRESP frame */
+  closure_reply(cb, mqtt_pingresp_frame, MQTT_HEADER_LEN);
+
+  return REARM_W;
+}
+
+static int pubrec_handler(struct closure *cb, union mqtt_packet *pkt)
+{
+  sol_debug("Received PUBREC (m%u)", pkt->ack.pkt_id);
+
+  /* Reply with a PUBREL, its fixed header flags must be 0010 */
+  size_t len = mqtt_pack_ack(cb->reply_buf, PUBREL_BYTE | 0x02,
+                             pkt->ack.pkt_id);
+  closure_reply(cb, cb->reply_buf, len);
+
+  return REARM_W;
+}
+
+static int pubrel_handler(struct closure *cb, union mqtt_packet *pkt)
+{
+  sol_debug("Received PUBREL (m%u)", pkt->ack.pkt_id);
+
+  /* Reply with a PUBCOMP */
+  size_t len = mqtt_pack_ack(cb->reply_buf, PUBCOMP_BYTE, pkt->ack.pkt_id);
+  closure_reply(cb, cb->reply_buf, len);
+
+  return REARM_W;
+}
+
+/* 
+ * Statistics topics, published every N seconds defined by configuration
+ * interval.
+ */
+#define SYS_TOPICS      26
+
+static const char *sys_topics[SYS_TOPICS] = {
+  "$SOL/",
+  "$SOL/broker/",
+  "$SOL/broker/clients/",
+  "$SOL/broker/bytes/",
+  "$SOL/broker/messages/",
+  "$SOL/broker/uptime/",
+  "$SOL/broker/uptime/sol",
+  "$SOL/broker/clients/connected/",
+  "$SOL/broker/clients/disconnected/",
+  "$SOL/broker/clients/throttled/",
+  "$SOL/broker/bytes/sent/",
+  "$SOL/broker/bytes/received/",
+  "$SOL/broker/messages/sent/",
+  "$SOL/broker/messages/received/",
+  "$SOL/broker/memory/used/",
+  "$SOL/broker/filter/",
+  "$SOL/broker/filter/hits/",
+  "$SOL/broker/filter/misses/",
+  "$SOL/broker/filter/false_positives/",
+  "$SOL/broker/top/",
+  "$SOL/broker/top/topics/",
+  "$SOL/broker/top/clients/",
+  "$SOL/broker/top/topics/messages/",
+  "$SOL/broker/top/topics/bytes/",
+  "$SOL/broker/top/clients/messages/",
+  "$SOL/broker/top/clients/bytes/",
+};
+
+/* Count a PUBLISH received, one in TOPK_SAMPLE standing for them all */
+static void hot_publish(struct closure *cb, const struct mqtt_publish *p)
+{
+  if (!hot_loop.topics || !topk_sampled(&hot_loop.rng)) {
+    return;
+  }
+
+  const char *topic = (const char *) p->topic;
+  uint64_t bytes = p->payloadlen * TOPK_SAMPLE;
+
+  topk_add(hot_loop.topics, intern_hash(topic, p->topiclen), topic,
+           p->topiclen, TOPK_SAMPLE, bytes);
+
+  if (!cb->obj) {
+    return;
+  }
+
+  const char *id = ((struct sol_client *) cb->obj)->client_id;
+  size_t len = strlen(id);
+
+  topk_add(hot_loop.clients, intern_hash(id, len), id, len, TOPK_SAMPLE,
+           bytes);
+}
+
+/* Count bytes sent to a client, sampled the same way */
+static void hot_sent(struct closure *cb, size_t n)
+{
+  if (!cb->obj || !hot_loop.clients || !topk_sampled(&hot_loop.rng)) {
+    return;
+  }
+
+  const char *id = ((struct sol_client *) cb->obj)->client_id;
+  size_t len = strlen(id);
+
+  topk_add(hot_loop.clients, intern_hash(id, len), id, len, 0,
+           (uint64_t) n * TOPK_SAMPLE);
+}
+
+/*
+ * Ranking of a tracker as a JSON object, the keys escaped, counts being the
+ * decayed estimates. Returns the lenght written, buf must hold HOT_REPORT.
+ */
+#define HOT_REPORT      (TOPK_SIZE * (TOPK_KEY * 6 + 64) + 64)
+
+static size_t hot_format(const struct topk *t, enum topk_metric m,
+                         char *buf)
+{
+  struct topk_entry top[TOPK_SIZE];
+  size_t n = topk_list(t, m, top);
+  size_t len = 0;
+
+  len += sprintf(buf, "{\"interval_ms\":%d,\"total\":%llu,\"top\":[",
+                 TOPK_INTERVAL, (unsigned long long) t->total[m]);
+
+  for (size_t i = 0; i < n; i++) {
+    len += sprintf(buf + len, "%s{\"key\":\"", i ? "," : "");
+    for (const unsigned char *c = (unsigned char *) top[i].key; *c; c++) {
+      if (*c == '"' || *c == '\\') {
+        len += sprintf(buf + len, "\\%c", *c);
+      } else if (*c < 0x20) {
+        len += sprintf(buf + len, "\\u%04x", *c);
+      } else {
+        buf[len++] = *c;
+      }
+    }
+    len += sprintf(buf + len, "\",\"count\":%llu,\"truncated\":%s}",
+                   (unsigned long long) top[i].count,
+                   top[i].len >= TOPK_KEY ? "true" : "false");
+  }
+
+  len += sprintf(buf + len, "]}");
+
+  return len;
+}
+
+/* Publish the rankings, retained, then decay them for the next interval */
+static void hot_report(struct evloop *loop, void *arg)
+{
+  static const struct {
+    const char *topic;
+    struct topk *t;
+    enum topk_metric m;
+  } reports[] = {
+    { "$SOL/broker/top/topics/messages/", &hot.topics, TOPK_MESSAGES },
+    { "$SOL/broker/top/topics/bytes/", &hot.topics, TOPK_BYTES },
+    { "$SOL/broker/top/clients/messages/", &hot.clients, TOPK_MESSAGES },
+    { "$SOL/broker/top/clients/bytes/", &hot.clients, TOPK_BYTES },
+  };
+  static char bufs[sizeof(reports) / sizeof(reports[0])][HOT_REPORT];
+  size_t lens[sizeof(reports) / sizeof(reports[0])];
+  (void) arg;
+
+  /* Formatted under the lock, published out of it */
+  pthread_mutex_lock(&hot.lock);
+
+  for (size_t i = 0; i < sizeof(reports) / sizeof(reports[0]); i++) {
+    lens[i] = hot_format(reports[i].t, reports[i].m, bufs[i]);
+  }
+
+  topk_decay(&hot.topics);
+  topk_decay(&hot.clients);
+
+  pthread_mutex_unlock(&hot.lock);
+
+  for (size_t i = 0; i < sizeof(reports) / sizeof(reports[0]); i++) {
+    if (sol_publish(reports[i].topic, (unsigned char *) bufs[i], lens[i],
+                    AT_MOST_ONCE, 1) < 0) {
+      sol_error("Error publishing %s", reports[i].topic);
+    }
+  }
+
+  if (evloop_defer_callback(loop, &hot.tick, TOPK_INTERVAL) < 0) {
+    sol_error("Heavy hitters reports stopped, out of memory");
+  }
+}
+
+/* Merge the trackers of the loop into the broker ones and start over */
+static void hot_fold(struct evloop *loop, void *arg)
+{
+  (void) arg;
+
+  pthread_mutex_lock(&hot.lock);
+  topk_merge(&hot.topics, hot_loop.topics);
+  topk_merge(&hot.clients, hot_loop.clients);
+  pthread_mutex_unlock(&hot.lock);
+
+  topk_init(hot_loop.topics);
+  topk_init(hot_loop.clients);
+
+  if (evloop_defer_callback(loop, &hot_loop.tick, TOPK_INTERVAL) < 0) {
+    sol_error("Heavy hitters of the loop stopped, out of memory");
+  }
+}
+
+/* Trackers of the loop, nothing is counted by a loop without them */
+static void hot_start(struct evloop *loop)
+{
+  hot_loop.topics = calloc(1, sizeof(*hot_loop.topics));
+  hot_loop.clients = calloc(1, sizeof(*hot_loop.clients));
+
+  if (!hot_loop.topics || !hot_loop.clients) {
+    goto err;
+  }
+
+  hot_loop.tick.call = hot_fold;
+  hot_loop.tick.arg = NULL;
+
+  if (evloop_defer_callback(loop, &hot_loop.tick, TOPK_INTERVAL) < 0) {
+    goto err;
+  }
+
+  return;
+
+err:
+  free(hot_loop.topics);
+  free(hot_loop.clients);
+  hot_loop.topics = NULL;
+  hot_loop.clients = NULL;
+  sol_error("Heavy hitters of the loop unavailable, out of memory");
+}
+
+/*
+ * Per-loop topic intern table, caches the subscription set of every topic
+ * published through the loop.
+ */
+static _Thread_local struct intern_table routing_cache;
+
+/*
+ * Route a published topic to every matching subscription, asking the
+ * negative-lookup filter first so that topics nobody is subscribed to are
+ * dropped without walking the trie, then the loop intern table so that hot
+ * topics are routed by ID from their cached subscription set. Returns the
+ * number of subscriptions matched.
+ */
+static size_t route_publish(const char *topic, trie_match_cb *cb, void *arg)
+{
+  if (!trie_may_match(&sol.topics, topic)) {
+    info.filter_hits++;
+    return 0;
+  }
+
+  info.filter_misses++;
+
+  size_t matched;
+
+  if (!routing_cache.entries &&
+      intern_init(&routing_cache, &sol.topics, INTERN_CAPACITY) < 0) {
+    matched = trie_match(&sol.topics, topic, cb, arg);
+  } else {
+    matched = intern_route(&routing_cache, topic, strlen(topic), cb, arg);
+  }
+
+  if (matched == 0) {
+    info.filter_false_positives++;
+  }
+
+  return matched;
+}
+
+/* Filters of a client, collected by a walk to be unsubscribed after it */
+struct client_filters {
+  const void *client;
+  char **filters;
+  size_t nr;
+  size_t cap;
+  int err;
+};
+
+static void client_filters_collect(const char *filter,
+                                   const struct subscription *sub, void *arg)
+{
+  struct client_filters *f = arg;
+
+  if (f->err || sub->subscriber != f->client) {
+    return;
+  }
+
+  if (f->nr == f->cap) {
+    size_t cap = f->cap ? f->cap * 2 : 16;
+    char **filters = realloc(f->filters, cap * sizeof(*filters));
+    if (!filters) {
+      f->err = 1;
+      return;
+    }
+    f->filters = filters;
+    f->cap = cap;
+  }
+
+  if (!(f->filters[f->nr] = strdup(filter))) {
+    f->err = 1;
+    return;
+  }
+
+  f->nr++;
+}
+
+/*
+ * Subscriptions hold the client by pointer, routing and the intern tables
+ * would still find it once freed. Unsubscribing logs every filter, the
+ * intern tables drop their entries for them on their next lookup.
+ */
+static void client_unsubscribe_all(struct sol_client *client)
+{
+  struct client_filters f = { .client = client };
+
+  if (!client) {
+    return;
+  }
+
+  if (trie_walk(&sol.topics, client_filters_collect, &f) < 0 || f.err) {
+    sol_error("Unsubscribing %s: %s", client->client_id, strerror(ENOMEM));
+  }
+
+  for (size_t i = 0; i < f.nr; i++) {
+    trie_unsubscribe(&sol.topics, f.filters[i], client);
+    free(f.filters[i]);
+  }
+
+  free(f.filters);
+}
+
+/*
+ * Reactions to memory pressure, in the order memory.h defines. Offline
+ * sessions keep no queue in this broker, there is nothing to spill.
+ */
+static size_t reclaim_routing_cache(void *arg)
+{
+  (void) arg;
+
+  if (!routing_cache.entries) {
+    return 0;
+  }
+
+  size_t used = mem_tag_used(MEM_TRIE);
+
+  /* Rebuilt on the next publish, starting from the hottest topics again */
+  intern_release(&routing_cache);
+
+  return used - mem_tag_used(MEM_TRIE);
+}
+
+static void drop_qos0_backlog(struct closure *cb, size_t *released)
+{
+  /* Frames setting a topic alias have to go out, later ones rely on it */
+  if (cb->mqtt5 && cb->mqtt5->alias_out_max > 0) {
+    return 0;
+  }
+
+  size_t queued = cb->out.bytes;
+
+  /* Routed messages waiting in the bulk lane */
+  info.messages_dropped += outq_drop_qos0(&cb->out);
+  *released += queued - cb->out.bytes;
+
+  /* Only whole messages not started yet, nor followed by a stream */
+  if (!cb->payload || cb->written > 0 || cb->blob) {
+    return;
+  }
+
+  unsigned char byte = cb->payload->data[0];
+
+  if ((byte >> 4) != PUBLISH || ((byte >> 1) & 0x03) != AT_MOST_ONCE) {
+    return;
+  }
+
+  *released += cb->payload->size;
+  bytestring_release(cb->payload);
+  cb->payload = NULL;
+  info.messages_dropped++;
+}
+
+/*
+ * Every loop drops the backlog of its own connections, found in the
+ * connection table, the read lock keeps other loops from growing it.
+ */
+static size_t reclaim_qos0_backlog(void *arg)
+{
+  size_t released = 0;
+  (void) arg;
+
+  pthread_rwlock_rdlock(&conns_lock);
+
+  for (int fd = 0; fd < conns_size; fd++) {
+    if (conns[fd] && conns[fd]->mailbox == &mailbox) {
+      drop_qos0_backlog(conns[fd], &released);
+    }
+  }
+
+  pthread_rwlock_unlock(&conns_lock);
+
+  return released;
+}
+
+static size_t reclaim_buffers(void *arg)
+{
+  (void) arg;
+  return bufpool_shrink();
+}
+
+static void memory_reclaimers(void)
+{
+  mem_reclaimer(MEM_SHRINK, reclaim_buffers, NULL);
+  mem_reclaimer(MEM_SHRINK, reclaim_routing_cache, NULL);
+  mem_reclaimer(MEM_DROP_QOS0, reclaim_qos0_backlog, NULL);
+}
+
+/* Pressure level the loop reached last and when it last reclaimed */
+static _Thread_local struct {
+  enum mem_pressure level;
+  unsigned long long at;
+} reclaimed;
+
+/*
+ * Reclaim on the way up a level, then every MEM_RECLAIM_INTERVAL for as
+ * long as the level holds, never on every packet. Levels are left with
+ * hysteresis, see mem_pressure_since.
+ */
+static enum mem_pressure memory_reclaim(unsigned long long now)
+{
+  static pthread_once_t registered = PTHREAD_ONCE_INIT;
+  enum mem_pressure level = mem_pressure_since(reclaimed.level);
+
+  if (level == MEM_OK) {
+    reclaimed.level = MEM_OK;
+    return MEM_OK;
+  }
+
+  if (level > reclaimed.level || now - reclaimed.at >= MEM_RECLAIM_INTERVAL) {
+    pthread_once(&registered, memory_reclaimers);
+    mem_reclaim();
+    reclaimed.at = now;
+  }
+
+  reclaimed.level = level;
+
+  return mem_pressure();
+}
+
+/*
+ * Embedded broker, see broker.h. In-process subscribers are stored in the
+ * trie as any client, their qos flagged with TRIE_SUB_LOCAL, so the same
+ * routing serves both and only delivery tells them apart.
+ */
+struct sol_subscriber {
+  char *filter;
+  sol_message_cb *cb;
+  void *arg;
+  /* Unsubscribed, a routing already under way must skip it */
+  int cancelled;
+};
+
+/* Last message retained on a topic, kept sorted by topic */
+struct retained {
+  char *topic;
+  unsigned char *payload;
+  size_t payloadlen;
+  unsigned qos;
+};
+
+static struct evloop *embed_loop;
+static struct retained *retained;
+static size_t retained_nr;
+static size_t retained_cap;
+
+/*
+ * Packet identifier of the QoS 1 and 2 messages sent to remote clients,
+ * taken by every loop routing them.
+ */
+static atomic_ushort embed_pkt_id;
+
+/*
+ * A message being routed. Frames for remote subscribers are packed on the
+ * first one needing them, one per QoS and protocol version, and queued to
+ * each of them with its own packet identifier, see outq.h.
+ */
+struct delivery {
+  const char *topic;
+  const unsigned char *payload;
+  size_t payloadlen;
+  unsigned qos;
+  /* MQTT v3.1.1 frames, then MQTT 5 ones without properties */
+  struct outq_frame *frames[2][3];
+};
+
+/* Pack a PUBLISH into a frame, its packet identifier spliced in later */
+static struct outq_frame *publish_frame(const union mqtt_packet *pkt,
+                                        unsigned char version)
+{
+  trace_tick t = trace_start();
+  size_t len = mqtt_publish_size(pkt, version);
+
+  if (len == 0) {
+    return NULL;
+  }
+
+  /* Packed straight into a huge page backed buffer when it fits */
+  unsigned char *data = arena_alloc(len);
+
+  if (data) {
+    mem_charge(MEM_QUEUES, arena_size(data));
+  } else if (!(data = mem_malloc(MEM_QUEUES, len))) {
+    return NULL;
+  }
+
+  mqtt_pack_publish(data, pkt, version);
+  trace_lap(&t, TRACE_PACK, PUBLISH);
+
+  /* The packet identifier comes right before the properties and payload */
+  size_t id_off = len - pkt->publish.payloadlen - 2;
+
+  if (version == MQTT_V5) {
+    id_off -= mqtt_properties_size(&pkt->publish.properties);
+  }
+
+  struct outq_frame *frame = outq_frame_create(data, len, id_off,
+                                               pkt->header.bits.qos);
+
+  if (!frame) {
+    outq_data_free(data);
+  }
+
+  return frame;
+}
+
+static struct outq_frame *delivery_frame(struct delivery *d, unsigned qos,
+                                         unsigned char version)
+{
+  int v = version == MQTT_V5;
+
+  if (!d->frames[v][qos]) {
+    union mqtt_packet pkt = {
+      .publish = {
+        .header.byte = PUBLISH_BYTE | (qos << 1),
+        .topiclen = strlen(d->topic),
+        .topic = (unsigned char *) d->topic,
+        .payloadlen = d->payloadlen,
+        .payload = (unsigned char *) d->payload
+      }
+    };
+    d->frames[v][qos] = publish_frame(&pkt, version);
+  }
+
+  return d->frames[v][qos];
+}
+
+/*
+ * Message of a frame packed by delivery_frame for MQTT v3.1.1, pointing in
+ * its data, to be packed again for an MQTT 5 connection.
+ */
+static void frame_publish(const struct outq_frame *frame,
+                          union mqtt_packet *pkt)
+{
+  const unsigned char *ptr = frame->data + 1;
+  size_t len;
+  int lenght_bytes = mqtt_decode_lenght_window(ptr, frame->len - 1, &len);
+
+  memset(pkt, 0, sizeof(*pkt));
+  ptr += lenght_bytes;
+  pkt->publish.header.byte = frame->data[0];
+  pkt->publish.topiclen = (ptr[0] << 8) | ptr[1];
+  pkt->publish.topic = (unsigned char *) ptr + 2;
+  ptr += 2 + pkt->publish.topiclen;
+  if (frame->qos > AT_MOST_ONCE) {
+    ptr += 2;
+  }
+  pkt->publish.payload = (unsigned char *) ptr;
+  pkt->publish.payloadlen = frame->data + frame->len - ptr;
+}
+
+static inline unsigned char closure_version(const struct closure *cb)
+{
+  return cb->mqtt5 ? cb->mqtt5->version : MQTT_V311;
+}
+
+/*
+ * Queue a message to an MQTT 5 connection, from the loop owning it, the
+ * only one touching its state. A QoS > 0 message takes a slot of the client
+ * Receive Maximum, one over it or over its Maximum Packet Size is dropped,
+ * nothing waits. With a topic alias the message is packed again for the
+ * connection, else the shared frame of the delivery is queued, if any.
+ */
+static void deliver_v5(struct closure *sc, struct delivery *d,
+                       union mqtt_packet *pkt, unsigned short pkt_id)
+{
+  struct mqtt5_state *state = sc->mqtt5;
+  unsigned qos = pkt->header.bits.qos;
+  struct outq_frame *frame, *own = NULL;
+
+  if (qos > AT_MOST_ONCE && mqtt5_inflight_acquire(state) < 0) {
+    info.messages_dropped++;
+    return;
+  }
+
+  /* Too big for the client, no alias was assigned for it */
+  if (mqtt5_publish_out(state, &pkt->publish) == 0) {
+    info.messages_dropped++;
+    goto release;
+  }
+
+  if (d && pkt->publish.properties.set == 0) {
+    frame = delivery_frame(d, qos, MQTT_V5);
+  } else {
+    frame = own = publish_frame(pkt, MQTT_V5);
+  }
+
+  if (!frame || outq_push(&sc->out, frame, pkt_id) < 0) {
+    sol_error("Error publishing to %s: %s",
+              ((struct sol_client *) sc->obj)->client_id, strerror(ENOMEM));
+    outq_frame_put(own);
+    goto release;
+  }
+
+  /* The queue holds its own reference */
+  outq_frame_put(own);
+  sched_wake(sc);
+  return;
+
+release:
+  if (qos > AT_MOST_ONCE) {
+    mqtt5_inflight_release(state);
+  }
+}
+
+static void deliver(const struct subscription *sub, void *arg)
+{
+  struct delivery *d = arg;
+  unsigned qos = TRIE_SUB_QOS(sub->qos);
+
+  if (qos > d->qos) {
+    qos = d->qos;
+  }
+
+  if (sub->qos & TRIE_SUB_LOCAL) {
+    struct sol_subscriber *s = sub->subscriber;
+    if (!s->cancelled) {
+      s->cb(d->topic, d->payload, d->payloadlen, qos, s->arg);
+    }
+    return;
+  }
+
+  int fd = ((struct sol_client *) sub->subscriber)->fd;
+  unsigned short pkt_id = 0;
+
+  if (qos > AT_MOST_ONCE) {
+    do {
+      pkt_id = atomic_fetch_add_explicit(&embed_pkt_id, 1,
+                                         memory_order_relaxed) + 1;
+    } while (pkt_id == 0);
+  }
+
+  /*
+   * The queue and the scheduler of another loop are for it to update, its
+   * closure is only read under the lock, the loop may be closing it. A
+   * descriptor reused by another client since is no connection of this
+   * subscriber. Other loops get the MQTT v3.1.1 frame, packed again there
+   * for MQTT 5 connections.
+   */
+  pthread_rwlock_rdlock(&conns_lock);
+
+  struct closure *sc = conn_lookup_locked(fd);
+
+  if (sc && sc->obj != sub->subscriber) {
+    sc = NULL;
+  }
+
+  if (sc && sc->mailbox != &mailbox) {
+    struct outq_frame *frame = delivery_frame(d, qos, MQTT_V311);
+    if (!frame ||
+        outq_mailbox_post(sc->mailbox, sc->fd, sub->subscriber, frame,
+                          pkt_id) < 0) {
+      sol_error("Error publishing to %s: %s",
+                ((struct sol_client *) sub->subscriber)->client_id,
+                strerror(ENOMEM));
+    }
+    pthread_rwlock_unlock(&conns_lock);
+    return;
+  }
+
+  pthread_rwlock_unlock(&conns_lock);
+
+  /* Offline subscriber, nothing is queued for it */
+  if (!sc) {
+    return;
+  }
+
+  if (closure_version(sc) == MQTT_V5) {
+    union mqtt_packet pkt = {
+      .publish = {
+        .header.byte = PUBLISH_BYTE | (qos << 1),
+        .topiclen = strlen(d->topic),
+        .topic = (unsigned char *) d->topic,
+        .payloadlen = d->payloadlen,
+        .payload = (unsigned char *) d->payload
+      }
+    };
+    deliver_v5(sc, d, &pkt, pkt_id);
+    return;
+  }
+
+  struct outq_frame *frame = delivery_frame(d, qos, MQTT_V311);
+
+  /* Sent by the loop scheduler, behind the control packets of the client */
+  if (!frame || outq_push(&sc->out, frame, pkt_id) < 0) {
+    sol_error("Error publishing to %s: %s",
+              ((struct sol_client *) sub->subscriber)->client_id,
+              strerror(ENOMEM));
+    return;
+  }
+
+  sched_wake(sc);
+}
+
+/*
+ * Frame posted by another thread, queued if its connection is still the one
+ * of the subscriber on the descriptor.
+ */
+static void mailbox_deliver(const struct outq_post *p, void *arg)
+{
+  struct closure *sc = conn_lookup(p->fd);
+  (void) arg;
+
+  if (!sc || sc->obj != p->target) {
+    return;
+  }
+
+  if (closure_version(sc) == MQTT_V5) {
+    union mqtt_packet pkt;
+    frame_publish(p->frame, &pkt);
+    deliver_v5(sc, NULL, &pkt, p->pkt_id);
+    return;
+  }
+
+  if (outq_push(&sc->out, p->frame, p->pkt_id) < 0) {
+    sol_error("Error publishing to %s: %s",
+              ((struct sol_client *) sc->obj)->client_id, strerror(errno));
+    return;
+  }
+
+  sched_wake(sc);
+}
+
+static void on_mailbox(struct evloop *loop, void *arg)
+{
+  struct closure *cb = arg;
+
+  sched.loop = loop;
+  outq_mailbox_drain(&mailbox, mailbox_deliver, NULL);
+  evloop_rearm_callback_read(loop, cb);
+}
+
+/* Set the mailbox of the loop running on this thread up */
+static int mailbox_start(struct evloop *loop)
+{
+  if (mailbox.fd >= 0) {
+    return 0;
+  }
+
+  if (outq_mailbox_init(&mailbox) < 0) {
+    return -1;
+  }
+
+  memset(&mailbox_closure, 0, sizeof(mailbox_closure));
+  mailbox_closure.fd = mailbox.fd;
+  mailbox_closure.arg = &mailbox_closure;
+  mailbox_closure.call = on_mailbox;
+  evloop_add_callback(loop, &mailbox_closure);
+
+  return 0;
+}
+
+/* Index of the retained message of a topic, or where it would go */
+static size_t retained_find(const char *topic, int *found)
+{
+  size_t lo = 0, hi = retained_nr;
+
+  *found = 0;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    int cmp = strcmp(topic, retained[mid].topic);
+    if (cmp == 0) {
+      *found = 1;
+      return mid;
+    }
+    if (cmp < 0) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+
+  return lo;
+}
+
+static int retain_message(const char *topic, const unsigned char *payload,
+                          size_t payloadlen, unsigned qos)
+{
+  int found;
+  size_t i = retained_find(topic, &found);
+
+  if (found) {
+    mem_free(MEM_RETAINED, retained[i].topic);
+    mem_free(MEM_RETAINED, retained[i].payload);
+    memmove(retained + i, retained + i + 1,
+            (retained_nr - i - 1) * sizeof(*retained));
+    retained_nr--;
+  }
+
+  /* An empty retained message only clears the previous one */
+  if (payloadlen == 0) {
+    return 0;
+  }
+
+  if (retained_nr == retained_cap) {
+    size_t cap = retained_cap ? retained_cap * 2 : 64;
+    struct retained *r = mem_realloc(MEM_RETAINED, retained, cap * sizeof(*r));
+    if (!r) {
+      return -1;
+    }
+    retained = r;
+    retained_cap = cap;
+  }
+
+  struct retained r = {
+    .topic = mem_strdup(MEM_RETAINED, topic),
+    .payload = mem_malloc(MEM_RETAINED, payloadlen),
+    .payloadlen = payloadlen,
+    .qos = qos
+  };
+
+  if (!r.topic || !r.payload) {
+    mem_free(MEM_RETAINED, r.topic);
+    mem_free(MEM_RETAINED, r.payload);
+    return -1;
+  }
+
+  memcpy(r.payload, payload, payloadlen);
+  memmove(retained + i + 1, retained + i,
+          (retained_nr - i) * sizeof(*retained));
+  retained[i] = r;
+  retained_nr++;
+
+  return 0;
+}
+
+int sol_init(struct evloop *loop)
+{
+  embed_loop = loop;
+  sched.loop = loop;
+
+  if (loop && mailbox_start(loop) < 0) {
+    return -1;
+  }
+
+  /* Without a server the index is ours to set up */
+  if (!loop) {
+    trie_init(&sol.topics);
+  }
+
+  /* Publishing reads the index from this thread */
+  return rcu_register_thread();
+}
+
+int sol_publish(const char *topic, const unsigned char *payload,
+                size_t payloadlen, unsigned qos, int retain)
+{
+  if (qos > EXACTLY_ONCE ||
+      !mqtt_valid_topic_name((const unsigned char *) topic, strlen(topic))) {
+    return -1;
+  }
+
+  if (retain && retain_message(topic, payload, payloadlen, qos) < 0) {
+    return -1;
+  }
+
+  struct delivery d = {
+    .topic = topic,
+    .payload = payload,
+    .payloadlen = payloadlen,
+    .qos = qos
+  };
+
+  info.messages_recv++;
+
+  size_t matched = route_publish(topic, deliver, &d);
+
+  /* Queued frames are held by the queues for as long as needed */
+  for (int v = 0; v < 2; v++) {
+    for (int i = 0; i < 3; i++) {
+      outq_frame_put(d.frames[v][i]);
+    }
+  }
+
+  return matched;
+}
+
+struct sol_subscriber *sol_subscribe(const char *filter, unsigned qos,
+                                     sol_message_cb *cb, void *arg)
+{
+  if (qos > EXACTLY_ONCE ||
+      !mqtt_valid_topic_filter((const unsigned char *) filter,
+                               strlen(filter))) {
+    return NULL;
+  }
+
+  struct sol_subscriber *s = mem_malloc(MEM_SESSIONS, sizeof(*s));
+
+  if (!s || !(s->filter = mem_strdup(MEM_SESSIONS, filter))) {
+    mem_free(MEM_SESSIONS, s);
+    return NULL;
+  }
+
+  s->cb = cb;
+  s->arg = arg;
+  s->cancelled = 0;
+
+  if (trie_subscribe(&sol.topics, filter, s, qos | TRIE_SUB_LOCAL) < 0) {
+    mem_free(MEM_SESSIONS, s->filter);
+    mem_free(MEM_SESSIONS, s);
+    return NULL;
+  }
+
+  /* Retained messages don't go to shared groups */
+  if (strncmp(filter, TRIE_SHARE_PREFIX, sizeof(TRIE_SHARE_PREFIX) - 1)) {
+    for (size_t i = 0; i < retained_nr && !s->cancelled; i++) {
+      if (trie_filter_match(filter, retained[i].topic)) {
+        s->cb(retained[i].topic, retained[i].payload, retained[i].payloadlen,
+              retained[i].qos < qos ? retained[i].qos : qos, s->arg);
+      }
+    }
+  }
+
+  return s;
+}
+
+static void subscriber_free(void *arg)
+{
+  struct sol_subscriber *s = arg;
+  mem_free(MEM_SESSIONS, s->filter);
+  mem_free(MEM_SESSIONS, s);
+}
+
+int sol_unsubscribe(struct sol_subscriber *s)
+{
+  if (s->cancelled || trie_unsubscribe(&sol.topics, s->filter, s) < 0) {
+    return -1;
+  }
+
+  /* Routings under way may still see it, until the next quiescent point */
+  s->cancelled = 1;
+  rcu_defer(s, subscriber_free);
+
+  return 0;
+}
+
+int sol_poll(int timeout)
+{
+  if (embed_loop) {
+    return evloop_poll(embed_loop, timeout);
+  }
+
+  rcu_quiescent_state();
+
+  return 0;
+}
+
+/*
+ * Zero-downtime restart, see handover.h. Closure of the handover socket and
+ * the listening socket handed over with the clients.
+ */
+static struct closure handover_closure;
+static int handover_listenfd = -1;
+
+/*
+ * Loops stopped for a handover. Ringing fd, watched by every loop started,
+ * has each of them drain what it holds and park until stopping is cleared,
+ * which happens only if the handover failed.
+ */
+static struct {
+  pthread_once_t once;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int fd;
+  int stopping;
+  int running;
+  int parked;
+} quiesce = {
+  PTHREAD_ONCE_INIT, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, -1
+};
+
+static _Thread_local struct closure quiesce_closure;
+
+static void quiesce_init(void)
+{
+  quiesce.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+/*
+ * Asked to stop: frames other loops posted go to their queues, which get a
+ * last round out, then the loop parks, out of the rcu readers meanwhile.
+ */
+static void on_quiesce(struct evloop *loop, void *arg)
+{
+  struct closure *cb = arg;
+
+  if (mailbox.fd >= 0) {
+    outq_mailbox_drain(&mailbox, mailbox_deliver, NULL);
+  }
+
+  if (sched.head) {
+    sched_round(loop, NULL);
+  }
+
+  rcu_thread_offline();
+
+  pthread_mutex_lock(&quiesce.lock);
+  quiesce.parked++;
+  pthread_cond_broadcast(&quiesce.cond);
+  while (quiesce.stopping) {
+    pthread_cond_wait(&quiesce.cond, &quiesce.lock);
+  }
+  quiesce.parked--;
+  pthread_mutex_unlock(&quiesce.lock);
+
+  rcu_thread_online();
+  evloop_rearm_callback_read(loop, cb);
+}
+
+/* Watch for a handover stopping the loops, from the loop thread */
+static void quiesce_start(struct evloop *loop)
+{
+  pthread_once(&quiesce.once, quiesce_init);
+
+  if (quiesce.fd < 0) {
+    return;
+  }
+
+  memset(&quiesce_closure, 0, sizeof(quiesce_closure));
+  quiesce_closure.fd = quiesce.fd;
+  quiesce_closure.arg = &quiesce_closure;
+  quiesce_closure.call = on_quiesce;
+
+  pthread_mutex_lock(&quiesce.lock);
+  quiesce.running++;
+  pthread_mutex_unlock(&quiesce.lock);
+
+  evloop_add_callback(loop, &quiesce_closure);
+}
+
+/* Stop every loop but the calling one, returns once all are parked */
+static int loops_stop(void)
+{
+  int self = quiesce_closure.call != NULL;
+
+  pthread_once(&quiesce.once, quiesce_init);
+
+  if (quiesce.fd < 0) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&quiesce.lock);
+  quiesce.stopping = 1;
+  eventfd_write(quiesce.fd, 1);
+  while (quiesce.parked < quiesce.running - self) {
+    pthread_cond_wait(&quiesce.cond, &quiesce.lock);
+  }
+  pthread_mutex_unlock(&quiesce.lock);
+
+  return 0;
+}
+
+static void loops_resume(void)
+{
+  eventfd_t value;
+
+  pthread_mutex_lock(&quiesce.lock);
+  eventfd_read(quiesce.fd, &value);
+  quiesce.stopping = 0;
+  pthread_cond_broadcast(&quiesce.cond);
+  pthread_mutex_unlock(&quiesce.lock);
+}
+
+/* Subscription collected for the handover */
+struct handover_entry {
+  void *client;
+  char *filter;
+  unsigned qos;
+};
+
+/* Client of a session, lets subscriptions be attached to it */
+struct handover_owner {
+  void *client;
+  size_t session;
+};
+
+struct handover_ctx {
+  struct handover h;
+  struct handover_owner *owners;
+  size_t sessions_cap;
+  struct handover_entry *entries;
+  size_t entries_nr;
+  size_t entries_cap;
+  int err;
+};
+
+static struct handover_session *handover_session_add(struct handover_ctx *ctx,
+                                                     void *client)
+{
+  if (ctx->h.sessions_nr == ctx->sessions_cap) {
+    size_t cap = ctx->sessions_cap ? ctx->sessions_cap * 2 : 256;
+    struct handover_session *sessions =
+        realloc(ctx->h.sessions, cap * sizeof(*sessions));
+    if (!sessions) {
+      return NULL;
+    }
+    ctx->h.sessions = sessions;
+    struct handover_owner *owners =
+        realloc(ctx->owners, cap * sizeof(*owners));
+    if (!owners) {
+      return NULL;
+    }
+    ctx->owners = owners;
+    ctx->sessions_cap = cap;
+  }
+
+  struct handover_session *s = &ctx->h.sessions[ctx->h.sessions_nr];
+
+  memset(s, 0, sizeof(*s));
+  s->fd = -1;
+  s->version = MQTT_V311;
+  s->receive_maximum = MQTT5_RECEIVE_MAXIMUM;
+  s->maximum_packet_size = MQTT5_MAX_PACKET_SIZE;
+
+  if (!(s->client_id = strdup(((struct sol_client *) client)->client_id))) {
+    return NULL;
+  }
+
+  ctx->owners[ctx->h.sessions_nr].client = client;
+  ctx->owners[ctx->h.sessions_nr].session = ctx->h.sessions_nr;
+  ctx->h.sessions_nr++;
+
+  return s;
+}
+
+/*
+ * Session of a live connection. Connections not past CONNECT or halfway
+ * through a packet are left behind, their clients will reconnect.
+ */
+static int handover_collect_conn(struct hashtable_entry *entry, void *arg)
+{
+  struct handover_ctx *ctx = arg;
+  struct closure *cb = entry->val;
+
+  /*
+   * Shared memory connections are tied to this process mappings, frames
+   * half read to its buffers, as are the messages queued to be sent.
+   */
+  if (!cb->obj || !cb->mqtt5 || cb->payload || cb->reply ||
+      cb->blob || cb->stream_in || cb->shm || cb->in || cb->out.head) {
+    return 0;
+  }
+
+  const struct mqtt5_state *state = cb->mqtt5;
+  struct handover_session *s = handover_session_add(ctx, cb->obj);
+
+  if (!s) {
+    ctx->err = 1;
+    return -1;
+  }
+
+  s->fd = cb->fd;
+  s->version = state->version;
+  s->receive_maximum = state->receive_maximum;
+  s->maximum_packet_size = state->maximum_packet_size;
+  s->alias_in_max = state->alias_in_max;
+  s->alias_out_max = state->alias_out_max;
+
+  for (uint16_t i = 0; i < state->alias_in_max; i++) {
+    s->aliases_nr += state->alias_in[i].topic != NULL;
+  }
+
+  if (s->aliases_nr == 0) {
+    return 0;
+  }
+
+  if (!(s->aliases = calloc(s->aliases_nr, sizeof(*s->aliases)))) {
+    s->aliases_nr = 0;
+    ctx->err = 1;
+    return -1;
+  }
+
+  size_t n = 0;
+
+  for (uint16_t i = 0; i < state->alias_in_max && n < s->aliases_nr; i++) {
+    if (!state->alias_in[i].topic) {
+      continue;
+    }
+    s->aliases[n].alias = i + 1;
+    if (!(s->aliases[n].topic = strdup(state->alias_in[i].topic))) {
+      s->aliases_nr = n;
+      ctx->err = 1;
+      return -1;
+    }
+    n++;
+  }
+
+  return 0;
+}
+
+static void handover_collect_sub(const char *filter,
+                                 const struct subscription *sub, void *arg)
+{
+  struct handover_ctx *ctx = arg;
+
+  /* In-process subscribers stay with this process */
+  if (ctx->err || (sub->qos & TRIE_SUB_LOCAL)) {
+    return;
+  }
+
+  if (ctx->entries_nr == ctx->entries_cap) {
+    size_t cap = ctx->entries_cap ? ctx->entries_cap * 2 : 1024;
+    struct handover_entry *entries =
+        realloc(ctx->entries, cap * sizeof(*entries));
+    if (!entries) {
+      ctx->err = 1;
+      return;
+    }
+    ctx->entries = entries;
+    ctx->entries_cap = cap;
+  }
+
+  struct handover_entry *e = &ctx->entries[ctx->entries_nr];
+
+  if (!(e->filter = strdup(filter))) {
+    ctx->err = 1;
+    return;
+  }
+
+  e->client = sub->subscriber;
+  e->qos = sub->qos;
+  ctx->entries_nr++;
+}
+
+/* Both entries and owners start with the client, ordered by address */
+static int handover_client_cmp(const void *a, const void *b)
+{
+  uintptr_t x = (uintptr_t) *(void * const *) a;
+  uintptr_t y = (uintptr_t) *(void * const *) b;
+  return (x > y) - (x < y);
+}
+
+/*
+ * Snapshot the live connections and every subscription grouped by client,
+ * clients with subscriptions and no connection get an offline session.
+ */
+static int handover_snapshot(struct handover_ctx *ctx)
+{
+  if (hashtable_map(sol.closures, handover_collect_conn, ctx) < 0 ||
+      ctx->err) {
+    return -1;
+  }
+
+  if (trie_walk(&sol.topics, handover_collect_sub, ctx) < 0 || ctx->err) {
+    return -1;
+  }
+
+  size_t owners_nr = ctx->h.sessions_nr;
+
+  qsort(ctx->owners, owners_nr, sizeof(*ctx->owners), handover_client_cmp);
+  qsort(ctx->entries, ctx->entries_nr, sizeof(*ctx->entries),
+        handover_client_cmp);
+
+  for (size_t i = 0, j; i < ctx->entries_nr; i = j) {
+    void *client = ctx->entries[i].client;
+    struct handover_owner *owner =
+        bsearch(&client, ctx->owners, owners_nr, sizeof(*ctx->owners),
+                handover_client_cmp);
+    struct handover_session *s = owner ?
+        &ctx->h.sessions[owner->session] : handover_session_add(ctx, client);
+
+    for (j = i; j < ctx->entries_nr && ctx->entries[j].client == client; j++)
+      ;
+
+    if (!s || !(s->subs = calloc(j - i, sizeof(*s->subs)))) {
+      return -1;
+    }
+
+    /* Filters move over to the session */
+    for (size_t k = i; k < j; k++) {
+      s->subs[s->subs_nr].filter = ctx->entries[k].filter;
+      s->subs[s->subs_nr++].qos = ctx->entries[k].qos;
+      ctx->entries[k].filter = NULL;
+    }
+  }
+
+  return 0;
+}
+
+static void handover_ctx_release(struct handover_ctx *ctx)
+{
+  for (size_t i = 0; i < ctx->entries_nr; i++) {
+    free(ctx->entries[i].filter);
+  }
+
+  free(ctx->entries);
+  free(ctx->owners);
+  handover_release(&ctx->h);
+}
+
+/*
+ * A successor connected to the handover socket, pass everything over and
+ * exit. The other loops are stopped first, nothing is accepted, read or
+ * written anymore once the snapshot is taken. Descriptors in flight stay
+ * open until it receives them, whatever happens to this process.
+ */
+static void on_handover(struct evloop *loop, void *arg)
+{
+  struct closure *cb = arg;
+  struct handover_ctx ctx;
+  int sock = accept(cb->fd, NULL, NULL);
+
+  if (sock < 0) {
+    evloop_rearm_callback_read(loop, cb);
+    return;
+  }
+
+  if (loops_stop() < 0) {
+    sol_error("Handover failed, still serving: %s", strerror(errno));
+    close(sock);
+    evloop_rearm_callback_read(loop, cb);
+    return;
+  }
+
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.h.listenfd = handover_listenfd;
+
+  if (handover_snapshot(&ctx) < 0 || handover_send(sock, &ctx.h) < 0) {
+    sol_error("Handover failed, still serving: %s", strerror(errno));
+    handover_ctx_release(&ctx);
+    close(sock);
+    loops_resume();
+    evloop_rearm_callback_read(loop, cb);
+    return;
+  }
+
+  sol_info("Handed over %zu sessions, exiting", ctx.h.sessions_nr);
+  handover_ctx_release(&ctx);
+  close(sock);
+  exit(EXIT_SUCCESS);
+}
+
+int server_handover_listen(struct evloop *loop, const char *path,
+                           int listenfd)
+{
+  int fd = create_and_bind(path, NULL, UNIX);
+
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (listen(fd, 1) < 0 || set_nonblocking(fd) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  memset(&handover_closure, 0, sizeof(handover_closure));
+  handover_closure.fd = fd;
+  handover_closure.arg = &handover_closure;
+  handover_closure.call = on_handover;
+  handover_listenfd = listenfd;
+  evloop_add_callback(loop, &handover_closure);
+
+  return 0;
+}
+
+/* Known client with its subscriptions, once its connection is back */
+static void handover_adopt_subs(struct sol_client *client,
+                                const struct handover_session *s)
+{
+  hashtable_put(sol.clients, client->client_id, client);
+
+  for (size_t i = 0; i < s->subs_nr; i++) {
+    trie_subscribe(&sol.topics, s->subs[i].filter, client, s->subs[i].qos);
+  }
+}
+
+/* Bring back a session handed over, with its connection if it had one */
+static int handover_adopt(struct evloop *loop,
+                          const struct handover_session *s)
+{
+  struct sol_client *client = calloc(1, sizeof(*client));
+
+  if (!client || !(client->client_id = strdup(s->client_id))) {
+    free(client);
+    return -1;
+  }
+
+  client->fd = s->fd;
+
+  /* Offline session, only its subscriptions come back */
+  if (s->fd < 0) {
+    handover_adopt_subs(client, s);
+    return 0;
+  }
+
+  /* Protocol state as set up by the CONNECT of the client */
+  struct mqtt_connect connect = { .version = s->version };
+  struct mqtt5_state *state = mem_malloc(MEM_SESSIONS, sizeof(*state));
+
+  connect.properties.receive_maximum = s->receive_maximum;
+  connect.properties.maximum_packet_size = s->maximum_packet_size;
+  connect.properties.topic_alias_maximum = s->alias_out_max;
+  MQTT_PROP_SET(&connect.properties, MQTT_PROP_RECEIVE_MAXIMUM);
+  MQTT_PROP_SET(&connect.properties, MQTT_PROP_MAXIMUM_PACKET_SIZE);
+
+  if (!state || mqtt5_state_init(state, &connect, s->alias_in_max) < 0) {
+    mem_free(MEM_SESSIONS, state);
+    free(client->client_id);
+    free(client);
+    return -1;
+  }
+
+  for (size_t i = 0; i < s->aliases_nr; i++) {
+    uint16_t alias = s->aliases[i].alias;
+    if (alias == 0 || alias > state->alias_in_max) {
+      continue;
+    }
+    free(state->alias_in[alias - 1].topic);
+    state->alias_in[alias - 1].topic = strdup(s->aliases[i].topic);
+    state->alias_in[alias - 1].len = strlen(s->aliases[i].topic);
+  }
+
+  struct closure *cb = client_closure_create(s->fd);
+
+  if (!cb) {
+    mqtt5_state_release(state);
+    mem_free(MEM_SESSIONS, state);
+    free(client->client_id);
+    free(client);
+    return -1;
+  }
+
+  cb->obj = client;
+  cb->mqtt5 = state;
+
+  /* Subscribed only now, nothing can fail past this point */
+  handover_adopt_subs(client, s);
+
+  evloop_add_callback(loop, cb);
+  info.nclients++;
+  info.nconnections++;
+
+  return 0;
+}
+
+int server_takeover(struct evloop *loop, const char *path)
+{
+  struct handover h;
+  int sock = handover_connect(path);
+
+  if (sock < 0) {
+    return -1;
+  }
+
+  int rc = handover_recv(sock, &h);
+
+  close(sock);
+
+  if (rc < 0) {
+    sol_error("Handover from %s failed", path);
+    return -1;
+  }
+
+  for (size_t i = 0; i < h.sessions_nr; i++) {
+    if (handover_adopt(loop, &h.sessions[i]) < 0 && h.sessions[i].fd >= 0) {
+      close(h.sessions[i].fd);
+    }
+  }
+
+  sol_info("Took over %zu sessions from %s", h.sessions_nr, path);
+  handover_release(&h);
+
+  return h.listenfd;
+}
+
+/*
+ * Metrics segment, see metrics.h, each loop copies its counters there every
+ * METRICS_INTERVAL, the first one the broker wide ones too.
+ */
+static _Thread_local struct closure metrics_tick;
+
+static void metrics_snapshot_broker(struct metrics_broker *b,
+                                    unsigned long long now)
+{
+  metrics_write_begin(&b->seq);
+
+  b->updated = now;
+  b->nclients = info.nclients;
+  b->nconnections = info.nconnections;
+  b->nthrottled = info.nthrottled;
+  b->start_time = info.start_time;
+  b->bytes_recv = info.bytes_recv;
+  b->bytes_sent = info.bytes_sent;
+  b->messages_recv = info.messages_recv;
+  b->messages_sent = info.messages_sent;
+  b->messages_dropped = info.messages_dropped;
+  b->filter_hits = info.filter_hits;
+  b->filter_misses = info.filter_misses;
+  b->filter_false_positives = info.filter_false_positives;
+  b->throttles = info.throttles;
+
+  b->mem_used = mem_used();
+  b->mem_ceiling = mem_ceiling();
+  b->mem_pressure = mem_pressure();
+  for (int i = 0; i < MEM_TAGS; i++) {
+    b->mem_tags[i] = mem_tag_used(i);
+  }
+
+  struct arena_stats arena;
+  arena_stats(&arena);
+  b->arena_backing = arena.backing;
+  b->arena_reserved = arena.reserved;
+  b->arena_carved = arena.carved;
+  b->arena_used = arena.used;
+  b->arena_buffers = arena.buffers;
+  b->arena_allocs = arena.allocs;
+  b->arena_fallbacks = arena.fallbacks;
+
+  /* Summed over the loops, each traces on its own */
+  b->packets = trace_packets();
+  b->ns_per_tick = trace_ns_per_tick();
+  for (int i = 0; i < TRACE_STAGES; i++) {
+    for (int j = 0; j < TRACE_TYPES; j++) {
+      struct trace_stat t;
+      struct metrics_stage *m = &b->stages[i][j];
+      trace_stat_sum(i, j, &t);
+      m->count = t.count;
+      m->ticks = t.ticks;
+      m->max = t.max;
+      memcpy(m->hist, t.hist, sizeof(m->hist));
+    }
+  }
+
+  metrics_write_end(&b->seq);
+}
+
+static void metrics_snapshot(struct evloop *loop, void *arg)
+{
+  struct metrics_segment *s = metrics_segment();
+  struct metrics_thread *t = metrics_thread_claim();
+  struct bufpool_stats pool;
+  (void) arg;
+
+  /* No segment or no section left for this loop, nothing to keep up */
+  if (!s || !t) {
+    return;
+  }
+
+  if (t == &s->threads[0]) {
+    metrics_snapshot_broker(&s->broker, loop->now);
+  }
+
+  bufpool_stats(&pool);
+
+  metrics_write_begin(&t->seq);
+
+  t->updated = loop->now;
+  t->sched_ready = sched.nr;
+  t->deferred = loop->deferred_nr;
+  t->cache_topics = routing_cache.entries_nr;
+  t->cache_hits = routing_cache.hits;
+  t->cache_misses = routing_cache.misses;
+  t->buf_lent = pool.lent;
+  t->buf_idle_bytes = pool.idle_bytes;
+  t->buf_hits = pool.hits;
+  t->buf_misses = pool.misses;
+  t->cpu = loop->cpu;
+  t->node = loop->node;
+  t->accepts_local = steering.local;
+  t->accepts_remote = steering.remote;
+
+  metrics_write_end(&t->seq);
+
+  if (evloop_defer_callback(loop, &metrics_tick, METRICS_INTERVAL) < 0) {
+    sol_error("Metrics snapshot stopped, out of memory");
+  }
+}
+
+/* Create the segment on the first call, start the snapshots of the loop */
+static void metrics_start(struct evloop *loop)
+{
+  const char *path = METRICS_PATH;
+
+  if (!path[0]) {
+    return;
+  }
+
+  if (!metrics_segment()) {
+    if (metrics_open(path) < 0) {
+      sol_error("Metrics segment %s unavailable: %s", path, strerror(errno));
+      return;
+    }
+    struct metrics_segment *s = metrics_segment();
+    for (int i = 0; i < MEM_TAGS; i++) {
+      snprintf(s->hdr.mem_tags[i], sizeof(s->hdr.mem_tags[i]), "%s",
+               mem_tag_name(i));
+    }
+  }
+
+  metrics_tick.call = metrics_snapshot;
+  metrics_tick.arg = NULL;
+  metrics_snapshot(loop, NULL);
+}
+
+/*
+ * Give the loop a CPU of its own, one after the other, and the memory node
+ * of it for what it allocates from now on: buffers, closures and the
+ * sessions of its clients stay next to the thread using them.
+ */
+static void place_loop(struct evloop *loop)
+{
+  int cpu = pin_thread(atomic_fetch_add(&polling.loops, 1));
+
+  if (cpu < 0) {
+    sol_warning("Event loop left unpinned: %s", strerror(errno));
+    return;
+  }
+
+  loop->cpu = cpu;
+  loop->node = prefer_local_memory();
+
+  /* Anything pooled before was touched from wherever the thread ran */
+  bufpool_shrink();
+
+  sol_debug("Event loop pinned to CPU %d, memory node %d", cpu, loop->node);
+}
+
+int server_listen_local(struct evloop *loop, const char *host,
+                        const char *port)
+{
+  int fd = make_listen_cpu(host, port, loop->cpu);
+
+  if (fd < 0) {
+    return -1;
+  }
+
+  memset(&listen_closure, 0, sizeof(listen_closure));
+  listen_closure.fd = fd;
+  listen_closure.arg = &listen_closure;
+  listen_closure.call = on_accept;
+  evloop_add_callback(loop, &listen_closure);
+
+  return fd;
+}
+
+static void run(struct evloop *loop)
+{
+  /* kill -USR1 dumps the flight recorder and the handler timings */
+  if (trace_init(SIGUSR1) < 0) {
+    sol_error("Flight recorder dump unavailable: %s", strerror(errno));
+  }
+
+  /* Counters readable by tools/solstat, at no cost to the loop */
+  metrics_start(loop);
+
+  /* Frames routed to its connections by other loops */
+  if (mailbox_start(loop) < 0) {
+    sol_error("Loop mailbox unavailable: %s", strerror(errno));
+    return;
+  }
+
+  /* Stopped by a handover, see on_handover */
+  quiesce_start(loop);
+
+  evloop_busy_poll(loop, polling.usecs);
+  if (polling.usecs > 0 && sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+    sol_warning("Busy polling on a single CPU, clients get less of it");
+  }
+  if (polling.pin) {
+    place_loop(loop);
+  }
+
+  hot_start(loop);
+
+  /* Rankings of the heavy hitters, from the first loop only */
+  if (atomic_exchange(&hot.started, 1) == 0) {
+    hot.tick.call = hot_report;
+    hot.tick.arg = NULL;
+    if (evloop_defer_callback(loop, &hot.tick, TOPK_INTERVAL) < 0) {
+      sol_error("Heavy hitters reports unavailable, out of memory");
+    }
+  }
+
+  if (evloop_wait(loop) < 0) {
+    sol_error("Event loop exited unexpectedely: %s", strerror(loop->status));
+    evloop_free(loop);
+  }
+}
+
+static void client_free(void *arg)
+{
+  struct sol_client *client = arg;
+
+  if (client->client_id) {
     free(client->client_id);
   }
 
   free(client);
+}
+
+/*
+ * Cleanup function to be passed in as a destructor to the hashtable for
+ * connecting clients, freed once no loop routes to it anymore.
+ */ 
+static int client_destructor(struct hashtable_entry *entry)
+{
+  if (!entry) {
+    return -1;
+  }
+
+  rcu_defer(entry->val, client_free);
   return 0;
 }
 
@@ -409,7 +3337,7 @@ static int client_destructor(struct hashtable_entry *entry)
     bytestring_release(closure->payload);
   }
 
-  free(closure);
+  mem_free(MEM_CONNECTIONS, closure);
   return 0;
 }
 
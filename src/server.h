@@ -9,17 +9,82 @@
 #define EPOLL_MAX_EVENTS    256
 #define EPOLL_TIMEOUT       -1
 
+/*
+ * Low latency mode, loops spin on epoll for BUSY_POLL_BUDGET microseconds
+ * before blocking, see network.h, and with BUSY_POLL_PIN set each is pinned
+ * to a CPU of its own. Set at runtime by server_busy_poll, off by default.
+ */
+#ifndef BUSY_POLL_PIN
+#define BUSY_POLL_PIN       0
+#endif
+
 /*
  * Error codes for packet reception, signaling respectively:
  * - client disconnection.
  * - error reading packet.
  * - error packet sent exceeds size defined by configuration (generally
  *   default to 2MB)
+ * - fixed header not entirely received yet.
+ * - PUBLISH too big to be buffered, its payload is to be streamed.
  */
 
 #define ERRCLIENTDC         1
 #define ERRPACKETERR        2
 #define ERRMAXREQSIZE       3
+#define ERRAGAIN            4
+#define ERRSTREAM           5
+
+/*
+ * PUBLISH packets bigger than this have their payload streamed to a memory
+ * file instead of being buffered, no matter the max_request_size, up to the
+ * protocol limit.
+ */
+#define STREAM_THRESHOLD    (1024 * 1024)
+
+/*
+ * Largest PUBLISH accepted for streaming, a bigger one closes the
+ * connection. Set at runtime by server_stream_max.
+ */
+#ifndef STREAM_MAX_SIZE
+#define STREAM_MAX_SIZE     (64 * 1024 * 1024)
+#endif
+
+/*
+ * Incoming frames up to this size are read on the stack, bigger ones in a
+ * buffer borrowed from the pool, see bufpool.h. Idle connections hold none.
+ */
+#define INLINE_FRAME_SIZE   256
+
+/*
+ * Outgoing payloads from this size on are sent with MSG_ZEROCOPY where the
+ * socket supports it, below it pinning pages costs more than copying them.
+ * Build with -DZEROCOPY_THRESHOLD=0 to disable it.
+ */
+#ifndef ZEROCOPY_THRESHOLD
+#define ZEROCOPY_THRESHOLD  (16 * 1024)
+#endif
+
+/*
+ * Bytes of PUBLISH data each connection gets to send per round of the loop
+ * scheduler, in deficit round robin with the others. Control packets don't
+ * count, they always go first.
+ */
+#ifndef SCHED_QUANTUM
+#define SCHED_QUANTUM       (64 * 1024)
+#endif
+
+/*
+ * Default rate limit of every client, in packets per second and burst, 0
+ * for none. Set at runtime by server_ratelimit, topic prefixes are limited
+ * on top of it by server_ratelimit_topic.
+ */
+#ifndef RATELIMIT_RATE
+#define RATELIMIT_RATE      0
+#endif
+
+#ifndef RATELIMIT_BURST
+#define RATELIMIT_BURST     0
+#endif
 
 /*
  * Return code of handler functions, signaling if there is data payload
@@ -32,6 +97,49 @@
 
 int start_server(const char *, const char *);
 
+struct evloop;
+
+/*
+ * Zero-downtime restart, see handover.h. Listen on the given path for a
+ * successor, the running broker hands its listening socket, the one given,
+ * its clients and their sessions over to the first one connecting and exits.
+ */
+int server_handover_listen(struct evloop *, const char *, int);
+
+/*
+ * Take over from the broker listening on the given path, if any, adopting
+ * its client connections and sessions. Returns its listening socket, to be
+ * served instead of a new one, or -1 if there is no broker to take over.
+ */
+int server_takeover(struct evloop *, const char *);
+
+/*
+ * Rate limits, a client over its limit or publishing under a prefix over
+ * its own is throttled: its next read waits for the bucket to refill,
+ * nothing is rejected. Prefix limits are shared by every client publishing
+ * under them, setting one again replaces it. Returns -1 if out of memory.
+ */
+void server_ratelimit(unsigned, unsigned);
+int server_ratelimit_topic(const char *, unsigned, unsigned);
+
+/*
+ * Busy poll budget in microseconds of the event loops started from now on,
+ * 0 to block, and whether to pin them to CPUs, the n-th loop started to the
+ * n-th CPU the broker may run on.
+ */
+void server_busy_poll(unsigned, int);
+
+/* Largest PUBLISH accepted for streaming, in bytes, see STREAM_MAX_SIZE */
+void server_stream_max(size_t);
+
+/*
+ * Listen on a TCP socket of the loop's own, all the loops listening on the
+ * same host and port share its connections. A loop pinned to a CPU gets the
+ * ones whose packets the kernel processes on it, keeping a connection, its
+ * loop and its memory on one node. Returns the socket, -1 on error.
+ */
+int server_listen_local(struct evloop *, const char *, const char *);
+
 /* Global informations statistics structure */
 struct sol_info {
   /* Number of clients currently connected */
@@ -48,6 +156,18 @@ struct sol_info {
   long long messages_sent;
   /* Total number of received messages */
   long long messages_recv;
+  /* Publishes rejected by the negative-lookup filter, no trie descent */
+  long long filter_hits;
+  /* Publishes the filter let through to the trie */
+  long long filter_misses;
+  /* Publishes let through which ended up matching no subscription */
+  long long filter_false_positives;
+  /* QoS 0 messages dropped to stay under the memory ceiling */
+  long long messages_dropped;
+  /* Clients currently throttled by a rate limit */
+  int nthrottled;
+  /* Total number of times a client was throttled */
+  long long throttles;
 };
 
 
@@ -0,0 +1,447 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include "shm.h"
+
+#define SHM_MAGIC       0x534f4c4d
+#define SHM_VERSION     1
+
+/* Largest ring accepted from a client */
+#define SHM_RING_MAX    (1 << 30)
+
+/* Handshake, sent along with the memory file and the two doorbells */
+struct shm_hello {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t ring_size;
+};
+
+static inline size_t min(size_t a, size_t b)
+{
+  return a < b ? a : b;
+}
+
+static void ring(int doorbell)
+{
+  eventfd_write(doorbell, 1);
+}
+
+static void ring_init(struct shm_ring *r, unsigned char *base, size_t size)
+{
+  r->hdr = (struct shm_ring_hdr *) base;
+  r->data = base + SHM_HDR_SIZE;
+  r->size = size;
+  r->seen = 0;
+}
+
+/* Map the two rings, the first one written by the connecting side */
+static int conn_map(struct shm_conn *conn, int memfd, size_t size,
+                    int connector)
+{
+  size_t maplen = 2 * (SHM_HDR_SIZE + size);
+  unsigned char *map = mmap(NULL, maplen, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, memfd, 0);
+
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+
+  conn->map = map;
+  conn->maplen = maplen;
+
+  unsigned char *first = map;
+  unsigned char *second = map + SHM_HDR_SIZE + size;
+
+  ring_init(&conn->tx, connector ? first : second, size);
+  ring_init(&conn->rx, connector ? second : first, size);
+
+  return 0;
+}
+
+int shm_connect(const char *path, size_t size, struct shm_conn *conn)
+{
+  struct sockaddr_un addr;
+  int memfd = -1;
+
+  if (size == 0) {
+    size = SHM_RING_SIZE;
+  }
+
+  if (size < SHM_RING_MIN || size > SHM_RING_MAX || (size & (size - 1))) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  memset(conn, 0, sizeof(*conn));
+  conn->doorbell = conn->peer_doorbell = conn->sock = -1;
+
+  if ((memfd = memfd_create("sol-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0 ||
+      ftruncate(memfd, 2 * (SHM_HDR_SIZE + size)) < 0 ||
+      fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0 ||
+      conn_map(conn, memfd, size, 1) < 0) {
+    goto err;
+  }
+
+  conn->doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  conn->peer_doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  conn->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+  if (conn->doorbell < 0 || conn->peer_doorbell < 0 || conn->sock < 0) {
+    goto err;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  if (connect(conn->sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    goto err;
+  }
+
+  struct shm_hello hello = {
+    .magic = SHM_MAGIC,
+    .version = SHM_VERSION,
+    .ring_size = size
+  };
+  int fds[3] = { memfd, conn->doorbell, conn->peer_doorbell };
+  char control[CMSG_SPACE(sizeof(fds))];
+  struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = sizeof(control)
+  };
+  struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+
+  memset(control, 0, sizeof(control));
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+  if (sendmsg(conn->sock, &msg, MSG_NOSIGNAL) != sizeof(hello)) {
+    goto err;
+  }
+
+  close(memfd);
+
+  return 0;
+
+err:
+  if (memfd >= 0) {
+    close(memfd);
+  }
+  if (conn->map) {
+    munmap(conn->map, conn->maplen);
+  }
+  if (conn->doorbell >= 0) {
+    close(conn->doorbell);
+  }
+  if (conn->peer_doorbell >= 0) {
+    close(conn->peer_doorbell);
+  }
+  if (conn->sock >= 0) {
+    close(conn->sock);
+  }
+  return -1;
+}
+
+int shm_accept(int sock, struct shm_conn *conn)
+{
+  struct shm_hello hello;
+  int fds[3];
+  char control[CMSG_SPACE(sizeof(fds))];
+  struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = sizeof(control)
+  };
+  size_t nr = 0;
+
+  if (recvmsg(sock, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC) != sizeof(hello)) {
+    return -1;
+  }
+
+  struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+
+  if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+    nr = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cm), sizeof(int) * min(nr, 3));
+  }
+
+  if (nr != 3 || (msg.msg_flags & MSG_CTRUNC)) {
+    goto err;
+  }
+
+  size_t size = hello.ring_size;
+  struct stat st;
+
+  if (hello.magic != SHM_MAGIC || hello.version != SHM_VERSION ||
+      size < SHM_RING_MIN || size > SHM_RING_MAX || (size & (size - 1))) {
+    goto err;
+  }
+
+  /*
+   * A file the client could still shrink would fault the broker on access,
+   * it must be sealed at the expected size.
+   */
+  int seals = fcntl(fds[0], F_GET_SEALS);
+
+  if (seals < 0 || !(seals & F_SEAL_SHRINK) || fstat(fds[0], &st) < 0 ||
+      (size_t) st.st_size != 2 * (SHM_HDR_SIZE + size)) {
+    goto err;
+  }
+
+  /* Ringing the client must never block the broker */
+  if (fcntl(fds[1], F_SETFL, O_NONBLOCK) < 0 ||
+      fcntl(fds[2], F_SETFL, O_NONBLOCK) < 0) {
+    goto err;
+  }
+
+  memset(conn, 0, sizeof(*conn));
+
+  if (conn_map(conn, fds[0], size, 0) < 0) {
+    goto err;
+  }
+
+  close(fds[0]);
+  conn->peer_doorbell = fds[1];
+  conn->doorbell = fds[2];
+  conn->sock = sock;
+
+  return 0;
+
+err:
+  for (size_t i = 0; i < min(nr, 3); i++) {
+    close(fds[i]);
+  }
+  return -1;
+}
+
+void shm_close(struct shm_conn *conn)
+{
+  atomic_store(&conn->tx.hdr->closed, 1);
+  ring(conn->peer_doorbell);
+  munmap(conn->map, conn->maplen);
+  close(conn->doorbell);
+  close(conn->peer_doorbell);
+  close(conn->sock);
+}
+
+void shm_ack(struct shm_conn *conn)
+{
+  eventfd_t value;
+  eventfd_read(conn->doorbell, &value);
+}
+
+void shm_kick(struct shm_conn *conn)
+{
+  ring(conn->doorbell);
+}
+
+/*
+ * Bytes used in a ring, the peer can't be trusted to keep head and tail
+ * sane, a bogus pair just reads as a full or empty ring.
+ */
+static inline size_t ring_used(const struct shm_ring *r,
+                               uint64_t head, uint64_t tail)
+{
+  return min(head - tail, r->size);
+}
+
+/* Publish what was written and ring the reader if it waits for it */
+static void ring_produced(struct shm_conn *conn, uint64_t head)
+{
+  struct shm_ring_hdr *hdr = conn->tx.hdr;
+
+  atomic_store_explicit(&hdr->head, head, memory_order_release);
+  atomic_thread_fence(memory_order_seq_cst);
+
+  if (atomic_load_explicit(&hdr->reader_waiting, memory_order_relaxed) &&
+      atomic_exchange(&hdr->reader_waiting, 0)) {
+    ring(conn->peer_doorbell);
+  }
+}
+
+/* Give back what was read and ring the writer if it waits for room */
+static void ring_consumed(struct shm_conn *conn, uint64_t tail)
+{
+  struct shm_ring_hdr *hdr = conn->rx.hdr;
+
+  atomic_store_explicit(&hdr->tail, tail, memory_order_release);
+  atomic_thread_fence(memory_order_seq_cst);
+
+  if (atomic_load_explicit(&hdr->writer_waiting, memory_order_relaxed) &&
+      atomic_exchange(&hdr->writer_waiting, 0)) {
+    ring(conn->peer_doorbell);
+  }
+}
+
+/* Room left in the transmit ring and where it starts */
+static size_t tx_room(struct shm_conn *conn, uint64_t *head)
+{
+  struct shm_ring *r = &conn->tx;
+
+  *head = atomic_load_explicit(&r->hdr->head, memory_order_relaxed);
+  r->seen = atomic_load_explicit(&r->hdr->tail, memory_order_acquire);
+
+  return r->size - ring_used(r, *head, r->seen);
+}
+
+ssize_t shm_send(struct shm_conn *conn, const unsigned char *buf, size_t len)
+{
+  struct shm_ring *r = &conn->tx;
+  uint64_t head;
+
+  if (atomic_load_explicit(&conn->rx.hdr->closed, memory_order_acquire)) {
+    errno = EPIPE;
+    return -1;
+  }
+
+  size_t n = min(tx_room(conn, &head), len);
+
+  if (n == 0) {
+    return 0;
+  }
+
+  size_t off = head & (r->size - 1);
+  size_t first = min(n, r->size - off);
+
+  memcpy(r->data + off, buf, first);
+  memcpy(r->data, buf + first, n - first);
+  ring_produced(conn, head + n);
+
+  return n;
+}
+
+ssize_t shm_send_file(struct shm_conn *conn, int fd, size_t *offset,
+                      size_t size)
+{
+  struct shm_ring *r = &conn->tx;
+  uint64_t head;
+
+  if (atomic_load_explicit(&conn->rx.hdr->closed, memory_order_acquire)) {
+    errno = EPIPE;
+    return -1;
+  }
+
+  size_t n = min(tx_room(conn, &head), size - *offset);
+  size_t done = 0;
+
+  /* At most two contiguous stretches, before and after the wrap */
+  while (done < n) {
+    size_t off = (head + done) & (r->size - 1);
+    ssize_t rd = pread(fd, r->data + off, min(n - done, r->size - off),
+                       *offset + done);
+    if (rd <= 0) {
+      break;
+    }
+    done += rd;
+  }
+
+  if (done == 0) {
+    return n == 0 ? 0 : -1;
+  }
+
+  ring_produced(conn, head + done);
+  *offset += done;
+
+  return done;
+}
+
+size_t shm_readable(struct shm_conn *conn)
+{
+  struct shm_ring *r = &conn->rx;
+  uint64_t tail = atomic_load_explicit(&r->hdr->tail, memory_order_relaxed);
+
+  r->seen = atomic_load_explicit(&r->hdr->head, memory_order_acquire);
+
+  return ring_used(r, r->seen, tail);
+}
+
+/* Copy up to len readable bytes, returning the count and the tail */
+static size_t rx_copy(struct shm_conn *conn, unsigned char *buf, size_t len,
+                      uint64_t *tail)
+{
+  struct shm_ring *r = &conn->rx;
+  size_t n = min(shm_readable(conn), len);
+
+  *tail = atomic_load_explicit(&r->hdr->tail, memory_order_relaxed);
+
+  size_t off = *tail & (r->size - 1);
+  size_t first = min(n, r->size - off);
+
+  memcpy(buf, r->data + off, first);
+  memcpy(buf + first, r->data, n - first);
+
+  return n;
+}
+
+size_t shm_peek(struct shm_conn *conn, unsigned char *buf, size_t len)
+{
+  uint64_t tail;
+  return rx_copy(conn, buf, len, &tail);
+}
+
+size_t shm_recv(struct shm_conn *conn, unsigned char *buf, size_t len)
+{
+  uint64_t tail;
+  size_t n = rx_copy(conn, buf, len, &tail);
+
+  if (n > 0) {
+    ring_consumed(conn, tail + n);
+  }
+
+  return n;
+}
+
+int shm_closed(struct shm_conn *conn)
+{
+  if (atomic_load_explicit(&conn->rx.hdr->closed, memory_order_acquire)) {
+    return 1;
+  }
+
+  /* A peer which died never got to set the flag, its socket end is gone */
+  char byte;
+  return recv(conn->sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
+}
+
+int shm_wait_data(struct shm_conn *conn)
+{
+  struct shm_ring_hdr *hdr = conn->rx.hdr;
+
+  atomic_store(&hdr->reader_waiting, 1);
+
+  if (atomic_load(&hdr->head) != conn->rx.seen || atomic_load(&hdr->closed)) {
+    ring(conn->doorbell);
+    return 1;
+  }
+
+  return 0;
+}
+
+int shm_wait_room(struct shm_conn *conn)
+{
+  struct shm_ring_hdr *hdr = conn->tx.hdr;
+
+  atomic_store(&hdr->writer_waiting, 1);
+
+  if (atomic_load(&hdr->tail) != conn->tx.seen ||
+      atomic_load(&conn->rx.hdr->closed)) {
+    ring(conn->doorbell);
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,126 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+/*
+ * Shared memory transport for clients running on the broker host. The same
+ * MQTT frames as over a socket go through a pair of single producer single
+ * consumer byte rings, one per direction, in a memory file both processes
+ * map, so messages never go through the kernel socket stack.
+ *
+ * The client creates the file, sealed against resizing, and two eventfd
+ * doorbells, one per side, and passes them to the broker over a UNIX socket
+ * bound with the SHM family. A side only rings the doorbell of the other
+ * one when it flagged it's waiting, for data to read or for room to write,
+ * so a busy stream makes no system calls at all. The broker doorbell is the
+ * descriptor its closure is registered with in the event loop.
+ *
+ * The UNIX socket is kept open for the lifetime of the connection, closing
+ * either end of it ends the connection as well.
+ */
+
+/* Default capacity of each ring, a power of 2 */
+#define SHM_RING_SIZE       (1 << 22)
+
+/* Smallest ring accepted, a frame header must always fit */
+#define SHM_RING_MIN        4096
+
+/* Ring control block, padded to a page so data is page aligned */
+#define SHM_HDR_SIZE        4096
+
+struct shm_ring_hdr {
+  /* Bytes ever written and read, each on its own cache line */
+  _Alignas(64) _Atomic uint64_t head;
+  _Alignas(64) _Atomic uint64_t tail;
+  /* Reader waiting for data, writer waiting for room, writer gone */
+  _Alignas(64) atomic_uint reader_waiting;
+  atomic_uint writer_waiting;
+  atomic_uint closed;
+};
+
+struct shm_ring {
+  struct shm_ring_hdr *hdr;
+  unsigned char *data;
+  size_t size;
+  /* Head last seen by the reader or tail by the writer */
+  uint64_t seen;
+};
+
+struct shm_conn {
+  struct shm_ring tx;
+  struct shm_ring rx;
+  /* Rung by the peer, and the peer one */
+  int doorbell;
+  int peer_doorbell;
+  /* UNIX socket the connection was set up on */
+  int sock;
+  void *map;
+  size_t maplen;
+};
+
+/*
+ * Client side, connect to a broker listening on a SHM family socket with
+ * rings of the given size, SHM_RING_SIZE if 0. Returns -1 on error.
+ */
+int shm_connect(const char *, size_t, struct shm_conn *);
+
+/*
+ * Broker side, set up the connection from the handshake waiting on an
+ * accepted socket, which the connection then owns. Returns -1 on error or
+ * if the memory file is not one it can trust, the socket is left open then.
+ */
+int shm_accept(int, struct shm_conn *);
+
+/* Tell the peer the connection is over and release everything */
+void shm_close(struct shm_conn *);
+
+/* Reset the doorbell, to be called every time it woke up the side */
+void shm_ack(struct shm_conn *);
+
+/*
+ * Ring the own doorbell, for a side which acked it but left data in the
+ * ring to come back to it on the next wake up.
+ */
+void shm_kick(struct shm_conn *);
+
+/*
+ * Write as much of the buffer as fits in the ring, ringing the peer if it
+ * waits for data. Returns the bytes written or -1 with errno set to EPIPE
+ * if the peer is gone.
+ */
+ssize_t shm_send(struct shm_conn *, const unsigned char *, size_t);
+
+/*
+ * Like shm_send, reading from a file at the offset, which is advanced,
+ * straight into the ring.
+ */
+ssize_t shm_send_file(struct shm_conn *, int, size_t *, size_t);
+
+/*
+ * Bytes readable from the ring, copied without being consumed by shm_peek
+ * and consumed by shm_recv, which rings the peer if it waits for room.
+ */
+size_t shm_readable(struct shm_conn *);
+size_t shm_peek(struct shm_conn *, unsigned char *, size_t);
+size_t shm_recv(struct shm_conn *, unsigned char *, size_t);
+
+/*
+ * Return 1 if the peer closed the connection or exited, what it wrote
+ * before is still readable.
+ */
+int shm_closed(struct shm_conn *);
+
+/*
+ * Ask the peer to ring once there's more to read, or more room to write,
+ * than the last shm_readable or shm_send saw. If that already happened
+ * meanwhile the doorbell is rung right away and 1 is returned, either way
+ * waiting on the doorbell is all that's left to do.
+ */
+int shm_wait_data(struct shm_conn *);
+int shm_wait_room(struct shm_conn *);
+
+#endif
@@ -0,0 +1,211 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include "memory.h"
+#include "stream.h"
+
+/* Pipe capacity asked for splicing, the default one is 64KB */
+#define PIPE_SIZE       (1 << 20)
+
+/* Bounce buffer used where splice is not supported */
+#define COPY_SIZE       (64 * 1024)
+
+/*
+ * Pipe backing socket to file splices, one per thread. Set to a negative
+ * value once splice turned out not to be usable.
+ */
+static _Thread_local int splice_pipe[2] = { 0, 0 };
+static _Thread_local int splice_ready = 0;
+
+struct stream_blob *stream_blob_create(size_t size)
+{
+  struct stream_blob *blob = malloc(sizeof(*blob));
+
+  if (!blob) {
+    return NULL;
+  }
+
+  blob->fd = memfd_create("sol-payload", MFD_CLOEXEC);
+
+  if (blob->fd < 0) {
+    free(blob);
+    return NULL;
+  }
+
+  /* Size it up front, tmpfs pages are only allocated as they are written */
+  if (ftruncate(blob->fd, size) < 0) {
+    close(blob->fd);
+    free(blob);
+    return NULL;
+  }
+
+  blob->size = size;
+  blob->filled = 0;
+  atomic_init(&blob->refs, 1);
+
+  /* Pages of the file are not the allocator's, the whole size is counted */
+  mem_charge(MEM_BUFFERS, size);
+
+  return blob;
+}
+
+struct stream_blob *stream_blob_get(struct stream_blob *blob)
+{
+  atomic_fetch_add_explicit(&blob->refs, 1, memory_order_relaxed);
+  return blob;
+}
+
+void stream_blob_put(struct stream_blob *blob)
+{
+  if (!blob) {
+    return;
+  }
+
+  if (atomic_fetch_sub_explicit(&blob->refs, 1, memory_order_acq_rel) == 1) {
+    mem_uncharge(MEM_BUFFERS, blob->size);
+    close(blob->fd);
+    free(blob);
+  }
+}
+
+int stream_blob_complete(const struct stream_blob *blob)
+{
+  return blob->filled == blob->size;
+}
+
+static int pipe_init(void)
+{
+  if (splice_ready) {
+    return splice_ready > 0 ? 0 : -1;
+  }
+
+  if (pipe2(splice_pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+    splice_ready = -1;
+    return -1;
+  }
+
+  /* Best effort, a bigger pipe means fewer round trips */
+  fcntl(splice_pipe[1], F_SETPIPE_SZ, PIPE_SIZE);
+  splice_ready = 1;
+
+  return 0;
+}
+
+/* Throw away whatever is left in the pipe after a failed splice */
+static void pipe_drain(void)
+{
+  unsigned char buf[4096];
+
+  while (read(splice_pipe[0], buf, sizeof(buf)) > 0)
+    ;
+}
+
+/* Socket to pipe to file, the payload never reaches userspace */
+static ssize_t fill_splice(struct stream_blob *blob, int sockfd)
+{
+  size_t left = blob->size - blob->filled;
+  ssize_t in = splice(sockfd, NULL, splice_pipe[1], NULL, left,
+                      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+  if (in <= 0) {
+    return in;
+  }
+
+  ssize_t total = 0;
+
+  while (total < in) {
+    loff_t off = blob->filled;
+    ssize_t out = splice(splice_pipe[0], NULL, blob->fd, &off, in - total,
+                         SPLICE_F_MOVE);
+    if (out <= 0) {
+      /* Bytes left in the pipe would end up in the next payload */
+      pipe_drain();
+      return -1;
+    }
+    blob->filled += out;
+    total += out;
+  }
+
+  return total;
+}
+
+static ssize_t fill_copy(struct stream_blob *blob, int sockfd)
+{
+  static _Thread_local unsigned char buf[COPY_SIZE];
+  size_t left = blob->size - blob->filled;
+  ssize_t n = read(sockfd, buf, left < COPY_SIZE ? left : COPY_SIZE);
+
+  if (n <= 0) {
+    return n;
+  }
+
+  if (pwrite(blob->fd, buf, n, blob->filled) != n) {
+    return -1;
+  }
+
+  blob->filled += n;
+
+  return n;
+}
+
+ssize_t stream_blob_fill(struct stream_blob *blob, int sockfd)
+{
+  ssize_t total = 0;
+
+  while (blob->filled < blob->size) {
+    ssize_t n;
+
+    if (pipe_init() == 0) {
+      n = fill_splice(blob, sockfd);
+      if (n < 0 && errno == EINVAL && total == 0) {
+        /* Socket or file can't be spliced, stick to copying */
+        splice_ready = -1;
+        continue;
+      }
+    } else {
+      n = fill_copy(blob, sockfd);
+    }
+
+    if (n < 0) {
+      if ((errno == EAGAIN || errno == EWOULDBLOCK) && total > 0) {
+        break;
+      }
+      return -1;
+    }
+
+    if (n == 0) {
+      break;
+    }
+
+    total += n;
+  }
+
+  return total;
+}
+
+ssize_t stream_blob_send(struct stream_blob *blob, int sockfd, size_t *offset)
+{
+  ssize_t total = 0;
+
+  while (*offset < blob->size) {
+    off_t off = *offset;
+    ssize_t n = sendfile(sockfd, blob->fd, &off, blob->size - *offset);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      return -1;
+    }
+    if (n == 0) {
+      break;
+    }
+    *offset += n;
+    total += n;
+  }
+
+  return total;
+}
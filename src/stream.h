@@ -0,0 +1,53 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+/*
+ * Streamed payloads, large PUBLISH payloads are never buffered in userspace.
+ * They are spliced from the client socket into an anonymous memory file as
+ * they arrive, across as many reads as needed, and sent to subscribers with
+ * sendfile straight from it. The file is shared by every delivery of the
+ * message and closed when the last one drops its reference, so a payload
+ * takes about one copy in memory whatever the number of subscribers. Its
+ * size is charged to MEM_BUFFERS for as long as the file is open.
+ */
+
+struct stream_blob {
+  /* memfd holding the payload */
+  int fd;
+  /* Payload size and bytes received so far */
+  size_t size;
+  size_t filled;
+  atomic_int refs;
+};
+
+/* Create an empty blob for a payload of the given size, one reference */
+struct stream_blob *stream_blob_create(size_t);
+
+/* Take another reference, returns the blob itself */
+struct stream_blob *stream_blob_get(struct stream_blob *);
+
+/* Drop a reference, the last one closes the file */
+void stream_blob_put(struct stream_blob *);
+
+/*
+ * Move the payload bytes available on a socket into the blob, up to its
+ * size. Returns the number of bytes moved, 0 if the client closed the
+ * connection and -1 on error, with errno set to EAGAIN if there was nothing
+ * to move yet.
+ */
+ssize_t stream_blob_fill(struct stream_blob *, int);
+
+/* Return 1 once the whole payload has been received */
+int stream_blob_complete(const struct stream_blob *);
+
+/*
+ * Send the blob to a socket starting at the offset, which is advanced,
+ * until done or the socket buffer is full. Returns -1 on error.
+ */
+ssize_t stream_blob_send(struct stream_blob *, int, size_t *);
+
+#endif
@@ -0,0 +1,249 @@
+#include <string.h>
+#include "topk.h"
+
+/* Murmur3 finalizer, the rows index with independent looking bits */
+static inline uint64_t mix64(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/*
+ * Column of a key in row i, 16 bits of the mixed hash each. Rows must not
+ * be derived from one another, two keys colliding in all of them would
+ * then be far likelier than the product of the rows makes it.
+ */
+static inline size_t column(uint64_t mixed, int i)
+{
+  return (mixed >> (16 * i)) & (TOPK_WIDTH - 1);
+}
+
+static void heap_swap(struct topk_heap *h, size_t a, size_t b)
+{
+  struct topk_entry tmp = h->entries[a];
+  h->entries[a] = h->entries[b];
+  h->entries[b] = tmp;
+}
+
+static void sift_up(struct topk_heap *h, size_t i)
+{
+  while (i > 0) {
+    size_t parent = (i - 1) / 2;
+    if (h->entries[parent].count <= h->entries[i].count) {
+      break;
+    }
+    heap_swap(h, i, parent);
+    i = parent;
+  }
+}
+
+static void sift_down(struct topk_heap *h, size_t i)
+{
+  for (;;) {
+    size_t min = i, l = 2 * i + 1, r = l + 1;
+    if (l < h->nr && h->entries[l].count < h->entries[min].count) {
+      min = l;
+    }
+    if (r < h->nr && h->entries[r].count < h->entries[min].count) {
+      min = r;
+    }
+    if (min == i) {
+      return;
+    }
+    heap_swap(h, i, min);
+    i = min;
+  }
+}
+
+static void entry_set(struct topk_entry *e, uint64_t hash, const char *key,
+                      size_t len, uint64_t count)
+{
+  /* A key kept, merged into another tracker, is cut already */
+  size_t n = strnlen(key, len < TOPK_KEY - 1 ? len : TOPK_KEY - 1);
+
+  /* Cut at a character boundary, names are published as UTF-8 */
+  if (n < len) {
+    while (n > 0 && ((unsigned char) key[n] & 0xc0) == 0x80) {
+      n--;
+    }
+  }
+
+  e->hash = hash;
+  e->count = count;
+  e->len = len;
+  memcpy(e->key, key, n);
+  e->key[n] = '\0';
+}
+
+/* Update the heap of a metric with the new estimate of a key */
+static void heap_update(struct topk_heap *h, uint64_t hash, const char *key,
+                        size_t len, uint64_t est)
+{
+  /*
+   * A key kept counts at most its estimate, below the smallest one kept it
+   * is not among them and doesn't get in, most keys stop here.
+   */
+  if (h->nr == TOPK_SIZE && est <= h->entries[0].count) {
+    return;
+  }
+
+  for (size_t i = 0; i < h->nr; i++) {
+    if (h->entries[i].hash == hash) {
+      h->entries[i].count = est;
+      sift_down(h, i);
+      return;
+    }
+  }
+
+  if (h->nr < TOPK_SIZE) {
+    entry_set(&h->entries[h->nr], hash, key, len, est);
+    sift_up(h, h->nr++);
+  } else {
+    entry_set(&h->entries[0], hash, key, len, est);
+    sift_down(h, 0);
+  }
+}
+
+/* Estimate of a key for a metric, the lowest of its counters */
+static uint64_t estimate(const struct topk *t, uint64_t hash,
+                         enum topk_metric m)
+{
+  uint64_t mixed = mix64(hash);
+  uint64_t est = UINT64_MAX;
+
+  for (int i = 0; i < TOPK_DEPTH; i++) {
+    uint64_t c = t->cells[i][column(mixed, i)][m];
+    if (c < est) {
+      est = c;
+    }
+  }
+
+  return est;
+}
+
+void topk_init(struct topk *t)
+{
+  memset(t, 0, sizeof(*t));
+}
+
+void topk_add(struct topk *t, uint64_t hash, const char *key, size_t len,
+              uint64_t messages, uint64_t bytes)
+{
+  const uint64_t weights[TOPK_METRICS] = { messages, bytes };
+  uint64_t mixed = mix64(hash);
+  uint64_t *cells[TOPK_DEPTH];
+
+  for (int i = 0; i < TOPK_DEPTH; i++) {
+    cells[i] = t->cells[i][column(mixed, i)];
+  }
+
+  for (int m = 0; m < TOPK_METRICS; m++) {
+    uint64_t est = UINT64_MAX;
+
+    if (weights[m] == 0) {
+      continue;
+    }
+
+    for (int i = 0; i < TOPK_DEPTH; i++) {
+      if (cells[i][m] < est) {
+        est = cells[i][m];
+      }
+    }
+
+    /* Conservative update, no counter is raised past the new estimate */
+    est += weights[m];
+    for (int i = 0; i < TOPK_DEPTH; i++) {
+      if (cells[i][m] < est) {
+        cells[i][m] = est;
+      }
+    }
+
+    t->total[m] += weights[m];
+    heap_update(&t->heaps[m], hash, key, len, est);
+  }
+}
+
+void topk_decay(struct topk *t)
+{
+  uint64_t *c = &t->cells[0][0][0];
+
+  for (size_t i = 0; i < TOPK_DEPTH * TOPK_WIDTH * TOPK_METRICS; i++) {
+    c[i] >>= 1;
+  }
+
+  for (int m = 0; m < TOPK_METRICS; m++) {
+    struct topk_heap *h = &t->heaps[m];
+    size_t kept = 0;
+
+    t->total[m] >>= 1;
+
+    /* Halving keeps the heap order, keys decayed to nothing leave it */
+    for (size_t i = 0; i < h->nr; i++) {
+      h->entries[i].count >>= 1;
+      if (h->entries[i].count > 0) {
+        h->entries[kept++] = h->entries[i];
+      }
+    }
+
+    h->nr = kept;
+    for (size_t i = h->nr / 2; i-- > 0;) {
+      sift_down(h, i);
+    }
+  }
+}
+
+void topk_merge(struct topk *dst, const struct topk *src)
+{
+  uint64_t *d = &dst->cells[0][0][0];
+  const uint64_t *s = &src->cells[0][0][0];
+
+  for (size_t i = 0; i < TOPK_DEPTH * TOPK_WIDTH * TOPK_METRICS; i++) {
+    d[i] += s[i];
+  }
+
+  for (int m = 0; m < TOPK_METRICS; m++) {
+    struct topk_heap *h = &dst->heaps[m];
+    const struct topk_heap *sh = &src->heaps[m];
+
+    dst->total[m] += src->total[m];
+
+    /* Estimates only grew, the heap is rebuilt on the new ones */
+    for (size_t i = 0; i < h->nr; i++) {
+      h->entries[i].count = estimate(dst, h->entries[i].hash, m);
+    }
+    for (size_t i = h->nr / 2; i-- > 0;) {
+      sift_down(h, i);
+    }
+
+    for (size_t i = 0; i < sh->nr; i++) {
+      const struct topk_entry *e = &sh->entries[i];
+      heap_update(h, e->hash, e->key, e->len, estimate(dst, e->hash, m));
+    }
+  }
+}
+
+size_t topk_list(const struct topk *t, enum topk_metric m,
+                 struct topk_entry *out)
+{
+  const struct topk_heap *h = &t->heaps[m];
+  size_t n = h->nr;
+
+  memcpy(out, h->entries, n * sizeof(*out));
+
+  /* TOPK_SIZE entries at most, insertion sort does */
+  for (size_t i = 1; i < n; i++) {
+    struct topk_entry e = out[i];
+    size_t j = i;
+    while (j > 0 && out[j - 1].count < e.count) {
+      out[j] = out[j - 1];
+      j--;
+    }
+    out[j] = e;
+  }
+
+  return n;
+}
@@ -0,0 +1,115 @@
+#ifndef TOPK_H
+#define TOPK_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Heavy hitters of a stream of keys, e.g. the topics published the most,
+ * by messages and by bytes, in fixed memory and at a constant cost per key.
+ *
+ * Every key is counted in a count-min sketch of TOPK_DEPTH rows of
+ * TOPK_WIDTH cells, which over-estimates a key by at most a small part of
+ * the total and never under-estimates it. A cell holds a counter for each
+ * metric, so both are counted with the same cache misses. Updates are
+ * conservative, only the counters at the current estimate grow, which keeps
+ * the error down for the keys sharing them.
+ *
+ * For each metric the TOPK_SIZE keys of highest estimate are kept in a
+ * min-heap with their name, truncated to TOPK_KEY - 1 bytes. A key counted
+ * enters it when it beats the smallest one.
+ *
+ * topk_decay halves every count, called once per interval so that the
+ * ranking follows what is hot now, a key weighing half as much every
+ * interval further back. A tracker is not thread safe, threads count in
+ * trackers of their own, merged with topk_merge.
+ */
+
+#define TOPK_DEPTH          4
+/* Cells per row, a power of 2 up to 65536 */
+#define TOPK_WIDTH          2048
+#define TOPK_SIZE           16
+#define TOPK_KEY            64
+
+/*
+ * One key counted every TOPK_SAMPLE on average, a power of 2, with weights
+ * scaled to match. Keys hot enough to rank are seen plenty of times anyway.
+ */
+#ifndef TOPK_SAMPLE
+#define TOPK_SAMPLE         8
+#endif
+
+/* Milliseconds between two rankings published and decays */
+#ifndef TOPK_INTERVAL
+#define TOPK_INTERVAL       10000
+#endif
+
+enum topk_metric {
+  TOPK_MESSAGES,
+  TOPK_BYTES,
+  TOPK_METRICS
+};
+
+struct topk_entry {
+  uint64_t hash;
+  uint64_t count;
+  /* Lenght of the whole key, key holds at most TOPK_KEY - 1 bytes of it */
+  size_t len;
+  char key[TOPK_KEY];
+};
+
+struct topk_heap {
+  size_t nr;
+  struct topk_entry entries[TOPK_SIZE];
+};
+
+struct topk {
+  uint64_t cells[TOPK_DEPTH][TOPK_WIDTH][TOPK_METRICS];
+  /* Counted since the start, decayed the same way */
+  uint64_t total[TOPK_METRICS];
+  struct topk_heap heaps[TOPK_METRICS];
+};
+
+/*
+ * Draw whether to count this one, from a xorshift state, any value but 0.
+ * Random rather than every TOPK_SAMPLE-th, not to alias with a stream in
+ * which keys come back periodically.
+ */
+static inline int topk_sampled(uint64_t *state)
+{
+  uint64_t x = *state;
+
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *state = x;
+
+  return (x & (TOPK_SAMPLE - 1)) == 0;
+}
+
+/* A zeroed tracker is an empty one, this is the same */
+void topk_init(struct topk *);
+
+/*
+ * Count a key of the given hash, e.g. intern_hash of it, as a number of
+ * messages and of bytes, either possibly 0.
+ */
+void topk_add(struct topk *, uint64_t, const char *, size_t, uint64_t,
+              uint64_t);
+
+/* Halve every count */
+void topk_decay(struct topk *);
+
+/*
+ * Add the counts of a tracker to another, the keys kept by either ranked
+ * again by their estimate over both.
+ */
+void topk_merge(struct topk *, const struct topk *);
+
+/*
+ * Copy the keys kept for a metric, highest count first, to an array of
+ * TOPK_SIZE. Returns how many.
+ */
+size_t topk_list(const struct topk *, enum topk_metric, struct topk_entry *);
+
+#endif
@@ -0,0 +1,333 @@
+#include <time.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "trace.h"
+
+/* Set of the threads with none of their own */
+static struct trace_loop trace_spare;
+
+_Thread_local struct trace_loop *trace_local = &trace_spare;
+
+/* Sets of the loops, by order of trace_init, NULL if one couldn't get one */
+static _Atomic(struct trace_loop *) loops[TRACE_LOOPS];
+static atomic_int loops_nr;
+
+static const char *stage_names[TRACE_STAGES] = {
+  "recv", "unpack", "handler", "pack"
+};
+
+static const char *event_names[TRACE_EVENTS] = {
+  "accept", "recv", "throttle", "error", "close"
+};
+
+static const char *type_names[TRACE_TYPES] = {
+  "RESERVED", "CONNECT", "CONNACK", "PUBLISH", "PUBACK", "PUBREC", "PUBREL",
+  "PUBCOMP", "SUBSCRIBE", "SUBACK", "UNSUBSCRIBE", "UNSUBACK", "PINGREQ",
+  "PINGRESP", "DISCONNECT", "AUTH"
+};
+
+/* Clock readings at init, to turn ticks into nanoseconds at dump time */
+static pthread_once_t base_once = PTHREAD_ONCE_INIT;
+static trace_tick base_tick;
+static uint64_t base_ns;
+static atomic_ullong last_error_dump;
+
+static uint64_t clock_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void on_dump_signal(int signo)
+{
+  int saved = errno;
+  (void) signo;
+  trace_dump(STDERR_FILENO);
+  errno = saved;
+}
+
+static void base_init(void)
+{
+  TRACE_STORE(&base_tick, trace_ticks());
+  TRACE_STORE(&base_ns, clock_ns());
+}
+
+/*
+ * Every set, the spare one first, in a caller array of TRACE_LOOPS + 1,
+ * returns how many. Signal safe.
+ */
+static int trace_loops(struct trace_loop **sets)
+{
+  int nr = atomic_load(&loops_nr);
+  int n = 0;
+
+  sets[n++] = &trace_spare;
+
+  for (int i = 0; i < nr && i < TRACE_LOOPS; i++) {
+    struct trace_loop *l = atomic_load_explicit(&loops[i],
+                                                memory_order_acquire);
+    if (l) {
+      sets[n++] = l;
+    }
+  }
+
+  return n;
+}
+
+int trace_init(int signo)
+{
+  pthread_once(&base_once, base_init);
+
+  /* Past TRACE_LOOPS or out of memory, the loop keeps the spare set */
+  if (trace_local == &trace_spare) {
+    int i = atomic_fetch_add(&loops_nr, 1);
+    struct trace_loop *l = i < TRACE_LOOPS ? calloc(1, sizeof(*l)) : NULL;
+    if (l) {
+      atomic_store_explicit(&loops[i], l, memory_order_release);
+      trace_local = l;
+    }
+  }
+
+  if (signo == 0) {
+    return 0;
+  }
+
+  struct sigaction sa;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_dump_signal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+
+  return sigaction(signo, &sa, NULL);
+}
+
+void trace_error(uint64_t ms, int fd, unsigned type, uint32_t code)
+{
+  trace_record(ms, TRACE_EV_ERROR, fd, type, code);
+
+  uint64_t now = clock_ns();
+  unsigned long long last = atomic_load(&last_error_dump);
+
+  /* One loop dumps for all of them */
+  if ((last == 0 || now - last >= TRACE_DUMP_INTERVAL * 1000000000ULL) &&
+      atomic_compare_exchange_strong(&last_error_dump, &last, now)) {
+    trace_dump(STDERR_FILENO);
+  }
+}
+
+uint64_t trace_packets(void)
+{
+  struct trace_loop *sets[TRACE_LOOPS + 1];
+  int n = trace_loops(sets);
+  uint64_t packets = 0;
+
+  for (int i = 0; i < n; i++) {
+    packets += TRACE_LOAD(&sets[i]->seq);
+  }
+
+  return packets;
+}
+
+void trace_stat_sum(enum trace_stage stage, unsigned type,
+                    struct trace_stat *sum)
+{
+  struct trace_loop *sets[TRACE_LOOPS + 1];
+  int n = trace_loops(sets);
+
+  memset(sum, 0, sizeof(*sum));
+
+  for (int i = 0; i < n; i++) {
+    struct trace_stat *s = &sets[i]->stats[stage][type & (TRACE_TYPES - 1)];
+    uint64_t max = TRACE_LOAD(&s->max);
+    sum->count += TRACE_LOAD(&s->count);
+    sum->ticks += TRACE_LOAD(&s->ticks);
+    if (max > sum->max) {
+      sum->max = max;
+    }
+    for (int b = 0; b < TRACE_HIST; b++) {
+      sum->hist[b] += TRACE_LOAD(&s->hist[b]);
+    }
+  }
+}
+
+/*
+ * Output buffer of a dump, written out when full, formatting by hand as
+ * nothing of stdio is safe in a signal handler.
+ */
+struct dump {
+  int fd;
+  size_t len;
+  char buf[4096];
+};
+
+static void dump_flush(struct dump *d)
+{
+  size_t off = 0;
+
+  while (off < d->len) {
+    ssize_t n = write(d->fd, d->buf + off, d->len - off);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    off += n;
+  }
+
+  d->len = 0;
+}
+
+static void dump_str(struct dump *d, const char *s)
+{
+  while (*s) {
+    if (d->len == sizeof(d->buf)) {
+      dump_flush(d);
+    }
+    d->buf[d->len++] = *s++;
+  }
+}
+
+/* Unsigned number, right aligned on width columns */
+static void dump_u64(struct dump *d, uint64_t v, int width)
+{
+  char digits[21];
+  int n = 0;
+
+  do {
+    digits[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v > 0);
+
+  for (int i = n; i < width; i++) {
+    dump_str(d, " ");
+  }
+
+  char s[2] = { 0, 0 };
+
+  while (n > 0) {
+    s[0] = digits[--n];
+    dump_str(d, s);
+  }
+}
+
+/* String left aligned on width columns */
+static void dump_col(struct dump *d, const char *s, int width)
+{
+  int n = strlen(s);
+
+  dump_str(d, s);
+  for (int i = n; i < width; i++) {
+    dump_str(d, " ");
+  }
+}
+
+double trace_ns_per_tick(void)
+{
+  trace_tick now_tick = trace_ticks();
+  uint64_t now_ns = clock_ns();
+
+  trace_tick tick = TRACE_LOAD(&base_tick);
+  uint64_t ns = TRACE_LOAD(&base_ns);
+
+  if (ns > 0 && now_tick > tick && now_ns > ns) {
+    return (double) (now_ns - ns) / (now_tick - tick);
+  }
+
+  return 1.0;
+}
+
+void trace_dump(int fd)
+{
+  struct dump d = { .fd = fd, .len = 0 };
+  uint64_t now_ns = clock_ns();
+  double scale = trace_ns_per_tick();
+
+  struct trace_loop *sets[TRACE_LOOPS + 1];
+  int n = trace_loops(sets);
+
+  dump_str(&d, "sol trace: ");
+  dump_u64(&d, trace_packets(), 0);
+  dump_str(&d, " packets and frames, 1 every ");
+  dump_u64(&d, TRACE_SAMPLE, 0);
+  dump_str(&d, " timed\n");
+  dump_str(&d, "stage    type           count       avg_ns       max_ns\n");
+
+  for (int s = 0; s < TRACE_STAGES; s++) {
+    for (int t = 0; t < TRACE_TYPES; t++) {
+      struct trace_stat st;
+      trace_stat_sum(s, t, &st);
+      if (st.count == 0) {
+        continue;
+      }
+      dump_col(&d, stage_names[s], 9);
+      dump_col(&d, type_names[t], 12);
+      dump_u64(&d, st.count, 8);
+      dump_u64(&d, (uint64_t) (st.ticks * scale / st.count), 13);
+      dump_u64(&d, (uint64_t) (st.max * scale), 13);
+      dump_str(&d, "\n");
+    }
+  }
+
+  /* Rings merged by loop clock, each already in order */
+  uint64_t next[TRACE_LOOPS + 1], head[TRACE_LOOPS + 1], events = 0;
+
+  for (int i = 0; i < n; i++) {
+    head[i] = TRACE_LOAD(&sets[i]->head);
+    next[i] = head[i] > TRACE_RING ? head[i] - TRACE_RING : 0;
+    events += head[i] - next[i];
+  }
+
+  dump_str(&d, "flight recorder, ");
+  dump_u64(&d, events, 0);
+  dump_str(&d, " events, oldest first, ms before now:\n");
+
+  uint64_t now_ms = now_ns / 1000000;
+
+  while (1) {
+    struct trace_record rec, *r = NULL;
+    int from = -1;
+    for (int i = 0; i < n; i++) {
+      if (next[i] < head[i]) {
+        const struct trace_record *c =
+            &sets[i]->ring[next[i] & (TRACE_RING - 1)];
+        uint64_t ms = TRACE_LOAD(&c->ms);
+        if (!r || ms < rec.ms) {
+          rec.ms = ms;
+          r = &rec;
+          from = i;
+        }
+      }
+    }
+    if (!r) {
+      break;
+    }
+    /* The loop may be writing over it, fields are read one by one */
+    const struct trace_record *c =
+        &sets[from]->ring[next[from]++ & (TRACE_RING - 1)];
+    rec.fd = TRACE_LOAD(&c->fd);
+    rec.event = TRACE_LOAD(&c->event);
+    rec.type = TRACE_LOAD(&c->type);
+    rec.len = TRACE_LOAD(&c->len);
+    dump_u64(&d, now_ms > r->ms ? now_ms - r->ms : 0, 10);
+    dump_str(&d, " ");
+    dump_col(&d, r->event < TRACE_EVENTS ? event_names[r->event] : "?", 9);
+    dump_col(&d, type_names[r->type & (TRACE_TYPES - 1)], 12);
+    dump_str(&d, " fd=");
+    dump_u64(&d, r->fd < 0 ? 0 : r->fd, 0);
+    dump_str(&d, r->event == TRACE_EV_ERROR ? " code=" : " len=");
+    dump_u64(&d, r->len, 0);
+    dump_str(&d, " loop=");
+    dump_u64(&d, from, 0);
+    dump_str(&d, "\n");
+  }
+
+  dump_flush(&d);
+}
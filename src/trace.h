@@ -0,0 +1,210 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+/*
+ * Low overhead instrumentation of the packet path, in two parts.
+ *
+ * Timing of the stages each packet goes through, by packet type, taken on
+ * one packet every TRACE_SAMPLE, with the TSC where there is one and the
+ * monotonic clock otherwise. The rest of the packets pay a counter
+ * increment and a predictable branch.
+ *
+ * A flight recorder, always on, a ring of the last TRACE_RING packet
+ * events. They are stamped with the loop clock, in milliseconds, which is
+ * read once per loop iteration, so recording costs no clock read. Events of
+ * the same millisecond keep their order in the ring. The ring is dumped to
+ * stderr on the signal given to trace_init, and on protocol errors at most
+ * once every TRACE_DUMP_INTERVAL seconds.
+ *
+ * Counters and ring are per loop, each written by its loop alone, and
+ * summed or merged by the readers, dumps and metrics. A dump racing with a
+ * loop may show its last few events half written. Threads past TRACE_LOOPS,
+ * or not running a loop, share a spare set.
+ */
+
+/* One packet timed every TRACE_SAMPLE, a power of 2, 0 for none */
+#ifndef TRACE_SAMPLE
+#define TRACE_SAMPLE        16
+#endif
+
+/* Events kept by the flight recorder, a power of 2 */
+#ifndef TRACE_RING
+#define TRACE_RING          4096
+#endif
+
+#define TRACE_DUMP_INTERVAL 60
+
+/* Loops with counters and ring of their own */
+#define TRACE_LOOPS         64
+
+/*
+ * Buckets of the histogram of each stage, log2 of the ticks taken, bucket
+ * i counting the laps of less than 2^i ticks not counted by the one before,
+ * the last one everything longer.
+ */
+#define TRACE_HIST          32
+
+enum trace_stage {
+  TRACE_RECV,
+  TRACE_UNPACK,
+  TRACE_HANDLER,
+  TRACE_PACK,
+  TRACE_STAGES
+};
+
+enum trace_event {
+  TRACE_EV_ACCEPT,
+  TRACE_EV_RECV,
+  TRACE_EV_THROTTLE,
+  TRACE_EV_ERROR,
+  TRACE_EV_CLOSE,
+  TRACE_EVENTS
+};
+
+/* Packet types, as the 4 bits of the fixed header */
+#define TRACE_TYPES         16
+
+typedef uint64_t trace_tick;
+
+struct trace_stat {
+  uint64_t count;
+  uint64_t ticks;
+  uint64_t max;
+  uint64_t hist[TRACE_HIST];
+};
+
+struct trace_record {
+  /* Loop clock, CLOCK_MONOTONIC in milliseconds */
+  uint64_t ms;
+  int32_t fd;
+  uint8_t event;
+  uint8_t type;
+  uint16_t pad;
+  /* Packet lenght, error code for TRACE_EV_ERROR */
+  uint32_t len;
+};
+
+/*
+ * What a loop traced. Everything read by other threads is stored relaxed,
+ * so it is never torn, at the cost of a plain store.
+ */
+struct trace_loop {
+  uint64_t seq;
+  uint64_t head;
+  struct trace_stat stats[TRACE_STAGES][TRACE_TYPES];
+  struct trace_record ring[TRACE_RING];
+};
+
+extern _Thread_local struct trace_loop *trace_local;
+
+#define TRACE_STORE(p, v)   __atomic_store_n(p, v, __ATOMIC_RELAXED)
+#define TRACE_LOAD(p)       __atomic_load_n(p, __ATOMIC_RELAXED)
+
+static inline trace_tick trace_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/*
+ * Start timing a packet, returns 0 if this one is not sampled, the laps
+ * below are no-ops then.
+ */
+static inline trace_tick trace_start(void)
+{
+#if TRACE_SAMPLE > 0
+  struct trace_loop *l = trace_local;
+  uint64_t seq = l->seq + 1;
+
+  TRACE_STORE(&l->seq, seq);
+  if ((seq & (TRACE_SAMPLE - 1)) == 0) {
+    return trace_ticks();
+  }
+#endif
+  return 0;
+}
+
+/* Account the time since the last lap to a stage, starting the next one */
+static inline void trace_lap(trace_tick *t, enum trace_stage stage,
+                             unsigned type)
+{
+  if (*t == 0) {
+    return;
+  }
+
+  trace_tick now = trace_ticks();
+  struct trace_stat *s = &trace_local->stats[stage][type & (TRACE_TYPES - 1)];
+  uint64_t d = now - *t;
+
+  TRACE_STORE(&s->count, s->count + 1);
+  TRACE_STORE(&s->ticks, s->ticks + d);
+  if (d > s->max) {
+    TRACE_STORE(&s->max, d);
+  }
+
+  unsigned b = d ? 64 - __builtin_clzll(d) : 0;
+  uint64_t *h = &s->hist[b < TRACE_HIST ? b : TRACE_HIST - 1];
+  TRACE_STORE(h, *h + 1);
+
+  /* 0 stands for not sampled, a clock reading 0 is a tick off at most */
+  *t = now ? now : 1;
+}
+
+/* Record an event in the flight recorder, at the loop clock given */
+static inline void trace_record(uint64_t ms, enum trace_event event, int fd,
+                                unsigned type, uint32_t len)
+{
+  struct trace_loop *l = trace_local;
+  struct trace_record *r = &l->ring[l->head & (TRACE_RING - 1)];
+
+  TRACE_STORE(&r->ms, ms);
+  TRACE_STORE(&r->fd, fd);
+  TRACE_STORE(&r->event, event);
+  TRACE_STORE(&r->type, type);
+  TRACE_STORE(&r->len, len);
+  TRACE_STORE(&l->head, l->head + 1);
+}
+
+/*
+ * Calibrate the clock, give the calling loop counters and ring of its own
+ * and dump the flight recorder on the given signal, 0 for none. Returns -1
+ * if the handler can't be installed.
+ */
+int trace_init(int);
+
+/* Packets and frames seen by every loop */
+uint64_t trace_packets(void);
+
+/* Statistics of a stage for a packet type, summed over every loop */
+void trace_stat_sum(enum trace_stage, unsigned, struct trace_stat *);
+
+/* Nanoseconds per tick, measured over the time since trace_init */
+double trace_ns_per_tick(void);
+
+/*
+ * Record a protocol error and dump the flight recorder if the last such
+ * dump is older than TRACE_DUMP_INTERVAL.
+ */
+void trace_error(uint64_t, int, unsigned, uint32_t);
+
+/*
+ * Write the stage statistics and the flight recorders of every loop merged,
+ * oldest event first, to a descriptor. Only async-signal-safe calls, it runs
+ * in the handler.
+ */
+void trace_dump(int);
+
+#endif
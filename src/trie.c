@@ -0,0 +1,1152 @@
+#include <stdlib.h>
+#include <string.h>
+#include "rcu.h"
+#include "memory.h"
+#include "trie.h"
+
+/* FNV-1a, lets the topic hash be extended level by level */
+#define FNV_OFFSET      0xcbf29ce484222325ULL
+#define FNV_PRIME       0x100000001b3ULL
+
+/*
+ * Kind of filter keys stored in the bloom filter. Filters without wildcards
+ * are stored as a whole, the others by the literal prefix before their first
+ * wildcard level and the wildcard itself.
+ */
+#define KEY_EXACT       0
+#define KEY_PLUS        1
+#define KEY_HASH        2
+
+/*
+ * Split the next level out of a topic, returning the pointer to the rest of
+ * the topic after the separator or NULL if it was the last level.
+ */
+static const char *next_level(const char *topic, size_t *len)
+{
+  *len = strcspn(topic, "/");
+  return topic[*len] == '/' ? topic + *len + 1 : NULL;
+}
+
+static inline uint64_t fnv_step(uint64_t hash, unsigned char c)
+{
+  return (hash ^ c) * FNV_PRIME;
+}
+
+static inline uint64_t filter_key(uint64_t hash, int kind)
+{
+  return (hash ^ kind) * 0x9e3779b97f4a7c15ULL;
+}
+
+/* Bloom key of a topic filter */
+static uint64_t filter_hash(const char *filter)
+{
+  uint64_t hash = FNV_OFFSET;
+  const char *level = filter;
+
+  while (1) {
+    size_t len = strcspn(level, "/");
+
+    if (len == 1 && (level[0] == '+' || level[0] == '#')) {
+      return filter_key(hash, level[0] == '+' ? KEY_PLUS : KEY_HASH);
+    }
+
+    for (size_t i = 0; i < len; i++) {
+      hash = fnv_step(hash, level[i]);
+    }
+
+    if (level[len] != '/') {
+      break;
+    }
+
+    hash = fnv_step(hash, '/');
+    level += len + 1;
+  }
+
+  return filter_key(hash, KEY_EXACT);
+}
+
+static void share_group_release(struct share_group *group)
+{
+  mem_free(MEM_TRIE, group->name);
+  mem_free(MEM_TRIE, group->subs);
+}
+
+/* Duplicate a group, the cursor carries on from where the original was */
+static int share_group_copy(struct share_group *dst,
+                            const struct share_group *src)
+{
+  dst->name = mem_strdup(MEM_TRIE, src->name);
+  dst->subs = mem_malloc(MEM_TRIE, src->subs_nr * sizeof(*dst->subs));
+  dst->subs_nr = src->subs_nr;
+  atomic_init(&dst->cursor, atomic_load_explicit(&src->cursor,
+                                                 memory_order_relaxed));
+
+  if (!dst->name || !dst->subs) {
+    share_group_release(dst);
+    return -1;
+  }
+
+  memcpy(dst->subs, src->subs, src->subs_nr * sizeof(*dst->subs));
+
+  return 0;
+}
+
+static struct trie_node *trie_node_create(const char *level, size_t len)
+{
+  struct trie_node *node = mem_calloc(MEM_TRIE, 1, sizeof(*node));
+
+  if (!node) {
+    return NULL;
+  }
+
+  node->level = mem_malloc(MEM_TRIE, len + 1);
+
+  if (!node->level) {
+    mem_free(MEM_TRIE, node);
+    return NULL;
+  }
+
+  memcpy(node->level, level, len);
+  node->level[len] = '\0';
+  node->levellen = len;
+
+  return node;
+}
+
+/*
+ * Shallow copy of a node, children are shared with the original while level
+ * and subscriptions are duplicated, so the copy can be freely modified before
+ * being published.
+ */
+static struct trie_node *trie_node_copy(const struct trie_node *node)
+{
+  struct trie_node *copy = trie_node_create(node->level, node->levellen);
+
+  if (!copy) {
+    return NULL;
+  }
+
+  if (node->children_nr > 0) {
+    copy->children = mem_malloc(MEM_TRIE,
+                                node->children_nr * sizeof(*copy->children));
+    if (!copy->children) {
+      goto err;
+    }
+    memcpy(copy->children, node->children,
+           node->children_nr * sizeof(*copy->children));
+    copy->children_nr = node->children_nr;
+  }
+
+  if (node->subs_nr > 0) {
+    copy->subs = mem_malloc(MEM_TRIE, node->subs_nr * sizeof(*copy->subs));
+    if (!copy->subs) {
+      goto err;
+    }
+    memcpy(copy->subs, node->subs, node->subs_nr * sizeof(*copy->subs));
+    copy->subs_nr = node->subs_nr;
+  }
+
+  if (node->groups_nr > 0) {
+    copy->groups = mem_calloc(MEM_TRIE, node->groups_nr, sizeof(*copy->groups));
+    if (!copy->groups) {
+      goto err;
+    }
+    for (size_t i = 0; i < node->groups_nr; i++) {
+      if (share_group_copy(&copy->groups[i], &node->groups[i]) < 0) {
+        goto err;
+      }
+      copy->groups_nr++;
+    }
+  }
+
+  return copy;
+
+err:
+  for (size_t i = 0; i < copy->groups_nr; i++) {
+    share_group_release(&copy->groups[i]);
+  }
+  mem_free(MEM_TRIE, copy->groups);
+  mem_free(MEM_TRIE, copy->subs);
+  mem_free(MEM_TRIE, copy->children);
+  mem_free(MEM_TRIE, copy->level);
+  mem_free(MEM_TRIE, copy);
+  return NULL;
+}
+
+/* Release a single node, children are left untouched */
+static void trie_node_free(void *ptr)
+{
+  struct trie_node *node = ptr;
+
+  for (size_t i = 0; i < node->groups_nr; i++) {
+    share_group_release(&node->groups[i]);
+  }
+
+  mem_free(MEM_TRIE, node->level);
+  mem_free(MEM_TRIE, node->children);
+  mem_free(MEM_TRIE, node->subs);
+  mem_free(MEM_TRIE, node->groups);
+  mem_free(MEM_TRIE, node);
+}
+
+static void trie_node_free_all(struct trie_node *node)
+{
+  if (!node) {
+    return;
+  }
+
+  for (size_t i = 0; i < node->children_nr; i++) {
+    trie_node_free_all(node->children[i]);
+  }
+
+  trie_node_free(node);
+}
+
+static int level_cmp(const struct trie_node *node, const char *level,
+                     size_t len)
+{
+  size_t min = node->levellen < len ? node->levellen : len;
+  int cmp = memcmp(node->level, level, min);
+
+  if (cmp != 0) {
+    return cmp;
+  }
+
+  return (node->levellen > len) - (node->levellen < len);
+}
+
+/*
+ * Binary search of a child by level, returns it or NULL, storing in pos the
+ * index where it is or where it should be inserted.
+ */
+static struct trie_node *child_find(const struct trie_node *node,
+                                    const char *level, size_t len,
+                                    size_t *pos)
+{
+  size_t lo = 0;
+  size_t hi = node->children_nr;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    int cmp = level_cmp(node->children[mid], level, len);
+    if (cmp == 0) {
+      if (pos) {
+        *pos = mid;
+      }
+      return node->children[mid];
+    } else if (cmp < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  if (pos) {
+    *pos = lo;
+  }
+
+  return NULL;
+}
+
+/*
+ * Add or update a subscription in an array, returns 1 if it was added, 0 if
+ * updated and -1 on allocation failure.
+ */
+static int subs_set(struct subscription **subs, size_t *subs_nr,
+                    void *subscriber, unsigned qos)
+{
+  for (size_t i = 0; i < *subs_nr; i++) {
+    if ((*subs)[i].subscriber == subscriber) {
+      (*subs)[i].qos = qos;
+      return 0;
+    }
+  }
+
+  struct subscription *nsubs =
+      mem_realloc(MEM_TRIE, *subs, (*subs_nr + 1) * sizeof(*nsubs));
+
+  if (!nsubs) {
+    return -1;
+  }
+
+  nsubs[*subs_nr].subscriber = subscriber;
+  nsubs[*subs_nr].qos = qos;
+  nsubs[*subs_nr].group = NULL;
+  *subs = nsubs;
+  (*subs_nr)++;
+
+  return 1;
+}
+
+/* Remove a subscription from an array, returns 1 if it was there */
+static int subs_remove(struct subscription *subs, size_t *subs_nr,
+                       void *subscriber)
+{
+  for (size_t i = 0; i < *subs_nr; i++) {
+    if (subs[i].subscriber == subscriber) {
+      subs[i] = subs[--(*subs_nr)];
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static struct share_group *group_find(const struct trie_node *node,
+                                      const char *name)
+{
+  for (size_t i = 0; i < node->groups_nr; i++) {
+    if (strcmp(node->groups[i].name, name) == 0) {
+      return &node->groups[i];
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Add or update a subscription in a private (not yet published) node, into
+ * the named shared group if group is not NULL.
+ */
+static int node_set_subscription(struct trie_node *node, void *subscriber,
+                                 unsigned qos, const char *group)
+{
+  if (!group) {
+    return subs_set(&node->subs, &node->subs_nr, subscriber, qos);
+  }
+
+  struct share_group *g = group_find(node, group);
+
+  if (!g) {
+    struct share_group *groups =
+        mem_realloc(MEM_TRIE, node->groups,
+                    (node->groups_nr + 1) * sizeof(*groups));
+    if (!groups) {
+      return -1;
+    }
+    node->groups = groups;
+    g = &groups[node->groups_nr];
+    g->name = mem_strdup(MEM_TRIE, group);
+    if (!g->name) {
+      return -1;
+    }
+    g->subs = NULL;
+    g->subs_nr = 0;
+    atomic_init(&g->cursor, 0);
+    node->groups_nr++;
+  }
+
+  return subs_set(&g->subs, &g->subs_nr, subscriber, qos);
+}
+
+/* Remove a subscription from a private node, returns 1 if it was there */
+static int node_remove_subscription(struct trie_node *node, void *subscriber,
+                                    const char *group)
+{
+  if (!group) {
+    return subs_remove(node->subs, &node->subs_nr, subscriber);
+  }
+
+  struct share_group *g = group_find(node, group);
+
+  if (!g || !subs_remove(g->subs, &g->subs_nr, subscriber)) {
+    return 0;
+  }
+
+  /* Drop the group with its last member */
+  if (g->subs_nr == 0) {
+    share_group_release(g);
+    *g = node->groups[--node->groups_nr];
+  }
+
+  return 1;
+}
+
+/*
+ * Build a new version of the path leading to the filter, node is the
+ * current version (NULL if it doesn't exist yet) and rest the remaining
+ * levels to descend, NULL when node is the target of the subscription.
+ */
+static struct trie_node *node_insert(const struct trie_node *node,
+                                     const char *level, size_t len,
+                                     const char *rest,
+                                     struct subscription *sub,
+                                     const char *group, int *added)
+{
+  struct trie_node *copy =
+      node ? trie_node_copy(node) : trie_node_create(level, len);
+
+  if (!copy) {
+    return NULL;
+  }
+
+  if (!rest) {
+    int rc = node_set_subscription(copy, sub->subscriber, sub->qos, group);
+    if (rc < 0) {
+      trie_node_free(copy);
+      return NULL;
+    }
+    *added = rc;
+    return copy;
+  }
+
+  size_t nlen;
+  const char *nrest = next_level(rest, &nlen);
+  size_t pos;
+  struct trie_node *child = child_find(copy, rest, nlen, &pos);
+  struct trie_node *nchild =
+      node_insert(child, rest, nlen, nrest, sub, group, added);
+
+  if (!nchild) {
+    trie_node_free(copy);
+    return NULL;
+  }
+
+  if (child) {
+    copy->children[pos] = nchild;
+    return copy;
+  }
+
+  struct trie_node **children =
+      mem_realloc(MEM_TRIE, copy->children,
+                  (copy->children_nr + 1) * sizeof(*children));
+
+  if (!children) {
+    /* Brand new path, nothing in it is shared with the published trie */
+    trie_node_free_all(nchild);
+    trie_node_free(copy);
+    return NULL;
+  }
+
+  memmove(children + pos + 1, children + pos,
+          (copy->children_nr - pos) * sizeof(*children));
+  children[pos] = nchild;
+  copy->children = children;
+  copy->children_nr++;
+
+  return copy;
+}
+
+/*
+ * Build a new version of the path without the subscription, out is set to
+ * NULL if the node is left empty and can be pruned from its parent.
+ */
+static int node_remove(const struct trie_node *node, const char *rest,
+                       void *subscriber, const char *group, int is_root,
+                       struct trie_node **out)
+{
+  struct trie_node *copy = trie_node_copy(node);
+
+  if (!copy) {
+    return -1;
+  }
+
+  if (!rest) {
+    node_remove_subscription(copy, subscriber, group);
+  } else {
+    size_t nlen;
+    const char *nrest = next_level(rest, &nlen);
+    size_t pos;
+    struct trie_node *child = child_find(copy, rest, nlen, &pos);
+    struct trie_node *nchild = NULL;
+
+    if (node_remove(child, nrest, subscriber, group, 0, &nchild) < 0) {
+      trie_node_free(copy);
+      return -1;
+    }
+
+    if (nchild) {
+      copy->children[pos] = nchild;
+    } else {
+      memmove(copy->children + pos, copy->children + pos + 1,
+              (copy->children_nr - pos - 1) * sizeof(*copy->children));
+      copy->children_nr--;
+    }
+  }
+
+  if (!is_root && copy->subs_nr == 0 && copy->groups_nr == 0 &&
+      copy->children_nr == 0) {
+    trie_node_free(copy);
+    *out = NULL;
+  } else {
+    *out = copy;
+  }
+
+  return 0;
+}
+
+/* Retire every node of the old version along the path of a filter */
+static void retire_path(struct trie_node *node, const char *rest)
+{
+  while (node) {
+    rcu_defer(node, trie_node_free);
+    if (!rest) {
+      break;
+    }
+    size_t len;
+    const char *nrest = next_level(rest, &len);
+    node = child_find(node, rest, len, NULL);
+    rest = nrest;
+  }
+}
+
+/* Look for a subscription in the current version, writer lock held */
+static int subscription_exists(const struct trie_node *node,
+                               const char *filter, void *subscriber,
+                               const char *group)
+{
+  const char *rest = filter;
+
+  while (rest) {
+    size_t len;
+    const char *nrest = next_level(rest, &len);
+    node = child_find(node, rest, len, NULL);
+    if (!node) {
+      return 0;
+    }
+    rest = nrest;
+  }
+
+  const struct subscription *subs = node->subs;
+  size_t subs_nr = node->subs_nr;
+
+  if (group) {
+    const struct share_group *g = group_find(node, group);
+    if (!g) {
+      return 0;
+    }
+    subs = g->subs;
+    subs_nr = g->subs_nr;
+  }
+
+  for (size_t i = 0; i < subs_nr; i++) {
+    if (subs[i].subscriber == subscriber) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Split a "$share/<group>/<filter>" filter, returning the inner filter and
+ * storing a copy of the group name in group, left NULL for plain filters.
+ * Returns NULL if the shared filter is malformed or on allocation failure.
+ */
+static const char *share_split(const char *filter, char **group)
+{
+  size_t prefix = sizeof(TRIE_SHARE_PREFIX) - 1;
+
+  *group = NULL;
+
+  if (strncmp(filter, TRIE_SHARE_PREFIX, prefix) != 0) {
+    return filter;
+  }
+
+  const char *name = filter + prefix;
+  size_t len = strcspn(name, "/+#");
+
+  /* Group names are a single non-empty level without wildcards */
+  if (len == 0 || name[len] != '/' || name[len + 1] == '\0') {
+    return NULL;
+  }
+
+  *group = strndup(name, len);
+
+  return *group ? name + len + 1 : NULL;
+}
+
+static void changelog_free(void *filter)
+{
+  mem_free(MEM_TRIE, filter);
+}
+
+/* Record a changed filter, writer lock held */
+static void log_change(struct trie *trie, const char *filter)
+{
+  unsigned long seq = atomic_load_explicit(&trie->version,
+                                           memory_order_relaxed) + 1;
+  char *copy = mem_strdup(MEM_TRIE, filter);
+
+  /*
+   * Without a copy the entry can't be trusted, pushing a full ring of
+   * changes forces every cache to flush instead.
+   */
+  if (!copy) {
+    seq += TRIE_CHANGELOG;
+  }
+
+  char *old = atomic_exchange(&trie->changelog[seq % TRIE_CHANGELOG], copy);
+  rcu_defer(old, changelog_free);
+  atomic_store_explicit(&trie->version, seq, memory_order_release);
+}
+
+void trie_init(struct trie *trie)
+{
+  atomic_init(&trie->root, trie_node_create("", 0));
+  atomic_init(&trie->size, 0);
+  atomic_init(&trie->version, 0);
+  pthread_mutex_init(&trie->wlock, NULL);
+  trie->share_strategy = SHARE_ROUND_ROBIN;
+  trie->share_depth = NULL;
+
+  for (int i = 0; i < TRIE_CHANGELOG; i++) {
+    atomic_init(&trie->changelog[i], NULL);
+  }
+
+  /* Without a filter every lookup just falls through to the trie */
+  if (bloom_init(&trie->filter, TRIE_FILTER_BLOCKS) < 0) {
+    trie->filter.bits = NULL;
+  }
+}
+
+void trie_release(struct trie *trie)
+{
+  trie_node_free_all(atomic_load(&trie->root));
+  atomic_store(&trie->root, NULL);
+  pthread_mutex_destroy(&trie->wlock);
+  bloom_release(&trie->filter);
+
+  for (int i = 0; i < TRIE_CHANGELOG; i++) {
+    mem_free(MEM_TRIE, atomic_exchange(&trie->changelog[i], NULL));
+  }
+}
+
+void trie_share_strategy(struct trie *trie, enum share_strategy strategy,
+                         share_depth_fn *depth)
+{
+  trie->share_strategy = strategy;
+  trie->share_depth = depth;
+}
+
+int trie_subscribe(struct trie *trie, const char *filter,
+                   void *subscriber, unsigned qos)
+{
+  struct subscription sub = {
+    .subscriber = subscriber,
+    .qos = qos,
+    .group = NULL
+  };
+  int added = 0;
+  char *group;
+
+  /* Shared groups live on the node of the inner filter */
+  filter = share_split(filter, &group);
+
+  if (!filter) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&trie->wlock);
+
+  struct trie_node *old = atomic_load_explicit(&trie->root,
+                                               memory_order_relaxed);
+  struct trie_node *root =
+      node_insert(old, "", 0, filter, &sub, group, &added);
+
+  if (!root) {
+    pthread_mutex_unlock(&trie->wlock);
+    free(group);
+    return -1;
+  }
+
+  if (added && trie->filter.bits) {
+    bloom_add(&trie->filter, filter_hash(filter));
+  }
+
+  /* Make the whole new path visible to readers at once */
+  atomic_store_explicit(&trie->root, root, memory_order_release);
+
+  if (added) {
+    atomic_fetch_add(&trie->size, 1);
+  }
+
+  /*
+   * Log before retiring, caches holding groups of the old path must see the
+   * change before those can be reclaimed.
+   */
+  log_change(trie, filter);
+  retire_path(old, filter);
+
+  pthread_mutex_unlock(&trie->wlock);
+  free(group);
+
+  return 0;
+}
+
+int trie_unsubscribe(struct trie *trie, const char *filter, void *subscriber)
+{
+  char *group;
+
+  filter = share_split(filter, &group);
+
+  if (!filter) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&trie->wlock);
+
+  struct trie_node *old = atomic_load_explicit(&trie->root,
+                                               memory_order_relaxed);
+  struct trie_node *root = NULL;
+
+  if (!subscription_exists(old, filter, subscriber, group) ||
+      node_remove(old, filter, subscriber, group, 1, &root) < 0) {
+    pthread_mutex_unlock(&trie->wlock);
+    free(group);
+    return -1;
+  }
+
+  atomic_store_explicit(&trie->root, root, memory_order_release);
+  atomic_fetch_sub(&trie->size, 1);
+
+  if (trie->filter.bits) {
+    bloom_del(&trie->filter, filter_hash(filter));
+  }
+
+  log_change(trie, filter);
+  retire_path(old, filter);
+
+  pthread_mutex_unlock(&trie->wlock);
+  free(group);
+
+  return 0;
+}
+
+int trie_filter_match(const char *filter, const char *topic)
+{
+  /* Wildcards on the first level don't match '$' topics */
+  if (topic[0] == '$' && (filter[0] == '+' || filter[0] == '#')) {
+    return 0;
+  }
+
+  while (1) {
+    size_t flen = strcspn(filter, "/");
+    size_t tlen = strcspn(topic, "/");
+
+    if (flen == 1 && filter[0] == '#') {
+      return 1;
+    }
+
+    if (!(flen == 1 && filter[0] == '+') &&
+        (flen != tlen || memcmp(filter, topic, flen) != 0)) {
+      return 0;
+    }
+
+    filter += flen;
+    topic += tlen;
+
+    if (*topic == '\0') {
+      /* "a/#" matches "a" too */
+      return *filter == '\0' || strcmp(filter, "/#") == 0;
+    }
+
+    if (*filter == '\0') {
+      return 0;
+    }
+
+    filter++;
+    topic++;
+  }
+}
+
+int trie_path_match(const char *filter, const char *topic)
+{
+  if (topic[0] == '$' && (filter[0] == '+' || filter[0] == '#')) {
+    return 0;
+  }
+
+  while (1) {
+    size_t flen = strcspn(filter, "/");
+    size_t tlen = strcspn(topic, "/");
+
+    if (flen == 1 && filter[0] == '#') {
+      return 1;
+    }
+
+    if (!(flen == 1 && filter[0] == '+') &&
+        (flen != tlen || memcmp(filter, topic, flen) != 0)) {
+      return 0;
+    }
+
+    filter += flen;
+    topic += tlen;
+
+    /* The node down to this level is on the path and matches the topic */
+    if (*topic == '\0') {
+      return 1;
+    }
+
+    if (*filter == '\0') {
+      return 0;
+    }
+
+    filter++;
+    topic++;
+  }
+}
+
+unsigned long trie_version(const struct trie *trie)
+{
+  return atomic_load_explicit(&trie->version, memory_order_acquire);
+}
+
+const char *trie_changed_filter(const struct trie *trie, unsigned long seq)
+{
+  return atomic_load_explicit(&trie->changelog[seq % TRIE_CHANGELOG],
+                              memory_order_acquire);
+}
+
+int trie_may_match(const struct trie *trie, const char *topic)
+{
+  const struct bloom *bloom = &trie->filter;
+
+  if (!bloom->bits) {
+    return 1;
+  }
+
+  uint64_t hash = FNV_OFFSET;
+  const char *p = topic;
+  /* Wildcards on the first level don't match '$' topics */
+  int wildcards = topic[0] != '$';
+
+  while (1) {
+    /* Filters with the first wildcard right at this level */
+    if (wildcards && (bloom_test(bloom, filter_key(hash, KEY_PLUS)) ||
+                      bloom_test(bloom, filter_key(hash, KEY_HASH)))) {
+      return 1;
+    }
+
+    while (*p && *p != '/') {
+      hash = fnv_step(hash, *p++);
+    }
+
+    if (*p != '/') {
+      break;
+    }
+
+    hash = fnv_step(hash, *p++);
+    wildcards = 1;
+  }
+
+  if (bloom_test(bloom, filter_key(hash, KEY_EXACT))) {
+    return 1;
+  }
+
+  /* "a/#" matches "a" too */
+  return bloom_test(bloom, filter_key(fnv_step(hash, '/'), KEY_HASH));
+}
+
+/* Topic name being routed and where its subscriptions go */
+struct match_ctx {
+  const struct trie *trie;
+  const char *topic;
+  /* Report shared groups instead of picking one of their members */
+  int shared;
+  trie_match_cb *cb;
+  void *arg;
+};
+
+/* Filter being built along the walk, path holds the one of the current node */
+struct walk_ctx {
+  char *path;
+  size_t cap;
+  trie_walk_cb *cb;
+  void *arg;
+};
+
+static int path_reserve(struct walk_ctx *ctx, size_t len)
+{
+  if (len <= ctx->cap) {
+    return 0;
+  }
+
+  size_t cap = ctx->cap ? ctx->cap : 64;
+
+  while (cap < len) {
+    cap *= 2;
+  }
+
+  char *path = realloc(ctx->path, cap);
+
+  if (!path) {
+    return -1;
+  }
+
+  ctx->path = path;
+  ctx->cap = cap;
+
+  return 0;
+}
+
+static int node_walk(const struct trie_node *node, size_t len, int root,
+                     struct walk_ctx *ctx)
+{
+  ctx->path[len] = '\0';
+
+  for (size_t i = 0; i < node->subs_nr; i++) {
+    ctx->cb(ctx->path, &node->subs[i], ctx->arg);
+  }
+
+  for (size_t i = 0; i < node->groups_nr; i++) {
+    const struct share_group *g = &node->groups[i];
+    size_t namelen = strlen(g->name);
+    size_t plen = sizeof(TRIE_SHARE_PREFIX) - 1;
+    char *shared = malloc(plen + namelen + 1 + len + 1);
+
+    if (!shared) {
+      return -1;
+    }
+
+    memcpy(shared, TRIE_SHARE_PREFIX, plen);
+    memcpy(shared + plen, g->name, namelen);
+    shared[plen + namelen] = '/';
+    memcpy(shared + plen + namelen + 1, ctx->path, len + 1);
+
+    for (size_t j = 0; j < g->subs_nr; j++) {
+      ctx->cb(shared, &g->subs[j], ctx->arg);
+    }
+
+    free(shared);
+  }
+
+  for (size_t i = 0; i < node->children_nr; i++) {
+    const struct trie_node *child = node->children[i];
+    /* Children of the root start a filter, the others add a level */
+    size_t clen = root ? child->levellen : len + 1 + child->levellen;
+
+    if (path_reserve(ctx, clen + 1) < 0) {
+      return -1;
+    }
+
+    if (!root) {
+      ctx->path[len] = '/';
+    }
+
+    memcpy(ctx->path + clen - child->levellen, child->level, child->levellen);
+
+    if (node_walk(child, clen, 0, ctx) < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int trie_walk(struct trie *trie, trie_walk_cb *cb, void *arg)
+{
+  struct walk_ctx ctx = {
+    .path = NULL,
+    .cap = 0,
+    .cb = cb,
+    .arg = arg
+  };
+  int rc = -1;
+
+  /* Nodes of the current version are never retired while writers wait */
+  pthread_mutex_lock(&trie->wlock);
+
+  const struct trie_node *root =
+      atomic_load_explicit(&trie->root, memory_order_relaxed);
+
+  if (path_reserve(&ctx, 1) == 0) {
+    rc = root ? node_walk(root, 0, 1, &ctx) : 0;
+  }
+
+  pthread_mutex_unlock(&trie->wlock);
+  free(ctx.path);
+
+  return rc;
+}
+
+static inline uint64_t mix64(uint64_t x)
+{
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  return x ^ (x >> 33);
+}
+
+/*
+ * Rendezvous hashing, every member scores the topic and the highest wins,
+ * so members joining or leaving only move the topics they win or lose.
+ */
+static const struct subscription *pick_sticky(const struct share_group *g,
+                                              const char *topic)
+{
+  uint64_t hash = FNV_OFFSET;
+  const struct subscription *best = NULL;
+  uint64_t best_score = 0;
+
+  while (*topic) {
+    hash = fnv_step(hash, *topic++);
+  }
+
+  for (size_t i = 0; i < g->subs_nr; i++) {
+    uint64_t score = mix64(hash ^ (uintptr_t) g->subs[i].subscriber);
+    if (!best || score > best_score) {
+      best = &g->subs[i];
+      best_score = score;
+    }
+  }
+
+  return best;
+}
+
+/* Shortest outbound queue wins, ties are broken round-robin */
+static const struct subscription *pick_least_queued(const struct trie *trie,
+                                                    struct share_group *g)
+{
+  size_t start = atomic_fetch_add_explicit(&g->cursor, 1,
+                                           memory_order_relaxed);
+  const struct subscription *best = NULL;
+  size_t best_depth = 0;
+
+  for (size_t i = 0; i < g->subs_nr; i++) {
+    const struct subscription *sub = &g->subs[(start + i) % g->subs_nr];
+    size_t depth = trie->share_depth(sub->subscriber);
+    if (!best || depth < best_depth) {
+      best = sub;
+      best_depth = depth;
+      if (depth == 0) {
+        break;
+      }
+    }
+  }
+
+  return best;
+}
+
+const struct subscription *trie_share_pick(const struct trie *trie,
+                                           const struct share_group *group,
+                                           const char *topic)
+{
+  /* The cursor is the only field of a published group readers may touch */
+  struct share_group *g = (struct share_group *) group;
+
+  if (g->subs_nr == 0) {
+    return NULL;
+  }
+
+  switch (trie->share_strategy) {
+    case SHARE_STICKY_HASH:
+      return pick_sticky(g, topic);
+    case SHARE_LEAST_QUEUED:
+      if (trie->share_depth) {
+        return pick_least_queued(trie, g);
+      }
+      /* fallthrough */
+    case SHARE_ROUND_ROBIN:
+    default:
+      break;
+  }
+
+  size_t i = atomic_fetch_add_explicit(&g->cursor, 1, memory_order_relaxed);
+
+  return &g->subs[i % g->subs_nr];
+}
+
+static size_t node_deliver(const struct trie_node *node,
+                           const struct match_ctx *ctx)
+{
+  for (size_t i = 0; i < node->subs_nr; i++) {
+    ctx->cb(&node->subs[i], ctx->arg);
+  }
+
+  /* One delivery per shared group, to a single member of it */
+  for (size_t i = 0; i < node->groups_nr; i++) {
+    const struct share_group *g = &node->groups[i];
+    if (ctx->shared) {
+      struct subscription sub = {
+        .subscriber = NULL,
+        .qos = 0,
+        .group = g
+      };
+      ctx->cb(&sub, ctx->arg);
+    } else {
+      const struct subscription *sub = trie_share_pick(ctx->trie, g,
+                                                       ctx->topic);
+      if (sub) {
+        ctx->cb(sub, ctx->arg);
+      }
+    }
+  }
+
+  return node->subs_nr + node->groups_nr;
+}
+
+/*
+ * Walk the trie following a topic name, rest is NULL once every level has
+ * been consumed. Per MQTT spec, topics starting with '$' are not matched by
+ * wildcards on the first level.
+ */
+static size_t node_match(const struct trie_node *node, const char *rest,
+                         int sys, const struct match_ctx *ctx)
+{
+  size_t matched = 0;
+  struct trie_node *child;
+
+  if (!rest) {
+    matched += node_deliver(node, ctx);
+    /* "a/#" matches "a" too */
+    if ((child = child_find(node, "#", 1, NULL))) {
+      matched += node_deliver(child, ctx);
+    }
+    return matched;
+  }
+
+  size_t len;
+  const char *nrest = next_level(rest, &len);
+
+  if ((child = child_find(node, rest, len, NULL))) {
+    matched += node_match(child, nrest, 0, ctx);
+  }
+
+  if (sys) {
+    return matched;
+  }
+
+  if ((child = child_find(node, "+", 1, NULL))) {
+    matched += node_match(child, nrest, 0, ctx);
+  }
+
+  if ((child = child_find(node, "#", 1, NULL))) {
+    matched += node_deliver(child, ctx);
+  }
+
+  return matched;
+}
+
+static size_t match(struct trie *trie, const char *topic, int shared,
+                    trie_match_cb *cb, void *arg)
+{
+  const struct trie_node *root =
+      atomic_load_explicit(&trie->root, memory_order_acquire);
+
+  if (!root) {
+    return 0;
+  }
+
+  struct match_ctx ctx = {
+    .trie = trie,
+    .topic = topic,
+    .shared = shared,
+    .cb = cb,
+    .arg = arg
+  };
+
+  return node_match(root, topic, topic[0] == '$', &ctx);
+}
+
+size_t trie_match(struct trie *trie, const char *topic,
+                  trie_match_cb *cb, void *arg)
+{
+  return match(trie, topic, 0, cb, arg);
+}
+
+size_t trie_match_shared(struct trie *trie, const char *topic,
+                         trie_match_cb *cb, void *arg)
+{
+  return match(trie, topic, 1, cb, arg);
+}
@@ -0,0 +1,193 @@
+#ifndef TRIE_H
+#define TRIE_H
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "bloom.h"
+
+/*
+ * Subscription index, a trie of topic levels where each node holds the
+ * subscriptions to the filter formed by the path from the root to it.
+ *
+ * The index is read-mostly: PUBLISH routing walks it from every loop without
+ * taking any lock, while SUBSCRIBE and UNSUBSCRIBE are serialized on a writer
+ * lock. Nodes are never modified once published, writers copy the path from
+ * the root to the touched node, publish the new root atomically and retire
+ * the old nodes through rcu_defer. Unchanged subtrees are shared between
+ * versions.
+ *
+ * A counting bloom filter over the subscribed filters sits in front of the
+ * trie, letting the router reject topics nobody is subscribed to without a
+ * full descent.
+ *
+ * Shared subscriptions, "$share/<group>/<filter>", are stored on the node of
+ * the inner filter as named groups; every message matching it is delivered
+ * to a single member of each group, picked by the trie share strategy.
+ */
+
+/* Default size of the negative-lookup filter, 64 bytes blocks */
+#define TRIE_FILTER_BLOCKS  4096
+
+/* Number of recent filter changes kept for incremental cache invalidation */
+#define TRIE_CHANGELOG      64
+
+/* Prefix of shared subscription filters */
+#define TRIE_SHARE_PREFIX   "$share/"
+
+/* How a member of a shared group is picked for each message */
+enum share_strategy {
+  SHARE_ROUND_ROBIN,
+  SHARE_LEAST_QUEUED,
+  SHARE_STICKY_HASH
+};
+
+/* Outbound queue depth of a subscriber, used by SHARE_LEAST_QUEUED */
+typedef size_t share_depth_fn(const void *);
+
+struct share_group;
+
+/*
+ * Flag set on the qos of subscribers living in the broker process, see
+ * broker.h, the QoS itself is in the low bits.
+ */
+#define TRIE_SUB_LOCAL      0x100
+#define TRIE_SUB_QOS(qos)   ((qos) & 0x03)
+
+/* A single subscription, the subscriber is opaque to the index */
+struct subscription {
+  void *subscriber;
+  unsigned qos;
+  /* Set only on the entries trie_match_shared reports for a group */
+  const struct share_group *group;
+};
+
+/*
+ * Members of a shared subscription group, cursor is the only field updated
+ * by readers, to spread messages round-robin.
+ */
+struct share_group {
+  char *name;
+  size_t subs_nr;
+  struct subscription *subs;
+  atomic_size_t cursor;
+};
+
+struct trie_node {
+  /* Topic level this node represents, NUL terminated */
+  char *level;
+  size_t levellen;
+  /* Children sorted by level, looked up with a binary search */
+  size_t children_nr;
+  struct trie_node **children;
+  size_t subs_nr;
+  struct subscription *subs;
+  size_t groups_nr;
+  struct share_group *groups;
+};
+
+struct trie {
+  _Atomic(struct trie_node *) root;
+  /* Serialize writers, readers never touch it */
+  pthread_mutex_t wlock;
+  /* Total number of subscriptions stored */
+  atomic_size_t size;
+  /* Negative-lookup filter, updated by writers under wlock */
+  struct bloom filter;
+  /*
+   * Sequence number of the last change and ring of the last changed filters,
+   * lets routing caches drop only the entries affected by a change.
+   */
+  atomic_ulong version;
+  _Atomic(char *) changelog[TRIE_CHANGELOG];
+  /* Shared groups member selection, see trie_share_strategy */
+  enum share_strategy share_strategy;
+  share_depth_fn *share_depth;
+};
+
+/* Callback executed on every subscription matching a published topic */
+typedef void trie_match_cb(const struct subscription *, void *);
+
+/* Callback executed on every subscription stored, with its full filter */
+typedef void trie_walk_cb(const char *, const struct subscription *, void *);
+
+void trie_init(struct trie *);
+
+/* Release the whole index, must be called when no reader is left */
+void trie_release(struct trie *);
+
+/*
+ * Set how members of shared groups are picked, round-robin by default. The
+ * depth callback is required by SHARE_LEAST_QUEUED, without it the strategy
+ * falls back to round-robin. Must be set before routing starts.
+ */
+void trie_share_strategy(struct trie *, enum share_strategy, share_depth_fn *);
+
+/*
+ * Add or update a subscription to a topic filter, wildcards '+' and '#' are
+ * accepted, as is the "$share/<group>/" prefix to join a shared group.
+ * Returns 0 on success, -1 on allocation failure or malformed shared filter.
+ */
+int trie_subscribe(struct trie *, const char *, void *, unsigned);
+
+/* Remove a subscription, returns -1 if it was not found */
+int trie_unsubscribe(struct trie *, const char *, void *);
+
+/*
+ * Visit every subscription of the index with the filter it was made with,
+ * "$share/<group>/" prefix included. Writers are blocked meanwhile and the
+ * callback must not change the index. Returns -1 on allocation failure.
+ */
+int trie_walk(struct trie *, trie_walk_cb *, void *);
+
+/*
+ * Fast negative lookup, return 0 if no subscription can match the topic name
+ * and 1 if there may be some. Probes the filter once for the exact topic and
+ * twice per level for wildcard filters, one cache line each.
+ */
+int trie_may_match(const struct trie *, const char *);
+
+/* Return 1 if the topic filter matches the topic name */
+int trie_filter_match(const char *, const char *);
+
+/*
+ * Return 1 if a node along the path of the topic filter, the ones a change
+ * to it retires, has a filter matching the topic name.
+ */
+int trie_path_match(const char *, const char *);
+
+/* Sequence number of the last subscription change */
+unsigned long trie_version(const struct trie *);
+
+/*
+ * Filter touched by the change with the given sequence number, NULL if it is
+ * too old and fell out of the changelog. Callers must check trie_version
+ * again after reading, a changed filter is valid only if it didn't move more
+ * than TRIE_CHANGELOG changes ahead meanwhile.
+ */
+const char *trie_changed_filter(const struct trie *, unsigned long);
+
+/*
+ * Route a published topic name to all the matching subscriptions, lock-free,
+ * must be called from a thread registered to rcu. Returns the number of
+ * subscriptions matched.
+ */
+size_t trie_match(struct trie *, const char *, trie_match_cb *, void *);
+
+/*
+ * Like trie_match but shared groups are reported as they are, once each
+ * with group set and no subscriber, leaving the pick to trie_share_pick.
+ * Meant for caches of subscription sets, which must not freeze the pick.
+ */
+size_t trie_match_shared(struct trie *, const char *, trie_match_cb *, void *);
+
+/*
+ * Pick the member of a shared group a message published on a topic goes to,
+ * NULL if the group is empty. The group must come from the current version
+ * of the trie or from one not yet reclaimed.
+ */
+const struct subscription *trie_share_pick(const struct trie *,
+                                           const struct share_group *,
+                                           const char *);
+
+#endif
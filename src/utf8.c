@@ -0,0 +1,245 @@
+#include <stdint.h>
+#include "utf8.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86    1
+#endif
+
+/* What to look for, besides non-ASCII and null bytes */
+#define MODE_STRING     0
+#define MODE_NAME       1
+#define MODE_FILTER     2
+
+/* Bytes validated one by one after a non-ASCII byte or a wildcard */
+#define SCALAR_WINDOW   16
+
+/*
+ * Scanners return the offset of the first byte needing a closer look: a
+ * non-ASCII or null byte and, if wildcards is set, a '+' or '#'. They return
+ * len if there is none.
+ */
+typedef size_t utf8_scanner(const unsigned char *, size_t, int);
+
+static size_t scan_scalar(const unsigned char *buf, size_t len, int wildcards)
+{
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = buf[i];
+    if (c == 0 || c >= 0x80 || (wildcards && (c == '+' || c == '#'))) {
+      return i;
+    }
+  }
+
+  return len;
+}
+
+#ifdef HAVE_X86
+
+__attribute__((target("sse2")))
+static size_t scan_sse2(const unsigned char *buf, size_t len, int wildcards)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i plus = _mm_set1_epi8('+');
+  const __m128i hash = _mm_set1_epi8('#');
+  size_t i = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (buf + i));
+    /* High bit set on non-ASCII bytes */
+    __m128i special = _mm_or_si128(v, _mm_cmpeq_epi8(v, zero));
+    if (wildcards) {
+      special = _mm_or_si128(special, _mm_cmpeq_epi8(v, plus));
+      special = _mm_or_si128(special, _mm_cmpeq_epi8(v, hash));
+    }
+    unsigned mask = _mm_movemask_epi8(special);
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+
+  return i + scan_scalar(buf + i, len - i, wildcards);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(const unsigned char *buf, size_t len, int wildcards)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i plus = _mm256_set1_epi8('+');
+  const __m256i hash = _mm256_set1_epi8('#');
+  size_t i = 0;
+
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (buf + i));
+    __m256i special = _mm256_or_si256(v, _mm256_cmpeq_epi8(v, zero));
+    if (wildcards) {
+      special = _mm256_or_si256(special, _mm256_cmpeq_epi8(v, plus));
+      special = _mm256_or_si256(special, _mm256_cmpeq_epi8(v, hash));
+    }
+    unsigned mask = _mm256_movemask_epi8(special);
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+
+  /*
+   * Tail stays in this function, jumping to the legacy SSE encoded scanner
+   * would pay an AVX to SSE transition on every short string.
+   */
+  if (i + 16 <= len) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (buf + i));
+    __m128i special = _mm_or_si128(v, _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+    if (wildcards) {
+      special = _mm_or_si128(special, _mm_cmpeq_epi8(v, _mm_set1_epi8('+')));
+      special = _mm_or_si128(special, _mm_cmpeq_epi8(v, _mm_set1_epi8('#')));
+    }
+    unsigned mask = _mm_movemask_epi8(special);
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+    i += 16;
+  }
+
+  return i + scan_scalar(buf + i, len - i, wildcards);
+}
+
+#endif
+
+static utf8_scanner *scanner = NULL;
+
+int utf8_select(int impl)
+{
+#ifdef HAVE_X86
+  __builtin_cpu_init();
+
+  if (impl >= UTF8_AVX2 && __builtin_cpu_supports("avx2")) {
+    scanner = scan_avx2;
+    return UTF8_AVX2;
+  }
+
+  if (impl >= UTF8_SSE2 && __builtin_cpu_supports("sse2")) {
+    scanner = scan_sse2;
+    return UTF8_SSE2;
+  }
+#else
+  (void) impl;
+#endif
+
+  scanner = scan_scalar;
+  return UTF8_SCALAR;
+}
+
+/*
+ * Length of the well-formed UTF-8 sequence starting at buf, 0 if it is
+ * ill-formed, overlong, a surrogate or beyond U+10FFFF (Unicode table 3-7).
+ */
+static size_t utf8_sequence(const unsigned char *buf, size_t len)
+{
+  unsigned char c = buf[0];
+  unsigned char lo = 0x80;
+  unsigned char hi = 0xBF;
+  size_t n;
+
+  if (c < 0x80) {
+    return c == 0 ? 0 : 1;
+  } else if (c >= 0xC2 && c <= 0xDF) {
+    n = 2;
+  } else if (c >= 0xE0 && c <= 0xEF) {
+    n = 3;
+    if (c == 0xE0) {
+      lo = 0xA0;
+    } else if (c == 0xED) {
+      hi = 0x9F;
+    }
+  } else if (c >= 0xF0 && c <= 0xF4) {
+    n = 4;
+    if (c == 0xF0) {
+      lo = 0x90;
+    } else if (c == 0xF4) {
+      hi = 0x8F;
+    }
+  } else {
+    return 0;
+  }
+
+  if (len < n || buf[1] < lo || buf[1] > hi) {
+    return 0;
+  }
+
+  for (size_t i = 2; i < n; i++) {
+    if (buf[i] < 0x80 || buf[i] > 0xBF) {
+      return 0;
+    }
+  }
+
+  return n;
+}
+
+/* A wildcard in a filter must be a whole level, '#' also the last one */
+static int wildcard_valid(const unsigned char *buf, size_t len, size_t i)
+{
+  if (i > 0 && buf[i - 1] != '/') {
+    return 0;
+  }
+
+  if (buf[i] == '#') {
+    return i + 1 == len;
+  }
+
+  return i + 1 == len || buf[i + 1] == '/';
+}
+
+static int validate(const unsigned char *buf, size_t len, int mode)
+{
+  if (!scanner) {
+    utf8_select(UTF8_AVX2);
+  }
+
+  size_t i = 0;
+
+  while (i < len) {
+    i += scanner(buf + i, len - i, mode != MODE_STRING);
+
+    /*
+     * Non-ASCII text tends to come in runs, once found one go on byte by
+     * byte for a whole vector width before scanning again.
+     */
+    size_t window = i + SCALAR_WINDOW < len ? i + SCALAR_WINDOW : len;
+
+    while (i < window) {
+      unsigned char c = buf[i];
+
+      if (c == '+' || c == '#') {
+        if (mode == MODE_NAME ||
+            (mode == MODE_FILTER && !wildcard_valid(buf, len, i))) {
+          return 0;
+        }
+        i++;
+      } else if (c > 0 && c < 0x80) {
+        i++;
+      } else {
+        size_t n = utf8_sequence(buf + i, len - i);
+        if (n == 0) {
+          return 0;
+        }
+        i += n;
+      }
+    }
+  }
+
+  return 1;
+}
+
+int utf8_valid(const unsigned char *buf, size_t len)
+{
+  return validate(buf, len, MODE_STRING);
+}
+
+int mqtt_valid_topic_name(const unsigned char *buf, size_t len)
+{
+  return len > 0 && validate(buf, len, MODE_NAME);
+}
+
+int mqtt_valid_topic_filter(const unsigned char *buf, size_t len)
+{
+  return len > 0 && validate(buf, len, MODE_FILTER);
+}
@@ -0,0 +1,39 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <stdio.h>
+
+/*
+ * Validation of MQTT strings: well-formed UTF-8 without null characters
+ * (MQTT v3.1.1 section 1.5.3), topic names without wildcards and topic
+ * filters with wildcards only on whole levels, '#' being the last one
+ * (section 4.7).
+ *
+ * Runs of plain ASCII are skipped 16 or 32 bytes at a time with SSE2 or
+ * AVX2, selected at runtime, falling back to a scalar loop elsewhere. Only
+ * multi-byte sequences and wildcard characters are looked at one by one.
+ */
+
+/* SIMD implementations, in order of preference */
+enum utf8_impl {
+  UTF8_SCALAR,
+  UTF8_SSE2,
+  UTF8_AVX2
+};
+
+/*
+ * Select the implementation to use, clamped to what the CPU supports, and
+ * return the one selected. Mainly useful to benchmark them.
+ */
+int utf8_select(int);
+
+/* Return 1 if the string is valid UTF-8 with no null characters */
+int utf8_valid(const unsigned char *, size_t);
+
+/* Return 1 if the string is a valid, non empty, PUBLISH topic name */
+int mqtt_valid_topic_name(const unsigned char *, size_t);
+
+/* Return 1 if the string is a valid, non empty, SUBSCRIBE topic filter */
+int mqtt_valid_topic_filter(const unsigned char *, size_t);
+
+#endif
@@ -0,0 +1,158 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include "zerocopy.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY     60
+#endif
+
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY    0x4000000
+#endif
+
+/* a comes before b, sequence numbers wrap around */
+#define SEQ_BEFORE(a, b) ((int32_t) ((a) - (b)) < 0)
+
+struct zerocopy *zerocopy_create(int fd)
+{
+  struct zerocopy *zc = calloc(1, sizeof(*zc));
+
+  if (!zc) {
+    return NULL;
+  }
+
+  zc->enabled =
+      setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &(int) {1}, sizeof(int)) == 0;
+
+  return zc;
+}
+
+void zerocopy_destroy(struct zerocopy *zc)
+{
+  if (!zc) {
+    return;
+  }
+
+  for (; zc->nr > 0; zc->nr--) {
+    struct zerocopy_pin *pin = &zc->pins[zc->head];
+    pin->release(pin->obj);
+    zc->head = (zc->head + 1) % ZEROCOPY_PINS_MAX;
+  }
+
+  free(zc);
+}
+
+ssize_t zerocopy_send(struct zerocopy *zc, int fd,
+                      const unsigned char *buf, size_t len)
+{
+  size_t total = 0;
+  /* A slot must be left to pin the buffer once sent */
+  int zerocopy = zc->enabled && zc->nr < ZEROCOPY_PINS_MAX;
+
+  while (total < len) {
+    int flags = MSG_NOSIGNAL | (zerocopy ? MSG_ZEROCOPY : 0);
+    ssize_t n = send(fd, buf + total, len - total, flags);
+
+    if (n < 0) {
+      /* Out of option memory to track the send, copy this one */
+      if (errno == ENOBUFS && zerocopy) {
+        zerocopy = 0;
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      return -1;
+    }
+
+    if (zerocopy) {
+      zc->next++;
+      zc->sends++;
+    }
+
+    total += n;
+  }
+
+  return total;
+}
+
+void zerocopy_pin(struct zerocopy *zc, void *obj, void (*release)(void *))
+{
+  /* Nothing sent with zerocopy since the last pin, or already completed */
+  if (zc->mark == zc->next || SEQ_BEFORE(zc->next - 1, zc->done)) {
+    zc->mark = zc->next;
+    release(obj);
+    return;
+  }
+
+  struct zerocopy_pin *pin =
+      &zc->pins[(zc->head + zc->nr) % ZEROCOPY_PINS_MAX];
+
+  pin->seq = zc->next - 1;
+  pin->obj = obj;
+  pin->release = release;
+  zc->nr++;
+  zc->mark = zc->next;
+}
+
+int zerocopy_reap(struct zerocopy *zc, int fd)
+{
+  char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+  struct msghdr msg;
+  int released = 0;
+
+  while (1) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      return -1;
+    }
+
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm;
+         cm = CMSG_NXTHDR(&msg, cm)) {
+      if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+            (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+        continue;
+      }
+
+      struct sock_extended_err *err = (void *) CMSG_DATA(cm);
+
+      if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+        continue;
+      }
+
+      /* Completed range of sequence numbers [ee_info, ee_data] */
+      zc->completed += err->ee_data - err->ee_info + 1;
+
+      if (!SEQ_BEFORE(err->ee_data, zc->done)) {
+        zc->done = err->ee_data + 1;
+      }
+
+      if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+        zc->copied++;
+        zc->enabled = 0;
+      }
+    }
+  }
+
+  /* Release the buffers whose last send has been completed */
+  while (zc->nr > 0 && SEQ_BEFORE(zc->pins[zc->head].seq, zc->done)) {
+    struct zerocopy_pin *pin = &zc->pins[zc->head];
+    pin->release(pin->obj);
+    zc->head = (zc->head + 1) % ZEROCOPY_PINS_MAX;
+    zc->nr--;
+    released++;
+  }
+
+  return released;
+}
@@ -0,0 +1,85 @@
+#ifndef ZEROCOPY_H
+#define ZEROCOPY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * MSG_ZEROCOPY sends, the kernel transmits straight from the pages of the
+ * buffer instead of copying it into the socket, which pays off for large
+ * payloads fanned out to many subscribers. The buffer must then stay
+ * untouched until the kernel says it is done with it, through notifications
+ * read from the socket error queue.
+ *
+ * Every zerocopy send gets a sequence number, buffers are pinned after being
+ * sent, covering the sends issued since the previous pin, and released once
+ * the completions reach them. Completions of a TCP socket come in order, so
+ * pins are kept in a FIFO.
+ *
+ * Falls back to plain copying sends on its own: when the socket doesn't
+ * support it, when the kernel is out of option memory to track a send, when
+ * too many buffers are pinned already and for good once the kernel reports
+ * it copied the data anyway, as it does over loopback, then zerocopy is
+ * only overhead.
+ */
+
+/* Most buffers pinned at once on a socket */
+#define ZEROCOPY_PINS_MAX   64
+
+struct zerocopy_pin {
+  /* Last sequence number the buffer was sent with */
+  uint32_t seq;
+  void *obj;
+  void (*release)(void *);
+};
+
+struct zerocopy {
+  int enabled;
+  /* Sequence number of the next zerocopy send and of the next to pin */
+  uint32_t next;
+  uint32_t mark;
+  /* Everything before this sequence number has been completed */
+  uint32_t done;
+  /* FIFO of pinned buffers */
+  size_t head;
+  size_t nr;
+  struct zerocopy_pin pins[ZEROCOPY_PINS_MAX];
+  /* Stats, zerocopy sends, completions and completions copied anyway */
+  uint64_t sends;
+  uint64_t completed;
+  uint64_t copied;
+};
+
+/*
+ * Create the zerocopy state of a socket, enabled only if the socket accepts
+ * SO_ZEROCOPY. Returns NULL on allocation failure.
+ */
+struct zerocopy *zerocopy_create(int);
+
+/*
+ * Release every buffer still pinned, to be called once the socket has been
+ * shut down and nothing sent matters anymore.
+ */
+void zerocopy_destroy(struct zerocopy *);
+
+/*
+ * Send as much of the buffer as the socket takes, like send_bytes, with
+ * MSG_ZEROCOPY when possible. The buffer must be pinned once entirely sent.
+ * Returns the number of bytes sent or -1 on error.
+ */
+ssize_t zerocopy_send(struct zerocopy *, int, const unsigned char *, size_t);
+
+/*
+ * Pin a buffer after sending it, release is called once the kernel no
+ * longer references it, right away if it was not sent with zerocopy.
+ */
+void zerocopy_pin(struct zerocopy *, void *, void (*)(void *));
+
+/*
+ * Read the completions available on the socket error queue and release the
+ * buffers they cover. Returns the number of buffers released, -1 on error.
+ */
+int zerocopy_reap(struct zerocopy *, int);
+
+#endif
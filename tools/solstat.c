@@ -0,0 +1,367 @@
+/*
+ * solstat, live view of a running broker from its metrics segment, see
+ * metrics.h. It only maps the segment, the broker does nothing for it and
+ * doesn't know it is there.
+ *
+ * Build from the repository root:
+ *
+ *   cc -O2 -Isrc tools/solstat.c src/metrics.c src/arena.c -lpthread \
+ *      -o solstat
+ *
+ * Usage:
+ *
+ *   ./solstat [-f segment] [-i seconds] [-c count] [-t] [-j]
+ *
+ * Every interval it prints the rates per second over the interval, computed
+ * from the differences between two snapshots of the broker, and the median
+ * and 99th percentile of the PUBLISH handler time over it, with how full
+ * the huge page buffer arena is. -t adds a line
+ * per event loop, with the share of the connections it accepted that the
+ * kernel steered to its CPU, -j prints a JSON object per interval instead.
+ */
+#define _GNU_SOURCE
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include "metrics.h"
+
+/* Lines between two headers of the table */
+#define HEADER_EVERY        20
+
+/* Packet type of a PUBLISH, the one whose handler time is shown */
+#define PUBLISH_TYPE        3
+
+struct snapshot {
+  struct metrics_broker broker;
+  struct metrics_thread threads[METRICS_THREADS];
+  unsigned threads_nr;
+};
+
+static uint64_t clock_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static int snapshot_take(const struct metrics_segment *s,
+                         struct snapshot *snap)
+{
+  if (metrics_read(&s->broker.seq, &s->broker, &snap->broker,
+                   sizeof(snap->broker)) < 0) {
+    return -1;
+  }
+
+  snap->threads_nr = atomic_load(&s->hdr.threads_nr);
+  if (snap->threads_nr > METRICS_THREADS) {
+    snap->threads_nr = METRICS_THREADS;
+  }
+
+  for (unsigned i = 0; i < snap->threads_nr; i++) {
+    if (metrics_read(&s->threads[i].seq, &s->threads[i], &snap->threads[i],
+                     sizeof(snap->threads[i])) < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Percentile of the laps of a stage between two snapshots, in nanoseconds,
+ * as the upper bound of the histogram bucket it falls in. 0 with no laps.
+ */
+static double percentile(const struct metrics_stage *cur,
+                         const struct metrics_stage *prev, double p,
+                         double ns_per_tick)
+{
+  uint64_t total = cur->count - prev->count;
+
+  if (total == 0) {
+    return 0;
+  }
+
+  uint64_t rank = (uint64_t) (total * p), seen = 0;
+
+  for (int i = 0; i < TRACE_HIST; i++) {
+    seen += cur->hist[i] - prev->hist[i];
+    if (seen > rank) {
+      return (double) (1ULL << i) * ns_per_tick;
+    }
+  }
+
+  return (double) cur->max * ns_per_tick;
+}
+
+static double rate(uint64_t cur, uint64_t prev, double secs)
+{
+  return cur >= prev ? (cur - prev) / secs : 0;
+}
+
+static void print_header(int threads)
+{
+  printf("%8s %8s %10s %10s %10s %10s %8s %8s %9s %7s %9s %9s\n",
+         "clients", "conn/s", "msg_in/s", "msg_out/s", "kb_in/s",
+         "kb_out/s", "drop/s", "thr/s", "mem_mb", "arena%", "pub_p50",
+         "pub_p99");
+  if (threads) {
+    printf("  %8s %4s %4s %8s %8s %10s %8s %8s %10s %8s\n", "tid", "cpu",
+           "node", "ready", "deferred", "topics", "hit%", "lent", "idle_kb",
+           "steer%");
+  }
+}
+
+static void print_text(const struct snapshot *cur,
+                       const struct snapshot *prev, double secs,
+                       int threads)
+{
+  const struct metrics_broker *b = &cur->broker, *p = &prev->broker;
+  const struct metrics_stage *h = &b->stages[TRACE_HANDLER][PUBLISH_TYPE];
+  const struct metrics_stage *ph = &p->stages[TRACE_HANDLER][PUBLISH_TYPE];
+
+  printf("%8lld %8.0f %10.0f %10.0f %10.1f %10.1f %8.0f %8.0f %9.1f "
+         "%6.1f%% %8.0fn %8.0fn\n",
+         (long long) b->nclients,
+         rate(b->nconnections, p->nconnections, secs),
+         rate(b->messages_recv, p->messages_recv, secs),
+         rate(b->messages_sent, p->messages_sent, secs),
+         rate(b->bytes_recv, p->bytes_recv, secs) / 1024,
+         rate(b->bytes_sent, p->bytes_sent, secs) / 1024,
+         rate(b->messages_dropped, p->messages_dropped, secs),
+         rate(b->throttles, p->throttles, secs),
+         b->mem_used / (1024.0 * 1024.0),
+         b->arena_reserved ? 100.0 * b->arena_used / b->arena_reserved : 0.0,
+         percentile(h, ph, 0.50, b->ns_per_tick),
+         percentile(h, ph, 0.99, b->ns_per_tick));
+
+  if (!threads) {
+    return;
+  }
+
+  for (unsigned i = 0; i < cur->threads_nr; i++) {
+    const struct metrics_thread *t = &cur->threads[i];
+    const struct metrics_thread *pt = &prev->threads[i];
+    uint64_t hits = t->cache_hits - pt->cache_hits;
+    uint64_t lookups = hits + t->cache_misses - pt->cache_misses;
+    uint64_t local = t->accepts_local - pt->accepts_local;
+    uint64_t accepts = local + t->accepts_remote - pt->accepts_remote;
+    printf("  %8u %4d %4d %8llu %8llu %10llu %7.1f%% %8llu %10.1f %7.1f%%\n",
+           t->tid, t->cpu, t->node, (unsigned long long) t->sched_ready,
+           (unsigned long long) t->deferred,
+           (unsigned long long) t->cache_topics,
+           lookups ? 100.0 * hits / lookups : 0.0,
+           (unsigned long long) t->buf_lent, t->buf_idle_bytes / 1024.0,
+           accepts ? 100.0 * local / accepts : 0.0);
+  }
+}
+
+static void print_json(const struct metrics_segment *s,
+                       const struct snapshot *cur,
+                       const struct snapshot *prev, double secs)
+{
+  const struct metrics_broker *b = &cur->broker, *p = &prev->broker;
+
+  printf("{\"pid\":%lld,\"interval_s\":%.3f,\"clients\":%lld,"
+         "\"throttled\":%lld,\"connections_per_s\":%.1f,"
+         "\"messages_recv_per_s\":%.1f,\"messages_sent_per_s\":%.1f,"
+         "\"bytes_recv_per_s\":%.1f,\"bytes_sent_per_s\":%.1f,"
+         "\"dropped_per_s\":%.1f,\"throttles_per_s\":%.1f,"
+         "\"filter_hits_per_s\":%.1f,\"mem_used\":%llu,"
+         "\"mem_ceiling\":%llu,\"mem_pressure\":%llu,\"mem\":{",
+         (long long) s->hdr.pid, secs, (long long) b->nclients,
+         (long long) b->nthrottled,
+         rate(b->nconnections, p->nconnections, secs),
+         rate(b->messages_recv, p->messages_recv, secs),
+         rate(b->messages_sent, p->messages_sent, secs),
+         rate(b->bytes_recv, p->bytes_recv, secs),
+         rate(b->bytes_sent, p->bytes_sent, secs),
+         rate(b->messages_dropped, p->messages_dropped, secs),
+         rate(b->throttles, p->throttles, secs),
+         rate(b->filter_hits, p->filter_hits, secs),
+         (unsigned long long) b->mem_used,
+         (unsigned long long) b->mem_ceiling,
+         (unsigned long long) b->mem_pressure);
+
+  for (int i = 0; i < MEM_TAGS; i++) {
+    printf("%s\"%.16s\":%llu", i ? "," : "", s->hdr.mem_tags[i],
+           (unsigned long long) b->mem_tags[i]);
+  }
+
+  printf("},\"arena\":{\"backing\":\"%s\",\"reserved\":%llu,"
+         "\"carved\":%llu,\"used\":%llu,\"buffers\":%llu,"
+         "\"allocs_per_s\":%.1f,\"fallbacks_per_s\":%.1f",
+         b->arena_backing <= ARENA_HUGETLB ?
+         arena_backing_name(b->arena_backing) : "unknown",
+         (unsigned long long) b->arena_reserved,
+         (unsigned long long) b->arena_carved,
+         (unsigned long long) b->arena_used,
+         (unsigned long long) b->arena_buffers,
+         rate(b->arena_allocs, p->arena_allocs, secs),
+         rate(b->arena_fallbacks, p->arena_fallbacks, secs));
+
+  printf("},\"handler_ns\":{");
+
+  int first = 1;
+
+  for (int t = 0; t < TRACE_TYPES; t++) {
+    const struct metrics_stage *h = &b->stages[TRACE_HANDLER][t];
+    const struct metrics_stage *ph = &p->stages[TRACE_HANDLER][t];
+    if (h->count == ph->count) {
+      continue;
+    }
+    printf("%s\"%d\":{\"p50\":%.0f,\"p99\":%.0f}", first ? "" : ",", t,
+           percentile(h, ph, 0.50, b->ns_per_tick),
+           percentile(h, ph, 0.99, b->ns_per_tick));
+    first = 0;
+  }
+
+  printf("},\"threads\":[");
+
+  for (unsigned i = 0; i < cur->threads_nr; i++) {
+    const struct metrics_thread *t = &cur->threads[i];
+    printf("%s{\"tid\":%u,\"sched_ready\":%llu,\"deferred\":%llu,"
+           "\"cache_topics\":%llu,\"cache_hits_per_s\":%.1f,"
+           "\"cache_misses_per_s\":%.1f,\"buf_lent\":%llu,"
+           "\"buf_idle_bytes\":%llu,\"cpu\":%d,\"node\":%d,"
+           "\"accepts_local\":%llu,\"accepts_remote\":%llu}",
+           i ? "," : "", t->tid,
+           (unsigned long long) t->sched_ready,
+           (unsigned long long) t->deferred,
+           (unsigned long long) t->cache_topics,
+           rate(t->cache_hits, prev->threads[i].cache_hits, secs),
+           rate(t->cache_misses, prev->threads[i].cache_misses, secs),
+           (unsigned long long) t->buf_lent,
+           (unsigned long long) t->buf_idle_bytes, t->cpu, t->node,
+           (unsigned long long) t->accepts_local,
+           (unsigned long long) t->accepts_remote);
+  }
+
+  printf("]}\n");
+}
+
+int main(int argc, char **argv)
+{
+  const char *path = METRICS_PATH;
+  double interval = 1.0;
+  long count = -1;
+  int threads = 0, json = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "f:i:c:tj")) != -1) {
+    switch (opt) {
+      case 'f':
+        path = optarg;
+        break;
+      case 'i':
+        interval = atof(optarg);
+        break;
+      case 'c':
+        count = atol(optarg);
+        break;
+      case 't':
+        threads = 1;
+        break;
+      case 'j':
+        json = 1;
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-f segment] [-i seconds] [-c count] "
+                "[-t] [-j]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if (interval <= 0 || !path[0]) {
+    fprintf(stderr, "Need an interval above 0 and a segment\n");
+    return 1;
+  }
+
+  uint64_t inode = 0;
+  const struct metrics_segment *s = metrics_attach(path, &inode);
+
+  if (!s) {
+    fprintf(stderr, "Can't read %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+
+  static struct snapshot snaps[2];
+  struct snapshot *prev = &snaps[0], *cur = &snaps[1];
+  struct timespec nap = {
+    (time_t) interval, (long) ((interval - (time_t) interval) * 1e9)
+  };
+  long lines = 0;
+  int have_prev = snapshot_take(s, prev) == 0;
+  int stale = 0;
+
+  while (count < 0 || lines < count) {
+    nanosleep(&nap, NULL);
+
+    /* A broker restarted or taken over from writes to a new file */
+    struct stat st;
+
+    if (stat(path, &st) == 0 && (uint64_t) st.st_ino != inode) {
+      const struct metrics_segment *next = metrics_attach(path, &inode);
+      if (next) {
+        metrics_detach(s);
+        s = next;
+        if (!json) {
+          printf("-- broker %lld\n", (long long) s->hdr.pid);
+        }
+        have_prev = snapshot_take(s, prev) == 0;
+        continue;
+      }
+    }
+
+    if (snapshot_take(s, cur) < 0) {
+      fprintf(stderr, "No consistent snapshot in %s\n", path);
+      continue;
+    }
+
+    /* Nothing to compare with yet, the rates start at the next one */
+    if (!have_prev) {
+      *prev = *cur;
+      have_prev = 1;
+      continue;
+    }
+
+    /* Rates over the time between the snapshots, not the one slept */
+    if (cur->broker.updated <= prev->broker.updated) {
+      if (!stale && clock_ms() - cur->broker.updated > 3 * METRICS_INTERVAL) {
+        fprintf(stderr, "No snapshot from broker %lld for %llums\n",
+                (long long) s->hdr.pid,
+                (unsigned long long) (clock_ms() - cur->broker.updated));
+        stale = 1;
+      }
+      continue;
+    }
+
+    stale = 0;
+
+    double secs = (cur->broker.updated - prev->broker.updated) / 1000.0;
+
+    if (json) {
+      print_json(s, cur, prev, secs);
+    } else {
+      if (lines % HEADER_EVERY == 0) {
+        print_header(threads);
+      }
+      print_text(cur, prev, secs, threads);
+    }
+
+    fflush(stdout);
+    lines++;
+
+    struct snapshot *tmp = prev;
+    prev = cur;
+    cur = tmp;
+  }
+
+  metrics_detach(s);
+
+  return 0;
+}